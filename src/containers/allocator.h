@@ -30,6 +30,7 @@ namespace octet {
   public:
     // todo: implement this from scratch using a pool allocator
     static void *malloc(size_t size) {
+      #pragma omp atomic
       state().num_bytes += size;
       #ifdef OCTET_SSE
         void *res = ::_aligned_malloc(size, 16);
@@ -41,6 +42,7 @@ namespace octet {
     }
 
     static void free(void *ptr, size_t size) {
+      #pragma omp atomic
       state().num_bytes -= size;
       //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
       #ifdef OCTET_SSE
@@ -51,6 +53,7 @@ namespace octet {
     }
 
     static void *realloc(void *ptr, size_t old_size, size_t size) {
+      #pragma omp atomic
       state().num_bytes += size - old_size;
       #ifdef OCTET_SSE
         void *res = ::_aligned_realloc(ptr, size, 16);
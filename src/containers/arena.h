@@ -0,0 +1,114 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012, 2013
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Arena (bump) allocator
+//
+// Objects are carved one after another out of big blocks taken from the allocator
+// and are all freed together, so there is no per object free and no heap lock.
+// Destructors are not called: use it for objects that own no memory,
+// or call the destructors before reset.
+//
+// example:
+//
+//   arena<> nodes;
+//   dynarray_dummy_t x;
+//   node *n = new (nodes.allocate(sizeof(node)), x) node();
+//   ...
+//   nodes.reset(); // every node is gone
+//
+
+namespace octet {
+  template <class allocator_t=allocator> class arena {
+    // blocks are chained, newest first
+    struct block {
+      block *next;
+      size_t size;
+    };
+
+    block *blocks_;
+    uint8_t *ptr_;
+    uint8_t *end_;
+    size_t block_size_;
+    size_t num_bytes_;
+
+    arena(const arena &rhs) {
+      // you can't do this at the moment!
+    }
+
+    static uint8_t *align_up(uint8_t *ptr, size_t align) {
+      return (uint8_t*)(((size_t)ptr + align - 1) & ~(align - 1));
+    }
+
+    void new_block(size_t min_size) {
+      size_t size = block_size_;
+      while (size < min_size + sizeof(block)) {
+        size *= 2;
+      }
+      block *b = (block*)allocator_t::malloc(size);
+      b->next = blocks_;
+      b->size = size;
+      blocks_ = b;
+      ptr_ = (uint8_t*)(b + 1);
+      end_ = (uint8_t*)b + size;
+    }
+
+  public:
+    arena(size_t block_size = 16384) {
+      blocks_ = 0;
+      ptr_ = end_ = 0;
+      block_size_ = block_size;
+      num_bytes_ = 0;
+    }
+
+    ~arena() {
+      release();
+    }
+
+    // align must be a power of two
+    void *allocate(size_t size, size_t align = 16) {
+      uint8_t *res = align_up(ptr_, align);
+      if (!ptr_ || res + size > end_) {
+        new_block(size + align);
+        res = align_up(ptr_, align);
+      }
+      ptr_ = res + size;
+      num_bytes_ += size;
+      return res;
+    }
+
+    // forget every allocation, the newest block is kept to allocate from again
+    void reset() {
+      if (!blocks_) return;
+
+      block *b = blocks_->next;
+      while (b) {
+        block *next = b->next;
+        allocator_t::free(b, b->size);
+        b = next;
+      }
+      blocks_->next = 0;
+      ptr_ = (uint8_t*)(blocks_ + 1);
+      end_ = (uint8_t*)blocks_ + blocks_->size;
+      num_bytes_ = 0;
+    }
+
+    // give every block back to the allocator
+    void release() {
+      reset();
+      if (blocks_) {
+        allocator_t::free(blocks_, blocks_->size);
+      }
+      blocks_ = 0;
+      ptr_ = end_ = 0;
+    }
+
+    // bytes allocated since the last reset
+    size_t get_num_bytes() const {
+      return num_bytes_;
+    }
+  };
+}
+
@@ -194,6 +194,13 @@ namespace octet {
       size_--;
     }
 
+    // exchange the contents of two arrays without copying the elements
+    void swap(dynarray &rhs) {
+      item_t *data = data_; data_ = rhs.data_; rhs.data_ = data;
+      int_size_t size = size_; size_ = rhs.size_; rhs.size_ = size;
+      int_size_t capacity = capacity_; capacity_ = rhs.capacity_; rhs.capacity_ = capacity;
+    }
+
     void reset() {
       if (use_new_delete) {
         for (int_size_t i = 0; i != size_; ++i) {
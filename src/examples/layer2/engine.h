@@ -48,7 +48,10 @@ namespace octet {
     City *city;
     CityMesh *city_mesh;
 
-    dynarray<Street> *streetList;
+    // everything in the city drawn sorted by shader and material
+    CityRenderQueue renderQueue;
+
+    StreetList *streetList;
     dynarray<BuildingArea> *buildingAreaList;
 
     std::vector <ref<Model>> *models;
@@ -62,6 +65,29 @@ namespace octet {
     int drawFlags;
 	int draw_texture_mode; 
 
+    bool runBenchmark;
+
+    // run the self checks of the city code at start and exit with their result
+    bool runChecks;
+
+    // the whole city depends on this number only
+    uint64_t citySeed;
+
+    // file to load the city from, or to save it to when it does not match
+    const char *snapshotPath;
+
+    // refine the partition around the camera every frame instead of generating it at start
+    bool lazyPartition;
+    enum { LAZY_PARTITION_BUDGET_MS = 4 };
+
+    // endless city of tiles generated around the camera, NULL for a single city
+    CityWorld *world;
+    bool tiledWorld;
+    enum { WORLD_TILE_SIZE = 24, WORLD_TILE_RADIUS = 1, WORLD_BUDGET_MB = 256, WORLD_WORKERS = 2 };
+
+    // largest error of the terrain patches on screen, in pixels
+    enum { TERRAIN_PIXEL_ERROR = 2 };
+
   public:
     // this is called when we construct the class
     engine(int argc, char **argv) 
@@ -73,7 +99,33 @@ namespace octet {
     , light_rotation(45.0f, 30.0f, 0.0f) 
     , drawFlags(DRAW_TERRAIN | DRAW_WATER | DRAW_ROADS | DRAW_BUILDINGS | DRAW_HELP | DRAW_COMPASS
      /* | DRAW_TERRAIN_NORMALS | DRAW_ROADS_NORMALS | DRAW_TERRAIN_WIREFRAME | DRAW_ROADS_WIREFRAME | DRAW_BUILDINGS_WIREFRAME*/ )
+    , runBenchmark(false)
+    , runChecks(false)
+    , citySeed((uint64_t)time(NULL))
+    , snapshotPath(NULL)
+    , lazyPartition(false)
+    , world(NULL)
+    , tiledWorld(false)
     {
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--benchmark")) {
+          runBenchmark = true;
+        } else if (!strcmp(argv[i], "--check")) {
+          runChecks = true;
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+          citySeed = (uint64_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+          snapshotPath = argv[++i];
+        } else if (!strcmp(argv[i], "--lazy")) {
+          lazyPartition = true;
+        } else if (!strcmp(argv[i], "--tiles")) {
+          tiledWorld = true;
+        }
+      }
+    }
+
+    ~engine() {
+      delete world;
     }
 
     // this is called once OpenGL is initialized
@@ -102,13 +154,24 @@ namespace octet {
       // Binary Space Partition
       depth = 8;
 
-      heightMap.setImage((*CityMesh::getImageArray())[CityMesh::TextureAsset::TEXTUREASSET_HEIGHTMAP]);
+      if (runChecks) {
+        bool passed = CityRandom::checkStreams();
+        passed = PointHash::checkWelding() && passed;
+        passed = StreetGraph::checkAdjacency() && passed;
+        passed = PolygonIntersections::checkClipping() && passed;
+        passed = render_queue::check_sort_order() && passed;
+        passed = CitySnapshot::checkRoundTrip("city_check.snap") && passed;
+        printf("Checks %s.\n", passed ? "passed" : "FAILED");
+        exit(passed ? 0 : 1);
+      }
+
       printf("Generating heightmap and normalmap.\n");
-      heightMap.generateHeightmap();
+      heightMap.loadHeightField("assets/citytex/heightmap6.gif");
       heightMap.generateNormalMap();
 
       //city = City::createFromRectangle(7.0f, 5.0f);
-      city = new City();
+      printf("City seed: %llu (use --seed to generate it again).\n", (unsigned long long)citySeed);
+      city = new City(citySeed);
       vec4 vertices[] = {
         vec4(-10.0f, 0.0f, -16.0f, 1.0f),
         vec4(-13.0f, 0.0f, 18.0f, 1.0f),
@@ -123,16 +186,38 @@ namespace octet {
       vec4(4.0f, 0.0f, -5.0f, 1.0f)
       };*/ 
 
-      city->init(vertices);
-      city->stepPartition(depth);
-      // city->printStreets();
+      if (runBenchmark) {
+        City::benchmarkGeneration(vertices, 4, 16);
+        City::checkLotLayouts(citySeed, 16);
+      }
+
+      double startTime = CityTimer::now();
 
-      city->calculateIntersections();
-      //city->printIntersections();
-      //city->calculateIntersectionsSpace();
-      city->calculateMeshesIntersections();
-      //city->printMeshesPoints();
-      city->calculateBuildingsAreas(); 
+      if (tiledWorld) {
+        printf("Tiled world: city tiles are generated around the camera, snapshots and lazy partition are not used.\n");
+        snapshotPath = NULL;
+        lazyPartition = false;
+      } else if (lazyPartition) {
+        printf("Lazy partition: the city is refined around the camera, snapshots are not used.\n");
+        snapshotPath = NULL;
+      }
+
+      CitySnapshot snapshot;
+      bool warmStart = snapshotPath && snapshot.open(snapshotPath) &&
+        snapshot.matches(citySeed, depth, CitySnapshot::hashHeightMap(heightMap), CitySnapshot::hashVertices(vertices));
+
+      city->init(vertices);
+      if (!warmStart && !tiledWorld) {
+        city->stepPartition(lazyPartition ? 0 : depth);
+        // city->printStreets();
+
+        city->calculateIntersections();
+        //city->printIntersections();
+        //city->calculateIntersectionsSpace();
+        city->calculateMeshesIntersections();
+        //city->printMeshesPoints();
+        city->calculateBuildingsAreas(); 
+      }
 
       vec4 dimensions;
       vec4 center;
@@ -142,6 +227,12 @@ namespace octet {
 
       heightMap.setCenter(center);
       heightMap.setDimensions(dimensions);
+
+      if (runBenchmark) {
+        heightMap.benchmarkSampling(1000000);
+        heightMap.benchmarkNormalMap();
+        PolygonIntersections::benchmarkClipping(100000);
+      }
       
       city->setHeightmap(&heightMap);
       
@@ -153,7 +244,12 @@ namespace octet {
       city_mesh->setHeightmap(&heightMap);
 
       city->loadModels();
-      city->generate3DModels();
+      if (warmStart) {
+        printf("Loading city snapshot %s.\n", snapshotPath);
+        snapshot.loadCity(*city);
+      } else if (!tiledWorld) {
+        city->generate3DModels();
+      }
 
       streetList = &city->streetsList;
       
@@ -162,9 +258,31 @@ namespace octet {
       //city->calculateBuildingsAreas(0.75);
       buildingAreaList = &city->buildingAreaList;
 
-      city_mesh->init(streetList, buildingAreaList, dimensions, center);
-
-      cameraControls.init(city, city_mesh, &heightMap);
+      if (tiledWorld) {
+        // the city only gives the terrain mapping and the prop models to the tiles
+        city_mesh->initMaterials();
+      } else if (warmStart) {
+        city_mesh->initFromSnapshot(snapshot, buildingAreaList, dimensions, center);
+        snapshot.close();
+      } else {
+        city_mesh->init(streetList, buildingAreaList, dimensions, center, city->random);
+        if (snapshotPath) {
+          city_mesh->saveSnapshot(snapshotPath, *city, depth, buildingAreaList);
+        }
+      }
+      city_mesh->initProps(models);
+
+      if (tiledWorld) {
+        world = new CityWorld(citySeed, depth, &heightMap, city, city_mesh, dimensions, center,
+                              (float)WORLD_TILE_SIZE, WORLD_TILE_RADIUS, WORLD_BUDGET_MB * 1048576u, WORLD_WORKERS);
+        // the walkthrough camera stays in the streets of the tile in the middle
+        CityTile *tile = world->pinTile(center);
+        world->set_mode(drawFlags);
+        cameraControls.init(tile->city, city_mesh, &heightMap);
+      } else {
+        cameraControls.init(city, city_mesh, &heightMap);
+      }
+      printf("City ready in %.1f ms.\n", CityTimer::msSince(startTime));
 
       glBindBuffer(GL_ARRAY_BUFFER, 0);
       glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -178,6 +296,7 @@ namespace octet {
     void keyboardInput() 
     {
       static bool justPressed = false;
+      static bool statsPressed = false;
       vec4 direction(0.0f);
       
       if (is_key_down('M') && !justPressed) {
@@ -192,6 +311,15 @@ namespace octet {
         cameraControls.resetCamera();
       }
 
+      if (is_key_down('P') && !statsPressed) {
+        city_mesh->printRenderStats();
+        renderQueue.printStats();
+        if (world) world->printStats();
+        statsPressed = true;
+      } else if (!is_key_down('P') && statsPressed) {
+        statsPressed = false;
+      }
+
       if (!is_key_down(key_alt)) {
         if (is_key_down('W')) {
           direction[1] = -1.0f;
@@ -274,10 +402,10 @@ namespace octet {
         if (is_key_down('C') && !justPressed) {
           if (drawFlags & DRAW_TERRAIN_WIREFRAME) {
             drawFlags = drawFlags & ~DRAW_TERRAIN_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           } else {
             drawFlags = drawFlags | DRAW_TERRAIN_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           }
           justPressed = true;
         } else if (!is_key_down('C') && !justPressed) {
@@ -287,10 +415,10 @@ namespace octet {
         if (is_key_down('V') && !justPressed) {
           if (drawFlags & DRAW_ROADS_WIREFRAME) {
             drawFlags = drawFlags & ~DRAW_ROADS_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           } else {
             drawFlags = drawFlags | DRAW_ROADS_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           }
           justPressed = true;
         } else if (!is_key_down('V') && !justPressed) {
@@ -300,10 +428,10 @@ namespace octet {
         if (is_key_down('B') && !justPressed) {
           if (drawFlags & DRAW_BUILDINGS_WIREFRAME) {
             drawFlags = drawFlags & ~DRAW_BUILDINGS_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           } else {
             drawFlags = drawFlags | DRAW_BUILDINGS_WIREFRAME;
-            city_mesh->set_mode(drawFlags, buildingAreaList);
+            set_mode();
           }
           justPressed = true;
         } else if (!is_key_down('B') && !justPressed) {
@@ -436,9 +564,27 @@ namespace octet {
 
       mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld, 0.1f, 1000.0f, 0.0f, 0.0f, 0.1f*vy/float(vx));
 
+      if (lazyPartition) {
+        refinePartition(modelToProjection);
+      }
+
       light_uniforms_array[2] = vec4(sin(light_rotation[0]*3.1415926f/180.0f), sin(light_rotation[1]*3.1415926f/180.0f), cos(light_rotation[0]*3.1415926f/180.0f), 0.0f) * worldToCamera;
 
-      city_mesh->debugRender(object_shader, city_buildings_bump_shader_, cshader, sb_shader, modelToProjection, modelToCamera, cameraToWorld,light_uniforms_array, num_light_uniforms, num_lights, buildingAreaList, models,drawFlags, draw_texture_mode);
+      int cityFlags = drawFlags;
+      renderQueue.begin(object_shader, city_buildings_bump_shader_, modelToProjection, modelToCamera, light_uniforms_array, num_light_uniforms, num_lights, draw_texture_mode);
+
+      if (world) {
+        world->update(cameraToWorld);
+        world->render(renderQueue, cshader, modelToProjection, cameraToWorld, drawFlags);
+        // the city has no geometry of its own, only the props of the tiles and the sky
+        cityFlags &= ~(DRAW_TERRAIN | DRAW_WATER | DRAW_ROADS | DRAW_BUILDINGS | DRAW_TERRAIN_NORMALS | DRAW_ROADS_NORMALS);
+      } else if (drawFlags & DRAW_TERRAIN) {
+        // the projection is 90 degrees wide, half the viewport is one unit at a distance of one
+        city_mesh->selectTerrain(modelToProjection, cameraToWorld.row(3), vx * 0.5f, (float)TERRAIN_PIXEL_ERROR);
+      }
+
+      city_mesh->setOcclusionCulling(!world && cameraControls.getMode() == CAMERAMODE_WALKTHROUGH);
+      city_mesh->debugRender(renderQueue, cshader, sb_shader, modelToProjection, modelToCamera, cameraToWorld, light_uniforms_array, num_light_uniforms, num_lights, buildingAreaList, cityFlags);
       //city_mesh->debugRender_newShader(streetList, city_bump_shader_, object_shader, modelToProjection, modelToCamera, light_uniforms_array, num_light_uniforms, num_lights);
       //city->debugRender(&cshader, &cameraToWorld, float(vx)/float(vy), depth);
 
@@ -460,6 +606,31 @@ namespace octet {
 
     }
 
+    // Add detail to the city where the camera looks, model to world is the identity
+    void refinePartition(const mat4t &worldToProjection) {
+      PartitionView view;
+      view.frustum.init(worldToProjection);
+      view.eye = cameraToWorld.row(3);
+
+      if (city->refinePartition(view, (float)LAZY_PARTITION_BUDGET_MS)) {
+        vec4 dimensions;
+        vec4 center;
+        city->getDimensions(dimensions);
+        city->getCenter(center);
+
+        city_mesh->updateRefined(*city, dimensions, center);
+        set_mode();
+      }
+    }
+
+    // Apply the wireframe flags to every mesh
+    void set_mode() {
+      city_mesh->set_mode(drawFlags, buildingAreaList);
+      if (world) {
+        world->set_mode(drawFlags);
+      }
+    }
+
     void setCamara() {
 
       cameraControls.updateCamera();
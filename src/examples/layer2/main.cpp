@@ -12,10 +12,24 @@
 
 // city headers
 #include "../../nntcity/cityconstants.h"
+#include "../../nntcity/citytimer.h"
+#include "../../nntcity/cityrandom.h"
+#include "../../nntcity/proplod.h"
 #include "../../nntcity/3dmodel.h"
+#include "../../nntcity/cityfrustum.h"
+#include "../../nntcity/cityocclusion.h"
+#include "../../nntcity/citybvh.h"
+#include "../../nntcity/cityprops.h"
+#include "../../nntcity/pointhash.h"
+#include "../../nntcity/streetgraph.h"
 #include "../../nntcity/polygonintersect.h"
 #include "../../nntcity/cityobjs.h"
+#include "../../nntcity/cityterrain.h"
+#include "../../nntcity/buildingbatch.h"
+#include "../../nntcity/cityrenderqueue.h"
+#include "../../nntcity/citysnapshot.h"
 #include "../../nntcity/citymesh.h"
+#include "../../nntcity/cityworld.h"
 #include "../../nntcity/citycamera.h"
 
 #include "engine.h"
@@ -0,0 +1,181 @@
+namespace octet {
+  // height field decoder - greyscale PGM (8 and 16 bit) and PFM (float)
+  //
+  // Height fields are single channel, so they are converted straight to floats
+  // instead of being expanded to RGBA like the images used as textures.
+  // The samples are not copied: the layout points into the file in memory.
+  class heightfield_decoder {
+  public:
+    enum {
+      HEIGHTS_UINT8,      // one byte per sample
+      HEIGHTS_UINT16_BE,  // two bytes per sample, most significant first (PGM)
+      HEIGHTS_FLOAT32,    // little endian floats (PFM)
+      HEIGHTS_RGB8,       // decoded images, the height is the average of red, green and blue
+      HEIGHTS_RGBA8,
+    };
+
+    // where the samples are and how to read them
+    struct layout {
+      const uint8_t *samples;   // first sample of the top row
+      int stride;               // bytes from a row to the one below, negative for files stored bottom up
+      unsigned format;
+      unsigned width;
+      unsigned height;
+      float bias;               // added to every sample before scale
+      float scale;              // brings the samples plus bias to [0, 1]
+    };
+
+  private:
+    // skip white space and # comments of a PNM header
+    static const uint8_t *skip_space(const uint8_t *src, const uint8_t *src_max) {
+      while (src != src_max) {
+        if (*src == '#') {
+          while (src != src_max && *src != '\n') ++src;
+        } else if (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') {
+          ++src;
+        } else {
+          break;
+        }
+      }
+      return src;
+    }
+
+    static const uint8_t *read_token(const uint8_t *src, const uint8_t *src_max, char *token, unsigned max_len) {
+      src = skip_space(src, src_max);
+      unsigned len = 0;
+      while (src != src_max && *src > ' ' && len + 1 < max_len) {
+        token[len++] = (char)*src++;
+      }
+      token[len] = 0;
+      return src;
+    }
+
+  public:
+    static unsigned get_bytes_per_sample(unsigned format) {
+      static const unsigned bytes[] = { 1, 2, 4, 3, 4 };
+      return bytes[format];
+    }
+
+    // read the header of a PGM (P5) or greyscale PFM (Pf) file in memory.
+    // returns false if it is neither, or it is cut short.
+    bool get_layout(layout &result, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < 3 || !(src[0] == 'P' && (src[1] == '5' || src[1] == 'f'))) {
+        return false;
+      }
+      bool is_float = src[1] == 'f';
+
+      char width[16], height[16], range[32];
+      src = read_token(src + 2, src_max, width, sizeof(width));
+      src = read_token(src, src_max, height, sizeof(height));
+      src = read_token(src, src_max, range, sizeof(range));
+      // a single white space character ends the header
+      if (src == src_max) return false;
+      ++src;
+
+      result.width = (unsigned)atoi(width);
+      result.height = (unsigned)atoi(height);
+      if (!result.width || !result.height) return false;
+
+      if (is_float) {
+        // a negative scale means little endian, the rows go from the bottom up
+        float pfm_scale = (float)atof(range);
+        if (pfm_scale >= 0.0f) {
+          printf("warning: big endian PFM files are not supported\n");
+          return false;
+        }
+        result.format = HEIGHTS_FLOAT32;
+      } else {
+        unsigned max_value = (unsigned)atoi(range);
+        if (!max_value || max_value > 65535) return false;
+        result.format = max_value < 256 ? HEIGHTS_UINT8 : HEIGHTS_UINT16_BE;
+        result.bias = 0.0f;
+        result.scale = 1.0f / max_value;
+      }
+
+      unsigned row_bytes = result.width * get_bytes_per_sample(result.format);
+      if ((size_t)(src_max - src) < (size_t)row_bytes * result.height) return false;
+
+      if (is_float) {
+        result.samples = src + (size_t)row_bytes * (result.height - 1);
+        result.stride = -(int)row_bytes;
+
+        // float heights have no fixed range: the lowest sample goes to 0 and the highest to 1.
+        // The scale in the header multiplies every sample, so it makes no difference here.
+        float lowest = std::numeric_limits<float>::max();
+        float highest = -std::numeric_limits<float>::max();
+        size_t count = (size_t)result.width * result.height;
+        for (size_t i = 0; i != count; ++i) {
+          float f;
+          memcpy(&f, src + i*4, sizeof(f));
+          // skips NaN too
+          if (f >= -std::numeric_limits<float>::max() && f <= std::numeric_limits<float>::max()) {
+            lowest = f < lowest ? f : lowest;
+            highest = f > highest ? f : highest;
+          }
+        }
+        result.bias = lowest <= highest ? -lowest : 0.0f;
+        result.scale = lowest < highest ? 1.0f / (highest - lowest) : 0.0f;
+      } else {
+        result.samples = src;
+        result.stride = (int)row_bytes;
+      }
+      return true;
+    }
+
+    // convert a row of count samples: dest[i] = (sample + bias) * scale
+    static void convert_row(const uint8_t *src, unsigned format, unsigned count, float bias, float scale, float *dest) {
+      unsigned i = 0;
+    #ifdef OCTET_SSE
+      __m128 vbias = _mm_set1_ps(bias);
+      __m128 vscale = _mm_set1_ps(scale);
+      __m128i zero = _mm_setzero_si128();
+      if (format == HEIGHTS_UINT8) {
+        for (; i + 16 <= count; i += 16) {
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+          __m128i lo = _mm_unpacklo_epi8(b, zero), hi = _mm_unpackhi_epi8(b, zero);
+          _mm_storeu_ps(dest + i + 0, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), vbias), vscale));
+          _mm_storeu_ps(dest + i + 4, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), vbias), vscale));
+          _mm_storeu_ps(dest + i + 8, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), vbias), vscale));
+          _mm_storeu_ps(dest + i + 12, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), vbias), vscale));
+        }
+      } else if (format == HEIGHTS_UINT16_BE) {
+        for (; i + 8 <= count; i += 8) {
+          __m128i w = _mm_loadu_si128((const __m128i*)(src + i*2));
+          w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+          _mm_storeu_ps(dest + i + 0, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), vbias), vscale));
+          _mm_storeu_ps(dest + i + 4, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), vbias), vscale));
+        }
+      } else if (format == HEIGHTS_FLOAT32) {
+        for (; i + 4 <= count; i += 4) {
+          _mm_storeu_ps(dest + i, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps((const float*)(src + i*4)), vbias), vscale));
+        }
+      } else if (format == HEIGHTS_RGBA8) {
+        // r + g and b + 0 of every pixel with one multiply add, then the two halves are added
+        __m128i weights = _mm_set_epi16(0, 1, 1, 1, 0, 1, 1, 1);
+        for (; i + 4 <= count; i += 4) {
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i*4));
+          __m128 p01 = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(b, zero), weights));
+          __m128 p23 = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(b, zero), weights));
+          __m128i even = _mm_castps_si128(_mm_shuffle_ps(p01, p23, _MM_SHUFFLE(2, 0, 2, 0)));
+          __m128i odd = _mm_castps_si128(_mm_shuffle_ps(p01, p23, _MM_SHUFFLE(3, 1, 3, 1)));
+          _mm_storeu_ps(dest + i, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(even, odd)), vbias), vscale));
+        }
+      }
+    #endif
+      for (; i != count; ++i) {
+        switch (format) {
+          case HEIGHTS_UINT8: dest[i] = (src[i] + bias) * scale; break;
+          case HEIGHTS_UINT16_BE: dest[i] = (src[i*2] * 256 + src[i*2+1] + bias) * scale; break;
+          case HEIGHTS_FLOAT32: {
+            float f;
+            memcpy(&f, src + i*4, sizeof(f));
+            dest[i] = (f + bias) * scale;
+            break;
+          }
+          case HEIGHTS_RGB8: dest[i] = (src[i*3] + src[i*3+1] + src[i*3+2] + bias) * scale; break;
+          case HEIGHTS_RGBA8: dest[i] = (src[i*4] + src[i*4+1] + src[i*4+2] + bias) * scale; break;
+        }
+      }
+    }
+  };
+}
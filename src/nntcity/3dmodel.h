@@ -1,10 +1,51 @@
 namespace octet {
 
   class ModelBuilder{
+  public:
+    enum { NUM_LODS = 3, MIN_LOD_TRIANGLES = 64 };
 
+  private:
     collada_builder builder;
 
+    // meshes shared by every instance of this model
+    std::vector<mesh*> meshes;
+
+    // container for resources
+    resources dict;
+
+    bool meshesBuilt;
+
+    // simplified meshes, level 0 is meshes
+    std::vector<mesh*> lodMeshes[NUM_LODS];
+    bool lodBuilt[NUM_LODS];
+
+    // crossed quads for the far away instances, empty if the model has none
+    std::vector<mesh*> impostorMeshes;
+    ref<material> impostorMaterial;
+    bool impostorBuilt;
+
   public:
+    ModelBuilder(){
+      meshesBuilt = false;
+      for(int i = 0; i != NUM_LODS; ++i){
+        lodBuilt[i] = false;
+      }
+      impostorBuilt = false;
+    }
+
+    ~ModelBuilder(){
+      for(int i = 0; i != (int)meshes.size(); ++i){
+        delete meshes[i];
+      }
+      for(int level = 1; level != NUM_LODS; ++level){
+        for(int i = 0; i != (int)lodMeshes[level].size(); ++i){
+          delete lodMeshes[level][i];
+        }
+      }
+      for(int i = 0; i != (int)impostorMeshes.size(); ++i){
+        delete impostorMeshes[i];
+      }
+    }
 
     void loadModel(char* modelPath){
       builder.load_xml(modelPath);
@@ -13,6 +54,71 @@ namespace octet {
     collada_builder* getColladaBuilder(){
       return &builder;
     }
+
+    // Extract the geometries only the first time, the rest of instances reuse them
+    std::vector<mesh*>& getMeshes(){
+      if(!meshesBuilt){
+        std::vector<std::string> geometries = builder.get_geometries();
+
+        for(int i=0;i!=(int)geometries.size();++i){
+          mesh* mesh1 = new mesh();
+          meshes.push_back(mesh1);
+          builder.get_mesh(*(meshes[i]), geometries[i].c_str(), dict);
+        }
+        meshesBuilt = true;
+      }
+      return meshes;
+    }
+
+    // Fraction of the triangles kept at every level of detail
+    static float getLodRatio(int level){
+      static const float ratios[NUM_LODS] = { 1.0f, 0.5f, 0.2f };
+      return ratios[level];
+    }
+
+    // Meshes simplified to getLodRatio(level), made the first time they are asked for
+    std::vector<mesh*>& getLodMeshes(int level){
+      std::vector<mesh*>& source = getMeshes();
+      if(level == 0) return source;
+
+      if(!lodBuilt[level]){
+        MeshSimplifier simplifier;
+        for(int i = 0; i != (int)source.size(); ++i){
+          int triangles = source[i]->get_num_indices() / 3;
+          int target = max((int)(triangles * getLodRatio(level)), (int)MIN_LOD_TRIANGLES);
+          mesh* result = new mesh();
+          simplifier.simplify(*source[i], target, *result);
+          lodMeshes[level].push_back(result);
+        }
+        lodBuilt[level] = true;
+      }
+      return lodMeshes[level];
+    }
+
+    // Impostor of the model drawn with texture, made the first time it is asked for.
+    // modelToWorld of any instance tells which way is up. Empty when there is nothing to draw.
+    std::vector<mesh*>& getImpostorMeshes(image* texture, const mat4t& modelToWorld){
+      if(!impostorBuilt && texture){
+        int upAxis = 0;
+        for(int i = 1; i != 3; ++i){
+          if(fabsf(modelToWorld[i][1]) > fabsf(modelToWorld[upAxis][1])) upAxis = i;
+        }
+        mesh* result = new mesh();
+        image* img = PropImpostor::build(getMeshes(), *texture, upAxis, modelToWorld[upAxis][1] > 0 ? 1.0f : -1.0f, *result);
+        if(img){
+          impostorMeshes.push_back(result);
+          impostorMaterial = new material(img, false);
+        } else {
+          delete result;
+        }
+        impostorBuilt = true;
+      }
+      return impostorMeshes;
+    }
+
+    material* getImpostorMaterial(){
+      return impostorMaterial;
+    }
   };
 
 
@@ -20,10 +126,8 @@ namespace octet {
   protected:
     mat4t modelToWorld;
 
-    std::vector<mesh*> meshes;  
-
-    // container for resources
-    resources dict;
+    // prototype owning the meshes
+    ModelBuilder* prototype;
 
     // how many lives do we have?
     int ref_count;
@@ -33,13 +137,8 @@ namespace octet {
   public:
     Model(ModelBuilder* builder){      
     
-      std::vector<std::string> geometries = builder->getColladaBuilder()->get_geometries();
-
-      for(int i=0;i!=geometries.size();++i){
-        mesh* mesh1 = new mesh();
-        meshes.push_back(mesh1);
-        builder->getColladaBuilder()->get_mesh(*(meshes[i]), geometries[i].c_str(), dict);
-      }
+      this->prototype = builder;
+      builder->getMeshes();
 
       this->modelToWorld = mat4t(1.0f);
 
@@ -48,32 +147,28 @@ namespace octet {
       this->stringMaterial="";
     }
 
-    Model(const Model& rhs){
+    // instance with a known placement, used when loading a city snapshot
+    Model(ModelBuilder* builder, const mat4t& modelToWorld, const std::string& material){
+      this->prototype = builder;
+      builder->getMeshes();
 
-      this->modelToWorld = rhs.modelToWorld;
+      this->modelToWorld = modelToWorld;
 
-      std::vector<mesh*> m; 
+      ref_count = 0;
 
-      for(int i=0; i!=rhs.meshes.size();++i){
-        mesh* mesh1 = new mesh();
-        *mesh1 = *(rhs.meshes[i]);
-        m.push_back(mesh1);
-      }
-      this->meshes = m;
-      this->dict = rhs.dict;
-      this->ref_count = rhs.ref_count;
+      this->stringMaterial = material;
     }
 
-
-    ~Model(){
-      for(int i = 0; i != meshes.size(); ++i){
-        delete meshes[i];
-      }
-      //printf("DESTRUCTOR\n");
+    Model(const Model& rhs){
+      this->modelToWorld = rhs.modelToWorld;
+      this->prototype = rhs.prototype;
+      this->stringMaterial = rhs.stringMaterial;
+      this->ref_count = 0;
     }
 
     void render(){
-      for(int i=0;i!=meshes.size();++i){
+      std::vector<mesh*>& meshes = prototype->getMeshes();
+      for(int i=0;i!=(int)meshes.size();++i){
         meshes[i]->render();
       }
     }
@@ -86,6 +181,10 @@ namespace octet {
       return this->stringMaterial;
     }
 
+    ModelBuilder* getPrototype(){
+      return this->prototype;
+    }
+
 
     // give this resource an extra life
     void add_ref() {
@@ -168,6 +267,7 @@ namespace octet {
 
       this->modelToWorld.translate(translation.x(),translation.y(),translation.z());
       this->modelToWorld.rotateX(-90.0f);
+      this->modelToWorld.rotateZ(rotation);
       this->modelToWorld.scale(0.08f,0.08f,0.08f);
       this->stringMaterial = "Tree";
     }
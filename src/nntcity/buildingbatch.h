@@ -0,0 +1,277 @@
+namespace octet {
+
+  // Geometry of every building merged in one mesh per building part.
+  // The per building parameters that used to be uniforms (height, area and part)
+  // are an extra vertex attribute, so the whole skyline is drawn with one
+  // material setup and one draw call per part instead of three per building.
+  // The buildings are merged in the order of a bounding volume hierarchy, so the
+  // buildings in view are a few ranges of indices of every part.
+  class BuildingBatcher {
+  public:
+    enum Part {
+      PART_WALLS,
+      PART_ROOF,
+      PART_BASEMENT,
+      NUM_PARTS,
+    };
+
+    enum { LEAF_BUILDINGS = 8, MAX_OCCLUDERS = 32 };
+
+    // Walls of a building as a prism, for the occlusion buffer
+    struct Occluder {
+      vec4 points[4];
+      float top;
+    };
+
+  private:
+    mesh parts[NUM_PARTS];
+
+    // firstIndex[part][i] is the first index of the i-th building of bvh order, with one more at the end
+    CityBVH bvh;
+    dynarray<unsigned> firstIndex[NUM_PARTS];
+    dynarray<Occluder> occluders;
+
+    // visible ranges of bvh order for this frame
+    dynarray<CityBVH::Range> visible;
+
+    // counters for the last rendered frame
+    int drawCalls;
+
+    static aabb getBounds(const BuildingArea &b) {
+      vec3 lo(b.points[0].x(), b.points[0].y(), b.points[0].z());
+      vec3 hi = lo;
+      for (int k = 1; k != 4; ++k) {
+        vec3 p(b.points[k].x(), b.points[k].y(), b.points[k].z());
+        lo = lo.min(p);
+        hi = hi.max(p);
+      }
+      // walls and roof are above the basement, the basement goes up from the ground
+      float top = CityConstants::BUILDING_BASEMENT_HEIGHT + b.height + CityConstants::BUILDING_ROOF_HEIGHT;
+      lo[1] = min(lo.y(), CityConstants::BUILDING_BASEMENT_HEIGHT);
+      hi[1] = max(hi.y() + CityConstants::BUILDING_BASEMENT_HEIGHT, top);
+      return aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+    }
+
+    // Copy the vertices of a mesh made by mesh_builder adding the building attribute after them
+    static void addBuildingAttribute(mesh &result, mesh &source, dynarray<vec4> &params) {
+      unsigned srcStride = source.get_stride();
+      unsigned stride = srcStride + sizeof(vec4);
+      unsigned nv = source.get_num_vertices();
+
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, stride * nv);
+      {
+        gl_resource::rolock src(source.get_vertices());
+        gl_resource::rwlock dst(vertices);
+        for (unsigned i = 0; i != nv; ++i) {
+          memcpy(dst.u8() + i * stride, src.u8() + i * srcStride, srcStride);
+          memcpy(dst.u8() + i * stride + srcStride, &params[i], sizeof(vec4));
+        }
+      }
+
+      result.init();
+      result.set_vertices(vertices);
+      result.set_indices(source.get_indices());
+      for (unsigned slot = 0; slot != source.get_num_slots(); ++slot) {
+        result.add_attribute(source.get_attr(slot), source.get_size(slot), source.get_kind(slot), source.get_offset(slot));
+      }
+      result.add_attribute(city_buildings_bump_shader::attribute_building, 3, GL_FLOAT, srcStride);
+      result.set_params(stride, source.get_num_indices(), nv, source.get_mode(), source.get_index_type());
+      result.set_chunks(source.get_chunks(), source.get_num_chunks());
+    }
+
+  public:
+    // Geometry of the parts before it is in GL buffers
+    struct Staging {
+      mesh_builder builders[NUM_PARTS];
+      dynarray<vec4> params[NUM_PARTS];
+      CityBVH bvh;
+      dynarray<unsigned> firstIndex[NUM_PARTS];
+      dynarray<Occluder> occluders;
+    };
+
+    BuildingBatcher() {
+      drawCalls = 0;
+    }
+
+    // Build the merged meshes. Heights and areas of the buildings must be set.
+    void build(dynarray<BuildingArea> &buildings) {
+      Staging staging;
+      prepare(buildings, staging);
+      upload(staging);
+    }
+
+    // Hierarchy and occluders of the buildings, the same for the same buildings in the same order
+    static void prepareHierarchy(dynarray<BuildingArea> &buildings, CityBVH &bvh, dynarray<Occluder> &occluders) {
+      dynarray<aabb> boxes(buildings.size());
+      for (int i = 0; i != buildings.size(); ++i) {
+        boxes[i] = getBounds(buildings[i]);
+      }
+      bvh.build(buildings.size() ? &boxes[0] : NULL, buildings.size(), LEAF_BUILDINGS);
+      const dynarray<int> &order = bvh.getOrder();
+      occluders.resize(order.size());
+      for (int k = 0; k != order.size(); ++k) {
+        BuildingArea &b = buildings[order[k]];
+        memcpy(occluders[k].points, b.points, sizeof(b.points));
+        occluders[k].top = CityConstants::BUILDING_BASEMENT_HEIGHT + b.height;
+      }
+    }
+
+    // The part of build that does not use GL, it can run in any thread
+    static void prepare(dynarray<BuildingArea> &buildings, Staging &staging) {
+      prepareHierarchy(buildings, staging.bvh, staging.occluders);
+      const dynarray<int> &order = staging.bvh.getOrder();
+
+      for (int part = 0; part != NUM_PARTS; ++part) {
+        mesh_builder &mb = staging.builders[part];
+        dynarray<vec4> &params = staging.params[part];
+
+        for (int k = 0; k != order.size(); ++k) {
+          staging.firstIndex[part].push_back(mb.get_num_indices());
+          BuildingArea &b = buildings[order[k]];
+          if (part == PART_WALLS) {
+            mb.add_extrude_polygon(b.points, b.height, CityConstants::BUILDING_BASEMENT_HEIGHT);
+          } else if (part == PART_ROOF) {
+            mb.add_roof(b.points, CityConstants::BUILDING_BASEMENT_HEIGHT + b.height);
+          } else {
+            mb.add_basement(b.points, CityConstants::BUILDING_BASEMENT_HEIGHT);
+          }
+
+          vec4 value(b.height, b.area, (float)part, 0.0f);
+          while (params.size() != mb.get_num_vertices()) {
+            params.push_back(value);
+          }
+        }
+        staging.firstIndex[part].push_back(mb.get_num_indices());
+      }
+    }
+
+    // Create the meshes of the parts from a prepared staging
+    void upload(Staging &staging) {
+      for (int part = 0; part != NUM_PARTS; ++part) {
+        mesh merged;
+        staging.builders[part].get_mesh(merged);
+        addBuildingAttribute(parts[part], merged, staging.params[part]);
+        firstIndex[part].swap(staging.firstIndex[part]);
+      }
+      bvh.swap(staging.bvh);
+      occluders.swap(staging.occluders);
+    }
+
+    // Parts loaded from elsewhere, drawn whole as there is no hierarchy for them
+    void clearHierarchy() {
+      CityBVH empty;
+      bvh.swap(empty);
+      occluders.reset();
+    }
+
+    // Hierarchy of parts loaded from elsewhere that prepare made from these buildings.
+    // Every building adds the same number of indices to a part, so the ranges of the buildings
+    // follow from the size of the part. Parts that do not match are drawn whole.
+    void rebuildHierarchy(dynarray<BuildingArea> &buildings) {
+      clearHierarchy();
+      int count = buildings.size();
+      if (!count) return;
+      for (int part = 0; part != NUM_PARTS; ++part) {
+        if (parts[part].get_num_indices() % count) return;
+      }
+
+      prepareHierarchy(buildings, bvh, occluders);
+      for (int part = 0; part != NUM_PARTS; ++part) {
+        unsigned perBuilding = parts[part].get_num_indices() / count;
+        firstIndex[part].resize(count + 1);
+        for (int k = 0; k <= count; ++k) {
+          firstIndex[part][k] = k * perBuilding;
+        }
+      }
+    }
+
+    // Draw the walls of the buildings in view that look biggest from the camera, the buffer must be begun
+    void addOccluders(OcclusionBuffer &buffer, const mat4t &worldToProjection) {
+      Frustum frustum;
+      frustum.init(worldToProjection);
+
+      // size over distance along the view, squared
+      dynarray<std::pair<float, int> > candidates;
+      for (int k = 0; k != occluders.size(); ++k) {
+        const Occluder &o = occluders[k];
+        vec3 lo(o.points[0].x(), CityConstants::BUILDING_BASEMENT_HEIGHT, o.points[0].z()), hi(lo.x(), o.top, lo.z());
+        for (int p = 1; p != 4; ++p) {
+          lo = lo.min(vec3(o.points[p].x(), lo.y(), o.points[p].z()));
+          hi = hi.max(vec3(o.points[p].x(), hi.y(), o.points[p].z()));
+        }
+        aabb box((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+        if (!frustum.intersects(box)) continue;
+
+        float size = max(hi.y() - lo.y(), max(hi.x() - lo.x(), hi.z() - lo.z()));
+        vec4 middle(box.get_center().x(), box.get_center().y(), box.get_center().z(), 1.0f);
+        float w = max((middle * worldToProjection).w(), 0.1f);
+        candidates.push_back(std::make_pair(-size * size / (w * w), k));
+      }
+
+      int count = min((int)candidates.size(), (int)MAX_OCCLUDERS);
+      if (count) {
+        std::partial_sort(&candidates[0], &candidates[0] + count, &candidates[0] + candidates.size());
+      }
+      for (int i = 0; i != count; ++i) {
+        const Occluder &o = occluders[candidates[i].second];
+        buffer.addPrism(o.points, CityConstants::BUILDING_BASEMENT_HEIGHT, o.top);
+      }
+    }
+
+    // Choose the buildings drawn by the next calls to render, model to world is the identity.
+    // occlusion, if given, hides the buildings behind its occluders.
+    void cull(const mat4t &worldToProjection, const OcclusionBuffer *occlusion = NULL) {
+      Frustum frustum;
+      frustum.init(worldToProjection);
+      bvh.cull(frustum, visible, occlusion);
+      drawCalls = 0;
+    }
+
+    mesh &getPart(Part part) {
+      return parts[part];
+    }
+
+    void render(Part part) {
+      if (!parts[part].get_num_indices()) return;
+
+      if (!bvh.isBuilt()) {
+        parts[part].render();
+        drawCalls++;
+        return;
+      }
+
+      if (!visible.size()) return;
+      mesh &m = parts[part];
+      m.enable_attributes();
+      for (int i = 0; i != visible.size(); ++i) {
+        unsigned first = firstIndex[part][visible[i].first];
+        unsigned end = firstIndex[part][visible[i].first + visible[i].count];
+        if (end != first) {
+          m.draw(first, end - first);
+          drawCalls++;
+        }
+      }
+      m.disable_attributes();
+    }
+
+    int getDrawCalls() const {
+      return drawCalls;
+    }
+
+    int getNodesTested() const {
+      return bvh.getNodesTested();
+    }
+
+    int getBuildingsCulled() const {
+      return bvh.getObjectsCulled();
+    }
+
+    int getNodesOccluded() const {
+      return bvh.getNodesOccluded();
+    }
+
+    void set_mode(Part part, unsigned int mode) {
+      parts[part].set_mode(mode);
+    }
+  };
+}
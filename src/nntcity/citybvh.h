@@ -0,0 +1,180 @@
+namespace octet {
+
+  // Bounding volume hierarchy over the boxes of objects that do not move, built once.
+  // The objects are reordered so that the objects of every node are a range of getOrder(),
+  // culling gives back the visible objects as ranges of that order, and the neighbouring
+  // visible nodes are merged in one range, so a merged mesh built in that order can draw
+  // every range with a single call.
+  class CityBVH {
+  public:
+    struct Range {
+      int first;
+      int count;
+    };
+
+  private:
+    struct Node {
+      aabb bounds;
+      // objects of the node in order
+      int first;
+      int count;
+      // children are left and left + 1, 0 for the leaves
+      int left;
+    };
+
+    struct CenterLess {
+      const aabb *boxes;
+      int axis;
+
+      bool operator()(int a, int b) const {
+        return boxes[a].get_center()[axis] < boxes[b].get_center()[axis];
+      }
+    };
+
+    dynarray<Node> nodes;
+    dynarray<int> order;
+
+    // counters for the last cull
+    int nodesTested;
+    int nodesOccluded;
+    int objectsVisible;
+
+    // Split the objects of a node at the median of the centres along the longest axis of the centres
+    void buildNode(int n, const aabb *boxes, int leafSize) {
+      int first = nodes[n].first;
+      int count = nodes[n].count;
+
+      vec3 boundsMin = boxes[order[first]].get_min(), boundsMax = boxes[order[first]].get_max();
+      vec3 centerMin = boxes[order[first]].get_center(), centerMax = centerMin;
+      for (int i = first + 1; i != first + count; ++i) {
+        const aabb &box = boxes[order[i]];
+        boundsMin = boundsMin.min(box.get_min());
+        boundsMax = boundsMax.max(box.get_max());
+        centerMin = centerMin.min(box.get_center());
+        centerMax = centerMax.max(box.get_center());
+      }
+      nodes[n].bounds = aabb((boundsMin + boundsMax) * 0.5f, (boundsMax - boundsMin) * 0.5f);
+      if (count <= leafSize) return;
+
+      vec3 extent = centerMax - centerMin;
+      int axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : extent.y() >= extent.z() ? 1 : 2;
+      if (extent[axis] == 0.0f) return;
+
+      int half = count / 2;
+      CenterLess less = { boxes, axis };
+      std::nth_element(&order[first], &order[first + half], &order[first] + count, less);
+
+      int left = nodes.size();
+      nodes.resize(left + 2);
+      nodes[n].left = left;
+      nodes[left].first = first;
+      nodes[left].count = half;
+      nodes[left].left = 0;
+      nodes[left + 1].first = first + half;
+      nodes[left + 1].count = count - half;
+      nodes[left + 1].left = 0;
+      buildNode(left, boxes, leafSize);
+      buildNode(left + 1, boxes, leafSize);
+    }
+
+    static void addRange(dynarray<Range> &visible, int first, int count) {
+      if (visible.size() && visible.back().first + visible.back().count == first) {
+        visible.back().count += count;
+      } else {
+        Range range = { first, count };
+        visible.push_back(range);
+      }
+    }
+
+    void cullNode(int n, const Frustum &frustum, const OcclusionBuffer *occlusion, dynarray<Range> &visible) {
+      const Node &node = nodes[n];
+      nodesTested++;
+      int side = frustum.classify(node.bounds);
+      if (side == Frustum::OUTSIDE) return;
+      if (occlusion && occlusion->isOccluded(node.bounds)) {
+        nodesOccluded++;
+        return;
+      }
+
+      if (node.left == 0 || side == Frustum::INSIDE) {
+        addRange(visible, node.first, node.count);
+        objectsVisible += node.count;
+      } else {
+        cullNode(node.left, frustum, occlusion, visible);
+        cullNode(node.left + 1, frustum, occlusion, visible);
+      }
+    }
+
+  public:
+    CityBVH() {
+      nodesTested = 0;
+      nodesOccluded = 0;
+      objectsVisible = 0;
+    }
+
+    // Box of a model placed with modelToWorld, row vectors as in the rest of octet
+    static aabb transformBox(const aabb &box, const mat4t &modelToWorld) {
+      vec3 c = box.get_center();
+      vec3 h = box.get_half_extent();
+      vec4 center = vec4(c.x(), c.y(), c.z(), 1.0f) * modelToWorld;
+      vec3 half;
+      for (int j = 0; j != 3; ++j) {
+        half[j] = fabsf(modelToWorld[0][j]) * h.x() + fabsf(modelToWorld[1][j]) * h.y() + fabsf(modelToWorld[2][j]) * h.z();
+      }
+      return aabb(vec3(center.x(), center.y(), center.z()), half);
+    }
+
+    void build(const aabb *boxes, int count, int leafSize) {
+      nodes.resize(0);
+      order.resize(count);
+      for (int i = 0; i != count; ++i) {
+        order[i] = i;
+      }
+      if (!count) return;
+
+      nodes.resize(1);
+      nodes[0].first = 0;
+      nodes[0].count = count;
+      nodes[0].left = 0;
+      buildNode(0, boxes, leafSize);
+    }
+
+    bool isBuilt() const {
+      return nodes.size() != 0;
+    }
+
+    // Objects in the order of the ranges
+    const dynarray<int> &getOrder() const {
+      return order;
+    }
+
+    // Ranges of getOrder() with the objects that may be visible, from first to last.
+    // occlusion, if given, also removes the nodes hidden behind its occluders.
+    void cull(const Frustum &frustum, dynarray<Range> &visible, const OcclusionBuffer *occlusion = NULL) {
+      visible.resize(0);
+      nodesTested = 0;
+      nodesOccluded = 0;
+      objectsVisible = 0;
+      if (nodes.size()) {
+        cullNode(0, frustum, occlusion, visible);
+      }
+    }
+
+    void swap(CityBVH &rhs) {
+      nodes.swap(rhs.nodes);
+      order.swap(rhs.order);
+    }
+
+    int getNodesTested() const {
+      return nodesTested;
+    }
+
+    int getNodesOccluded() const {
+      return nodesOccluded;
+    }
+
+    int getObjectsCulled() const {
+      return order.size() - objectsVisible;
+    }
+  };
+}
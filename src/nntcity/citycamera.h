@@ -43,7 +43,8 @@ struct LinearConfig {
   vec4 end;
   float t;
   int pointEnd;
-  Street *street;
+  // index in City::streetsList, streets move in memory when the partition is refined
+  int street;
 
   quat startRotation;
   quat endRotation;
@@ -53,7 +54,7 @@ struct LinearConfig {
   , end(0.0f)
   , t(0.0f)
   , pointEnd(0)
-  , street(NULL)
+  , street(-1)
   , startRotation(0.0f)
   , endRotation(0.0f)
   { }
@@ -101,7 +102,7 @@ class camera_controls {
   vec4 camera_position;
   vec3 camera_rotation;
 
-  random randomizer;
+  CityRandom::Generator randomizer;
 
   CameraMode cameraMode;
   WalkthroughMode walkthroughMode;
@@ -130,33 +131,62 @@ class camera_controls {
     return camera_position[2]/40.0f;
   }
 
+  // The first street left from a random one, nothing changes if every street is removed
   void selectRandomStreet() {
-    int i = randomizer.get(0, city->streetsList.size());
+    int numStreets = city->streetsList.size();
+    if (!numStreets) return;
+    int first = randomizer.getInt(0, numStreets);
+    int i = first;
+    while (city->streetRemoved[i]) {
+      i = (i + 1) % numStreets;
+      if (i == first) return;
+    }
     Street *st = &city->streetsList[i];
 
     streetLerp.start = st->points[0];
     streetLerp.end = st->points[1];
     streetLerp.t = 0.0f;
     streetLerp.pointEnd = 1;
-    streetLerp.street = st;
+    streetLerp.street = i;
 
     orientCameraToStreet(true);
   }
 
   void selectNewStreet() {
     dynarray <Street *>streetsIntersecting;
+    Street *current = &city->streetsList[streetLerp.street];
+    vec4 end = current->points[streetLerp.pointEnd];
 
-    city->getStreetsIntersectingByExtreme(streetLerp.street, streetLerp.pointEnd, streetsIntersecting);
+    if (!city->streetRemoved[streetLerp.street]) {
+      city->getStreetsIntersectingByExtreme(current, streetLerp.pointEnd, streetsIntersecting);
+    } else {
+      // The incremental partition split the street while we were on it,
+      // go on from its end except back along the half just walked
+      dynarray <Street *>streetsAtEnd;
+      city->getStreetsAtPoint(end, streetsAtEnd);
+      float length = (end - streetLerp.start).length();
+      for (int i = 0; i != streetsAtEnd.size(); ++i) {
+        vec4 other = all(streetsAtEnd[i]->points[0] == end) ? streetsAtEnd[i]->points[1] : streetsAtEnd[i]->points[0];
+        if ((other - end).length() + (streetLerp.start - other).length() > length + 0.001f) {
+          streetsIntersecting.push_back(streetsAtEnd[i]);
+        }
+      }
+    }
+
+    if (streetsIntersecting.size() == 0) {
+      selectRandomStreet();
+      return;
+    }
 
-    int i = randomizer.get(0, streetsIntersecting.size());
+    int i = randomizer.getInt(0, streetsIntersecting.size());
     Street *st = streetsIntersecting[i];
 
-    if (all(streetLerp.street->points[streetLerp.pointEnd] == st->points[0])) {
+    if (all(end == st->points[0])) {
       streetLerp.pointEnd = 1;
     } else {
       streetLerp.pointEnd = 0;
     }
-    streetLerp.street = st;
+    streetLerp.street = city->getStreetId(st);
     streetLerp.start = st->points[streetLerp.pointEnd == 0? 1: 0];
     streetLerp.end = st->points[streetLerp.pointEnd];
     streetLerp.t = 0.0f;
@@ -193,7 +223,6 @@ public:
   camera_controls()
   : camera_position(0.0f, 0.0f, 10.0f, 0.0f)
   , camera_rotation(45.0f, 0.0f, 0.0f)
-  , randomizer(time(NULL))
   , cameraMode(CAMERAMODE_FREEFORM)
   , walkthroughMode(WALKTHROUGHMODE_SELECT)
   , streetIndexSelected(-1)
@@ -210,6 +239,7 @@ public:
   
   void init(City *c, CityMesh *cm, HeightMap *hm) {
     city = c;
+    randomizer = city->random.getGenerator(CityRandom::STREAM_CAMERA, 0);
     city->getDimensions(cityDimensions);
     city->getCenter(cityCenter);
     cityMesh = cm;
@@ -10,6 +10,7 @@ namespace octet {
     static const float ROAD_HEIGHT;
     static const float PAVEMENT_HEIGHT;
     static const float LAMPS_SEPARATION;
+    static const float POINT_HASH_SCALE;
 
     //CityMesh
     static const float HEIGHT_FACTOR;
@@ -32,6 +33,7 @@ namespace octet {
   const float CityConstants::ROAD_HEIGHT = 0.04f;
   const float CityConstants::PAVEMENT_HEIGHT = 0.042f;
   const float CityConstants::LAMPS_SEPARATION = 2.0f;
+  const float CityConstants::POINT_HASH_SCALE = 16.0f;
   
   const float CityConstants::HEIGHT_FACTOR = 1.0f/255.0f;
   const float CityConstants::WATER_LEVEL = 0.3f;
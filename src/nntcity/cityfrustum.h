@@ -0,0 +1,68 @@
+namespace octet {
+
+  // View frustum as six planes in world space, taken from the world to projection matrix.
+  // Points are row vectors (p * m), so every plane is a sum or difference of two columns.
+  // Planes are (nx, ny, nz, d) with the inside at nx*x + ny*y + nz*z + d >= 0, not normalized.
+  class Frustum {
+    vec4 planes[6];
+
+    static vec4 column(const mat4t &m, int j) {
+      return vec4(m[0][j], m[1][j], m[2][j], m[3][j]);
+    }
+
+  public:
+    Frustum() {
+      // until init everything is inside
+      for (int i = 0; i != 6; ++i) {
+        planes[i] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+      }
+    }
+
+    void init(const mat4t &worldToProjection) {
+      vec4 w = column(worldToProjection, 3);
+      for (int j = 0; j != 3; ++j) {
+        vec4 c = column(worldToProjection, j);
+        planes[j*2+0] = w + c;
+        planes[j*2+1] = w - c;
+      }
+    }
+
+    // False only if the box is completely behind one of the planes, boxes near
+    // the corners of the frustum may pass the test without being visible.
+    bool intersects(const aabb &box) const {
+      vec3 center = box.get_center();
+      vec3 half = box.get_half_extent();
+
+      for (int i = 0; i != 6; ++i) {
+        const vec4 &p = planes[i];
+        float distance = p.x() * center.x() + p.y() * center.y() + p.z() * center.z() + p.w();
+        float radius = fabsf(p.x()) * half.x() + fabsf(p.y()) * half.y() + fabsf(p.z()) * half.z();
+        if (distance < -radius) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    enum { OUTSIDE, INTERSECTING, INSIDE };
+
+    // Same test as intersects, also telling apart the boxes completely inside every plane
+    int classify(const aabb &box) const {
+      vec3 center = box.get_center();
+      vec3 half = box.get_half_extent();
+
+      int result = INSIDE;
+      for (int i = 0; i != 6; ++i) {
+        const vec4 &p = planes[i];
+        float distance = p.x() * center.x() + p.y() * center.y() + p.z() * center.z() + p.w();
+        float radius = fabsf(p.x()) * half.x() + fabsf(p.y()) * half.y() + fabsf(p.z()) * half.z();
+        if (distance < -radius) {
+          return OUTSIDE;
+        } else if (distance < radius) {
+          result = INTERSECTING;
+        }
+      }
+      return result;
+    }
+  };
+}
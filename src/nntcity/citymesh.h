@@ -1,5 +1,15 @@
 namespace octet {
 
+  // Meshes of a CityMesh before they are in GL buffers, see CityMesh::stageTile
+  struct CityMeshStaging {
+    mesh_builder surface;
+    mesh_builder water;
+    mesh_builder roadLeft;
+    mesh_builder roadRight;
+    mesh_builder pavement;
+    BuildingBatcher::Staging buildings;
+  };
+
   class CityMesh {
 
     mesh roadLeftMesh;
@@ -29,6 +39,21 @@ namespace octet {
     material *benchMaterial;
     material *binMaterial;
 
+    PropRenderer props;
+    BuildingBatcher buildings;
+
+    // Ground of a single city, surfaceMesh is the ground of a tile of a CityWorld
+    ChunkedTerrain terrain;
+
+    // Nearest buildings drawn on the CPU to hide the buildings and props behind them
+    OcclusionBuffer occlusion;
+    bool occlusionCulling;
+    // the buffer has this frame's occluders
+    bool occlusionReady;
+
+    // Projected geometry of the streets, kept for the streets that do not change in updateRefined
+    StreetGeometry streetGeometry;
+
     HeightMap *heightMap;
     
     static dynarray<image *> *imageArray_;
@@ -44,7 +69,6 @@ namespace octet {
       TEXTUREASSET_PAVEMENT,
       TEXTUREASSET_ROADLEFT,
       TEXTUREASSET_ROADRIGHT,
-      TEXTUREASSET_HEIGHTMAP,
       TEXTUREASSET_BUILDING,
       TEXTUREASSET_BUILDING_RES_1,
       TEXTUREASSET_BUILDING_RES_2,
@@ -73,7 +97,6 @@ namespace octet {
           "assets/citytex/pavement.gif",
           "assets/citytex/road_left.gif",
           "assets/citytex/road_right.gif",
-          "assets/citytex/heightmap6.gif",
           "assets/citytex/grass/detail.gif",
           "assets/citytex/buildings/building_residential_low.gif",
           "assets/citytex/buildings/building_office_glass.gif",
@@ -107,7 +130,13 @@ namespace octet {
     }
 
     CityMesh() {
+      occlusionCulling = false;
+      occlusionReady = false;
+    }
 
+    // Worth it at street level, where the nearest buildings hide most of the city
+    void setOcclusionCulling(bool value) {
+      occlusionCulling = value;
     }
 
     void setHeightmap(HeightMap *hm) {
@@ -125,15 +154,12 @@ namespace octet {
     void get_road_heights(dynarray<float> &result, vec4 &v1, vec4 &v2, int points, vec4 &cityDimensions, vec4 &cityCenter, float multiplier, float offsetX, float offsetY) {
       result.reset();
 
-      image *heightmapImage = ((*getImageArray())[TEXTUREASSET_HEIGHTMAP]);
-
       vec4 vDiff = v2 - v1;
 
       for (int i = 0; i != points+1; i++) {
         float t = ((float)i)/((float)points);
 
         vec4 vt = v1 + vDiff*t;
-        vec4 color;
 
         float u_ = (vt.x()+cityCenter.x()+cityDimensions.x()*0.5f) / (cityDimensions.x());
         float v_ = (vt.z()+cityCenter.z()+cityDimensions.z()*0.5f) / (cityDimensions.z());
@@ -141,10 +167,7 @@ namespace octet {
         u_ = ((1.0f-u_)*multiplier)+offsetX;
         v_ = (v_*multiplier)+offsetY;
 
-        heightmapImage->sample2Dbilinear(u_, v_, color);
-        //printf("Point %.2f (%.2f, %.2f, %.2f, %.2f), Sampling hm at (%.2f, %.2f) = %.2f\n", t, vt.x(), vt.y(), vt.z(), vt.w(), u_, v_, color.x()/255.0f*2.0f);
-
-        float h = (color.x() * CityConstants::HEIGHT_FACTOR)+CityConstants::HEIGHT_FACTOR*3;
+        float h = heightMap->sample_uv(u_, v_)+CityConstants::HEIGHT_FACTOR*3;
         if (h < CityConstants::BRIDGE_LEVEL) {
           h = CityConstants::BRIDGE_LEVEL;
         }
@@ -152,27 +175,187 @@ namespace octet {
       }
     }
 
-    void init(dynarray<Street> *streetsList, dynarray<BuildingArea> *buildingAreaList, vec4 &cityDimensions, vec4 &cityCenter) {
-    // temp
-    dynarray<BuildingArea> buildingAreaList2; 
+    // Raises points to the terrain height plus raise
+    void projectPoints(vec4 *points, unsigned count, float raise) {
+      if (count == 0) return;
+
+      dynarray<float> heights;
+      heights.resize(count);
+      heightMap->sample_heightmap(points, heights.data(), count);
+      for (unsigned i = 0; i != count; ++i) {
+        points[i][1] += heights[i] + raise;
+      }
+    }
+
+    // Projects one street on the terrain, the result is appended to geometry.
+    // Only the street and geometry are modified, so different streets can be projected
+    // at the same time into different geometry.
+    // leftOnly - only the half on the side of the left node, for the streets on the border of a tile
+    void projectStreet(Street &street, StreetGeometry &geometry, vec4 &cityCenter, float separationX, float separationZ,
+                       int gridWidth, int gridHeight, bool leftOnly = false) {
+      street.intersectGridStreet(geometry, cityCenter.x(), cityCenter.z(), separationX, separationZ, CityConstants::ROAD_HEIGHT, CityConstants::PAVEMENT_HEIGHT, gridWidth, gridHeight, leftOnly);
+
+      for (int side = 0; side != StreetGeometry::NUM_SIDES; ++side) {
+        StreetGeometry::Range &range = street.terrainRanges[side];
+        bool road = side == StreetGeometry::ROAD_LEFT || side == StreetGeometry::ROAD_RIGHT;
+        dynarray<vec4> &positions = geometry.getPool(StreetGeometry::getPoolOfSide(side)).positions;
+        projectPoints(positions.data() + range.firstVertex, range.numVertices, road ? CityConstants::ROAD_RAISE : CityConstants::PAVEMENT_RAISE);
+      }
+    }
+
+    // Adds the road and pavement geometry of projected streets to the builders, a pool at a time
+    void addStreetGeometry(StreetGeometry &geometry, mesh_builder &mbRoadLeft, mesh_builder &mbRoadRight, mesh_builder &mbPavement,
+                           vec4 &cityDimensions, vec4 &cityCenter) {
+      // the left half of the street is drawn with the right road material
+      mesh_builder *builders[StreetGeometry::NUM_POOLS] = { &mbRoadRight, &mbRoadLeft, &mbPavement };
+
+      for (int p = 0; p != StreetGeometry::NUM_POOLS; ++p) {
+        StreetGeometry::Pool &pool = geometry.getPool(p);
+        if (pool.positions.size() == 0) continue;
+        builders[p]->add_vertices(pool.positions, pool.indices, pool.normals, pool.uvCoords,
+                                  cityDimensions, cityCenter, CityConstants::MULTIPLIER, CityConstants::OFFSET_X, CityConstants::OFFSET_Y,
+                                  heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXZ(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap());
+      }
+    }
+
+    void init(StreetList *streetsList, dynarray<BuildingArea> *buildingAreaList, vec4 &cityDimensions, vec4 &cityCenter, const CityRandom &random) {
+      initTerrain(cityDimensions, cityCenter);
+      initRoads(streetsList, cityDimensions, cityCenter);
+      initBuildings(buildingAreaList, random);
+      initMaterials();
+    }
+
+    // Same as init, with the roads and buildings of a snapshot instead of generating them
+    void initFromSnapshot(CitySnapshot &snapshot, dynarray<BuildingArea> *buildingAreaList, vec4 &cityDimensions, vec4 &cityCenter) {
+      initTerrain(cityDimensions, cityCenter);
+
+      printf("Loading road meshes.\n");
+      snapshot.getMesh(CitySnapshot::MESH_ROAD_LEFT, roadLeftMesh);
+      snapshot.getMesh(CitySnapshot::MESH_ROAD_RIGHT, roadRightMesh);
+      snapshot.getMesh(CitySnapshot::MESH_PAVEMENT, pavementMesh);
+      initRoadNormals();
+
+      printf("Loading buildings.\n");
+      snapshot.getBuildings(*buildingAreaList);
+      for (int part = 0; part != BuildingBatcher::NUM_PARTS; ++part) {
+        snapshot.getMesh(CitySnapshot::MESH_FIRST_BUILDING_PART + part, buildings.getPart((BuildingBatcher::Part)part));
+      }
+      buildings.rebuildHierarchy(*buildingAreaList);
+
+      initMaterials();
+    }
+
+    // The meshes of one tile of a CityWorld, without GL so that it can run in any thread.
+    // Roads follow the terrain grid of the whole world (worldDimensions and worldCenter, as in init),
+    // the ground is a patch from tileMin to tileMax with cellsX by cellsZ cells of that grid.
+    // Streets on the border of the tile only add their inner half, the tile across adds the other.
+    void stageTile(City &city, vec4 &worldDimensions, vec4 &worldCenter, const vec4 &tileMin, const vec4 &tileMax,
+                   int cellsX, int cellsZ, CityMeshStaging &staging) {
+      vec4 terrainDimensions = worldDimensions*2.0f;
+      float stepX = (tileMax.x() - tileMin.x()) / cellsX;
+      float stepZ = (tileMax.z() - tileMin.z()) / cellsZ;
+
+      // Ground, the last row and column are exactly on the border shared with the next tile
+      mesh_builder &mbSurface = staging.surface;
+      for (int j = 0; j <= cellsZ; j++) {
+        float z = j == cellsZ ? tileMax.z() : tileMin.z() + stepZ * j;
+        for (int i = 0; i <= cellsX; i++) {
+          float x = i == cellsX ? tileMax.x() : tileMin.x() + stepX * i;
+          float dx = heightMap->sample_ground(x + stepX, z) - heightMap->sample_ground(x - stepX, z);
+          float dz = heightMap->sample_ground(x, z + stepZ) - heightMap->sample_ground(x, z - stepZ);
+          vec4 normal = vec4(-dx / (2.0f * stepX), 1.0f, -dz / (2.0f * stepZ), 0.0f).normalize();
+          vec4 pos(x, heightMap->sample_ground(x, z), z, 1.0f);
+          mbSurface.add_vertex(pos, normal, x / terrainDimensions.x() * 10.0f, z / terrainDimensions.z() * 13.0f);
+        }
+      }
+      for (int j = 0; j != cellsZ; j++) {
+        for (int i = 0; i != cellsX; i++) {
+          unsigned v = j * (cellsX + 1) + i;
+          mbSurface.add_index(v);
+          mbSurface.add_index(v + cellsX + 1);
+          mbSurface.add_index(v + cellsX + 2);
+          mbSurface.add_index(v);
+          mbSurface.add_index(v + cellsX + 2);
+          mbSurface.add_index(v + 1);
+        }
+      }
 
+      staging.water.translate((tileMin.x() + tileMax.x()) * 0.5f, CityConstants::WATER_LEVEL, (tileMin.z() + tileMax.z()) * 0.5f);
+      staging.water.rotate(-90, 1, 0, 0);
+      staging.water.add_plane(tileMax.x() - tileMin.x(), tileMax.z() - tileMin.z(), 1, 1);
+
+      float separationX = terrainDimensions.x()/(heightMap->getWidth()-2);
+      float separationZ = terrainDimensions.z()/(heightMap->getHeight()-2);
+      int gridWidth = heightMap->getWidth()-2;
+      int gridHeight = heightMap->getHeight()-2;
+
+      StreetGeometry geometry;
+      for (int i = 0; i != city.streetsList.size(); i++) {
+        if (city.streetRemoved[i]) continue;
+        Street &street = city.streetsList[i];
+        projectStreet(street, geometry, worldCenter, separationX, separationZ, gridWidth, gridHeight, street.rightNode == NULL);
+      }
+      addStreetGeometry(geometry, staging.roadLeft, staging.roadRight, staging.pavement, worldDimensions, worldCenter);
+
+      setBuildingHeights(&city.buildingAreaList, city.random);
+      BuildingBatcher::prepare(city.buildingAreaList, staging.buildings);
+    }
+
+    // Meshes of a staged tile, materials are the ones of the shared CityMesh
+    void initFromStaging(CityMeshStaging &staging, const CityMesh &shared) {
+      staging.surface.get_mesh(surfaceMesh);
+      staging.water.get_mesh(waterMesh);
+      staging.roadLeft.get_mesh(roadLeftMesh);
+      staging.roadRight.get_mesh(roadRightMesh);
+      staging.pavement.get_mesh(pavementMesh);
+      surfaceNormalsMesh.make_normal_visualizer(surfaceMesh, 0.3f, attribute_normal);
+      initRoadNormals();
+      buildings.upload(staging.buildings);
+
+      roadMaterialLeft = shared.roadMaterialLeft;
+      roadMaterialRight = shared.roadMaterialRight;
+      pavementMaterial = shared.pavementMaterial;
+      grassMaterial = shared.grassMaterial;
+      waterMaterial = shared.waterMaterial;
+      buldingMaterial = shared.buldingMaterial;
+    }
+
+    // Bytes in the buffers of the terrain, roads and buildings
+    unsigned getGeometryBytes() {
+      mesh *meshes[] = {
+        &roadLeftMesh, &roadRightMesh, &pavementMesh, &surfaceMesh, &waterMesh,
+        &roadLeftNormalsMesh, &roadRightNormalsMesh, &pavementNormalsMesh, &surfaceNormalsMesh,
+        &buildings.getPart(BuildingBatcher::PART_WALLS), &buildings.getPart(BuildingBatcher::PART_ROOF), &buildings.getPart(BuildingBatcher::PART_BASEMENT)
+      };
+      unsigned bytes = terrain.getGeometryBytes();
+      for (int i = 0; i != sizeof(meshes) / sizeof(meshes[0]); i++) {
+        bytes += meshes[i]->get_vertices()->get_size() + meshes[i]->get_indices()->get_size();
+      }
+      return bytes;
+    }
+
+    // Meshes after City::refinePartition. Only the streets that changed are projected again,
+    // the merged meshes are built again from the geometry kept in streetGeometry.
+    void updateRefined(City &city, vec4 &cityDimensions, vec4 &cityCenter) {
+      initRoads(&city.streetsList, cityDimensions, cityCenter, &city.streetDirty, &city.streetRemoved);
+      updateBuildings(&city.buildingAreaList, city.firstNewBuilding, city.random);
+      updateProps(&city.models);
+    }
+
+    // Write the generated city, call after init
+    bool saveSnapshot(const char *path, City &city, unsigned int depth, dynarray<BuildingArea> *buildingAreaList) {
+      return CitySnapshot::save(path, city, depth, *heightMap, roadLeftMesh, roadRightMesh, pavementMesh, *buildingAreaList, buildings);
+    }
+
+    void initTerrain(vec4 &cityDimensions, vec4 &cityCenter) {
       mesh_builder mb;
-      mesh_builder mbRoadLeft;
-      mesh_builder mbRoadRight;
-      mesh_builder mbPavement;
 
       //Create heightmap
       vec4 terrainDimensions = cityDimensions*2.0f;
 
-      printf("Creating road meshes.\n");
-
       printf("Creating surface from heightmap.\n");
-      mb.init(0, 0);
-      mb.translate(cityCenter.x(), cityCenter.y(), cityCenter.z());
-      mb.rotate(-90, 1, 0, 0);
-      mb.add_plane_heightmap(terrainDimensions.x(), terrainDimensions.z(), heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXY(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap(), 0.0f, 0.0f, 10, 13);
-      mb.get_mesh(surfaceMesh);
-      //surfaceMesh.set_mode(GL_LINE_STRIP);
+      terrain.build(*heightMap, terrainDimensions, cityCenter);
+      surfaceMesh.init();
   
       printf("Creating water plane.\n");
       mb.init(0, 0);
@@ -181,129 +364,125 @@ namespace octet {
       mb.add_plane(terrainDimensions.x(), terrainDimensions.z(), 10, 10);
       mb.get_mesh(waterMesh);
 
+      // normals of the coarsest patch, the full resolution would be a mesh as big as the one the patches replace
+      surfaceNormalsMesh.make_normal_visualizer(*terrain.getRootPatch(), 0.3f, attribute_normal);
+    }
+
+    // Choose the terrain patches for the next frame, model to world is the identity.
+    // pixelsPerUnit is the size in pixels of a world unit at a distance of one.
+    void selectTerrain(const mat4t &worldToProjection, const vec4 &eye, float pixelsPerUnit, float maxPixelError) {
+      terrain.select(worldToProjection, eye, pixelsPerUnit / maxPixelError);
+    }
+
+    // dirty - if given, only these streets are projected again, the others reuse their geometry
+    // removed - streets to leave out
+    void initRoads(StreetList *streetsList, vec4 &cityDimensions, vec4 &cityCenter,
+                   const dynarray<bool> *dirty = NULL, const dynarray<bool> *removed = NULL) {
+      mesh_builder mbRoadLeft;
+      mesh_builder mbRoadRight;
+      mesh_builder mbPavement;
+
+      vec4 terrainDimensions = cityDimensions*2.0f;
       float separationX = terrainDimensions.x()/(heightMap->getWidth()-2);
       float separationZ = terrainDimensions.z()/(heightMap->getHeight()-2);
       int gridWidth = heightMap->getWidth()-2;
       int gridHeight = heightMap->getHeight()-2;
 
       // Creating road meshes
-      printf("Creating road meshes.\n");
+      if (!dirty) printf("Creating road meshes.\n");
       mbRoadLeft.init(0, 0);
       mbRoadRight.init(0, 0);
       mbPavement.init(0, 0);
 
-      for (int i = 0; i < streetsList->size(); i++) {
-        Street &street = (*streetsList)[i];
-        dynarray<float> road_heights;
-
-        // Creating road
-        vec4 v1 = street.points[0];
-        vec4 v2 = street.points[1];
-
-        street.intersectGridStreet(cityCenter.x(), cityCenter.z(), separationX, separationZ, CityConstants::ROAD_HEIGHT, CityConstants::PAVEMENT_HEIGHT, gridWidth, gridHeight);
-
-        for (auto j = street.terrainIntersectedPoints.roadLeft.begin(); j != street.terrainIntersectedPoints.roadLeft.end(); j++) {
-          (*j)[1] += heightMap->sample_heightmap(*j) + CityConstants::ROAD_RAISE;
-        }
-
-        for (auto j = street.terrainIntersectedPoints.roadRight.begin(); j != street.terrainIntersectedPoints.roadRight.end(); j++) {
-          (*j)[1] += heightMap->sample_heightmap(*j) + CityConstants::ROAD_RAISE;
-        }
-
-        for (auto j = street.terrainIntersectedPoints.pavementLeft.begin(); j != street.terrainIntersectedPoints.pavementLeft.end(); j++) {
-          (*j)[1] += heightMap->sample_heightmap(*j) + CityConstants::PAVEMENT_RAISE;
+      // Streets are independent until their geometry is appended, so every range of
+      // streets is projected into its own geometry and the ranges are merged in order.
+      // The result does not depend on the number of threads.
+      int numStreets = streetsList->size();
+      int numRanges = 1;
+    #ifdef _OPENMP
+      numRanges = omp_get_max_threads() * 4;
+    #endif
+      if (numRanges > numStreets) numRanges = numStreets > 0 ? numStreets : 1;
+
+      StreetGeometry *rangeGeometry = new StreetGeometry[numRanges];
+
+      #pragma omp parallel for schedule(dynamic)
+      for (int r = 0; r < numRanges; r++) {
+        int first = numStreets * r / numRanges;
+        int last = numStreets * (r+1) / numRanges;
+        for (int i = first; i != last; i++) {
+          if (removed && (*removed)[i]) continue;
+          Street &street = (*streetsList)[i];
+          if (!dirty || (*dirty)[i]) {
+            projectStreet(street, rangeGeometry[r], cityCenter, separationX, separationZ, gridWidth, gridHeight);
+          } else {
+            rangeGeometry[r].copyStreet(streetGeometry, street.terrainRanges);
+          }
         }
+      }
 
-        for (auto j = street.terrainIntersectedPoints.pavementRight.begin(); j != street.terrainIntersectedPoints.pavementRight.end(); j++) {
-          (*j)[1] += heightMap->sample_heightmap(*j) + CityConstants::PAVEMENT_RAISE;
-        }
-        
-        if (street.terrainIntersectedPoints.roadLeft.size() > 0) {
-          mbRoadRight.add_vertices(street.terrainIntersectedPoints.roadLeft,
-                                   street.terrainIntersectedIndices.roadLeft,
-                                   street.terrainIntersectedNormals.roadLeft,
-                                   street.terrainIntersectedUVCoords.roadLeft,
-                                   cityDimensions, cityCenter, CityConstants::MULTIPLIER, CityConstants::OFFSET_X, CityConstants::OFFSET_Y,
-                                   heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXZ(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap());
-        }
-        
-        if (street.terrainIntersectedPoints.roadRight.size() > 0) {
-          mbRoadLeft.add_vertices(street.terrainIntersectedPoints.roadRight,
-                                  street.terrainIntersectedIndices.roadRight,
-                                  street.terrainIntersectedNormals.roadRight,
-                                  street.terrainIntersectedUVCoords.roadRight,
-                                  cityDimensions, cityCenter, CityConstants::MULTIPLIER, CityConstants::OFFSET_X, CityConstants::OFFSET_Y,
-                                  heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXZ(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap());
-        }
+      StreetGeometry merged;
+      for (int r = 0; r != numRanges; r++) {
+        StreetGeometry::Range offsets[StreetGeometry::NUM_POOLS];
+        merged.append(rangeGeometry[r], offsets);
 
-        // Right Pavement
-        if (street.terrainIntersectedPoints.pavementRight.size() > 0) {
-          mbPavement.add_vertices(street.terrainIntersectedPoints.pavementRight,
-                                  street.terrainIntersectedIndices.pavementRight,
-                                  street.terrainIntersectedNormals.pavementRight,
-                                  street.terrainIntersectedUVCoords.pavementRight,
-                                  cityDimensions, cityCenter, CityConstants::MULTIPLIER, CityConstants::OFFSET_X, CityConstants::OFFSET_Y,
-                                  heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXZ(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap());
-        }
-        
-        // Left Pavement
-        if (street.terrainIntersectedPoints.pavementLeft.size() > 0) {
-          mbPavement.add_vertices(street.terrainIntersectedPoints.pavementLeft,
-                                  street.terrainIntersectedIndices.pavementLeft,
-                                  street.terrainIntersectedNormals.pavementLeft,
-                                  street.terrainIntersectedUVCoords.pavementLeft,
-                                  cityDimensions, cityCenter, CityConstants::MULTIPLIER, CityConstants::OFFSET_X, CityConstants::OFFSET_Y,
-                                  heightMap->getWidth()-2, heightMap->getHeight()-2, heightMap->getNormalMapXZ(), heightMap->getWidth(), heightMap->getHeight(), heightMap->getHeightmap());
+        int first = numStreets * r / numRanges;
+        int last = numStreets * (r+1) / numRanges;
+        for (int i = first; i != last; i++) {
+          if (removed && (*removed)[i]) continue;
+          StreetGeometry::moveRanges((*streetsList)[i].terrainRanges, offsets);
         }
       }
+      delete[] rangeGeometry;
+      streetGeometry.swap(merged);
+
+      addStreetGeometry(streetGeometry, mbRoadLeft, mbRoadRight, mbPavement, cityDimensions, cityCenter);
 
       mbRoadLeft.get_mesh(roadLeftMesh); 
       mbRoadRight.get_mesh(roadRightMesh); 
       mbPavement.get_mesh(pavementMesh);
 
+      initRoadNormals();
+    }
+
+    void initRoadNormals() {
       roadLeftNormalsMesh.make_normal_visualizer(roadLeftMesh, 0.3f, attribute_normal);
       roadRightNormalsMesh.make_normal_visualizer(roadRightMesh, 0.3f, attribute_normal);
       pavementNormalsMesh.make_normal_visualizer(pavementMesh, 0.3f, attribute_normal);
-      surfaceNormalsMesh.make_normal_visualizer(surfaceMesh, 0.3f, attribute_normal);
-
-    
-  
+    }
 
+    void initBuildings(dynarray<BuildingArea> *buildingAreaList, const CityRandom &random) {
+      printf("Creating buildings.\n");
+      setBuildingHeights(buildingAreaList, random);
+      buildings.build(*buildingAreaList);
+    }
 
-    // creating buildings meshes 
-    printf("Creating buildings.\n");
+    static void setBuildingHeights(dynarray<BuildingArea> *buildingAreaList, const CityRandom &random) {
       for (int i = 0; i < buildingAreaList->size(); i++) {
-        mb.init(0, 0);
-        
-        float random_height = std::rand()%4 + 2;
-
-    // central mesh of the building
-        mb.add_extrude_polygon((*buildingAreaList)[i].points, random_height, CityConstants::BUILDING_BASEMENT_HEIGHT); 
-    (*buildingAreaList)[i].height = random_height; 
-    (*buildingAreaList)[i].calculate_area();
-        
-        mesh * m = new mesh();
-        mb.get_mesh(*m);
-        m->set_mode(GL_TRIANGLES);
-        (*buildingAreaList)[i].areaMesh = (*m);
-
-    // basement mesh of the building
-    mb.init(0,0); 
-    mb.add_basement((*buildingAreaList)[i].points, CityConstants::BUILDING_BASEMENT_HEIGHT);
-    m->init();
-    mb.get_mesh(*m);
-    m->set_mode(GL_TRIANGLES);
-    (*buildingAreaList)[i].basementMesh = (*m);
-
-    // roof mesh of the building
-    mb.init(0,0); 
-    mb.add_roof((*buildingAreaList)[i].points, CityConstants::BUILDING_BASEMENT_HEIGHT + random_height);
-    m->init();
-    mb.get_mesh(*m);
-    m->set_mode(GL_TRIANGLES);
-    (*buildingAreaList)[i].roofMesh = (*m);
+        (*buildingAreaList)[i].height = (float)random.getGenerator(CityRandom::STREAM_BUILDINGS, i).getInt(2, 6);
+        (*buildingAreaList)[i].calculate_area();
+      }
+    }
+
+    // Heights of the buildings from firstNew are keyed by their block and their order in it,
+    // so they do not depend on the order the city is refined in
+    void updateBuildings(dynarray<BuildingArea> *buildingAreaList, int firstNew, const CityRandom &random) {
+      BSPNode *block = NULL;
+      int area = 0;
+      for (int i = firstNew; i < buildingAreaList->size(); i++) {
+        BuildingArea &b = (*buildingAreaList)[i];
+        if (b.block != block) {
+          block = b.block;
+          area = 0;
+        }
+        uint64_t key = CityRandom::combine(block ? block->id : 0, area++);
+        b.height = (float)random.getGenerator(CityRandom::STREAM_BUILDINGS, key).getInt(2, 6);
+        b.calculate_area();
       }
+      buildings.build(*buildingAreaList);
+    }
 
+    void initMaterials() {
       pavementMaterial = new material((*getImageArray())[TEXTUREASSET_PAVEMENT]);
       roadMaterialLeft = new material((*getImageArray())[TEXTUREASSET_ROADLEFT]);
       roadMaterialRight = new material((*getImageArray())[TEXTUREASSET_ROADRIGHT]);
@@ -364,40 +543,96 @@ namespace octet {
       return &images[0];
     }
 
-    void debugRender(bump_shader &shader, city_buildings_bump_shader &buldingShader, color_shader &cshader, skybox_shader &sb_shader,const mat4t &modelToProjection, const mat4t &modelToCamera, const mat4t &cameraToWorld, vec4 *light_uniforms, const int num_light_uniforms, const int num_lights,
-        dynarray<BuildingArea> *buildingAreaList,std::vector <ref<Model>> *models,int drawFlags, int draw_texture_mode) {
+    material *getPropMaterial(const std::string &name) {
+      if (name == "Lamp") return lampMaterial;
+      if (name == "Traffic Light") return trafficLightMaterial;
+      if (name == "Hydrant") return hydrantMaterial;
+      if (name == "Postbox") return postBoxMaterial;
+      if (name == "Tree") return treeMaterial;
+      if (name == "Tree2") return tree2Material;
+      if (name == "Bench") return benchMaterial;
+      return binMaterial;
+    }
 
-      if (drawFlags & 0x1) {
-        grassMaterial->render(shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        surfaceMesh.render();
+    // texture drawn on the impostors of the far away props, only the trees have them
+    image *getPropImpostorTexture(const std::string &name) {
+      if (name == "Tree") return (*getImageArray())[TEXTUREASSET_TREE_TEXTURE];
+      if (name == "Tree2") return (*getImageArray())[TEXTUREASSET_TREE2_TEXTURE];
+      return NULL;
+    }
+
+    // Group the 3D models by prototype, call after init
+    void initProps(std::vector <ref<Model>> *models) {
+      printf("Batching 3D models.\n");
+      props.init();
+      updateProps(models);
+    }
+
+    // Replace the props drawn for owner, the props of the other owners stay. Call after initProps
+    void updateProps(std::vector <ref<Model>> *models, const void *owner = NULL) {
+      for (int i = 0; i != models->size(); ++i) {
+        Model *model = (*models)[i];
+        props.addInstance(model->getPrototype(), getPropMaterial(model->getMaterial()), model->getModelToWorld(), getPropImpostorTexture(model->getMaterial()));
       }
+      props.upload(owner);
+    }
 
-      if (drawFlags & 0x4) {
-        roadMaterialLeft->render(shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        roadLeftMesh.render();
+    // Stop drawing the props of owner
+    void removeProps(const void *owner) {
+      props.removeInstances(owner);
+    }
 
-        roadMaterialRight->render(shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        roadRightMesh.render();
+    void printRenderStats() {
+      printf("Props: %d instances in %d draw calls, %d culled testing %d nodes.\n", props.getInstancesDrawn(), props.getDrawCalls(), props.getInstancesCulled(), props.getNodesTested());
+      printf("Prop levels:");
+      for (int level = 0; level != PropRenderer::IMPOSTOR_LEVEL; ++level) {
+        printf(" lod%d %d (%d triangles),", level, props.getLevelInstances(level), props.getLevelTriangles(level));
+      }
+      printf(" impostors %d (%d triangles).\n", props.getLevelInstances(PropRenderer::IMPOSTOR_LEVEL), props.getLevelTriangles(PropRenderer::IMPOSTOR_LEVEL));
+      printf("Buildings: %d draw calls, %d culled testing %d nodes.\n", buildings.getDrawCalls(), buildings.getBuildingsCulled(), buildings.getNodesTested());
+      if (occlusionReady) {
+        printf("Occlusion: %d occluders, %d triangles, %d building nodes and %d prop nodes hidden.\n",
+               occlusion.getOccluders(), occlusion.getTriangles(), buildings.getNodesOccluded(), props.getNodesOccluded());
+      }
+      if (terrain.isBuilt()) {
+        printf("Terrain: %d patches, %d triangles, %d patches built.\n", terrain.getPatchesDrawn(), terrain.getTrianglesDrawn(), terrain.getPatchesBuilt());
+      }
+    }
 
-        pavementMaterial->render(shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        pavementMesh.render();
+    // Terrain, roads, buildings and water, without the props and the sky
+    // Ground, roads, buildings and water in renderQueue, drawn when it is executed, depth is the distance to the camera.
+    // The normals are drawn straight away.
+    void renderGeometry(CityRenderQueue &renderQueue, color_shader &cshader, const mat4t &modelToProjection, int drawFlags, float depth) {
+      occlusionReady = occlusionCulling && (drawFlags & 0x8) != 0;
+      if (occlusionReady) {
+        occlusion.begin(modelToProjection);
+        buildings.addOccluders(occlusion, modelToProjection);
       }
 
-      if (drawFlags & 0x8) {
-       
-      for (int i = 0; i != buildingAreaList->size(); ++i) {
-      buldingMaterial->render_building(buldingShader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, (*buildingAreaList)[i].height, (*buildingAreaList)[i].area, draw_texture_mode, 0);
-      (*buildingAreaList)[i].areaMesh.render();
-      buldingMaterial->render_building(buldingShader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, (*buildingAreaList)[i].height, (*buildingAreaList)[i].area, draw_texture_mode, 1);
-      (*buildingAreaList)[i].roofMesh.render();
-      buldingMaterial->render_building(buldingShader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, (*buildingAreaList)[i].height, (*buildingAreaList)[i].area, draw_texture_mode, 2);
-      (*buildingAreaList)[i].basementMesh.render();
+      if (drawFlags & 0x1) {
+        if (terrain.isBuilt()) {
+          renderQueue.addTerrain(grassMaterial, &terrain, depth);
+        } else {
+          renderQueue.addMesh(grassMaterial, &surfaceMesh, depth);
         }
       }
 
+      if (drawFlags & 0x4) {
+        renderQueue.addMesh(roadMaterialLeft, &roadLeftMesh, depth);
+        renderQueue.addMesh(roadMaterialRight, &roadRightMesh, depth);
+        renderQueue.addMesh(pavementMaterial, &pavementMesh, depth);
+      }
+
+      if (drawFlags & 0x8) {
+        buildings.cull(modelToProjection, occlusionReady ? &occlusion : NULL);
+        renderQueue.addBuildings(buldingMaterial, &buildings, BuildingBatcher::PART_WALLS, depth);
+        renderQueue.addBuildings(buldingMaterial, &buildings, BuildingBatcher::PART_ROOF, depth);
+        renderQueue.addBuildings(buldingMaterial, &buildings, BuildingBatcher::PART_BASEMENT, depth);
+      }
+
+      // water is blended, the queue draws it after everything else
       if (drawFlags & 0x2) {
-        waterMaterial->render(shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        waterMesh.render();
+        renderQueue.addMesh(waterMaterial, &waterMesh, depth, true);
       }
 
       if (drawFlags & 0x40) {
@@ -411,44 +646,19 @@ namespace octet {
         roadRightNormalsMesh.render();
         pavementNormalsMesh.render();
       }
+    }
 
-      //RENDER 3D MODELS
-
-      for(int i=0;i!=models->size();++i){
-        if((*models)[i]->getMaterial() == "Lamp"){
-          lampMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
-
-        if((*models)[i]->getMaterial() == "Traffic Light"){
-          trafficLightMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
-
-        if((*models)[i]->getMaterial() == "Hydrant"){
-          hydrantMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
-
-        if((*models)[i]->getMaterial() == "Postbox"){
-          postBoxMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
+    // The geometry and props of this city with whatever else is in renderQueue, then the sky
+    void debugRender(CityRenderQueue &renderQueue, color_shader &cshader, skybox_shader &sb_shader, const mat4t &modelToProjection, const mat4t &modelToCamera, const mat4t &cameraToWorld,
+        vec4 *light_uniforms, const int num_light_uniforms, const int num_lights, dynarray<BuildingArea> *buildingAreaList, int drawFlags) {
 
-        if((*models)[i]->getMaterial() == "Tree"){
-          treeMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
+      renderGeometry(renderQueue, cshader, modelToProjection, drawFlags, 0.0f);
 
-        if((*models)[i]->getMaterial() == "Tree2"){
-          tree2Material->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
-
-        if((*models)[i]->getMaterial() == "Bench"){
-          benchMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
+      //RENDER 3D MODELS
 
-        if((*models)[i]->getMaterial() == "Bin"){
-          binMaterial->render(shader, (*models)[i]->getModelToWorld()*modelToProjection, (*models)[i]->getModelToWorld()*modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        }
+      props.submit(renderQueue.getQueue(), modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, occlusionReady ? &occlusion : NULL);
 
-        (*models)[i]->render();
-      }
+      renderQueue.execute();
 
       glActiveTexture(GL_TEXTURE7);
       glBindTexture(GL_TEXTURE_CUBE_MAP,sky_box_textureObj);
@@ -469,8 +679,10 @@ namespace octet {
       unsigned int WIREFRAME_MODE = GL_LINE_LOOP; 
       if (drawFlags & 0x100) {
         surfaceMesh.set_mode(WIREFRAME_MODE);
+        terrain.set_mode(WIREFRAME_MODE);
       } else {
         surfaceMesh.set_mode(GL_TRIANGLES);
+        terrain.set_mode(GL_TRIANGLES);
       }
 
       if (drawFlags & 0x200) {
@@ -484,13 +696,9 @@ namespace octet {
       }
 
       if (drawFlags & 0x400) {
-        for (int i = 0; i != buildingAreaList->size(); ++i) {
-          (*buildingAreaList)[i].areaMesh.set_mode(WIREFRAME_MODE);
-        }
+        buildings.set_mode(BuildingBatcher::PART_WALLS, WIREFRAME_MODE);
       } else {
-        for (int i = 0; i != buildingAreaList->size(); ++i) {
-          (*buildingAreaList)[i].areaMesh.set_mode(GL_TRIANGLES);
-        }
+        buildings.set_mode(BuildingBatcher::PART_WALLS, GL_TRIANGLES);
       }
     }
   };
@@ -6,6 +6,9 @@ namespace octet {
 
   template <class T>
   class StreetArrayCollection {
+    //dynarray assigns its pointer, the arrays can only be swapped
+    StreetArrayCollection &operator=(const StreetArrayCollection &c);
+
   public:
     dynarray<T> roadLeft;
     dynarray<T> roadRight;
@@ -18,6 +21,153 @@ namespace octet {
       , pavementLeft()
       , pavementRight()
     { }
+
+    void reset() {
+      roadLeft.reset();
+      roadRight.reset();
+      pavementLeft.reset();
+      pavementRight.reset();
+    }
+
+    void swap(StreetArrayCollection &c) {
+      roadLeft.swap(c.roadLeft);
+      roadRight.swap(c.roadRight);
+      pavementLeft.swap(c.pavementLeft);
+      pavementRight.swap(c.pavementRight);
+    }
+  };
+
+  // Road and pavement geometry of the streets of a city once it is projected on the terrain.
+  // There is one pool of positions, normals, UVs and indices per mesh they go to, and every
+  // street owns a range of the pool of each side instead of having arrays of its own.
+  // Indices are positions in their pool, so a whole pool is added to a mesh_builder at once.
+  class StreetGeometry {
+  public:
+    //In the order they are added to the meshes
+    enum Side {
+      ROAD_LEFT,
+      ROAD_RIGHT,
+      PAVEMENT_RIGHT,
+      PAVEMENT_LEFT,
+      NUM_SIDES,
+    };
+
+    enum PoolId {
+      POOL_ROAD_LEFT,
+      POOL_ROAD_RIGHT,
+      POOL_PAVEMENT,
+      NUM_POOLS,
+    };
+
+    struct Pool {
+      dynarray<vec4> positions;
+      dynarray<vec4> normals;
+      dynarray<vec2> uvCoords;
+      dynarray<uint32_t> indices;
+    };
+
+    struct Range {
+      unsigned firstVertex;
+      unsigned numVertices;
+      unsigned firstIndex;
+      unsigned numIndices;
+
+      Range()
+        : firstVertex(0)
+        , numVertices(0)
+        , firstIndex(0)
+        , numIndices(0)
+      {}
+    };
+
+  private:
+    Pool pools[NUM_POOLS];
+
+  public:
+    static PoolId getPoolOfSide(int side) {
+      return side == ROAD_LEFT ? POOL_ROAD_LEFT : side == ROAD_RIGHT ? POOL_ROAD_RIGHT : POOL_PAVEMENT;
+    }
+
+    Pool &getPool(int pool) {
+      return pools[pool];
+    }
+
+    //A range starting at the end of the pool of a side, the geometry of the side is appended after it
+    Range beginRange(int side) {
+      Pool &pool = pools[getPoolOfSide(side)];
+      Range range;
+      range.firstVertex = pool.positions.size();
+      range.firstIndex = pool.indices.size();
+      return range;
+    }
+
+    void endRange(int side, Range &range) {
+      Pool &pool = pools[getPoolOfSide(side)];
+      range.numVertices = pool.positions.size() - range.firstVertex;
+      range.numIndices = pool.indices.size() - range.firstIndex;
+    }
+
+    //Append the geometry of a street in another store, its ranges are changed to the new place
+    void copyStreet(StreetGeometry &from, Range ranges[NUM_SIDES]) {
+      for (int side = 0; side != NUM_SIDES; ++side) {
+        Pool &src = from.pools[getPoolOfSide(side)];
+        Pool &dst = pools[getPoolOfSide(side)];
+        Range &range = ranges[side];
+        Range result = beginRange(side);
+
+        for (unsigned i = 0; i != range.numVertices; ++i) {
+          dst.positions.push_back(src.positions[range.firstVertex + i]);
+          dst.normals.push_back(src.normals[range.firstVertex + i]);
+          dst.uvCoords.push_back(src.uvCoords[range.firstVertex + i]);
+        }
+        for (unsigned i = 0; i != range.numIndices; ++i) {
+          dst.indices.push_back(src.indices[range.firstIndex + i] - range.firstVertex + result.firstVertex);
+        }
+
+        endRange(side, result);
+        range = result;
+      }
+    }
+
+    //Append every pool of another store. The ranges into it are moved with moveRanges(ranges, offsets).
+    void append(StreetGeometry &other, Range offsets[NUM_POOLS]) {
+      for (int p = 0; p != NUM_POOLS; ++p) {
+        Pool &src = other.pools[p];
+        Pool &dst = pools[p];
+        offsets[p].firstVertex = dst.positions.size();
+        offsets[p].firstIndex = dst.indices.size();
+
+        dst.positions.reserve(dst.positions.size() + src.positions.size());
+        dst.normals.reserve(dst.normals.size() + src.normals.size());
+        dst.uvCoords.reserve(dst.uvCoords.size() + src.uvCoords.size());
+        dst.indices.reserve(dst.indices.size() + src.indices.size());
+        for (int i = 0; i != src.positions.size(); ++i) {
+          dst.positions.push_back(src.positions[i]);
+          dst.normals.push_back(src.normals[i]);
+          dst.uvCoords.push_back(src.uvCoords[i]);
+        }
+        for (int i = 0; i != src.indices.size(); ++i) {
+          dst.indices.push_back(src.indices[i] + offsets[p].firstVertex);
+        }
+      }
+    }
+
+    static void moveRanges(Range ranges[NUM_SIDES], const Range offsets[NUM_POOLS]) {
+      for (int side = 0; side != NUM_SIDES; ++side) {
+        const Range &offset = offsets[getPoolOfSide(side)];
+        ranges[side].firstVertex += offset.firstVertex;
+        ranges[side].firstIndex += offset.firstIndex;
+      }
+    }
+
+    void swap(StreetGeometry &other) {
+      for (int p = 0; p != NUM_POOLS; ++p) {
+        pools[p].positions.swap(other.pools[p].positions);
+        pools[p].normals.swap(other.pools[p].normals);
+        pools[p].uvCoords.swap(other.pools[p].uvCoords);
+        pools[p].indices.swap(other.pools[p].indices);
+      }
+    }
   };
 
   class Street {
@@ -30,19 +180,12 @@ namespace octet {
     BSPNode *leftNode;
     BSPNode *rightNode;
 
-    //These points are generated from the previous points. Unintersected roads.
-    StreetArrayCollection<vec4> originalStreetPoints;
-    StreetArrayCollection<vec2> originalStreetUVCoords;
-
     //Store meshes after intersection between roads
     StreetArrayCollection<vec4> streetIntersectedPoints;
     StreetArrayCollection<vec2> streetIntersectedUVCoords;
 
-    //Store meshes after projection to terrain (Final form)
-    StreetArrayCollection<vec4> terrainIntersectedPoints;
-    StreetArrayCollection<unsigned short> terrainIntersectedIndices;
-    StreetArrayCollection<vec4> terrainIntersectedNormals;
-    StreetArrayCollection<vec2> terrainIntersectedUVCoords;
+    //Meshes after projection to terrain (Final form), ranges of every side in a StreetGeometry
+    StreetGeometry::Range terrainRanges[StreetGeometry::NUM_SIDES];
 
     float angleCS[2];
     float translatedDistance[2];
@@ -53,29 +196,58 @@ namespace octet {
       , rightNode(NULL)
       , streetIntersectedPoints()
       , streetIntersectedUVCoords()
-      , terrainIntersectedPoints()
-      , terrainIntersectedIndices()
-      , terrainIntersectedNormals()
-      , terrainIntersectedUVCoords()
     {
       memset(points, 0, sizeof(vec4)*2);
       memset(angleCS, 0, sizeof(float)*2);
       memset(translatedDistance, 0, sizeof(float)*2);
     }
 
-    //Copy constructor that may be maybe modified
-    Street(Street &s) {                                                       
-      this->points[0] = s.points[0];
-      this->points[1] = s.points[1];
-      this->leftNode = s.leftNode;
-      this->rightNode = s.rightNode;
-    } 
+    //Move a street and its meshes to another place of the StreetList
+    void swap(Street &s) {
+      for (int i = 0; i != 2; ++i) {
+        vec4 point = points[i]; points[i] = s.points[i]; s.points[i] = point;
+        float angle = angleCS[i]; angleCS[i] = s.angleCS[i]; s.angleCS[i] = angle;
+        float distance = translatedDistance[i]; translatedDistance[i] = s.translatedDistance[i]; s.translatedDistance[i] = distance;
+      }
+      BSPNode *node = leftNode; leftNode = s.leftNode; s.leftNode = node;
+      node = rightNode; rightNode = s.rightNode; s.rightNode = node;
+
+      streetIntersectedPoints.swap(s.streetIntersectedPoints);
+      streetIntersectedUVCoords.swap(s.streetIntersectedUVCoords);
+      for (int side = 0; side != StreetGeometry::NUM_SIDES; ++side) {
+        StreetGeometry::Range range = terrainRanges[side];
+        terrainRanges[side] = s.terrainRanges[side];
+        s.terrainRanges[side] = range;
+      }
+    }
 
-    Street(vec4 p1, vec4 p2){
-      this->points[0] = p1;
-      this->points[1] = p2;
+    //Forget the meshes, they are generated again from the points
+    void resetMeshes() {
+      streetIntersectedPoints.reset();
+      streetIntersectedUVCoords.reset();
+      for (int side = 0; side != StreetGeometry::NUM_SIDES; ++side) {
+        terrainRanges[side] = StreetGeometry::Range();
+      }
+    }
+
+    //A street used again for other points, with no meshes
+    void reset(const vec4 &p1, const vec4 &p2, BSPNode *left, BSPNode *right) {
+      resetMeshes();
+      points[0] = p1;
+      points[1] = p2;
+      leftNode = left;
+      rightNode = right;
+      memset(angleCS, 0, sizeof(float)*2);
+      memset(translatedDistance, 0, sizeof(float)*2);
     }
 
+  private:
+    //Streets own their meshes and stay in their StreetList, they are never copied
+    Street(const Street &s);
+    Street &operator=(const Street &s);
+
+  public:
+
     bool equalsTo(Street *s2){
       return all(this->points[0] == s2->points[0]) && all(this->points[1] == s2->points[1]);
     }
@@ -93,63 +265,39 @@ namespace octet {
       return leftNode == node;
     }
 
-    void intersectGridStreet(float centerX, float centerZ,
+    //The geometry is appended to the pools of geometry and terrainRanges says where it is.
+    //leftOnly - only the sides on the left node, the others are left empty
+    void intersectGridStreet(StreetGeometry &geometry, float centerX, float centerZ,
       float separationX, float separationZ, 
       float roadHalfSizeY, float pavementHalfSizeY,
-      int width, int height) {
+      int width, int height, bool leftOnly = false) {
+
+        const dynarray<vec4> *sidePoints[StreetGeometry::NUM_SIDES] = {
+          &streetIntersectedPoints.roadLeft, &streetIntersectedPoints.roadRight,
+          &streetIntersectedPoints.pavementRight, &streetIntersectedPoints.pavementLeft
+        };
+
+        for (int side = 0; side != StreetGeometry::NUM_SIDES; ++side) {
+          StreetGeometry::Range range = geometry.beginRange(side);
+          if (!leftOnly || side == StreetGeometry::ROAD_LEFT || side == StreetGeometry::PAVEMENT_LEFT) {
+            StreetGeometry::Pool &pool = geometry.getPool(StreetGeometry::getPoolOfSide(side));
+            intersectMesh(sidePoints[side],
+              &pool.positions, &pool.indices, &pool.normals, &pool.uvCoords,
+              centerX, centerZ, 
+              separationX, separationZ, roadHalfSizeY,
+              width, height);
+          }
+          geometry.endRange(side, range);
+          terrainRanges[side] = range;
+        }
+    }
 
-        // Road Mesh Left
-        intersectMesh(&streetIntersectedPoints.roadLeft,
-          &streetIntersectedUVCoords.roadLeft,
-          &terrainIntersectedPoints.roadLeft, 
-          &terrainIntersectedIndices.roadLeft,
-          &terrainIntersectedNormals.roadLeft,
-          &terrainIntersectedUVCoords.roadLeft,
-          centerX, centerZ, 
-          separationX, separationZ, roadHalfSizeY,
-          width, height);
-
-        // Road Mesh Right
-        intersectMesh(&streetIntersectedPoints.roadRight,
-          &streetIntersectedUVCoords.roadRight,
-          &terrainIntersectedPoints.roadRight, 
-          &terrainIntersectedIndices.roadRight,
-          &terrainIntersectedNormals.roadRight,
-          &terrainIntersectedUVCoords.roadRight,
-          centerX, centerZ, 
-          separationX, separationZ, roadHalfSizeY,
-          width, height);
-
-        // Pavement Mesh Left
-        intersectMesh(&streetIntersectedPoints.pavementLeft,
-          &streetIntersectedUVCoords.pavementLeft,
-          &terrainIntersectedPoints.pavementLeft, 
-          &terrainIntersectedIndices.pavementLeft,
-          &terrainIntersectedNormals.pavementLeft,
-          &terrainIntersectedUVCoords.pavementLeft,
-          centerX, centerZ, 
-          separationX, separationZ, roadHalfSizeY,
-          width, height);
-
-        // Pavement Mesh Right
-        intersectMesh(&streetIntersectedPoints.pavementRight,
-          &streetIntersectedUVCoords.pavementRight,
-          &terrainIntersectedPoints.pavementRight, 
-          &terrainIntersectedIndices.pavementRight,
-          &terrainIntersectedNormals.pavementRight,
-          &terrainIntersectedUVCoords.pavementRight,
-          centerX, centerZ, 
-          separationX, separationZ, roadHalfSizeY,
-          width, height);
-    }
-
-    void intersectMesh(const dynarray<vec4> *polygonVec4, const dynarray<vec2> *polygonUVCoords,
-      dynarray<vec4> *polygonResultPoints, dynarray<unsigned short> *polygonResultIndices,
+    void intersectMesh(const dynarray<vec4> *polygonVec4,
+      dynarray<vec4> *polygonResultPoints, dynarray<uint32_t> *polygonResultIndices,
       dynarray<vec4> *polygonResultNormals, dynarray<vec2> *polygonResultUVCoords,
       float centerX, float centerZ, float separationX, float separationZ, float roadHalfSizeY,
       int width, int height) {
         dynarray<vec4> polygonInputPosition;
-        dynarray<vec2> polygonInputUVCoords;
 
         if (polygonVec4->size() > 0) {
           polygonInputPosition.reset();
@@ -157,13 +305,7 @@ namespace octet {
           polygonInputPosition.push_back((*polygonVec4)[1]);
           polygonInputPosition.push_back((*polygonVec4)[5]);
           polygonInputPosition.push_back((*polygonVec4)[4]);
-          polygonInputUVCoords.reset();
-          polygonInputUVCoords.push_back((*polygonUVCoords)[0]);
-          polygonInputUVCoords.push_back((*polygonUVCoords)[1]);
-          polygonInputUVCoords.push_back((*polygonUVCoords)[5]);
-          polygonInputUVCoords.push_back((*polygonUVCoords)[4]);
           PolygonIntersections::intersectGrid(polygonInputPosition,
-            polygonInputUVCoords,
             centerX, centerZ, 
             separationX, separationZ, roadHalfSizeY,
             width, height, 
@@ -175,24 +317,90 @@ namespace octet {
 
   };
 
+  //The streets of a city. They are kept in blocks that never move, so growing the list
+  //adds a block instead of copying the streets and their meshes, and pointers to them stay valid.
+  class StreetList {
+    enum { BLOCK_SHIFT = 8, BLOCK_SIZE = 1 << BLOCK_SHIFT };
+
+    dynarray<Street *> blocks;
+    unsigned numStreets;
+
+    StreetList(const StreetList &l);
+    StreetList &operator=(const StreetList &l);
+
+  public:
+    StreetList()
+      : numStreets(0)
+    {}
+
+    ~StreetList() {
+      reset();
+    }
+
+    unsigned size() const {
+      return numStreets;
+    }
+
+    Street &operator[](int i) const {
+      return blocks[i >> BLOCK_SHIFT][i & (BLOCK_SIZE - 1)];
+    }
+
+    //Index of a street of the list
+    int indexOf(const Street *st) const {
+      for (int b = 0; b != blocks.size(); ++b) {
+        if (st >= blocks[b] && st < blocks[b] + BLOCK_SIZE) {
+          return (b << BLOCK_SHIFT) + (int)(st - blocks[b]);
+        }
+      }
+      return -1;
+    }
+
+    //Empty streets are added at the end, streets taken off the end lose their meshes
+    void resize(unsigned size) {
+      while (blocks.size() << BLOCK_SHIFT < size) {
+        blocks.push_back(new Street[BLOCK_SIZE]);
+      }
+      for (unsigned i = size; i < numStreets; ++i) {
+        Street empty;
+        (*this)[i].swap(empty);
+      }
+      numStreets = size;
+    }
+
+    Street &push_back() {
+      resize(numStreets + 1);
+      return (*this)[numStreets - 1];
+    }
+
+    void reset() {
+      for (int b = 0; b != blocks.size(); ++b) {
+        delete[] blocks[b];
+      }
+      blocks.reset();
+      numStreets = 0;
+    }
+  };
+
   class BuildingArea {
   public:
     vec4 points[4];
-    mesh areaMesh;
-    mesh roofMesh; 
-    mesh basementMesh;
     float height; 
     float area; 
 
+    //Block (BSP leaf) the building was generated in
+    BSPNode *block;
+
     BuildingArea() {
       memset(points, 0, sizeof(vec4)*4);
+      block = NULL;
     }
 
-    BuildingArea(vec4 p0, vec4 p1, vec4 p2, vec4 p3) {
+    BuildingArea(vec4 p0, vec4 p1, vec4 p2, vec4 p3, BSPNode *block_ = NULL) {
       points[0] = p0;
       points[1] = p1;
       points[2] = p2;
       points[3] = p3;
+      block = block_;
     }
 
     //Copy constructor - maybe to be modified 
@@ -201,6 +409,9 @@ namespace octet {
       this->points[1] = b.points[1];
       this->points[2] = b.points[2];
       this->points[3] = b.points[3];
+      this->height = b.height;
+      this->area = b.area;
+      this->block = b.block;
     } 
 
     bool equalsTo(BuildingArea *b2){
@@ -220,34 +431,34 @@ namespace octet {
   };
 
 
+  //Node of the street graph where two or more streets meet, its streets are the edges of the node
   class StreetIntersection{
   public:
-    dynarray<Street*> streets;
     vec4 point;
 
-    StreetIntersection(){}
+    //Node of the street graph
+    int node;
 
-    StreetIntersection(Street* s1, Street* s2, vec4 p){
-      this->streets.push_back(s1);
-      this->streets.push_back(s2);
+    StreetIntersection()
+      : node(-1)
+    {}
+
+    StreetIntersection(int node, const vec4 &p){
       this->point = p;
+      this->node = node;
     }
 
-    bool containsStreet(Street* s1){
-      for(int i=0; i!=this->streets.size(); ++i){
-        for(int j=0; j!=2; ++j){
-          for(int k=0; k!=2; ++k){
-
-            if(all(streets[i]->points[j] == s1->points[k]) && 
-              all(streets[i]->points[(j==1) ? 0 : 1] == s1->points[(k==1) ? 0 : 1])){
-                return true;
-            }
+    int getNumStreets(const StreetGraph &graph) const {
+      return graph.getNode(node).numEdges;
+    }
 
-          }
-        } 
-      }
+    //Id of the i-th street, in street order
+    int getStreet(const StreetGraph &graph, int i) const {
+      return graph.getNodeEdge(node, i);
+    }
 
-      return false;
+    bool containsStreet(const StreetGraph &graph, int street) const {
+      return graph.isNodeOfEdge(node, street);
     }
   };
 
@@ -262,6 +473,11 @@ namespace octet {
     BSPNode *left;
     BSPNode *right;
 
+    //Hash of the path from the root, keys the random numbers of the node
+    uint64_t id;
+    //Times the partition has gone through this node
+    unsigned int visits;
+
     BSPNode(BSPNode *parent_ = NULL)
       : vertices()
       , nodesOutside()
@@ -269,6 +485,8 @@ namespace octet {
       , parent(parent_)
       , left(NULL)
       , right(NULL)
+      , id(0)
+      , visits(0)
     {
       //streetsList = new dynarray<Street *>();
     }
@@ -373,11 +591,91 @@ namespace octet {
     float offset_x;
     float offset_y;
 
+    // world x, z to heightmap cell coordinates: cx = x * scale_x + bias_x
+    float scale_x;
+    float bias_x;
+    float scale_z;
+    float bias_z;
+
     image *img;
 
+    void updateMapping() {
+      if (heightmap.size() == 0) return;
+      float w = (float)(heightmap_width-2);
+      float h = (float)(heightmap_height-2);
+      // same mapping as the terrain mesh, the heightmap has a border of one cell
+      scale_x = multiplier * w / dimensions.x();
+      bias_x = (0.5f - center.x() / dimensions.x()) * multiplier * w + offset_x * w + 1.0f;
+      scale_z = -multiplier * h / dimensions.z();
+      bias_z = (0.5f + center.z() / dimensions.z()) * multiplier * h + offset_y * h + 1.0f;
+    }
+
+    // Bilinear interpolation of the heightmap at cell coordinates, clamped to the border
+    float sampleCell(float cx, float cz) const {
+      cx = min(max(cx, 0.0f), (float)(heightmap_width-1));
+      cz = min(max(cz, 0.0f), (float)(heightmap_height-1));
+      int i = min((int)cx, heightmap_width-2);
+      int j = min((int)cz, heightmap_height-2);
+      float tx = cx - i;
+      float tz = cz - j;
+
+      const float *row = &heightmap[j*heightmap_width+i];
+      float h0 = row[0] + (row[1] - row[0]) * tx;
+      float h1 = row[heightmap_width] + (row[heightmap_width+1] - row[heightmap_width]) * tx;
+      return h0 + (h1 - h0) * tz;
+    }
+
+    // Normals of row j of the normal map, from the central differences of the heightmap.
+    // The normal is (-2 dx, -2 dz, 4, 1) normalized with w in the length like vec4::normalize,
+    // the XZ layout is the same normal with y and z swapped: (x, z, -y, w).
+    void generateNormalRow_(unsigned j, unsigned nx, unsigned hmx) {
+      const float *above = &heightmap[hmx*j+1];
+      const float *middle = &heightmap[hmx*(j+1)];
+      const float *below = &heightmap[hmx*(j+2)+1];
+      vec4 *xy = &normalmapXY[nx*j];
+      vec4 *xz = &normalmapXZ[nx*j];
+
+      unsigned i = 0;
+    #ifdef OCTET_SSE
+      __m128 minusTwo = _mm_set1_ps(-2.0f);
+      __m128 four = _mm_set1_ps(4.0f);
+      __m128 one = _mm_set1_ps(1.0f);
+      for (; i + 4 <= nx; i += 4) {
+        __m128 cx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(middle + i + 2), _mm_loadu_ps(middle + i)), minusTwo);
+        __m128 cy = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(below + i), _mm_loadu_ps(above + i)), minusTwo);
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_set1_ps(16.0f)), one);
+        __m128 r = _mm_div_ps(one, _mm_sqrt_ps(len2));
+
+        // one register per component, the transposes turn them into four normals
+        __m128 x0 = _mm_mul_ps(cx, r), y0 = _mm_mul_ps(cy, r), z0 = _mm_mul_ps(four, r), w0 = r;
+        __m128 x1 = x0, y1 = z0, z1 = _mm_sub_ps(_mm_setzero_ps(), y0), w1 = r;
+        _MM_TRANSPOSE4_PS(x0, y0, z0, w0);
+        _MM_TRANSPOSE4_PS(x1, y1, z1, w1);
+        _mm_storeu_ps(xy[i+0].get(), x0);
+        _mm_storeu_ps(xy[i+1].get(), y0);
+        _mm_storeu_ps(xy[i+2].get(), z0);
+        _mm_storeu_ps(xy[i+3].get(), w0);
+        _mm_storeu_ps(xz[i+0].get(), x1);
+        _mm_storeu_ps(xz[i+1].get(), y1);
+        _mm_storeu_ps(xz[i+2].get(), z1);
+        _mm_storeu_ps(xz[i+3].get(), w1);
+      }
+    #endif
+      for (; i != nx; i++) {
+        float cx = (middle[i+2] - middle[i]) * -2.0f;
+        float cy = (below[i] - above[i]) * -2.0f;
+        float r = rsqrt(cx*cx + cy*cy + 16.0f + 1.0f);
+        xy[i] = vec4(cx*r, cy*r, 4.0f*r, r);
+        xz[i] = vec4(cx*r, 4.0f*r, -(cy*r), r);
+      }
+    }
+
   public:
     HeightMap(image *heightmapImage = NULL)
-      : multiplier(CityConstants::MULTIPLIER)
+      : heightmap_width(0)
+      , heightmap_height(0)
+      , dimensions(1.0f, 1.0f, 1.0f, 0.0f)
+      , multiplier(CityConstants::MULTIPLIER)
       , offset_x(CityConstants::OFFSET_X)
       , offset_y(CityConstants::OFFSET_Y)
       , img(heightmapImage)
@@ -389,10 +687,12 @@ namespace octet {
 
     void setCenter(vec4 c) {
       center = c;
+      updateMapping();
     }
 
     void setDimensions(vec4 d) {
       dimensions = d;
+      updateMapping();
     }
 
     float *getHeightmap() {
@@ -415,8 +715,77 @@ namespace octet {
       return heightmap_height;
     }
 
-    float sample_heightmap(vec4 &vertex) {
-      image *heightmapImage = img;
+    // Terrain height under a point, only x and z are used
+    float sample_heightmap(const vec4 &vertex) const {
+      float h = sampleCell(vertex.x() * scale_x + bias_x, vertex.z() * scale_z + bias_z);
+      return max(h, CityConstants::BRIDGE_LEVEL);
+    }
+
+    // Terrain height under world x, z without the bridge level, the ground itself.
+    // Outside the heightmap the border heights go on forever.
+    float sample_ground(float x, float z) const {
+      return sampleCell(x * scale_x + bias_x, z * scale_z + bias_z);
+    }
+
+    // Height at image coordinates u, v in [0, 1], without the bridge level
+    float sample_uv(float u, float v) const {
+      return sampleCell(u * (heightmap_width-2) + 1.0f, v * (heightmap_height-2) + 1.0f);
+    }
+
+    // sample_heightmap for an array of points
+    void sample_heightmap(const vec4 *points, float *heights, unsigned count) const {
+      unsigned i = 0;
+    #ifdef OCTET_SSE
+      __m128 scaleX = _mm_set1_ps(scale_x), biasX = _mm_set1_ps(bias_x);
+      __m128 scaleZ = _mm_set1_ps(scale_z), biasZ = _mm_set1_ps(bias_z);
+      __m128 zero = _mm_setzero_ps();
+      __m128 maxX = _mm_set1_ps((float)(heightmap_width-1));
+      __m128 maxZ = _mm_set1_ps((float)(heightmap_height-1));
+      __m128 bridge = _mm_set1_ps(CityConstants::BRIDGE_LEVEL);
+
+      for (; i + 4 <= count; i += 4) {
+        // rows are points, after the transpose p0 has the four x and p2 the four z
+        __m128 p0 = _mm_loadu_ps(points[i+0].get());
+        __m128 p1 = _mm_loadu_ps(points[i+1].get());
+        __m128 p2 = _mm_loadu_ps(points[i+2].get());
+        __m128 p3 = _mm_loadu_ps(points[i+3].get());
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+
+        __m128 cx = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(p0, scaleX), biasX), zero), maxX);
+        __m128 cz = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(p2, scaleZ), biasZ), zero), maxZ);
+
+        // no gather in SSE, fetch the four corners of every cell one lane at a time
+        float fx[4], fz[4], h00[4], h10[4], h01[4], h11[4];
+        _mm_storeu_ps(fx, cx);
+        _mm_storeu_ps(fz, cz);
+        for (unsigned k = 0; k != 4; ++k) {
+          int ci = min((int)fx[k], heightmap_width-2);
+          int cj = min((int)fz[k], heightmap_height-2);
+          const float *row = &heightmap[cj*heightmap_width+ci];
+          h00[k] = row[0];
+          h10[k] = row[1];
+          h01[k] = row[heightmap_width];
+          h11[k] = row[heightmap_width+1];
+          fx[k] -= ci;
+          fz[k] -= cj;
+        }
+
+        __m128 tx = _mm_loadu_ps(fx);
+        __m128 tz = _mm_loadu_ps(fz);
+        __m128 a00 = _mm_loadu_ps(h00), a01 = _mm_loadu_ps(h01);
+        __m128 h0 = _mm_add_ps(a00, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h10), a00), tx));
+        __m128 h1 = _mm_add_ps(a01, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h11), a01), tx));
+        __m128 h = _mm_add_ps(h0, _mm_mul_ps(_mm_sub_ps(h1, h0), tz));
+        _mm_storeu_ps(heights + i, _mm_max_ps(h, bridge));
+      }
+    #endif
+      for (; i != count; ++i) {
+        heights[i] = sample_heightmap(points[i]);
+      }
+    }
+
+    // The per point image sampling used before the float heightmap, kept to compare with
+    float sample_heightmap_image(const vec4 &vertex) const {
       vec4 color;
 
       float u_ = (vertex.x()-center.x()+dimensions.x()*0.5f) / (dimensions.x());
@@ -425,7 +794,7 @@ namespace octet {
       u_ = (u_*multiplier)+offset_x;
       v_ = ((1-v_)*multiplier)+offset_y;
 
-      heightmapImage->sample2Dbilinear(u_, v_, color);
+      img->sample2Dbilinear(u_, v_, color);
 
       float h = (color.x() * CityConstants::HEIGHT_FACTOR);
       if (h < CityConstants::BRIDGE_LEVEL) {
@@ -434,32 +803,173 @@ namespace octet {
       return h;
     }
 
-    void generateHeightmap() {
-      heightmap.reset();
-      image *heightmapImage = img;
-      heightmap_width = heightmapImage->get_width()+2;
-      heightmap_height = heightmapImage->get_height()+2;
-      heightmap.resize(heightmap_width*heightmap_height);
+    // Time the image sampling against the heightmap sampling over the city area
+    void benchmarkSampling(unsigned int numPoints) const {
+      CityRandom::Generator rnd(numPoints);
+      dynarray<vec4> points;
+      dynarray<float> heights;
+      points.resize(numPoints);
+      heights.resize(numPoints);
+      for (unsigned i = 0; i != numPoints; ++i) {
+        float x = center.x() + (rnd.getFloat() - 0.5f) * dimensions.x();
+        float z = center.z() + (rnd.getFloat() - 0.5f) * dimensions.z();
+        points[i] = vec4(x, 0.0f, z, 1.0f);
+      }
+
+      // the sums keep the compiler from removing the loops
+      float sum[3] = { 0, 0, 0 };
+      clock_t t0 = clock();
+      if (img) {
+        for (unsigned i = 0; i != numPoints; ++i) {
+          sum[0] += sample_heightmap_image(points[i]);
+        }
+      }
+      clock_t t1 = clock();
+      for (unsigned i = 0; i != numPoints; ++i) {
+        sum[1] += sample_heightmap(points[i]);
+      }
+      clock_t t2 = clock();
+      sample_heightmap(points.data(), heights.data(), numPoints);
+      for (unsigned i = 0; i != numPoints; ++i) {
+        sum[2] += heights[i];
+      }
+      clock_t t3 = clock();
 
-      for (int j = 0; j != heightmap_height; j++) {
-        float v_ = ((float)j-1) / (heightmap_height-2);
-        for (int i = 0; i != heightmap_width; i++) {
-          vec4 color;
+      // a heightmap decoded by loadHeightField has no image, then only the heightmap is timed
+      float toMs = 1000.0f / CLOCKS_PER_SEC;
+      printf("Heightmap sampling, %d points (ms): ", numPoints);
+      if (img) {
+        printf("image %.1f (average height %.3f) | ", (t1 - t0) * toMs, sum[0] / numPoints);
+      }
+      printf("scalar %.1f | batch %.1f (average heights %.3f %.3f)\n",
+        (t2 - t1) * toMs, (t3 - t2) * toMs, sum[1] / numPoints, sum[2] / numPoints);
+    }
 
-          float u_ = ((float)i-1) / (heightmap_width-2);
+    // Time generating the normal maps with the matrix per pixel and a row at a time.
+    // The normals should be the same but for the rounding of the rotation.
+    void benchmarkNormalMap() {
+      clock_t t0 = clock();
+      generateNormalMapMatrix();
+      clock_t t1 = clock();
+      dynarray<vec4> matrixXZ;
+      matrixXZ.swap(normalmapXZ);
+
+      // clock() adds the time of every thread, use the OpenMP clock when there is one
+    #ifdef _OPENMP
+      double w0 = omp_get_wtime();
+    #endif
+      clock_t t2 = clock();
+      generateNormalMap();
+      clock_t t3 = clock();
+      float rowMs = (t3 - t2) * 1000.0f / CLOCKS_PER_SEC;
+    #ifdef _OPENMP
+      rowMs = (float)((omp_get_wtime() - w0) * 1000.0);
+    #endif
+
+      float maxError = 0.0f;
+      for (int i = 0; i != normalmapXZ.size(); ++i) {
+        vec4 d = normalmapXZ[i] - matrixXZ[i];
+        maxError = max(maxError, max(max(fabsf(d.x()), fabsf(d.y())), fabsf(d.z())));
+      }
 
-          heightmapImage->sample2Dbilinear(u_, v_, color);
+      float toMs = 1000.0f / CLOCKS_PER_SEC;
+      printf("Normal map, %dx%d (ms): matrix %.1f | rows %.1f (max difference %g)\n", heightmap_width-2, heightmap_height-2,
+        (t1 - t0) * toMs, rowMs, maxError);
+    }
 
-          heightmap[j*heightmap_width+i] = ((color.x()+color.y()+color.z())/3.0f)*CityConstants::HEIGHT_FACTOR;
+    // Heights of the image set with setImage, the average of red, green and blue of every pixel.
+    // The pixels are read directly, the image is not sampled.
+    void generateHeightmap() {
+      image *heightmapImage = img;
+      unsigned format = heightmapImage->get_format() == GL_RGB ? heightfield_decoder::HEIGHTS_RGB8 : heightfield_decoder::HEIGHTS_RGBA8;
+
+      heightfield_decoder::layout source;
+      source.samples = heightmapImage->get_bytes();
+      source.format = format;
+      source.width = heightmapImage->get_width();
+      source.height = heightmapImage->get_height();
+      source.stride = (int)(source.width * heightfield_decoder::get_bytes_per_sample(format));
+      source.bias = 0.0f;
+      source.scale = 1.0f / (3.0f * 255.0f);
+      importHeights(source);
+    }
 
+    // Load the heights from a file: greyscale PGM (8 or 16 bit) and PFM (float) go straight to the
+    // heightmap, other images are decoded to a temporary image. No image is kept afterwards.
+    // The maximum value of a PGM file is at 255 * HEIGHT_FACTOR, like a white pixel. The heights of a
+    // PFM file go from 0 for the lowest sample to 255 * HEIGHT_FACTOR for the highest.
+    bool loadHeightField(const char *url) {
+      img = NULL;
+      {
+        dynarray<uint8_t> buffer;
+        app_utils::get_url(buffer, url);
+        if (!buffer.size()) return false;
+
+        heightfield_decoder dec;
+        heightfield_decoder::layout source;
+        if (dec.get_layout(source, buffer.data(), buffer.data() + buffer.size())) {
+          importHeights(source);
+          return true;
         }
       }
+
+      image heightmapImage(url);
+      heightmapImage.load();
+      if (!heightmapImage.get_width()) return false;
+      img = &heightmapImage;
+      generateHeightmap();
+      img = NULL;
+      return true;
+    }
+
+    // Convert the samples of a height field to the heightmap, a row at a time in parallel.
+    // The border of one cell repeats the nearest samples.
+    void importHeights(const heightfield_decoder::layout &source) {
+      heightmap_width = source.width + 2;
+      heightmap_height = source.height + 2;
+      if (heightmap.size() != heightmap_width*heightmap_height) {
+        heightmap.reset();
+        heightmap.resize(heightmap_width*heightmap_height);
+      }
+
+      float scale = source.scale * 255.0f * CityConstants::HEIGHT_FACTOR;
+      int w = heightmap_width;
+      #pragma omp parallel for schedule(static)
+      for (int j = 0; j < (int)source.height; j++) {
+        float *row = &heightmap[(j+1)*w];
+        heightfield_decoder::convert_row(source.samples + (ptrdiff_t)j * source.stride, source.format, source.width, source.bias, scale, row + 1);
+        row[0] = row[1];
+        row[w-1] = row[w-2];
+      }
+      memcpy(&heightmap[0], &heightmap[w], w * sizeof(float));
+      memcpy(&heightmap[(heightmap_height-1)*w], &heightmap[(heightmap_height-2)*w], w * sizeof(float));
+      updateMapping();
     }
 
+    // Fill the normal maps a row at a time, the rows are independent and run in parallel.
+    // Needs generateHeightmap first.
     void generateNormalMap() {
-      image *heightmapImage = img;
-      unsigned int nx = heightmapImage->get_width();
-      unsigned int ny = heightmapImage->get_height();
+      unsigned int nx = heightmap_width - 2;
+      unsigned int ny = heightmap_height - 2;
+
+      // every element is written below, reloading a heightmap of the same size keeps the memory
+      if (normalmapXY.size() != nx*ny || normalmapXZ.size() != nx*ny) {
+        normalmapXY.reset();
+        normalmapXY.resize(nx*ny);
+        normalmapXZ.reset();
+        normalmapXZ.resize(nx*ny);
+      }
+
+      #pragma omp parallel for schedule(static)
+      for (int j = 0; j < (int)ny; j++) {
+        generateNormalRow_((unsigned)j, nx, heightmap_width);
+      }
+    }
+
+    // The per pixel normal and matrix rotation used before generateNormalRow_, kept to compare with
+    void generateNormalMapMatrix() {
+      unsigned int nx = heightmap_width - 2;
+      unsigned int ny = heightmap_height - 2;
       unsigned int hmx = nx + 2;
       unsigned int hmy = ny + 2;
 
@@ -492,6 +1002,27 @@ namespace octet {
     }
   };
 
+  //What the camera sees, for City::refinePartition
+  struct PartitionView {
+    Frustum frustum;
+    //Camera position in world space
+    vec4 eye;
+    //Blocks are split while they are bigger than detail times their distance to the eye
+    float detail;
+    //Blocks smaller than this are never split
+    float minBlockSize;
+    //Top of the tallest building, for the visibility of the blocks
+    float maxHeight;
+
+    PartitionView()
+      : frustum()
+      , eye(0.0f, 0.0f, 0.0f, 1.0f)
+      , detail(0.5f)
+      , minBlockSize(4.0f)
+      , maxHeight(10.0f)
+    {}
+  };
+
   class City {
     HeightMap* heightMap;
 
@@ -501,12 +1032,30 @@ namespace octet {
     mat4t modelToWorld;
 
     dynarray<BSPNode> subAreaNodes;
-    dynarray<Street> streetsList;
+    StreetList streetsList;
     dynarray<BuildingArea> buildingAreaList;
     dynarray<BuildingArea> buildingAreaList_streets; 
 
     dynarray <StreetIntersection*> streetsIntersections;
 
+    //Street extremes indexed by position, used while the partition changes the streets
+    PointHash streetEndpoints;
+
+    //Road network of the final streets
+    StreetGraph streetGraph;
+
+    //Streets replaced during the partition, they are removed from streetsList at the end
+    //(at every refinement of the incremental partition they stay, so that ids do not move)
+    dynarray<bool> streetRemoved;
+
+    //Streets whose meshes were generated again by the last refinePartition, as flags and as a list
+    dynarray<bool> streetDirty;
+    dynarray<int> dirtyStreets;
+    //Buildings added by the last refinePartition start here in buildingAreaList
+    int firstNewBuilding;
+    //Time per block of the last refinement, to stay inside the refinement budget
+    float refineCostMs;
+
 
     ModelBuilder lampModel;
     ModelBuilder trafficLightModel;
@@ -518,15 +1067,102 @@ namespace octet {
     ModelBuilder binModel;
 
     std::vector <ref<Model>> models;
+    //Street every model was placed along
+    dynarray<int> modelStreets;
+    //City that loaded the models above, itself unless they are shared (the tiles of a CityWorld)
+    City *propPrototypes;
 
-    class random randomizer;
+    //Every random decision of the generation comes from here
+    CityRandom random;
 
     vec4 * debugColors;
 
-    City ()
-      : randomizer(time(NULL))
+  private:
+    //Every node of the partition lives here and is freed with the city
+    arena<> nodeArena;
+    //Intersections, freed when they are calculated again
+    arena<> intersectionArena;
+
+    //Scratch arrays of the building areas pass, kept to reuse their memory
+    dynarray<Street *> scratchStreets;
+    dynarray<int> scratchStreetIds;
+
+    //Streets added and removed since the partition or the refinement started
+    dynarray<int> addedStreets;
+    dynarray<int> removedStreets;
+    //Streets removed by earlier refinements, addStreet takes their place before growing the list
+    dynarray<int> freeStreets;
+
+    //Index in streetsIntersections of the intersection at every node of the graph, -1 for none
+    dynarray<int> nodeIntersections;
+    //Intersections of nodes left with one street, used again before allocating new ones
+    dynarray<StreetIntersection *> freeIntersections;
+
+    BSPNode *newNode_(arena<> &a, BSPNode *parent) {
+      dynarray_dummy_t x;
+      return new (a.allocate(sizeof(BSPNode)), x) BSPNode(parent);
+    }
+
+    void releaseIntersections_() {
+      for (int i = 0; i != streetsIntersections.size(); ++i) {
+        streetsIntersections[i]->~StreetIntersection();
+      }
+      streetsIntersections.reset();
+      freeIntersections.reset();
+      nodeIntersections.reset();
+      intersectionArena.reset();
+    }
+
+    void addIntersection_(int node) {
+      StreetIntersection *streetInt;
+      if (freeIntersections.size()) {
+        streetInt = freeIntersections.back();
+        freeIntersections.pop_back();
+      } else {
+        streetInt = (StreetIntersection*)intersectionArena.allocate(sizeof(StreetIntersection));
+      }
+      dynarray_dummy_t x;
+      new (streetInt, x) StreetIntersection(node, streetGraph.getNode(node).point);
+
+      while (nodeIntersections.size() != streetGraph.getNumNodes()) {
+        nodeIntersections.push_back(-1);
+      }
+      nodeIntersections[node] = streetsIntersections.size();
+      streetsIntersections.push_back(streetInt);
+    }
+
+    //The last intersection takes the place of the one removed
+    void removeIntersection_(int node) {
+      int index = nodeIntersections[node];
+      StreetIntersection *last = streetsIntersections.back();
+      freeIntersections.push_back(streetsIntersections[index]);
+      streetsIntersections[index] = last;
+      nodeIntersections[last->node] = index;
+      streetsIntersections.pop_back();
+      nodeIntersections[node] = -1;
+    }
+
+  public:
+    City (uint64_t seed = 0)
+      : firstNewBuilding(0)
+      , refineCostMs(0.0f)
+      , propPrototypes(this)
+      , random(seed)
+      , debugColors(NULL)
     {}
 
+    ~City() {
+      //The nodes go with nodeArena
+      releaseIntersections_();
+      delete[] debugColors;
+    }
+
+    //Place the props with the models loaded by another city, instead of loadModels.
+    //The meshes of the models must be built already if the city is generated in another thread.
+    void sharePropPrototypes(City *owner) {
+      propPrototypes = owner;
+    }
+
     static City *createFromRectangle(float width, float height) {
       vec4 vert_[4];
 
@@ -565,20 +1201,141 @@ namespace octet {
       modelToWorld.loadIdentity();
 
       for(int i=0; i!=4; ++i){
-        Street s1(root.vertices[i],root.vertices[(i+1)%4]);
-        s1.leftNode = &root;
-        s1.rightNode = root.nodesOutside[i];
-        streetsList.push_back(s1);
+        addStreet(root.vertices[i], root.vertices[(i+1)%4], &root, root.nodesOutside[i]);
         //root.streetsList->push_back(&streetsList[streetsList.size()-1]);
       }
+    }
+
+    // Print how long every generation stage takes for a range of partition depths
+    static void benchmarkGeneration(const vec4 *vertices_, unsigned int minDepth, unsigned int maxDepth) {
+      printf("Depth | Streets | Partition | Intersections | Meshes | Buildings (ms)\n");
+
+      for (unsigned int depth = minDepth; depth <= maxDepth; ++depth) {
+        City *c = new City();
+
+        clock_t t0 = clock();
+        c->init(vertices_);
+        c->stepPartition(depth);
+        clock_t t1 = clock();
+        c->calculateIntersections();
+        clock_t t2 = clock();
+        c->calculateMeshesIntersections();
+        clock_t t3 = clock();
+        c->calculateBuildingsAreas();
+        clock_t t4 = clock();
+
+        float toMs = 1000.0f / CLOCKS_PER_SEC;
+        printf("%5d | %7d | %9.1f | %13.1f | %6.1f | %9.1f\n", depth, c->streetsList.size(),
+          (t1 - t0) * toMs, (t2 - t1) * toMs, (t3 - t2) * toMs, (t4 - t3) * toMs);
+
+        delete c;
+      }
+    }
+
+    // Subdivide the lots of blocks of the same shape and print how many different layouts they get.
+    // The splits are keyed by the block, so only a few of them should have the same lots by chance.
+    static int checkLotLayouts(uint64_t seed, unsigned int numBlocks) {
+      City c(seed);
+      arena<> lotNodes;
+      dynarray<BuildingArea> lots;
+      dynarray<uint64_t> layouts;
+
+      for (unsigned int i = 0; i != numBlocks; ++i) {
+        BSPNode block;
+        block.id = CityRandom::combine(c.root.id, i);
+        block.vertices[0] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        block.vertices[1] = vec4(0.0f, 0.0f, 1.0f, 1.0f);
+        block.vertices[2] = vec4(2.0f, 0.0f, 1.0f, 1.0f);
+        block.vertices[3] = vec4(2.0f, 0.0f, 0.0f, 1.0f);
+
+        BSPNode area(&block);
+        area.id = block.id;
+        for (int j = 0; j != 4; ++j) {
+          area.vertices[j] = block.vertices[j];
+        }
+
+        lots.resize(0);
+        c.calculateFinalBuildingsAreas_(&area, lotNodes, lots);
+
+        // the layout is the sequence of lot corners
+        uint64_t layout = lots.size();
+        for (int j = 0; j != lots.size(); ++j) {
+          for (int k = 0; k != 4; ++k) {
+            uint32_t bits[2];
+            memcpy(&bits[0], &lots[j].points[k][0], sizeof(float));
+            memcpy(&bits[1], &lots[j].points[k][2], sizeof(float));
+            layout = CityRandom::combine(layout, (uint64_t)bits[0] << 32 | bits[1]);
+          }
+        }
 
-      srand (static_cast <unsigned> (time(0)));
+        bool found = false;
+        for (int j = 0; j != layouts.size(); ++j) {
+          found = found || layouts[j] == layout;
+        }
+        if (!found) layouts.push_back(layout);
+      }
+
+      printf("Lot layouts: %d different for %d blocks of the same shape%s\n", layouts.size(), numBlocks,
+        numBlocks > 1 && layouts.size() == 1 ? ", ERROR: every block gets the same lots." : ".");
+      return layouts.size();
     }
 
     void stepPartition(unsigned int depth/* camera frustrum */) {
       setDebugColors(depth);
-      stepPartition_(depth, &root, false);
+      stepPartition_(depth, &root, nodeArena, false);
+      compactStreets();
+      streetGraph.build(streetsList);
+
+    }
+
+    //Incremental partition driven by the camera, instead of stepPartition(depth).
+    //Splits the visible blocks that are too big for their distance to the camera, nearest first,
+    //and generates streets, meshes, buildings and props only around the blocks split.
+    //Start from stepPartition(0) and the usual generation, then call it every frame followed
+    //by CityMesh::updateRefined. Returns the number of blocks split.
+    int refinePartition(const PartitionView &view, float budgetMs) {
+      double startTime = CityTimer::now();
+
+      dynarray<BSPNode *> candidates;
+      dynarray<float> distances;
+      getBlocksToRefine_(&root, view, candidates, distances);
+      if (candidates.size() == 0) return 0;
+
+      int maxSplits = refineCostMs > 0.0f ? (int)(budgetMs / refineCostMs) : 1;
+      if (maxSplits < 1) maxSplits = 1;
+
+      addedStreets.resize(0);
+      removedStreets.resize(0);
+      dynarray<BSPNode *> splitNodes;
+
+      while (candidates.size() != 0 && (int)splitNodes.size() != maxSplits) {
+        int nearest = 0;
+        for (int i = 1; i != candidates.size(); ++i) {
+          if (distances[i] < distances[nearest]) nearest = i;
+        }
+
+        BSPNode *b = candidates[nearest];
+        candidates[nearest] = candidates.back();
+        distances[nearest] = distances.back();
+        candidates.pop_back();
+        distances.pop_back();
+
+        splitNode(b, nodeArena, false);
+        splitNodes.push_back(b);
+      }
+
+      updateRefinedStreets_();
+      updateRefinedBuildings_(splitNodes);
+      updateRefinedModels_();
 
+      //Nothing refers to the removed streets anymore, their meshes go and their places are used again
+      for (int i = 0; i != removedStreets.size(); ++i) {
+        streetsList[removedStreets[i]].resetMeshes();
+        freeStreets.push_back(removedStreets[i]);
+      }
+
+      refineCostMs = max(CityTimer::msSince(startTime) / splitNodes.size(), 0.05f);
+      return splitNodes.size();
     }
 
     void setHeightmap(HeightMap *hm) {
@@ -587,10 +1344,12 @@ namespace octet {
 
     void setDebugColors(unsigned int depth) {
 
+      delete[] debugColors;
       debugColors = new vec4[depth+1];
 
       for(int i=0; i!= depth+1; ++i){
-        vec4 color((float)(rand() % 2),(float)(rand() % 2),(float)(rand() % 2),1.0f);
+        CityRandom::Generator rnd = random.getGenerator(CityRandom::STREAM_DEBUG_COLORS, i);
+        vec4 color((float)rnd.getInt(0, 2),(float)rnd.getInt(0, 2),(float)rnd.getInt(0, 2),1.0f);
         debugColors[i] = color;
       }
     }
@@ -664,26 +1423,62 @@ namespace octet {
       center[3] = (root.vertices[0].w() + root.vertices[1].w() + root.vertices[2].w() + root.vertices[3].w())/4.0f;
     }
 
+    //Every node of the street graph shared by two or more streets is an intersection.
+    //They are created sorted by their two lowest street ids, with their streets in order.
     void calculateIntersections(){
+      releaseIntersections_();
+
       for(int i=0; i!= streetsList.size(); ++i){
-        for(int j=0; j!=streetsList.size(); ++j){
-          for(int k=0; k!=2; ++k){
-            for(int l=0; l!=2; ++l){
-              //If has any point in common
-              if( all(streetsList[i].points[k] == streetsList[j].points[l]) ){
-                //If it is not the same street
-                if( !all(streetsList[i].points[(k==1) ? 0 : k+1] == streetsList[j].points[(l==1) ? 0 : l+1])){
-                  addIntersection(&streetsList[i],&streetsList[j],streetsList[i].points[k]);
-                }
-              }
-            }
-          }
+        if (streetRemoved[i]) continue;
+
+        int candidates[2];
+        int numCandidates = 0;
+
+        for(int k=0; k!=2; ++k){
+          int node = streetGraph.getEdge(i).nodes[k];
+          if (k == 1 && node == streetGraph.getEdge(i).nodes[0]) continue;
+          if (streetGraph.getNode(node).numEdges < 2 || streetGraph.getNodeEdge(node, 0) != i) continue;
+          candidates[numCandidates++] = node;
+        }
+
+        if (numCandidates == 2 && streetGraph.getNodeEdge(candidates[1], 1) < streetGraph.getNodeEdge(candidates[0], 1)) {
+          swap(candidates[0], candidates[1]);
+        }
+
+        for(int c=0; c!=numCandidates; ++c){
+          addIntersection_(candidates[c]);
         }
       }
     }
 
+    //Intersections of the nodes whose streets changed: nodes with two or more streets get one
+    //and nodes left with fewer lose theirs
+    void updateIntersections_(const dynarray<int> &nodes) {
+      while (nodeIntersections.size() != streetGraph.getNumNodes()) {
+        nodeIntersections.push_back(-1);
+      }
+      for (int i = 0; i != nodes.size(); ++i) {
+        int node = nodes[i];
+        bool isIntersection = streetGraph.getNode(node).numEdges >= 2;
+        if (isIntersection && nodeIntersections[node] == -1) {
+          addIntersection_(node);
+        } else if (!isIntersection && nodeIntersections[node] != -1) {
+          removeIntersection_(node);
+        }
+      }
+    }
+
+    //The index of a street is its id in the graph
+    int getStreetId(Street *st){
+      return streetsList.indexOf(st);
+    }
+
     int getStreetsIndex(Street *st){
-      for(int i=0; i!= streetsList.size(); ++i){
+      dynarray<int> candidates;
+      streetEndpoints.find(st->points[0], candidates);
+
+      for(int c=0; c!= candidates.size(); ++c){
+        int i = candidates[c];
         if(all(streetsList[i].points[0] == st->points[0]) && all(streetsList[i].points[1] == st->points[1])){
           return i;
         }
@@ -694,38 +1489,79 @@ namespace octet {
     void getStreetsIntersectingByExtreme(Street* s1, int pointIndex, dynarray<Street *> &streetsInIntersection) {
       streetsInIntersection.reset();
 
-      for (int i = 0; i != streetsList.size(); ++i){
-        if (&streetsList[i] == s1) continue;
+      int street = getStreetId(s1);
+      int node = streetGraph.getEdge(street).nodes[pointIndex];
 
-        for (int j = 0; j != 2; ++j){
-          if (all(streetsList[i].points[j] == s1->points[pointIndex])){
-            streetsInIntersection.push_back(&streetsList[i]);
-          }
-        } 
+      for (int i = 0; i != streetGraph.getNode(node).numEdges; ++i){
+        int other = streetGraph.getNodeEdge(node, i);
+        if (other == street) continue;
+        streetsInIntersection.push_back(&streetsList[other]);
       }
     }
 
-    void calculateMeshesIntersections(){
+    //Streets with an extreme at the point, removed streets are not included
+    void getStreetsAtPoint(const vec4 &p, dynarray<Street *> &result) {
+      result.reset();
+
+      dynarray<int> candidates;
+      streetEndpoints.find(p, candidates);
+      for (int c = 0; c != candidates.size(); ++c) {
+        Street &st = streetsList[candidates[c]];
+        if (all(st.points[0] == p) || all(st.points[1] == p)) {
+          result.push_back(&st);
+        }
+      }
+    }
 
-      unsigned int streetsListSize = streetsList.size();
+    //Intersections at the ends of the streets, once each and in the order calculateIntersections
+    //makes them, which is the order of the ids of their two lowest streets
+    void getIntersectionsOfStreets_(const dynarray<int> &streets, dynarray<StreetIntersection *> &result) {
+      dynarray<uint64_t> keys;
+      for (int i = 0; i != streets.size(); ++i) {
+        for (int k = 0; k != 2; ++k) {
+          int node = streetGraph.getEdge(streets[i]).nodes[k];
+          if (node == -1 || nodeIntersections[node] == -1) continue;
+          keys.push_back((uint64_t)streetGraph.getNodeEdge(node, 0) << 32 | (uint32_t)streetGraph.getNodeEdge(node, 1));
+        }
+      }
+      if (keys.size()) {
+        std::sort(&keys[0], &keys[0] + keys.size());
+      }
 
-      dynarray<bool> checkIntersections(streetsListSize*streetsListSize);
-      for (int i = 0; i != streetsListSize*streetsListSize; i++) {
-        checkIntersections[i] = false;
+      result.resize(0);
+      for (int i = 0; i != keys.size(); ++i) {
+        if (i && keys[i] == keys[i-1]) continue;
+        const StreetGraph::Edge &lowest = streetGraph.getEdge((int)(keys[i] >> 32));
+        int node = streetGraph.isNodeOfEdge(lowest.nodes[0], (int)(uint32_t)keys[i]) ? lowest.nodes[0] : lowest.nodes[1];
+        result.push_back(streetsIntersections[nodeIntersections[node]]);
       }
+    }
+
+    //dirtyStreets - if given, only the meshes of these streets are calculated, the other streets keep theirs.
+    //They must be the streets set in streetDirty.
+    void calculateMeshesIntersections(const dynarray<int> *dirtyStreets = NULL){
 
-      int index = 0;
+      //Pairs of streets (street, other street) whose corner is already built
+      hash_map<uint64_t, bool> checkIntersections;
 
-      for(int i=index; i!= streetsIntersections.size(); ++i){
-        StreetIntersection *streetInt = streetsIntersections[i];
-        int numStreets = streetInt->streets.size();
+      const dynarray<bool> *dirty = dirtyStreets ? &streetDirty : NULL;
+      dynarray<StreetIntersection *> dirtyIntersections;
+      if (dirtyStreets) {
+        getIntersectionsOfStreets_(*dirtyStreets, dirtyIntersections);
+      }
+      dynarray<StreetIntersection *> &intersections = dirtyStreets ? dirtyIntersections : streetsIntersections;
 
+      for(int i=0; i!= intersections.size(); ++i){
+        StreetIntersection *streetInt = intersections[i];
+        int numStreets = streetInt->getNumStreets(streetGraph);
 
         for(int j = 0; j != numStreets; ++j){
-          Street *street1 = streetInt->streets[j];
+          int street1Id = streetInt->getStreet(streetGraph, j);
+          Street *street1 = &streetsList[street1Id];
 
           for(int k = 0; k != numStreets; ++k){
-            Street *street2 = streetInt->streets[k];
+            int street2Id = streetInt->getStreet(streetGraph, k);
+            Street *street2 = &streetsList[street2Id];
 
             if(!(street1->equalsTo(street2))){
               //----------------------We calculate the distance to translate each pair of streets from the intersection point----------------------
@@ -734,6 +1570,7 @@ namespace octet {
               Street *streetsToModify [2];
               streetsToModify[0] = street1;
               streetsToModify[1] = street2;
+              int streetIds[2] = { street1Id, street2Id };
 
               //We obtain their defining vectors setting the origin as the intersection point
               vec4 streetVectors[2];
@@ -826,10 +1663,14 @@ namespace octet {
                   Street *streetToModify1 = streetsToModify[z];
                   vec4 *street1VectorStandard = &streetVectorsStandard[z];
 
+                  if (dirty && !(*dirty)[streetIds[z]]) continue;
+
                   for (int w = 0; w != 2; ++w) {
                     vec4 &point = streetToModify1->points[w];
                     if (all(streetInt->point == point)) {
 
+                      uint64_t pairKey = ((uint64_t)(streetIds[(z==1) ? 0 : z+1] + 1) << 32) | (uint64_t)(streetIds[z] + 1);
+
                       vec4 exteriorPointPavement (point[0] + exteriorPavementDistance * cos(resultingAngle),0,
                         point[2] + exteriorPavementDistance * sin(resultingAngle),1);
 
@@ -855,7 +1696,7 @@ namespace octet {
                       float crossProductResult = (street1VectorStandard->x() *exteriorPointVector.y()) - (street1VectorStandard->y() * exteriorPointVector.x()); 
                       //ROAD & PAVEMENT MESHES CALCULATION
 
-                      if (crossProductResult < 0 && !checkIntersections[getStreetsIndex(streetToModify1)+getStreetsIndex(streetsToModify[(z==1) ? 0 : z+1])*streetsListSize]) {
+                      if (crossProductResult < 0 && !checkIntersections.contains(pairKey)) {
 
                         pushBackRightSide(streetToModify1, streetInt, exteriorPointRoad, interiorPointPavement, exteriorPointPavement, exteriorUVCoordRoad, exteriorUVCoordPavement);
 
@@ -871,14 +1712,14 @@ namespace octet {
                           vec4 exteriorPointRoad (streetToModify1->points[w][0] - exteriorRoadDistance * cos(resultingAngle),0,
                             point[2] - exteriorRoadDistance * sin(resultingAngle),1);
 
-                          pushBackLeftSide(streetToModify1, i, exteriorPointRoad, interiorPointPavement, exteriorPointPavement, interiorUVCoordRoad, interiorUVCoordPavement);
+                          pushBackLeftSide(streetToModify1, streetInt, exteriorPointRoad, interiorPointPavement, exteriorPointPavement, interiorUVCoordRoad, interiorUVCoordPavement);
                         }
 
-                        checkIntersections[getStreetsIndex(streetToModify1)+getStreetsIndex(streetsToModify[(z==1) ? 0 : z+1])*streetsListSize] = true;
+                        checkIntersections[pairKey] = true;
 
-                      } else if(crossProductResult > 0 && !checkIntersections[getStreetsIndex(streetToModify1)+getStreetsIndex(streetsToModify[(z==1) ? 0 : z+1])*streetsListSize]){
+                      } else if(crossProductResult > 0 && !checkIntersections.contains(pairKey)){
 
-                        pushBackLeftSide(streetToModify1, i, exteriorPointRoad, interiorPointPavement, exteriorPointPavement, interiorUVCoordRoad, interiorUVCoordPavement);
+                        pushBackLeftSide(streetToModify1, streetInt, exteriorPointRoad, interiorPointPavement, exteriorPointPavement, interiorUVCoordRoad, interiorUVCoordPavement);
 
 
                         //We close the corners of the 2 intersection street
@@ -898,7 +1739,7 @@ namespace octet {
 
                         }
 
-                        checkIntersections[getStreetsIndex(streetToModify1)+getStreetsIndex(streetsToModify[(z==1) ? 0 : z+1])*streetsListSize] = true;
+                        checkIntersections[pairKey] = true;
                       }
                     }
                   } 
@@ -908,17 +1749,17 @@ namespace octet {
           }
         }
       }
-      generatePointsEmptyRoadMeshes();
-      generatePointsIncompleteMeshes();
+      generatePointsEmptyRoadMeshes(dirtyStreets);
+      generatePointsIncompleteMeshes(dirtyStreets);
       // printMeshesPoints();
     } 
 
-    void pushBackLeftSide( Street * streetToModify1, int i, vec4 &exteriorPointRoad, vec4 &interiorPointPavement, vec4 &exteriorPointPavement, vec2 interiorUVCoordRoad, vec2 interiorUVCoordPavement ) 
+    void pushBackLeftSide( Street * streetToModify1, StreetIntersection * streetInt, vec4 &exteriorPointRoad, vec4 &interiorPointPavement, vec4 &exteriorPointPavement, vec2 interiorUVCoordRoad, vec2 interiorUVCoordPavement ) 
     {
-      streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(streetsIntersections[i]->point.x(),0.02f,streetsIntersections[i]->point.z(),streetsIntersections[i]->point.w()));
+      streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(streetInt->point.x(),0.02f,streetInt->point.z(),streetInt->point.w()));
       streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(exteriorPointRoad.x(),0.02f,exteriorPointRoad.z(),exteriorPointRoad.w()));
       streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(exteriorPointRoad.x(),-0.02f,exteriorPointRoad.z(),exteriorPointRoad.w()));
-      streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(streetsIntersections[i]->point.x(),-0.02f,streetsIntersections[i]->point.z(),streetsIntersections[i]->point.w()));
+      streetToModify1->streetIntersectedPoints.roadLeft.push_back(vec4(streetInt->point.x(),-0.02f,streetInt->point.z(),streetInt->point.w()));
 
       streetToModify1->streetIntersectedPoints.pavementLeft.push_back(vec4(interiorPointPavement.x(),0.04f,interiorPointPavement.z(),interiorPointPavement.w()));
       streetToModify1->streetIntersectedPoints.pavementLeft.push_back(vec4(exteriorPointPavement.x(),0.04f,exteriorPointPavement.z(),exteriorPointPavement.w()));
@@ -960,11 +1801,15 @@ namespace octet {
     }
 
     //generates 4 or 8 additional points for the Road Meshes that just have 4 points
-    void generatePointsEmptyRoadMeshes(){
+    //streets - if given, only these streets
+    void generatePointsEmptyRoadMeshes(const dynarray<int> *streets = NULL){
       float exteriorPavementDistance = (CityConstants::STREET_WIDTH / 2);
       float interiorPavementDistance = ((CityConstants::STREET_WIDTH / 2) - CityConstants::PAVEMENT_WIDTH);
 
-      for(int i=0; i!= streetsList.size(); ++i){
+      int numStreets = streets ? streets->size() : streetsList.size();
+      for(int n=0; n!= numStreets; ++n){
+        int i = streets ? (*streets)[n] : n;
+        if (streetRemoved[i]) continue;
 
         if(streetsList[i].streetIntersectedPoints.roadLeft.size() == 0  || streetsList[i].streetIntersectedPoints.roadRight.size() == 0 ){
 
@@ -1083,9 +1928,14 @@ namespace octet {
     }
 
     //generates 4 additional points for the Pavement Meshes that just have 4 points
-    void generatePointsIncompleteMeshes(){
+    //streets - if given, only these streets
+    void generatePointsIncompleteMeshes(const dynarray<int> *streets = NULL){
+
+      int numStreets = streets ? streets->size() : streetsList.size();
+      for(int n=0; n!= numStreets; ++n){
+        int i = streets ? (*streets)[n] : n;
+        if (streetRemoved[i]) continue;
 
-      for(int i=0; i!= streetsList.size(); ++i){
         if(streetsList[i].streetIntersectedPoints.pavementLeft.size() == 4 || streetsList[i].streetIntersectedPoints.pavementRight.size() == 4 ||
           streetsList[i].streetIntersectedPoints.roadLeft.size() == 4 || streetsList[i].streetIntersectedPoints.pavementLeft.size() == 4){
 
@@ -1255,10 +2105,11 @@ namespace octet {
 
       for(int i=0; i!= streetsIntersections.size(); ++i){
         printf("Point (%.2f, %.2f): \n",streetsIntersections[i]->point.x(),streetsIntersections[i]->point.z());
-        for(int j=0; j!= streetsIntersections[i]->streets.size(); ++j){
+        for(int j=0; j!= streetsIntersections[i]->getNumStreets(streetGraph); ++j){
+          Street &street = streetsList[streetsIntersections[i]->getStreet(streetGraph, j)];
           printf("s%d. (%.2f, %.2f), (%.2f, %.2f).\n",j+1,
-            streetsIntersections[i]->streets[j]->points[0].x(), streetsIntersections[i]->streets[j]->points[0].z(),  
-            streetsIntersections[i]->streets[j]->points[1].x(), streetsIntersections[i]->streets[j]->points[1].z());
+            street.points[0].x(), street.points[0].z(),
+            street.points[1].x(), street.points[1].z());
         }
         printf("\n");
       }
@@ -1266,11 +2117,19 @@ namespace octet {
 
     void calculateBuildingsAreas() {
       calculateBuildingsAreas_(&root);
-      for (int i=0; i!=subAreaNodes.size(); ++i) {
-        calculateFinalBuildingsAreas_(&subAreaNodes[i]);
-      }
+      calculateLots_(0);
 
+    }
 
+    enum { NUM_PROP_PROTOTYPES = 8 };
+
+    //Models in a fixed order, snapshots refer to them by index
+    ModelBuilder *getPropPrototype(int index) {
+      City *p = propPrototypes;
+      ModelBuilder *prototypes[NUM_PROP_PROTOTYPES] = {
+        &p->lampModel, &p->trafficLightModel, &p->hydrantModel, &p->postboxModel, &p->treeModel, &p->tree2Model, &p->benchModel, &p->binModel
+      };
+      return prototypes[index];
     }
 
     void loadModels(){
@@ -1284,11 +2143,17 @@ namespace octet {
       binModel.loadModel("assets/citytex/models/bin/bin.dae");
     }
 
-    void generate3DModels(){
+    //Props along the pavements of every street, or only of the dirty ones when the partition is refined
+    void generate3DModels(const dynarray<int> *streets = NULL){
 
       dynarray<vec4>* pavementMeshes[2];
 
-      for(int i=0; i!=streetsList.size();++i){
+      int numStreets = streets ? streets->size() : streetsList.size();
+      for(int n=0; n!=numStreets;++n){
+        int i = streets ? (*streets)[n] : n;
+        if (streetRemoved[i]) continue;
+        CityRandom::Generator rnd = random.getGenerator(CityRandom::STREAM_PROPS, i);
+
         pavementMeshes[0] = &(streetsList[i].streetIntersectedPoints.pavementLeft);
         pavementMeshes[1] = &(streetsList[i].streetIntersectedPoints.pavementRight);
 
@@ -1342,7 +2207,7 @@ namespace octet {
         //To determine the orientation of the lamp depending if it is placed on the right or on the left pavement
         float crossProductResult = (streetVector.x() *lampVector.y()) - (streetVector.y() * lampVector.x()); 
 
-        int typeOfTree = (float)rand() / static_cast <float> (RAND_MAX/10);
+        int typeOfTree = rnd.getInt(0, 10);
 
         for(int j=0;j!=2;++j){
 
@@ -1402,7 +2267,7 @@ namespace octet {
 
           while(walkedDistance < distanceBetweenPoints){
 
-            Model* lamp = new LampModel(&lampModel,translationPoint,rotation);
+            Model* lamp = new LampModel(&propPrototypes->lampModel,translationPoint,rotation);
             models.push_back(lamp);
 
             translationPoint += CityConstants::LAMPS_SEPARATION*normalizedPavementVector;
@@ -1428,24 +2293,24 @@ namespace octet {
           Model* t2 = 0; 
 
           //We place traffic lights randomly
-          int r = (float)rand() / static_cast <float> (RAND_MAX/5);
+          int r = rnd.getInt(0, 5);
 
           if(r == 0){
-            tl = new TrafficLight(&trafficLightModel,pointTF1,rotationAngle);
+            tl = new TrafficLight(&propPrototypes->trafficLightModel,pointTF1,rotationAngle);
             models.push_back(tl);
           }else if(r == 1){
-            t2 = new TrafficLight(&trafficLightModel,pointTF2,rotationAngle);
+            t2 = new TrafficLight(&propPrototypes->trafficLightModel,pointTF2,rotationAngle);
             models.push_back(t2);
           }else if (r==2){
-            tl = new TrafficLight(&trafficLightModel,pointTF1,rotationAngle);
-            t2 = new TrafficLight(&trafficLightModel,pointTF2,rotationAngle);
+            tl = new TrafficLight(&propPrototypes->trafficLightModel,pointTF1,rotationAngle);
+            t2 = new TrafficLight(&propPrototypes->trafficLightModel,pointTF2,rotationAngle);
             models.push_back(tl);
             models.push_back(t2);
           }
 
 
           
-          int r2 = (float)rand() / static_cast <float> (RAND_MAX/10);
+          int r2 = rnd.getInt(0, 10);
 
 
           if(distanceBetweenPoints > 1.0f){
@@ -1453,13 +2318,13 @@ namespace octet {
             //HYDRANTS
             if(r2==5){
 
-              r2 = (float)rand() / static_cast <float> (RAND_MAX/static_cast<int>(distanceBetweenPoints));
+              r2 = rnd.getInt(0, static_cast<int>(distanceBetweenPoints));
 
               vec4 hydP = pavementMidPoint2+r2*(normalizedPavementVector/3);
 
               hydP = vec4(hydP.x(),heightMap->sample_heightmap(vec4(hydP.x(), 0, hydP.z(), 0.0f))+CityConstants::PAVEMENT_RAISE*1.8f,hydP.z(),hydP.w());
 
-              Model* h = new Hydrant(&hydrantModel,hydP,rotation);
+              Model* h = new Hydrant(&propPrototypes->hydrantModel,hydP,rotation);
               models.push_back(h);
 
             }
@@ -1467,26 +2332,26 @@ namespace octet {
           //POSTBOXES
             if(r2 == 3 || r2 == 6){
 
-              r2 = (float)rand() / static_cast <float> (RAND_MAX/static_cast<int>(distanceBetweenPoints));
+              r2 = rnd.getInt(0, static_cast<int>(distanceBetweenPoints));
 
               vec4 postBoxPoint = pavementMidPoint2+r2*(normalizedPavementVector/3);
 
               postBoxPoint = vec4(postBoxPoint.x(),heightMap->sample_heightmap(vec4(postBoxPoint.x(), 0, postBoxPoint.z(), 0.0f))+CityConstants::PAVEMENT_RAISE*3.5f,postBoxPoint.z(),postBoxPoint.w());
 
-              Model* p = new PostBox(&postboxModel,postBoxPoint,rotation);
+              Model* p = new PostBox(&propPrototypes->postboxModel,postBoxPoint,rotation);
               models.push_back(p);
 
             }
 
             if(r2 == 2 || r2 == 4 || r2 == 7){
 
-              r2 = (float)rand() / static_cast <float> (RAND_MAX/static_cast<int>(distanceBetweenPoints));
+              r2 = rnd.getInt(0, static_cast<int>(distanceBetweenPoints));
 
               vec4 binPoint = pavementMidPoint2+r2*(normalizedPavementVector/3);
 
               binPoint = vec4(binPoint.x(),heightMap->sample_heightmap(vec4(binPoint.x(), 0, binPoint.z(), 0.0f))+CityConstants::PAVEMENT_RAISE*1.5f,binPoint.z(),binPoint.w());
 
-              Model* p = new Bin(&binModel,binPoint,rotation);
+              Model* p = new Bin(&propPrototypes->binModel,binPoint,rotation);
               models.push_back(p);
 
             }
@@ -1505,10 +2370,10 @@ namespace octet {
             while(walkedDistance < distanceBetweenPoints){
 
               if(i % 2 == 0){
-                Model* tree = new Tree(&treeModel,translationPoint,rotation);
+                Model* tree = new Tree(&propPrototypes->treeModel,translationPoint,rotation);
                 models.push_back(tree);
               }else{
-                Model* tree = new Tree2(&tree2Model,translationPoint,rotation);
+                Model* tree = new Tree2(&propPrototypes->tree2Model,translationPoint,rotation);
                 models.push_back(tree);
               }
 
@@ -1532,7 +2397,7 @@ namespace octet {
 
             while(walkedDistance < distanceBetweenPoints){
 
-              Model* bench = new Bench(&benchModel,translationPoint,rotation);
+              Model* bench = new Bench(&propPrototypes->benchModel,translationPoint,rotation);
               models.push_back(bench);
 
               translationPoint += CityConstants::LAMPS_SEPARATION*normalizedPavementVector;
@@ -1546,8 +2411,11 @@ namespace octet {
 
 
         }
-      }
 
+        while (modelStreets.size() != models.size()) {
+          modelStreets.push_back(i);
+        }
+      }
 
     }
 
@@ -1595,14 +2463,18 @@ namespace octet {
 
 
       if (!b->right && !b->left ) { //If it's a leaf
-        dynarray <Street *> nodeStreetsList;
+        dynarray <Street *> &nodeStreetsList = scratchStreets;
 
         getStreetsWithNode(b, nodeStreetsList);
+        //A block without streets around has no area
+        if (nodeStreetsList.size() == 0) return;
         dynarray <vec4> points;
         b->getBuildAreaBase(&nodeStreetsList, points);
 
         //buildingAreaList.push_back(BuildingArea(points[0], points[1], points[2], points[3]));
-        BSPNode buildingNodeRoot = BSPNode();
+        //The parent of the area is the block it belongs to, and its lots are keyed by the block
+        BSPNode buildingNodeRoot = BSPNode(b);
+        buildingNodeRoot.id = b->id;
         buildingNodeRoot.vertices[0] = points[0];
         buildingNodeRoot.vertices[1] = points[1];
         buildingNodeRoot.vertices[2] = points[2];
@@ -1618,143 +2490,331 @@ namespace octet {
       }
     }
 
-    void calculateFinalBuildingsAreas_(BSPNode *b) {
+    //Subdivide the areas from subAreaNodes[firstArea] on into lots and add their buildings.
+    //The lots of an area do not depend on anything else, so ranges of areas are subdivided
+    //in parallel into their own lists, which are appended in order.
+    //The result does not depend on the number of threads.
+    void calculateLots_(int firstArea) {
+      int numAreas = subAreaNodes.size() - firstArea;
+      if (numAreas <= 0) return;
+
+      int numRanges = 1;
+    #ifdef _OPENMP
+      numRanges = omp_get_max_threads() * 4;
+    #endif
+      if (numRanges > numAreas) numRanges = numAreas;
+
+      dynarray<BuildingArea> *rangeAreas = new dynarray<BuildingArea>[numRanges];
+      arena<> *rangeNodes = new arena<>[numRanges];
+
+      #pragma omp parallel for schedule(dynamic)
+      for (int r = 0; r < numRanges; r++) {
+        int first = firstArea + numAreas * r / numRanges;
+        int last = firstArea + numAreas * (r+1) / numRanges;
+        for (int i = first; i != last; i++) {
+          calculateFinalBuildingsAreas_(&subAreaNodes[i], rangeNodes[r], rangeAreas[r]);
+        }
+      }
+
+      for (int r = 0; r != numRanges; r++) {
+        for (int i = 0; i != rangeAreas[r].size(); ++i) {
+          buildingAreaList.push_back(rangeAreas[r][i]);
+        }
+      }
+      delete[] rangeNodes;
+      delete[] rangeAreas;
+
+      //The areas are only needed to make the lots, their memory is kept for the next ones
+      subAreaNodes.resize(firstArea);
+    }
+
+    //The lot nodes go in lotNodes, which is reset after the buildings of every area are made
+    void calculateFinalBuildingsAreas_(BSPNode *b, arena<> &lotNodes, dynarray<BuildingArea> &result) {
       if (!b->right && !b->left ) { //If it's a leaf
+        //Splitting the lots uses the partition stream, the tag keeps them apart from the streets
         BSPNode buildingNodeRoot = BSPNode();
+        buildingNodeRoot.id = CityRandom::combine(b->id, CityRandom::STREAM_LOTS);
         buildingNodeRoot.vertices[0] = b->vertices[0];
         buildingNodeRoot.vertices[1] = b->vertices[1];
         buildingNodeRoot.vertices[2] = b->vertices[2];
         buildingNodeRoot.vertices[3] = b->vertices[3];
-        stepPartition_(5, &buildingNodeRoot, true);
+        stepPartition_(5, &buildingNodeRoot, lotNodes, true);
 
-        createBuildingAreas(&buildingNodeRoot);
+        createBuildingAreas(&buildingNodeRoot, b->parent, result);
+        lotNodes.reset();
       } else {
         if (b->right) {
-          calculateFinalBuildingsAreas_(b->right);
+          calculateFinalBuildingsAreas_(b->right, lotNodes, result);
         }
         if (b->left) {
-          calculateFinalBuildingsAreas_(b->left);
+          calculateFinalBuildingsAreas_(b->left, lotNodes, result);
         }
       }
     }
 
-    void createBuildingAreas(BSPNode *b) {
+    void createBuildingAreas(BSPNode *b, BSPNode *block, dynarray<BuildingArea> &result) {
       if (!b->right && !b->left) {
-        buildingAreaList.push_back(BuildingArea(b->vertices[0], b->vertices[1], b->vertices[2], b->vertices[3]));
+        result.push_back(BuildingArea(b->vertices[0], b->vertices[1], b->vertices[2], b->vertices[3], block));
       } else {
         if (b->right) {
-          createBuildingAreas(b->right);
+          createBuildingAreas(b->right, block, result);
         }
         if (b->left) {
-          createBuildingAreas(b->left);
+          createBuildingAreas(b->left, block, result);
         }
       }
     }
 
     void getStreetsWithNode(BSPNode *b, dynarray <Street *> &resultList) {
-      resultList.reset();
+      resultList.resize(0);
 
-      for (auto i = streetsList.begin(); i != streetsList.end(); i++) {
-        if (i->leftNode == b || i ->rightNode == b) {
-          resultList.push_back(&(*i));
-        }
+      dynarray<int> &streetIds = scratchStreetIds;
+      streetGraph.getBlockEdges(b, streetIds);
+      for (int i = 0; i != streetIds.size(); ++i) {
+        resultList.push_back(&streetsList[streetIds[i]]);
+      }
+    }
+
+    //Split a leaf in two through the middle of its longest sides and add the streets of its children
+    void splitNode(BSPNode *b, arena<> &nodes, bool noStreet) {
+      int side_index = getSideToMakePartition(b);
+      //printf("Side picked: %d\n", side_index);
+
+      //Opposite side
+      int opposite_side_index = (side_index+2)%4;
+      vec4 &opposite_side_vertex_a = b->vertices[opposite_side_index];
+      vec4 &opposite_side_vertex_b = b->vertices[(opposite_side_index+1)%4];
+
+      vec4 &side_vertex_a = b->vertices[side_index];
+      vec4 &side_vertex_b = b->vertices[(side_index+1)%4];
+
+      //Calculate mid-points
+      vec4 midpoint(side_vertex_a.x() + (side_vertex_b.x() - side_vertex_a.x())*0.5f,
+        side_vertex_a.y() + (side_vertex_b.y() - side_vertex_a.y())*0.5f,
+        side_vertex_a.z() + (side_vertex_b.z() - side_vertex_a.z())*0.5f,
+        1.0f);
+
+      vec4 midpoint_opposite(opposite_side_vertex_a.x() + (opposite_side_vertex_b.x() - opposite_side_vertex_a.x())*0.5f,
+        opposite_side_vertex_a.y() + (opposite_side_vertex_b.y() - opposite_side_vertex_a.y())*0.5f,
+        opposite_side_vertex_a.z() + (opposite_side_vertex_b.z() - opposite_side_vertex_a.z())*0.5f,
+        1.0f);
+
+      b->left = newNode_(nodes, b);
+      b->right = newNode_(nodes, b);
+      b->left->id = CityRandom::combine(b->id, 0);
+      b->right->id = CityRandom::combine(b->id, 1);
+
+      b->left->nodesOutside[0] = b->nodesOutside[side_index];
+      b->left->nodesOutside[1] = b->right;
+      b->left->nodesOutside[2] = b->nodesOutside[(side_index+2)%4];
+      b->left->nodesOutside[3] = b->nodesOutside[(side_index+3)%4];
+
+      //Put resulting vertices in the same positions as its parent
+      b->left->vertices[0] = side_vertex_a;
+      b->left->vertices[1] = midpoint;
+      b->left->vertices[2] = midpoint_opposite;
+      b->left->vertices[3] = opposite_side_vertex_b;
+
+      b->right->nodesOutside[0] = b->nodesOutside[(side_index+2)%4];
+      b->right->nodesOutside[1] = b->left;
+      b->right->nodesOutside[2] = b->nodesOutside[side_index];
+      b->right->nodesOutside[3] = b->nodesOutside[(side_index+1)%4];
+
+      b->right->vertices[0] = opposite_side_vertex_a;
+      b->right->vertices[1] = midpoint_opposite;
+      b->right->vertices[2] = midpoint;
+      b->right->vertices[3] = side_vertex_b;
+
+      //printf("Left side, v:{ (%g, %g, %g), (%g, %g, %g), (%g, %g, %g), (%g, %g, %g) }, nout: { %p, %p, %p, %p }\n",
+      //  b->left->vertices[0].x(), b->left->vertices[0].y(), b->left->vertices[0].z(), 
+      //  b->left->vertices[1].x(), b->left->vertices[1].y(), b->left->vertices[1].z(), 
+      //  b->left->vertices[2].x(), b->left->vertices[2].y(), b->left->vertices[2].z(), 
+      //  b->left->vertices[3].x(), b->left->vertices[3].y(), b->left->vertices[3].z(), 
+      //  b->left->nodesOutside[0], b->left->nodesOutside[1], b->left->nodesOutside[2], b->left->nodesOutside[3]);
+
+
+      //printf("Right side, v:{ (%g, %g, %g), (%g, %g, %g), (%g, %g, %g), (%g, %g, %g) }, nout: { %p, %p, %p, %p }\n",
+      //  b->right->vertices[0].x(), b->right->vertices[0].y(), b->right->vertices[0].z(), 
+      //  b->right->vertices[1].x(), b->right->vertices[1].y(), b->right->vertices[1].z(), 
+      //  b->right->vertices[2].x(), b->right->vertices[2].y(), b->right->vertices[2].z(), 
+      //  b->right->vertices[3].x(), b->right->vertices[3].y(), b->right->vertices[3].z(), 
+      //  b->right->nodesOutside[0], b->right->nodesOutside[1], b->right->nodesOutside[2], b->right->nodesOutside[3]);
+
+      //Lots have no streets
+      if (!noStreet) {
+        generateStreets(b->left, noStreet);
+        generateStreets(b->right, noStreet);
       }
     }
 
-    void stepPartition_(unsigned int depth, BSPNode *b, bool noStreet) {
+    void stepPartition_(unsigned int depth, BSPNode *b, arena<> &nodes, bool noStreet) {
       if (depth == 0) return;
 
       //rintf("Partition depth: %d\n", depth);
 
       if (!b->right || !b->left) { // It was a leaf node, expand it
-
-        int side_index = getSideToMakePartition(b);
-        //printf("Side picked: %d\n", side_index);
-
-        //Opposite side
-        int opposite_side_index = (side_index+2)%4;
-        vec4 &opposite_side_vertex_a = b->vertices[opposite_side_index];
-        vec4 &opposite_side_vertex_b = b->vertices[(opposite_side_index+1)%4];
-
-        vec4 &side_vertex_a = b->vertices[side_index];
-        vec4 &side_vertex_b = b->vertices[(side_index+1)%4];
-
-        //Calculate mid-points
-        vec4 midpoint(side_vertex_a.x() + (side_vertex_b.x() - side_vertex_a.x())*0.5f,
-          side_vertex_a.y() + (side_vertex_b.y() - side_vertex_a.y())*0.5f,
-          side_vertex_a.z() + (side_vertex_b.z() - side_vertex_a.z())*0.5f,
-          1.0f);
-
-        vec4 midpoint_opposite(opposite_side_vertex_a.x() + (opposite_side_vertex_b.x() - opposite_side_vertex_a.x())*0.5f,
-          opposite_side_vertex_a.y() + (opposite_side_vertex_b.y() - opposite_side_vertex_a.y())*0.5f,
-          opposite_side_vertex_a.z() + (opposite_side_vertex_b.z() - opposite_side_vertex_a.z())*0.5f,
-          1.0f);
-
-        b->left = new BSPNode(b);
-        b->right = new BSPNode(b);
-
-        b->left->nodesOutside[0] = b->nodesOutside[side_index];
-        b->left->nodesOutside[1] = b->right;
-        b->left->nodesOutside[2] = b->nodesOutside[(side_index+2)%4];
-        b->left->nodesOutside[3] = b->nodesOutside[(side_index+3)%4];
-
-        //Put resulting vertices in the same positions as its parent
-        b->left->vertices[0] = side_vertex_a;
-        b->left->vertices[1] = midpoint;
-        b->left->vertices[2] = midpoint_opposite;
-        b->left->vertices[3] = opposite_side_vertex_b;
-
-        b->right->nodesOutside[0] = b->nodesOutside[(side_index+2)%4];
-        b->right->nodesOutside[1] = b->left;
-        b->right->nodesOutside[2] = b->nodesOutside[side_index];
-        b->right->nodesOutside[3] = b->nodesOutside[(side_index+1)%4];
-
-        b->right->vertices[0] = opposite_side_vertex_a;
-        b->right->vertices[1] = midpoint_opposite;
-        b->right->vertices[2] = midpoint;
-        b->right->vertices[3] = side_vertex_b;
-
-        //printf("Left side, v:{ (%g, %g, %g), (%g, %g, %g), (%g, %g, %g), (%g, %g, %g) }, nout: { %p, %p, %p, %p }\n",
-        //  b->left->vertices[0].x(), b->left->vertices[0].y(), b->left->vertices[0].z(), 
-        //  b->left->vertices[1].x(), b->left->vertices[1].y(), b->left->vertices[1].z(), 
-        //  b->left->vertices[2].x(), b->left->vertices[2].y(), b->left->vertices[2].z(), 
-        //  b->left->vertices[3].x(), b->left->vertices[3].y(), b->left->vertices[3].z(), 
-        //  b->left->nodesOutside[0], b->left->nodesOutside[1], b->left->nodesOutside[2], b->left->nodesOutside[3]);
-
-
-        //printf("Right side, v:{ (%g, %g, %g), (%g, %g, %g), (%g, %g, %g), (%g, %g, %g) }, nout: { %p, %p, %p, %p }\n",
-        //  b->right->vertices[0].x(), b->right->vertices[0].y(), b->right->vertices[0].z(), 
-        //  b->right->vertices[1].x(), b->right->vertices[1].y(), b->right->vertices[1].z(), 
-        //  b->right->vertices[2].x(), b->right->vertices[2].y(), b->right->vertices[2].z(), 
-        //  b->right->vertices[3].x(), b->right->vertices[3].y(), b->right->vertices[3].z(), 
-        //  b->right->nodesOutside[0], b->right->nodesOutside[1], b->right->nodesOutside[2], b->right->nodesOutside[3]);
-
-        generateStreets(b->left, noStreet);
-        generateStreets(b->right, noStreet);
-
+        splitNode(b, nodes, noStreet);
       }
 
 
       //stepPartition_(depth - 1, b->left);
 
       // Heuristic to choose side: random by now
-      // TODO Heuristic: choose sides intersected by frustrum
+      // (refinePartition chooses the blocks with the camera frustum instead)
 
 
-      float r = ((float)rand()) / ((float)RAND_MAX);
+      float r = random.getGenerator(CityRandom::STREAM_PARTITION, CityRandom::combine(b->id, b->visits++)).getFloat();
 
       if (r >= 0.5f) {
-        stepPartition_(depth - 1, b->left, noStreet);
+        stepPartition_(depth - 1, b->left, nodes, noStreet);
       }
       if (r < 0.5f) {
-        stepPartition_(depth - 1, b->right, noStreet);
+        stepPartition_(depth - 1, b->right, nodes, noStreet);
+      }
+
+    }
+
+    //Leaves in the view that need more detail, with their distance to the eye
+    void getBlocksToRefine_(BSPNode *b, const PartitionView &view, dynarray<BSPNode *> &blocks, dynarray<float> &distances) {
+      vec3 minCoord = b->vertices[0].xyz();
+      vec3 maxCoord = minCoord;
+      for (int i = 1; i != 4; ++i) {
+        minCoord = minCoord.min(b->vertices[i].xyz());
+        maxCoord = maxCoord.max(b->vertices[i].xyz());
+      }
+      minCoord[1] = 0.0f;
+      maxCoord[1] = view.maxHeight;
+
+      //Children are inside their parent, a node out of the view discards the whole subtree
+      if (!view.frustum.intersects(aabb((minCoord + maxCoord) * 0.5f, (maxCoord - minCoord) * 0.5f))) return;
+
+      if (b->left && b->right) {
+        getBlocksToRefine_(b->left, view, blocks, distances);
+        getBlocksToRefine_(b->right, view, blocks, distances);
+        return;
+      }
+
+      float size = max(maxCoord.x() - minCoord.x(), maxCoord.z() - minCoord.z());
+      if (size <= view.minBlockSize) return;
+
+      //Distance on the ground, 0 when the eye is over the block
+      float dx = max(max(minCoord.x() - view.eye.x(), view.eye.x() - maxCoord.x()), 0.0f);
+      float dz = max(max(minCoord.z() - view.eye.z(), view.eye.z() - maxCoord.z()), 0.0f);
+      float distance = sqrtf(dx*dx + dz*dz);
+
+      if (size > view.detail * distance) {
+        blocks.push_back(b);
+        distances.push_back(distance);
+      }
+    }
+
+    //Graph, intersections and meshes of the streets added and removed by the refinement and of
+    //the streets meeting the new ones. Only the nodes of those streets are visited.
+    void updateRefinedStreets_() {
+      for (int i = 0; i != dirtyStreets.size(); ++i) {
+        streetDirty[dirtyStreets[i]] = false;
+      }
+      dirtyStreets.resize(0);
+
+      dynarray<int> nodes;
+      for (int i = 0; i != removedStreets.size(); ++i) {
+        const StreetGraph::Edge &edge = streetGraph.getEdge(removedStreets[i]);
+        if (edge.nodes[0] == -1) continue;
+        nodes.push_back(edge.nodes[0]);
+        nodes.push_back(edge.nodes[1]);
+        streetGraph.removeEdge(removedStreets[i]);
+      }
+      int firstNewNode = nodes.size();
+      for (int i = 0; i != addedStreets.size(); ++i) {
+        if (streetRemoved[addedStreets[i]]) continue;
+        streetGraph.setEdge(addedStreets[i], streetsList[addedStreets[i]]);
+        nodes.push_back(streetGraph.getEdge(addedStreets[i]).nodes[0]);
+        nodes.push_back(streetGraph.getEdge(addedStreets[i]).nodes[1]);
+      }
+
+      for (int n = firstNewNode; n != nodes.size(); ++n) {
+        for (int e = 0; e != streetGraph.getNode(nodes[n]).numEdges; ++e) {
+          int street = streetGraph.getNodeEdge(nodes[n], e);
+          if (!streetDirty[street]) {
+            streetDirty[street] = true;
+            dirtyStreets.push_back(street);
+          }
+        }
+      }
+      //The same order as a pass over every street
+      if (dirtyStreets.size()) {
+        std::sort(&dirtyStreets[0], &dirtyStreets[0] + dirtyStreets.size());
+      }
+
+      for (int i = 0; i != dirtyStreets.size(); ++i) {
+        streetsList[dirtyStreets[i]].resetMeshes();
+      }
+
+      updateIntersections_(nodes);
+      calculateMeshesIntersections(&dirtyStreets);
+    }
+
+    //Buildings of the split blocks and of the blocks along the streets that changed
+    void updateRefinedBuildings_(dynarray<BSPNode *> &splitNodes) {
+      hash_map<void *, bool> replaced;
+      dynarray<BSPNode *> blocks;
+
+      for (int i = 0; i != splitNodes.size(); ++i) {
+        replaced[splitNodes[i]] = true;
+      }
+
+      for (int i = 0; i != dirtyStreets.size(); ++i) {
+        BSPNode *sides[2] = { streetsList[dirtyStreets[i]].leftNode, streetsList[dirtyStreets[i]].rightNode };
+        for (int j = 0; j != 2; ++j) {
+          BSPNode *block = sides[j];
+          if (block && !block->left && !block->right && !replaced.contains(block)) {
+            replaced[block] = true;
+            blocks.push_back(block);
+          }
+        }
+      }
+
+      int numBuildings = 0;
+      for (int i = 0; i != buildingAreaList.size(); ++i) {
+        BSPNode *block = buildingAreaList[i].block;
+        if (block && replaced.contains(block)) continue;
+        if (numBuildings != i) {
+          buildingAreaList[numBuildings] = buildingAreaList[i];
+        }
+        numBuildings++;
       }
+      buildingAreaList.resize(numBuildings);
+      firstNewBuilding = numBuildings;
 
+      int firstArea = subAreaNodes.size();
+      for (int i = 0; i != blocks.size(); ++i) {
+        calculateBuildingsAreas_(blocks[i]);
+      }
+      calculateLots_(firstArea);
+    }
+
+    //Props of the streets that changed
+    void updateRefinedModels_() {
+      int numModels = 0;
+      for (int i = 0; i != models.size(); ++i) {
+        int street = modelStreets[i];
+        if (streetDirty[street] || streetRemoved[street]) continue;
+        if (numModels != i) {
+          models[numModels] = models[i];
+          modelStreets[numModels] = street;
+        }
+        numModels++;
+      }
+      models.resize(numModels);
+      modelStreets.resize(numModels);
+
+      generate3DModels(&dirtyStreets);
     }
 
     void generateStreets( BSPNode * node, bool noStreet) {
 
-      dynarray<Street> localList;
+      //Sides of the node that get a street
+      dynarray<int> localList;
       //dynarray<unsigned int> parentIndexList;
 
       for (int i = 0; i != 4; ++i) {
@@ -1774,24 +2834,21 @@ namespace octet {
             //  }
             //}
 
-            streetsList.erase(indexToDelete);
+            removeStreet(indexToDelete);
           }
 
-          Street s1(node->vertices[i],node->vertices[(i+1)%4]);
-          s1.leftNode = node;
-          s1.rightNode = node->nodesOutside[i];
-          localList.push_back(s1);
+          localList.push_back(i);
 
           //if (indexToDelete != 1) {
           //parentIndexList.push_back(localList.size()-1);
           //}
-          //printf("Generated street from (%g, %g, %g) to (%g, %g, %g). Left node: %p, Right node: %p\n", s1.points[0].x(), s1.points[0].y(), s1.points[0].z(), s1.points[1].x(), s1.points[1].y(), s1.points[1].z(), s1.leftNode, s1.rightNode);
         }
       }
 
       if (!noStreet) {
         for (int m = 0; m != localList.size(); m++) {
-          streetsList.push_back(localList[m]);
+          int i = localList[m];
+          addStreet(node->vertices[i], node->vertices[(i+1)%4], node, node->nodesOutside[i]);
           //node->streetsList->push_back(&streetsList[streetsList.size()-1]);
 
           //for (int n = 0; n != parentIndexList.size(); n++) {
@@ -1806,21 +2863,15 @@ namespace octet {
 
     bool streetAlreadyExists(vec4 sp1Son, vec4 sp2Son){
 
-      vec4 streenSonPoints[2];
-      streenSonPoints[0] = sp1Son;
-      streenSonPoints[1] = sp2Son;
-
-      for(int i=0; i!=streetsList.size(); ++i){
-        for(int j=0; j!=2; ++j){
-          for(int k=0; k!=2; ++k){
+      dynarray<int> candidates;
+      streetEndpoints.find(sp1Son, candidates);
 
-            if(all(streetsList[i].points[j] == streenSonPoints[k]) && 
-              all(streetsList[i].points[(j==1) ? 0 : j+1] == streenSonPoints[(k==1) ? 0 : k+1])){
-                return true;
-            }
-
-          }
-        } 
+      for(int c=0; c!=candidates.size(); ++c){
+        Street &st = streetsList[candidates[c]];
+        if((all(st.points[0] == sp1Son) && all(st.points[1] == sp2Son)) ||
+          (all(st.points[0] == sp2Son) && all(st.points[1] == sp1Son))){
+            return true;
+        }
       }
 
       return false;
@@ -1835,7 +2886,12 @@ namespace octet {
 
       int indexToDelete = -1;
 
-      for (int i = 0; i!=streetsList.size(); ++i){
+      dynarray<int> candidates;
+      streetEndpoints.find(sp1Son, candidates);
+      streetEndpoints.find(sp2Son, candidates);
+
+      for (int c = 0; c != candidates.size(); ++c){
+        int i = candidates[c];
         for (int j = 0; j != 2; ++j){
           for (int k = 0; k != 2; ++k){
 
@@ -1857,35 +2913,59 @@ namespace octet {
       return indexToDelete;
     }
 
+    //The place of a street removed by an earlier refinement is used before growing the list
+    void addStreet(const vec4 &p1, const vec4 &p2, BSPNode *left, BSPNode *right) {
+      int index;
+      if (freeStreets.size()) {
+        index = freeStreets.back();
+        freeStreets.pop_back();
+        streetRemoved[index] = false;
+      } else {
+        index = streetsList.size();
+        streetsList.push_back();
+        streetRemoved.push_back(false);
+        streetDirty.push_back(false);
+      }
+      streetsList[index].reset(p1, p2, left, right);
+      addedStreets.push_back(index);
+      streetEndpoints.add(p1, index);
+      streetEndpoints.add(p2, index);
+    }
 
+    //The street stays in streetsList until compactStreets so that the indices do not move
+    void removeStreet(int index) {
+      streetRemoved[index] = true;
+      removedStreets.push_back(index);
+      streetEndpoints.remove(streetsList[index].points[0], index);
+      streetEndpoints.remove(streetsList[index].points[1], index);
+    }
 
-    void addIntersection(Street *s1, Street *s2, vec4 p ) 
-    {
-
-      StreetIntersection* st = new StreetIntersection(s1,s2,p);
-
-
-      for(int i=0; i!= streetsIntersections.size(); ++i){
-        //The intersection exists
-        if( all( streetsIntersections[i]->point == p ) ){
-          if(!streetsIntersections[i]->containsStreet(s2)) { 
-            streetsIntersections[i]->streets.push_back(s2);
-            /* printf("Add street :(%.2f, %.2f), (%.2f, %.2f) in (%.2f, %.2f).\n",
-            s2.points[0].x(), s2.points[0].z(), s2.points[1].x(), s2.points[1].z(),p.x(),p.z()); */
-
+    void compactStreets() {
+      int numStreets = 0;
+      for (int i = 0; i != streetsList.size(); ++i) {
+        if (!streetRemoved[i]) {
+          if (numStreets != i) {
+            streetsList[numStreets].swap(streetsList[i]);
           }
-          goto outloop; 
+          numStreets++;
         }
       }
-
-      //The intersection does not exist
-
-      streetsIntersections.push_back(st);
-      /* printf("Add intersection :(%.2f, %.2f), (%.2f, %.2f) -- (%.2f, %.2f), (%.2f, %.2f) in (%.2f, %.2f).\n",
-      s1.points[0].x(), s1.points[0].z(), s1.points[1].x(), s1.points[1].z(), s2.points[0].x(), s2.points[0].z(), 
-      s2.points[1].x(), s2.points[1].z(),p.x(),p.z());      */
-
-outloop:;
+      streetsList.resize(numStreets);
+
+      streetRemoved.reset();
+      streetDirty.reset();
+      dirtyStreets.reset();
+      addedStreets.reset();
+      removedStreets.reset();
+      freeStreets.reset();
+      streetEndpoints.reset();
+      for (int i = 0; i != streetsList.size(); ++i) {
+        streetRemoved.push_back(false);
+        streetDirty.push_back(false);
+        streetEndpoints.add(streetsList[i].points[0], i);
+        streetEndpoints.add(streetsList[i].points[1], i);
+      }
     }
+
   }; 
 }
\ No newline at end of file
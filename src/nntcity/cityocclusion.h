@@ -0,0 +1,206 @@
+namespace octet {
+
+  // Low resolution depth buffer drawn on the CPU with the buildings nearest to the camera,
+  // to skip whatever they hide before it gets to the GPU.
+  // Every pixel keeps 1/w of the nearest occluder, which is linear on the screen,
+  // 0 where there is none. Triangles only write the pixels they cover whole, with the
+  // furthest depth they have in the pixel, so the buffer never hides more than the occluders do.
+  class OcclusionBuffer {
+  public:
+    enum { WIDTH = 256, HEIGHT = 128 };
+
+  private:
+    // clip space w of the near plane of the engine projection
+    static const float NEAR_W;
+
+    dynarray<float> depth;
+    mat4t worldToProjection;
+
+    // counters for the last frame
+    int occluders;
+    int triangles;
+
+    // Screen position and 1/w of a vertex in front of the near plane
+    static void toScreen(const vec4 &clip, float *result) {
+      float rw = 1.0f / clip.w();
+      result[0] = (clip.x() * rw * 0.5f + 0.5f) * WIDTH;
+      result[1] = (clip.y() * rw * 0.5f + 0.5f) * HEIGHT;
+      result[2] = rw;
+    }
+
+    // Keep the nearest depth in the pixels the triangle covers whole, either winding.
+    // The depth of a pixel is the furthest of the triangle in it.
+    void rasterizeScreen(const float *v0, const float *v1, const float *v2) {
+      float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v2[0] - v0[0]) * (v1[1] - v0[1]);
+      if (area == 0.0f) return;
+      if (area < 0.0f) {
+        std::swap(v1, v2);
+        area = -area;
+      }
+
+      int minX = max(0, (int)floorf(min(v0[0], min(v1[0], v2[0]))));
+      int maxX = min(WIDTH - 1, (int)floorf(max(v0[0], max(v1[0], v2[0]))));
+      int minY = max(0, (int)floorf(min(v0[1], min(v1[1], v2[1]))));
+      int maxY = min(HEIGHT - 1, (int)floorf(max(v0[1], max(v1[1], v2[1]))));
+      if (minX > maxX || minY > maxY) return;
+      triangles++;
+
+      // edge functions e = a*x + b*y + c, positive inside, and the depth plane
+      const float *v[3] = { v0, v1, v2 };
+      float a[3], b[3], c[3];
+      for (int k = 0; k != 3; ++k) {
+        const float *p = v[k], *q = v[(k + 1) % 3];
+        a[k] = p[1] - q[1];
+        b[k] = q[0] - p[0];
+        c[k] = p[0] * q[1] - p[1] * q[0];
+      }
+      // edge k is opposite to vertex (k + 2) % 3
+      float za = (a[1] * v0[2] + a[2] * v1[2] + a[0] * v2[2]) / area;
+      float zb = (b[1] * v0[2] + b[2] * v1[2] + b[0] * v2[2]) / area;
+      float zc = (c[1] * v0[2] + c[2] * v1[2] + c[0] * v2[2]) / area;
+
+      // evaluated at the corner (x, y) of a pixel, the functions give their lowest value in the pixel
+      for (int k = 0; k != 3; ++k) {
+        c[k] += min(a[k], 0.0f) + min(b[k], 0.0f);
+      }
+      zc += min(za, 0.0f) + min(zb, 0.0f);
+
+      for (int y = minY; y <= maxY; ++y) {
+        float py = (float)y;
+        float *row = &depth[y * WIDTH];
+        int x = minX;
+      #ifdef OCTET_SSE
+        __m128 step = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        __m128 zero = _mm_setzero_ps();
+        for (x = minX & ~3; x <= maxX; x += 4) {
+          __m128 px = _mm_add_ps(_mm_set1_ps((float)x), step);
+          __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), px), _mm_set1_ps(b[0] * py + c[0]));
+          __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), px), _mm_set1_ps(b[1] * py + c[1]));
+          __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), px), _mm_set1_ps(b[2] * py + c[2]));
+          __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+          __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(za), px), _mm_set1_ps(zb * py + zc));
+          __m128 old = _mm_loadu_ps(row + x);
+          __m128 nearest = _mm_max_ps(old, z);
+          _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+        }
+      #endif
+        for (; x <= maxX; ++x) {
+          float px = (float)x;
+          if (a[0] * px + b[0] * py + c[0] >= 0.0f && a[1] * px + b[1] * py + c[1] >= 0.0f && a[2] * px + b[2] * py + c[2] >= 0.0f) {
+            row[x] = max(row[x], za * px + zb * py + zc);
+          }
+        }
+      }
+    }
+
+  public:
+    OcclusionBuffer() {
+      occluders = 0;
+      triangles = 0;
+    }
+
+    // Empty the buffer for a new view, model to world is the identity
+    void begin(const mat4t &worldToProjection_) {
+      worldToProjection = worldToProjection_;
+      depth.resize(WIDTH * HEIGHT);
+      memset(&depth[0], 0, WIDTH * HEIGHT * sizeof(float));
+      occluders = 0;
+      triangles = 0;
+    }
+
+    // Triangle in world space, cut by the near plane
+    void addTriangle(const vec4 &p0, const vec4 &p1, const vec4 &p2) {
+      vec4 clip[3] = { p0 * worldToProjection, p1 * worldToProjection, p2 * worldToProjection };
+
+      // at most one more vertex after cutting a corner of the triangle
+      vec4 kept[4];
+      int numKept = 0;
+      for (int k = 0; k != 3; ++k) {
+        const vec4 &p = clip[k], &q = clip[(k + 1) % 3];
+        bool pIn = p.w() >= NEAR_W, qIn = q.w() >= NEAR_W;
+        if (pIn) kept[numKept++] = p;
+        if (pIn != qIn) {
+          float t = (NEAR_W - p.w()) / (q.w() - p.w());
+          kept[numKept++] = p + (q - p) * t;
+        }
+      }
+      if (numKept < 3) return;
+
+      float screen[4][3];
+      for (int k = 0; k != numKept; ++k) {
+        toScreen(kept[k], screen[k]);
+      }
+      for (int k = 2; k < numKept; ++k) {
+        rasterizeScreen(screen[0], screen[k - 1], screen[k]);
+      }
+    }
+
+    // Walls and top of a building, the quad from points extruded from bottom to top
+    void addPrism(const vec4 *points, float bottom, float top) {
+      vec4 low[4], high[4];
+      for (int k = 0; k != 4; ++k) {
+        low[k] = vec4(points[k].x(), bottom, points[k].z(), 1.0f);
+        high[k] = vec4(points[k].x(), top, points[k].z(), 1.0f);
+      }
+      for (int k = 0; k != 4; ++k) {
+        int n = (k + 1) % 4;
+        addTriangle(low[k], low[n], high[n]);
+        addTriangle(low[k], high[n], high[k]);
+      }
+      addTriangle(high[0], high[1], high[2]);
+      addTriangle(high[0], high[2], high[3]);
+      occluders++;
+    }
+
+    // True if every pixel the box may cover has an occluder nearer than the nearest point of the box
+    bool isOccluded(const aabb &box) const {
+      if (!depth.size()) return false;
+
+      vec3 c = box.get_center();
+      vec3 h = box.get_half_extent();
+      float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 0.0f;
+      for (int k = 0; k != 8; ++k) {
+        vec4 corner(c.x() + (k & 1 ? h.x() : -h.x()), c.y() + (k & 2 ? h.y() : -h.y()), c.z() + (k & 4 ? h.z() : -h.z()), 1.0f);
+        vec4 clip = corner * worldToProjection;
+        if (clip.w() < NEAR_W) return false;
+        float screen[3];
+        toScreen(clip, screen);
+        minX = min(minX, screen[0]);
+        maxX = max(maxX, screen[0]);
+        minY = min(minY, screen[1]);
+        maxY = max(maxY, screen[1]);
+        nearest = max(nearest, screen[2]);
+      }
+
+      // the frustum decides about boxes out of the screen
+      int x0 = max(0, (int)floorf(minX)), x1 = min(WIDTH - 1, (int)floorf(maxX));
+      int y0 = max(0, (int)floorf(minY)), y1 = min(HEIGHT - 1, (int)floorf(maxY));
+      if (x0 > x1 || y0 > y1) return false;
+
+      for (int y = y0; y <= y1; ++y) {
+        const float *row = &depth[y * WIDTH];
+        int x = x0;
+      #ifdef OCTET_SSE
+        __m128 vnearest = _mm_set1_ps(nearest);
+        for (; x + 4 <= x1 + 1; x += 4) {
+          if (_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + x), vnearest))) return false;
+        }
+      #endif
+        for (; x <= x1; ++x) {
+          if (row[x] < nearest) return false;
+        }
+      }
+      return true;
+    }
+
+    int getOccluders() const {
+      return occluders;
+    }
+
+    int getTriangles() const {
+      return triangles;
+    }
+  };
+
+  const float OcclusionBuffer::NEAR_W = 0.1f;
+}
@@ -0,0 +1,567 @@
+namespace octet {
+
+  // Draws the street furniture grouped by prototype.
+  // Every prototype mesh is drawn with one instanced call, or with one call
+  // every max_batch instances when the driver has no instancing (GLES2),
+  // fewer for the meshes too big to copy max_batch times with 16 bit indices.
+  // GLES2 has no 32 bit indices, so a mesh with more vertices than 16 bit indices reach is drawn in chunks.
+  // Only the instances in a bounding volume hierarchy node in view are drawn.
+  // Every instance picks a level of detail from its distance to the camera in radii
+  // of its box, the prototype meshes near, simplified copies further and, for the
+  // models with an impostor texture, two textured quads far away. Levels change a bit
+  // past the switch distance so that the instances near one do not flicker.
+  // The renderer is the pass of its own packets in the render queue, one per level of every batch.
+  // Instances are added in groups, one for every owner such as a tile of a CityWorld, each with its own
+  // hierarchy, so that adding or removing the props of an owner does not touch the others.
+  class PropRenderer : public render_pass {
+  public:
+    enum { NUM_LEVELS = ModelBuilder::NUM_LODS + 1, IMPOSTOR_LEVEL = ModelBuilder::NUM_LODS };
+
+  private:
+    enum { LEAF_INSTANCES = 8 };
+
+    struct PropBatch {
+      ModelBuilder* prototype;
+      material* mat;
+      image* impostorTexture;
+      // instances in every group
+      int numInstances;
+
+      // box of the prototype meshes in model space
+      aabb bounds;
+
+      // meshes of every level in use, the last level is numLevels - 1, 0 until the first upload
+      std::vector<mesh*>* levels[NUM_LEVELS];
+      int numLevels;
+
+      // instances in view this frame and distance to the nearest, per level
+      dynarray<mat4t> visible[NUM_LEVELS];
+      float nearest[NUM_LEVELS];
+
+      // model to world matrices, room for bufferInstances. Every frame the visible instances
+      // of every level are uploaded one level after the other, starting at levelOffsets
+      ref<gl_resource> instanceBuffer;
+      int bufferInstances;
+      unsigned levelOffsets[NUM_LEVELS];
+
+      // GLES2 only: chunks of the meshes of every level replicated up to max_batch times,
+      // the copy number of every vertex and the number of copies in every chunk
+      std::vector<mesh*> batchMeshes[NUM_LEVELS];
+      std::vector<gl_resource*> batchCopies[NUM_LEVELS];
+      std::vector<unsigned> batchSizes[NUM_LEVELS];
+    };
+
+    dynarray<PropBatch*> batches;
+
+    // batch of an instance and its centre and radius in the world
+    struct PropRef {
+      int batch;
+      vec3 center;
+      float radius;
+    };
+
+    // the instances of an owner
+    struct PropGroup {
+      const void* owner;
+      dynarray<mat4t> instances;
+      dynarray<PropRef> props;
+      // level of every instance, kept between frames
+      dynarray<uint8_t> instanceLevels;
+      CityBVH bvh;
+    };
+    dynarray<PropGroup*> groups;
+    // instances added since the last upload
+    PropGroup* pending;
+    dynarray<CityBVH::Range> visibleRanges;
+
+    city_props_bump_shader propShader;
+
+    // camera and lights of the frame
+    mat4t worldToProjection;
+    mat4t worldToCamera;
+    const vec4 *lightUniforms;
+    int numLightUniforms;
+    int numLights;
+
+    // counters for the last rendered frame
+    int drawCalls;
+    int instancesDrawn;
+    int levelInstances[NUM_LEVELS];
+    int levelTriangles[NUM_LEVELS];
+    int nodesTested;
+    int instancesCulled;
+    int nodesOccluded;
+
+    int getBatch(ModelBuilder* prototype, material* mat, image* impostorTexture) {
+      for (int i = 0; i != batches.size(); ++i) {
+        if (batches[i]->prototype == prototype && batches[i]->mat == mat) {
+          return i;
+        }
+      }
+      PropBatch* batch = new PropBatch();
+      batch->prototype = prototype;
+      batch->mat = mat;
+      batch->impostorTexture = impostorTexture;
+      batch->numInstances = 0;
+      batch->numLevels = 0;
+      batch->bufferInstances = 0;
+      batches.push_back(batch);
+      return batches.size() - 1;
+    }
+
+    // Bounds and levels of a batch and, without instancing, its batch meshes.
+    // instance is any instance, it orients the impostor.
+    void initBatch(PropBatch* batch, const mat4t& instance) {
+      batch->bounds = getBounds(batch->prototype->getMeshes());
+      for (int level = 0; level != ModelBuilder::NUM_LODS; ++level) {
+        batch->levels[level] = &batch->prototype->getLodMeshes(level);
+      }
+      batch->numLevels = ModelBuilder::NUM_LODS;
+      std::vector<mesh*>& impostor = batch->prototype->getImpostorMeshes(batch->impostorTexture, instance);
+      if (batch->impostorTexture && impostor.size()) {
+        batch->levels[IMPOSTOR_LEVEL] = &impostor;
+        batch->numLevels = IMPOSTOR_LEVEL + 1;
+      }
+
+      if (!propShader.is_instanced()) {
+        for (int level = 0; level != batch->numLevels; ++level) {
+          std::vector<mesh*>& meshes = *batch->levels[level];
+          for (int j = 0; j != meshes.size(); ++j) {
+            buildBatchMesh(batch, level, meshes[j]);
+          }
+        }
+      }
+    }
+
+    // Distance to the camera, in radii of the instance, where level becomes level + 1
+    static float getSwitchDistance(int level) {
+      static const float distances[NUM_LEVELS - 1] = { 8.0f, 20.0f, 50.0f };
+      return distances[level];
+    }
+
+    // Level for an instance at distance radii from the camera that was at level before,
+    // it only moves once past the switch distance by the hysteresis.
+    static int selectLevel(int level, float radii, int numLevels) {
+      static const float hysteresis = 0.1f;
+      while (level + 1 < numLevels && radii > getSwitchDistance(level) * (1.0f + hysteresis)) {
+        level++;
+      }
+      while (level > 0 && radii < getSwitchDistance(level - 1) * (1.0f - hysteresis)) {
+        level--;
+      }
+      return level;
+    }
+
+    static aabb getBounds(std::vector<mesh*>& meshes) {
+      vec3 lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f);
+      for (int i = 0; i != meshes.size(); ++i) {
+        mesh* m = meshes[i];
+        unsigned stride = m->get_stride();
+        unsigned offset = m->get_offset(m->get_slot(attribute_pos));
+        gl_resource::rolock src(m->get_vertices());
+        for (unsigned v = 0; v != m->get_num_vertices(); ++v) {
+          const float* pos = (const float*)(src.u8() + v * stride + offset);
+          vec3 p(pos[0], pos[1], pos[2]);
+          lo = lo.min(p);
+          hi = hi.max(p);
+        }
+      }
+      if (lo.x() > hi.x()) return aabb(vec3(0, 0, 0), vec3(0, 0, 0));
+      return aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+    }
+
+    // Copy the vertices of a chunk of the source mesh, chunkVertices, and its triangles, chunkIndices into them,
+    // as many times as fit in 16 bit indices and at most max_batch, in a single buffer so that a batch can be
+    // drawn in one call.
+    void buildBatchChunk(PropBatch* batch, int level, mesh* source, const dynarray<uint32_t> &chunkVertices, const dynarray<uint32_t> &chunkIndices) {
+      unsigned stride = source->get_stride();
+      unsigned nv = chunkVertices.size();
+      unsigned ni = chunkIndices.size();
+      unsigned copies = 0x10000 / nv;
+      if (copies > city_props_bump_shader::max_batch) copies = city_props_bump_shader::max_batch;
+
+      gl_resource* vertices = new gl_resource(GL_ARRAY_BUFFER, stride * nv * copies);
+      gl_resource* indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * ni * copies);
+      gl_resource* copyNumbers = new gl_resource(GL_ARRAY_BUFFER, sizeof(float) * nv * copies);
+
+      {
+        gl_resource::rolock src(source->get_vertices());
+        gl_resource::rwlock dstVertices(vertices);
+        gl_resource::rwlock dstIndices(indices);
+        gl_resource::rwlock dstCopies(copyNumbers);
+
+        for (unsigned c = 0; c != copies; ++c) {
+          for (unsigned i = 0; i != nv; ++i) {
+            memcpy(dstVertices.u8() + (c * nv + i) * stride, src.u8() + chunkVertices[i] * stride, stride);
+            dstCopies.f32()[c * nv + i] = (float)c;
+          }
+          for (unsigned i = 0; i != ni; ++i) {
+            dstIndices.u16()[c * ni + i] = (uint16_t)(chunkIndices[i] + c * nv);
+          }
+        }
+      }
+
+      mesh* result = new mesh();
+      result->set_vertices(vertices);
+      result->set_indices(indices);
+      for (unsigned slot = 0; slot != source->get_num_slots(); ++slot) {
+        result->add_attribute(source->get_attr(slot), source->get_size(slot), source->get_kind(slot), source->get_offset(slot));
+      }
+      result->set_params(stride, ni * copies, nv * copies, source->get_mode(), GL_UNSIGNED_SHORT);
+
+      batch->batchMeshes[level].push_back(result);
+      batch->batchCopies[level].push_back(copyNumbers);
+      batch->batchSizes[level].push_back(copies);
+    }
+
+    // Split the source mesh in chunks of whole primitives that use 65536 vertices at most
+    // and add the batch meshes of every chunk. Only lists of triangles, lines or points can be split.
+    void buildBatchMesh(PropBatch* batch, int level, mesh* source) {
+      unsigned nv = source->get_num_vertices();
+      unsigned ni = source->get_num_indices();
+      unsigned mode = source->get_mode();
+      unsigned primitive = mode == GL_TRIANGLES ? 3 : mode == GL_LINES ? 2 : mode == GL_POINTS ? 1 : ni;
+      assert(nv <= 0x10000 || primitive != ni);
+
+      // the chunk vertex of every source vertex, or ~0 when the vertex is not in the chunk
+      dynarray<uint32_t> chunkVertex;
+      chunkVertex.resize(nv);
+      for (unsigned i = 0; i != nv; ++i) {
+        chunkVertex[i] = ~0u;
+      }
+
+      dynarray<uint32_t> chunkVertices;
+      dynarray<uint32_t> chunkIndices;
+      for (unsigned first = 0; first < ni; first += primitive) {
+        unsigned newVertices = 0;
+        for (unsigned i = first; i != first + primitive; ++i) {
+          if (chunkVertex[source->get_index(i)] == ~0u) newVertices++;
+        }
+        if (chunkVertices.size() + newVertices > 0x10000) {
+          buildBatchChunk(batch, level, source, chunkVertices, chunkIndices);
+          for (int i = 0; i != chunkVertices.size(); ++i) {
+            chunkVertex[chunkVertices[i]] = ~0u;
+          }
+          chunkVertices.resize(0);
+          chunkIndices.resize(0);
+        }
+        for (unsigned i = first; i != first + primitive; ++i) {
+          unsigned index = source->get_index(i);
+          if (chunkVertex[index] == ~0u) {
+            chunkVertex[index] = chunkVertices.size();
+            chunkVertices.push_back(index);
+          }
+          chunkIndices.push_back(chunkVertex[index]);
+        }
+      }
+      if (chunkVertices.size()) {
+        buildBatchChunk(batch, level, source, chunkVertices, chunkIndices);
+      }
+    }
+
+    // Upload the visible instances of every level in one go, once a frame
+    void uploadVisible(PropBatch* batch) {
+      uint8_t *dst = (uint8_t*)batch->instanceBuffer->lock();
+      unsigned count = 0;
+      for (int level = 0; level != NUM_LEVELS; ++level) {
+        dynarray<mat4t> &visible = batch->visible[level];
+        batch->levelOffsets[level] = count;
+        if (visible.size()) {
+          memcpy(dst + count * sizeof(mat4t), visible.data(), visible.size() * sizeof(mat4t));
+        }
+        count += visible.size();
+      }
+      if (count) {
+        batch->instanceBuffer->unlock(0, count * sizeof(mat4t));
+      }
+    }
+
+    void renderInstanced(PropBatch* batch, int level, mesh* m) {
+      dynarray<mat4t> &visible = batch->visible[level];
+      m->enable_attributes();
+
+      unsigned offset = batch->levelOffsets[level] * sizeof(mat4t);
+      batch->instanceBuffer->bind();
+      for (unsigned row = 0; row != 4; ++row) {
+        unsigned attr = city_props_bump_shader::attribute_instance0 + row;
+        glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, sizeof(mat4t), (void*)(offset + row * sizeof(vec4)));
+        glEnableVertexAttribArray(attr);
+        glVertexAttribDivisor(attr, 1);
+      }
+
+      m->get_indices()->bind();
+      glDrawElementsInstanced(m->get_mode(), m->get_num_indices(), m->get_index_type(), (GLvoid*)0, visible.size());
+      drawCalls++;
+
+      for (unsigned row = 0; row != 4; ++row) {
+        unsigned attr = city_props_bump_shader::attribute_instance0 + row;
+        glVertexAttribDivisor(attr, 0);
+        glDisableVertexAttribArray(attr);
+      }
+      m->disable_attributes();
+    }
+
+    void renderBatched(PropBatch* batch, int level, int meshIndex) {
+      dynarray<mat4t> &visible = batch->visible[level];
+      mesh* m = batch->batchMeshes[level][meshIndex];
+      int copies = batch->batchSizes[level][meshIndex];
+      unsigned indicesPerCopy = m->get_num_indices() / copies;
+      m->enable_attributes();
+
+      unsigned attr = city_props_bump_shader::attribute_instance_index;
+      batch->batchCopies[level][meshIndex]->bind();
+      glVertexAttribPointer(attr, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+      glEnableVertexAttribArray(attr);
+
+      m->get_indices()->bind();
+      int numInstances = visible.size();
+      for (int first = 0; first < numInstances; first += copies) {
+        int count = numInstances - first;
+        if (count > copies) count = copies;
+        propShader.set_instances(&visible[first], count);
+        glDrawElements(m->get_mode(), count * indicesPerCopy, m->get_index_type(), (GLvoid*)0);
+        drawCalls++;
+      }
+
+      glDisableVertexAttribArray(attr);
+      m->disable_attributes();
+    }
+
+  public:
+    PropRenderer() {
+      pending = NULL;
+      nodesTested = 0;
+      instancesCulled = 0;
+      nodesOccluded = 0;
+      lightUniforms = NULL;
+      numLightUniforms = 0;
+      numLights = 0;
+      drawCalls = 0;
+      instancesDrawn = 0;
+      for (int level = 0; level != NUM_LEVELS; ++level) {
+        levelInstances[level] = 0;
+        levelTriangles[level] = 0;
+      }
+    }
+
+    ~PropRenderer() {
+      clear();
+    }
+
+    // Remove every instance, to add them again
+    void clear() {
+      for (int i = 0; i != groups.size(); ++i) {
+        delete groups[i];
+      }
+      groups.reset();
+      delete pending;
+      pending = NULL;
+      for (int i = 0; i != batches.size(); ++i) {
+        for (int level = 0; level != NUM_LEVELS; ++level) {
+          for (int j = 0; j != batches[i]->batchMeshes[level].size(); ++j) {
+            delete batches[i]->batchMeshes[level][j];
+            delete batches[i]->batchCopies[level][j];
+          }
+        }
+        delete batches[i];
+      }
+      batches.reset();
+    }
+
+    void init() {
+      propShader.init(city_props_bump_shader::has_hardware_instancing());
+      printf("Props rendering with %s.\n", propShader.is_instanced() ? "hardware instancing" : "uniform batches");
+    }
+
+    // impostorTexture, if given, is drawn on the impostor of the prototype for the far away instances
+    void addInstance(ModelBuilder* prototype, material* mat, const mat4t& modelToWorld, image* impostorTexture = NULL) {
+      if (!pending) {
+        pending = new PropGroup();
+      }
+      PropRef prop = { getBatch(prototype, mat, impostorTexture), vec3(0, 0, 0), 0.0f };
+      pending->instances.push_back(modelToWorld);
+      pending->props.push_back(prop);
+    }
+
+    // Upload the instances added since the last upload, they replace the instances of owner
+    void upload(const void* owner = NULL) {
+      removeInstances(owner);
+      PropGroup* group = pending ? pending : new PropGroup();
+      pending = NULL;
+      group->owner = owner;
+
+      dynarray<aabb> boxes;
+      boxes.resize(group->instances.size());
+      group->instanceLevels.resize(group->instances.size());
+      for (int j = 0; j != group->instances.size(); ++j) {
+        PropRef &prop = group->props[j];
+        PropBatch* batch = batches[prop.batch];
+        if (!batch->numLevels) {
+          initBatch(batch, group->instances[j]);
+        }
+        batch->numInstances++;
+
+        boxes[j] = CityBVH::transformBox(batch->bounds, group->instances[j]);
+        prop.center = boxes[j].get_center();
+        prop.radius = max(boxes[j].get_half_extent().length(), 1e-3f);
+        group->instanceLevels[j] = 0;
+      }
+      group->bvh.build(boxes.size() ? &boxes[0] : NULL, boxes.size(), LEAF_INSTANCES);
+      groups.push_back(group);
+
+      // room for twice the instances, so that the buffer is not made again for every group
+      if (propShader.is_instanced()) {
+        for (int i = 0; i != batches.size(); ++i) {
+          PropBatch* batch = batches[i];
+          if (batch->numInstances <= batch->bufferInstances) continue;
+          batch->bufferInstances = batch->numInstances * 2;
+          batch->instanceBuffer = new gl_resource(GL_ARRAY_BUFFER, batch->bufferInstances * sizeof(mat4t));
+        }
+      }
+    }
+
+    // Remove the instances of owner, the other groups stay as they are
+    void removeInstances(const void* owner) {
+      for (int g = 0; g != groups.size(); ++g) {
+        PropGroup* group = groups[g];
+        if (group->owner != owner) continue;
+        for (int j = 0; j != group->props.size(); ++j) {
+          batches[group->props[j].batch]->numInstances--;
+        }
+        delete group;
+        groups[g] = groups.back();
+        groups.pop_back();
+        return;
+      }
+    }
+
+    // Cull and pick the levels of the props, then add every level of every batch with instances in view to queue.
+    // occlusion, if given, hides the props behind its occluders.
+    // light_uniforms must last until the queue is executed.
+    void submit(render_queue &queue, const mat4t &worldToProjection_, const mat4t &worldToCamera_, const vec4 *lightUniforms_, int numLightUniforms_, int numLights_,
+                const OcclusionBuffer *occlusion = NULL) {
+      worldToProjection = worldToProjection_;
+      worldToCamera = worldToCamera_;
+      lightUniforms = lightUniforms_;
+      numLightUniforms = numLightUniforms_;
+      numLights = numLights_;
+
+      drawCalls = 0;
+      instancesDrawn = 0;
+      for (int level = 0; level != NUM_LEVELS; ++level) {
+        levelInstances[level] = 0;
+        levelTriangles[level] = 0;
+      }
+
+      mat4t cameraToWorld;
+      worldToCamera.invertQuick(cameraToWorld);
+      vec3 eye = cameraToWorld.row(3).xyz();
+
+      Frustum frustum;
+      frustum.init(worldToProjection);
+      for (int i = 0; i != batches.size(); ++i) {
+        for (int level = 0; level != NUM_LEVELS; ++level) {
+          batches[i]->visible[level].resize(0);
+          batches[i]->nearest[level] = 1e30f;
+        }
+      }
+
+      // only the instances in view change level, the others keep theirs until they are seen again
+      nodesTested = 0;
+      instancesCulled = 0;
+      nodesOccluded = 0;
+      for (int g = 0; g != groups.size(); ++g) {
+        PropGroup* group = groups[g];
+        group->bvh.cull(frustum, visibleRanges, occlusion);
+        nodesTested += group->bvh.getNodesTested();
+        instancesCulled += group->bvh.getObjectsCulled();
+        nodesOccluded += group->bvh.getNodesOccluded();
+
+        const dynarray<int> &order = group->bvh.getOrder();
+        for (int r = 0; r != visibleRanges.size(); ++r) {
+          for (int k = visibleRanges[r].first; k != visibleRanges[r].first + visibleRanges[r].count; ++k) {
+            PropRef &prop = group->props[order[k]];
+            PropBatch* batch = batches[prop.batch];
+            float distance = (prop.center - eye).length();
+            uint8_t &level = group->instanceLevels[order[k]];
+            level = (uint8_t)selectLevel(level, distance / prop.radius, batch->numLevels);
+            batch->visible[level].push_back(group->instances[order[k]]);
+            batch->nearest[level] = min(batch->nearest[level], distance);
+          }
+        }
+      }
+
+      for (int i = 0; i != batches.size(); ++i) {
+        PropBatch* batch = batches[i];
+        if (!batch->numInstances) continue;
+        if (propShader.is_instanced()) {
+          uploadVisible(batch);
+        }
+        for (int level = 0; level != batch->numLevels; ++level) {
+          if (!batch->visible[level].size()) continue;
+          material* mat = level == IMPOSTOR_LEVEL ? batch->prototype->getImpostorMaterial() : batch->mat;
+          queue.submit(this, mat, batch, mat4t(1.0f), batch->nearest[level], level);
+        }
+      }
+    }
+
+    void bind_shader() {
+      propShader.render(worldToProjection, worldToCamera, lightUniforms, numLightUniforms, numLights);
+    }
+
+    void bind_material(material *mat) {
+      mat->render_textures();
+    }
+
+    // the object of the packet is a batch and the tag its level
+    void draw(const render_packet &packet) {
+      PropBatch* batch = (PropBatch*)packet.object;
+      int level = packet.tag;
+      dynarray<mat4t> &visible = batch->visible[level];
+
+      std::vector<mesh*>& meshes = *batch->levels[level];
+      for (int j = 0; j != meshes.size(); ++j) {
+        if (propShader.is_instanced()) {
+          renderInstanced(batch, level, meshes[j]);
+        }
+        levelTriangles[level] += meshes[j]->get_num_indices() / 3 * visible.size();
+      }
+      if (!propShader.is_instanced()) {
+        for (int j = 0; j != batch->batchMeshes[level].size(); ++j) {
+          renderBatched(batch, level, j);
+        }
+      }
+      levelInstances[level] += visible.size();
+      instancesDrawn += visible.size();
+    }
+
+    int getDrawCalls() const {
+      return drawCalls;
+    }
+
+    int getInstancesDrawn() const {
+      return instancesDrawn;
+    }
+
+    // instances and triangles drawn at a level of detail in the last frame
+    int getLevelInstances(int level) const {
+      return levelInstances[level];
+    }
+
+    int getLevelTriangles(int level) const {
+      return levelTriangles[level];
+    }
+
+    int getNodesTested() const {
+      return nodesTested;
+    }
+
+    int getInstancesCulled() const {
+      return instancesCulled;
+    }
+
+    int getNodesOccluded() const {
+      return nodesOccluded;
+    }
+  };
+}
@@ -0,0 +1,93 @@
+namespace octet {
+
+  // Random numbers for the city generation.
+  // Values are a hash of (seed, stream, key, counter) instead of a global sequence,
+  // so every subsystem and every element (BSP node, street, building) has its own
+  // stream. Regenerating one part of the city, or generating parts in any order or
+  // in parallel, gives the same result for the same seed.
+  class CityRandom {
+    uint64_t seed;
+
+  public:
+    enum Stream {
+      STREAM_PARTITION = 1,   // keyed by BSP node id
+      STREAM_DEBUG_COLORS,    // keyed by partition level
+      STREAM_PROPS,           // keyed by street id
+      STREAM_BUILDINGS,       // keyed by building area id, or by block and area for the incremental partition
+      STREAM_CAMERA,
+      STREAM_LOTS,            // tag of the root of the lots of a block, combined with the block id
+    };
+
+    // splitmix64 finalizer, a good 64 bit mixing function
+    static uint64_t mix(uint64_t x) {
+      x += 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return x ^ (x >> 31);
+    }
+
+    // order dependent combination of two keys
+    static uint64_t combine(uint64_t a, uint64_t b) {
+      return mix(a ^ mix(b));
+    }
+
+    // Sequence of values for one key, the n-th value only depends on the key and n
+    class Generator {
+      uint64_t key;
+      uint64_t counter;
+
+    public:
+      Generator(uint64_t key_ = 0) : key(key_), counter(0) {
+      }
+
+      uint64_t next() {
+        return combine(key, counter++);
+      }
+
+      // float in [0, 1)
+      float getFloat() {
+        return (float)(next() >> 40) * (1.0f / 16777216.0f);
+      }
+
+      // int in [min, max), min if the range is empty
+      int getInt(int min, int max) {
+        if (max <= min) return min;
+        return min + (int)(((next() >> 32) * (uint64_t)(max - min)) >> 32);
+      }
+    };
+
+    CityRandom(uint64_t seed_ = 0) : seed(seed_) {
+    }
+
+    uint64_t getSeed() const {
+      return seed;
+    }
+
+    Generator getGenerator(Stream stream, uint64_t key) const {
+      return Generator(combine(combine(seed, stream), key));
+    }
+
+    // The values of a seed must never change, or the seeds and snapshots saved so far make other cities.
+    // Compares a few streams with the values they had when they were written, returns false if one differs.
+    static bool checkStreams() {
+      static const uint64_t partition[] = { 0x88b974d152f5c0ddULL, 0xd556cfa1fb5a2d98ULL, 0x5d81f0af40941981ULL };
+      bool ok = mix(0) == 0xe220a8397b1dcdafULL && combine(1, 2) == 0xe06dd043328bd285ULL;
+
+      CityRandom random(12345);
+      Generator rnd = random.getGenerator(STREAM_PARTITION, 7);
+      for (int i = 0; i != 3; ++i) {
+        ok = ok && rnd.next() == partition[i];
+      }
+      ok = ok && random.getGenerator(STREAM_BUILDINGS, 7).next() == 0xbe44b81ae6b93cb1ULL;
+
+      Generator props = random.getGenerator(STREAM_PROPS, 3);
+      ok = ok && props.getFloat() == 0.530702055f && props.getInt(10, 20) == 18 && props.getInt(5, 5) == 5;
+
+      // a value only depends on its key and position, not on the generators used before
+      ok = ok && random.getGenerator(STREAM_PARTITION, 7).next() == partition[0];
+
+      printf("Random streams check: %s\n", ok ? "ok." : "ERROR: the values of a seed changed.");
+      return ok;
+    }
+  };
+}
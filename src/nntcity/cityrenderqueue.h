@@ -0,0 +1,135 @@
+namespace octet {
+
+  // Ground, roads and water: bump shader meshes and terrain, all in world space
+  class CityGroundPass : public render_pass {
+    bump_shader *shader;
+    mat4t worldToProjection;
+    mat4t worldToCamera;
+    const vec4 *lightUniforms;
+    int numLightUniforms;
+    int numLights;
+
+  public:
+    // what the object of a packet is
+    enum { OBJECT_MESH, OBJECT_TERRAIN };
+
+    CityGroundPass() {
+      shader = NULL;
+      lightUniforms = NULL;
+      numLightUniforms = 0;
+      numLights = 0;
+    }
+
+    void init(bump_shader *shader_, const mat4t &worldToProjection_, const mat4t &worldToCamera_, const vec4 *lightUniforms_, int numLightUniforms_, int numLights_) {
+      shader = shader_;
+      worldToProjection = worldToProjection_;
+      worldToCamera = worldToCamera_;
+      lightUniforms = lightUniforms_;
+      numLightUniforms = numLightUniforms_;
+      numLights = numLights_;
+    }
+
+    void bind_shader() {
+      shader->render(worldToProjection, worldToCamera, lightUniforms, numLightUniforms, numLights);
+    }
+
+    void bind_material(material *mat) {
+      mat->render_textures();
+    }
+
+    void draw(const render_packet &packet) {
+      if (packet.tag == OBJECT_TERRAIN) {
+        ((ChunkedTerrain*)packet.object)->render();
+      } else {
+        ((mesh*)packet.object)->render();
+      }
+    }
+  };
+
+  // Parts of the merged buildings, the object of a packet is a BuildingBatcher and the tag the part
+  class CityBuildingPass : public render_pass {
+    city_buildings_bump_shader *shader;
+    mat4t worldToProjection;
+    mat4t worldToCamera;
+    const vec4 *lightUniforms;
+    int numLightUniforms;
+    int numLights;
+    int textureMode;
+
+  public:
+    CityBuildingPass() {
+      shader = NULL;
+      lightUniforms = NULL;
+      numLightUniforms = 0;
+      numLights = 0;
+      textureMode = 0;
+    }
+
+    void init(city_buildings_bump_shader *shader_, const mat4t &worldToProjection_, const mat4t &worldToCamera_, const vec4 *lightUniforms_, int numLightUniforms_, int numLights_,
+              int textureMode_) {
+      shader = shader_;
+      worldToProjection = worldToProjection_;
+      worldToCamera = worldToCamera_;
+      lightUniforms = lightUniforms_;
+      numLightUniforms = numLightUniforms_;
+      numLights = numLights_;
+      textureMode = textureMode_;
+    }
+
+    void bind_shader() {
+      shader->render(worldToProjection, worldToCamera, lightUniforms, numLightUniforms, numLights, textureMode);
+    }
+
+    void bind_material(material *mat) {
+      mat->render_textures_building();
+    }
+
+    void draw(const render_packet &packet) {
+      ((BuildingBatcher*)packet.object)->render((BuildingBatcher::Part)packet.tag);
+    }
+  };
+
+  // One frame of the city: the tiles and the props submit their geometry during the frame,
+  // and it is all drawn at the end sorted by shader and material.
+  class CityRenderQueue {
+    render_queue queue;
+    CityGroundPass groundPass;
+    CityBuildingPass buildingPass;
+
+  public:
+    // Shaders, camera and lights of the frame, light_uniforms must last until execute
+    void begin(bump_shader &shader, city_buildings_bump_shader &buildingShader, const mat4t &worldToProjection, const mat4t &worldToCamera,
+               const vec4 *lightUniforms, int numLightUniforms, int numLights, int textureMode) {
+      queue.begin();
+      groundPass.init(&shader, worldToProjection, worldToCamera, lightUniforms, numLightUniforms, numLights);
+      buildingPass.init(&buildingShader, worldToProjection, worldToCamera, lightUniforms, numLightUniforms, numLights, textureMode);
+    }
+
+    // depth is the distance from the camera to the tile the geometry belongs to
+    void addMesh(material *mat, mesh *m, float depth, bool transparent = false) {
+      queue.submit(&groundPass, mat, m, mat4t(1.0f), depth, CityGroundPass::OBJECT_MESH, transparent);
+    }
+
+    void addTerrain(material *mat, ChunkedTerrain *terrain, float depth) {
+      queue.submit(&groundPass, mat, terrain, mat4t(1.0f), depth, CityGroundPass::OBJECT_TERRAIN);
+    }
+
+    void addBuildings(material *mat, BuildingBatcher *buildings, BuildingBatcher::Part part, float depth) {
+      queue.submit(&buildingPass, mat, buildings, mat4t(1.0f), depth, part);
+    }
+
+    // for the systems with passes of their own
+    render_queue &getQueue() {
+      return queue;
+    }
+
+    void execute() {
+      queue.execute();
+    }
+
+    void printStats() {
+      printf("Render queue: %d packets, %d shader and %d material changes (%d in submission order).\n",
+             queue.get_num_packets(), queue.get_shader_changes(), queue.get_material_changes(), queue.get_unsorted_changes());
+    }
+  };
+}
@@ -0,0 +1,587 @@
+#ifndef WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace octet {
+
+  // Binary snapshot of a generated city, to skip the generation on the next launch.
+  //
+  // The file is a header followed by flat arrays (sections) of fixed size records
+  // and the raw vertex and index buffers of the meshes, every one aligned to 16 bytes.
+  // Loading maps the file in memory and reads the arrays in place: there is no parsing
+  // and no pointer in the file, buffers are handed to gl_resource as they are.
+  // Records are stored in the memory layout of this build, the version and the
+  // record sizes in the header reject files written by a different layout.
+  // Every id and range in the file is checked when it is opened, a damaged file is
+  // rejected and the city is generated instead.
+  class CitySnapshot {
+  public:
+    enum {
+      VERSION = 4,
+      ALIGNMENT = 16,
+      MAX_SLOTS = 8,
+    };
+
+    enum Section {
+      SECTION_STREETS,          // StreetRecord, in street id order
+      SECTION_GRAPH_NODES,      // StreetGraph::Node
+      SECTION_GRAPH_EDGES,      // StreetGraph::Edge
+      SECTION_GRAPH_NODE_EDGES, // int
+      SECTION_MESHES,           // MeshRecord, data offsets point anywhere in the file
+      SECTION_BUILDINGS,        // BuildingRecord
+      SECTION_PROPS,            // PropRecord
+      NUM_SECTIONS,
+    };
+
+    // fixed mesh ids, the building meshes are in BuildingBatcher::Part order
+    enum MeshId {
+      MESH_ROAD_LEFT,
+      MESH_ROAD_RIGHT,
+      MESH_PAVEMENT,
+      MESH_FIRST_BUILDING_PART,
+    };
+
+    struct SectionRange {
+      uint32_t offset;
+      uint32_t count;
+      uint32_t stride;
+      uint32_t pad;
+    };
+
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t depth;
+      uint64_t seed;
+      // inputs of the generation besides the seed, see hashHeightMap and hashVertices
+      uint64_t heightmapHash;
+      uint64_t verticesHash;
+      SectionRange sections[NUM_SECTIONS];
+    };
+
+    struct StreetRecord {
+      vec4 points[2];
+    };
+
+    struct MeshRecord {
+      uint32_t vertexOffset;
+      uint32_t vertexBytes;
+      uint32_t indexOffset;
+      uint32_t indexBytes;
+      uint32_t numVertices;
+      uint32_t numIndices;
+      uint16_t stride;
+      uint16_t mode;
+      uint16_t indexType;
+      uint16_t numSlots;
+      // attr | size << 8 | (kind - GL_BYTE) << 16 | offset << 24
+      uint32_t slots[MAX_SLOTS];
+      uint32_t numChunks;
+      mesh::index_chunk chunks[mesh::max_chunks];
+    };
+
+    struct BuildingRecord {
+      vec4 points[4];
+      float height;
+      float area;
+      uint32_t pad[2];
+    };
+
+    struct PropRecord {
+      mat4t modelToWorld;
+      uint32_t prototype; // City::getPropPrototype index
+      char material[28];
+    };
+
+  private:
+    const uint8_t *data;
+    unsigned size;
+
+  #ifdef WIN32
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+  #endif
+
+    // Writes aligned blocks and remembers where they went
+    class Writer {
+      FILE *file;
+      unsigned pos;
+
+    public:
+      Writer(FILE *file_) : file(file_), pos(0) {
+      }
+
+      unsigned write(const void *src, unsigned bytes) {
+        static const uint8_t zeros[ALIGNMENT] = { 0 };
+        unsigned pad = (ALIGNMENT - (pos & (ALIGNMENT-1))) & (ALIGNMENT-1);
+        fwrite(zeros, 1, pad, file);
+        pos += pad;
+
+        unsigned offset = pos;
+        fwrite(src, 1, bytes, file);
+        pos += bytes;
+        return offset;
+      }
+
+      template <class T> void writeSection(Header &header, Section section, const T *records, unsigned count) {
+        header.sections[section].offset = write(records, count * sizeof(T));
+        header.sections[section].count = count;
+        header.sections[section].stride = sizeof(T);
+      }
+    };
+
+    static void writeMesh(Writer &writer, mesh &m, dynarray<MeshRecord> &meshes) {
+      MeshRecord record;
+      memset(&record, 0, sizeof(record));
+
+      gl_resource::rolock vertices(m.get_vertices());
+      gl_resource::rolock indices(m.get_indices());
+      record.vertexBytes = m.get_vertices()->get_size();
+      record.vertexOffset = writer.write(vertices.u8(), record.vertexBytes);
+      record.indexBytes = m.get_indices()->get_size();
+      record.indexOffset = writer.write(indices.u8(), record.indexBytes);
+
+      record.numVertices = m.get_num_vertices();
+      record.numIndices = m.get_num_indices();
+      record.stride = m.get_stride();
+      record.mode = m.get_mode();
+      record.indexType = m.get_index_type();
+      record.numSlots = m.get_num_slots() < MAX_SLOTS ? m.get_num_slots() : MAX_SLOTS;
+      for (unsigned slot = 0; slot != record.numSlots; ++slot) {
+        record.slots[slot] = m.get_attr(slot) | (m.get_size(slot) << 8) | ((m.get_kind(slot) - GL_BYTE) << 16) | (m.get_offset(slot) << 24);
+      }
+      record.numChunks = m.get_num_chunks();
+      memcpy(record.chunks, m.get_chunks(), record.numChunks * sizeof(mesh::index_chunk));
+      meshes.push_back(record);
+    }
+
+    // true if [offset, offset + bytes) is inside the file
+    bool isInFile(uint32_t offset, uint32_t bytes) const {
+      return (uint64_t)offset + bytes <= size;
+    }
+
+    static uint64_t hashBytes(uint64_t hash, const void *src, unsigned bytes) {
+      const uint8_t *src8 = (const uint8_t*)src;
+      uint64_t word;
+      for (; bytes >= sizeof(word); bytes -= sizeof(word), src8 += sizeof(word)) {
+        memcpy(&word, src8, sizeof(word));
+        hash = CityRandom::combine(hash, word);
+      }
+      word = 0;
+      memcpy(&word, src8, bytes);
+      return CityRandom::combine(hash, word);
+    }
+
+    template <class T> const T *getSection(Section section, unsigned &count) const {
+      const SectionRange &range = ((const Header*)data)->sections[section];
+      count = range.count;
+      return (const T*)(data + range.offset);
+    }
+
+  public:
+    CitySnapshot() {
+      data = NULL;
+      size = 0;
+    #ifdef WIN32
+      fileHandle = INVALID_HANDLE_VALUE;
+      mappingHandle = NULL;
+    #endif
+    }
+
+    ~CitySnapshot() {
+      close();
+    }
+
+    // Map a snapshot file, returns false if it is missing or was written by another version
+    bool open(const char *path) {
+      close();
+
+    #ifdef WIN32
+      fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if (fileHandle == INVALID_HANDLE_VALUE) return false;
+      size = GetFileSize(fileHandle, NULL);
+      mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mappingHandle) {
+        data = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+      }
+    #else
+      int fd = ::open(path, O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = (unsigned)st.st_size;
+        void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        data = ptr == MAP_FAILED ? NULL : (const uint8_t*)ptr;
+      }
+      ::close(fd);
+    #endif
+
+      if (!data || !isValid()) {
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void close() {
+    #ifdef WIN32
+      if (data) UnmapViewOfFile(data);
+      if (mappingHandle) CloseHandle(mappingHandle);
+      if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+      fileHandle = INVALID_HANDLE_VALUE;
+      mappingHandle = NULL;
+    #else
+      if (data) munmap((void*)data, size);
+    #endif
+      data = NULL;
+      size = 0;
+    }
+
+    bool isValid() const {
+      if (size < sizeof(Header)) return false;
+
+      const Header &header = *(const Header*)data;
+      if (memcmp(header.magic, "NNTCITY", 8) || header.version != VERSION) return false;
+
+      static const uint32_t strides[NUM_SECTIONS] = {
+        sizeof(StreetRecord), sizeof(StreetGraph::Node), sizeof(StreetGraph::Edge), sizeof(int),
+        sizeof(MeshRecord), sizeof(BuildingRecord), sizeof(PropRecord)
+      };
+      for (int i = 0; i != NUM_SECTIONS; ++i) {
+        const SectionRange &range = header.sections[i];
+        if (range.stride != strides[i] || range.offset % ALIGNMENT || range.offset > size || range.count > (size - range.offset) / strides[i]) return false;
+      }
+
+      // the buffers of every mesh must be in the file and hold its vertices and indices, or none is used
+      unsigned numMeshes;
+      const MeshRecord *meshes = getSection<MeshRecord>(SECTION_MESHES, numMeshes);
+      if (numMeshes < MESH_FIRST_BUILDING_PART + BuildingBatcher::NUM_PARTS) return false;
+      for (unsigned i = 0; i != numMeshes; ++i) {
+        const MeshRecord &record = meshes[i];
+        if (!isInFile(record.vertexOffset, record.vertexBytes) || !isInFile(record.indexOffset, record.indexBytes) || record.numSlots > MAX_SLOTS) return false;
+        if (record.indexType != GL_UNSIGNED_SHORT && record.indexType != GL_UNSIGNED_INT) return false;
+        uint64_t indexSize = record.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+        if ((uint64_t)record.numIndices * indexSize > record.indexBytes || (uint64_t)record.numVertices * record.stride > record.vertexBytes) return false;
+
+        // chunks of 16 bit indices start at index 0 and go forward inside the buffers
+        if (record.numChunks > mesh::max_chunks || (record.numChunks && (record.indexType != GL_UNSIGNED_SHORT || record.chunks[0].first_index != 0))) return false;
+        for (unsigned c = 0; c != record.numChunks; ++c) {
+          if (record.chunks[c].first_index > record.numIndices || record.chunks[c].first_vertex >= record.numVertices) return false;
+          if (c && record.chunks[c].first_index <= record.chunks[c - 1].first_index) return false;
+        }
+      }
+
+      // the road network: every street is an edge, and nodes and edges only refer to each other
+      unsigned numStreets, numNodes, numEdges, numNodeEdges;
+      getSection<StreetRecord>(SECTION_STREETS, numStreets);
+      const StreetGraph::Node *nodes = getSection<StreetGraph::Node>(SECTION_GRAPH_NODES, numNodes);
+      const StreetGraph::Edge *edges = getSection<StreetGraph::Edge>(SECTION_GRAPH_EDGES, numEdges);
+      const int *nodeEdges = getSection<int>(SECTION_GRAPH_NODE_EDGES, numNodeEdges);
+      if (numEdges != numStreets) return false;
+      for (unsigned i = 0; i != numNodes; ++i) {
+        if (nodes[i].firstEdge < 0 || nodes[i].numEdges < 0 || (uint64_t)nodes[i].firstEdge + nodes[i].numEdges > numNodeEdges) return false;
+      }
+      for (unsigned i = 0; i != numEdges; ++i) {
+        for (int j = 0; j != 2; ++j) {
+          if (edges[i].nodes[j] < 0 || (unsigned)edges[i].nodes[j] >= numNodes) return false;
+        }
+      }
+      for (unsigned i = 0; i != numNodeEdges; ++i) {
+        if (nodeEdges[i] < 0 || (unsigned)nodeEdges[i] >= numEdges) return false;
+      }
+      return true;
+    }
+
+    // Keys of the inputs of the generation, the city depends on the heights and the corners of the city
+    static uint64_t hashHeightMap(HeightMap &heightMap) {
+      int dims[2] = { heightMap.getWidth(), heightMap.getHeight() };
+      uint64_t hash = hashBytes(0, dims, sizeof(dims));
+      return hashBytes(hash, heightMap.getHeightmap(), dims[0] * dims[1] * sizeof(float));
+    }
+
+    static uint64_t hashVertices(const vec4 *vertices) {
+      return hashBytes(0, vertices, 4 * sizeof(vec4));
+    }
+
+    // True if the open snapshot was generated with these parameters, from this heightmap and these corners
+    bool matches(uint64_t seed, unsigned int depth, uint64_t heightmapHash, uint64_t verticesHash) const {
+      if (!data) return false;
+      const Header &header = *(const Header*)data;
+      return header.seed == seed && header.depth == depth && header.heightmapHash == heightmapHash && header.verticesHash == verticesHash;
+    }
+
+    // Streets, road network and props of the city. Call City::loadModels first.
+    void loadCity(City &city) {
+      unsigned numStreets, numNodes, numEdges, numNodeEdges, numProps;
+      const StreetRecord *streets = getSection<StreetRecord>(SECTION_STREETS, numStreets);
+      const StreetGraph::Node *nodes = getSection<StreetGraph::Node>(SECTION_GRAPH_NODES, numNodes);
+      const StreetGraph::Edge *edges = getSection<StreetGraph::Edge>(SECTION_GRAPH_EDGES, numEdges);
+      const int *nodeEdges = getSection<int>(SECTION_GRAPH_NODE_EDGES, numNodeEdges);
+      const PropRecord *props = getSection<PropRecord>(SECTION_PROPS, numProps);
+
+      city.streetsList.reset();
+      city.streetsList.resize(numStreets);
+      city.streetRemoved.reset();
+      city.streetDirty.reset();
+      for (unsigned i = 0; i != numStreets; ++i) {
+        city.streetsList[i].points[0] = streets[i].points[0];
+        city.streetsList[i].points[1] = streets[i].points[1];
+        city.streetRemoved.push_back(false);
+        city.streetDirty.push_back(false);
+      }
+      city.streetGraph.load(nodes, numNodes, edges, numEdges, nodeEdges, numNodeEdges);
+
+      city.models.clear();
+      for (unsigned i = 0; i != numProps; ++i) {
+        if (props[i].prototype >= City::NUM_PROP_PROTOTYPES) continue;
+        city.models.push_back(new Model(city.getPropPrototype(props[i].prototype), props[i].modelToWorld, props[i].material));
+      }
+    }
+
+    // Make a mesh with the buffers of a mesh record
+    void getMesh(unsigned id, mesh &m) const {
+      unsigned numMeshes;
+      const MeshRecord &record = getSection<MeshRecord>(SECTION_MESHES, numMeshes)[id];
+
+      m.init();
+      m.allocate(record.vertexBytes, record.indexBytes);
+      m.assign(record.vertexBytes, record.indexBytes, (uint8_t*)data + record.vertexOffset, (uint8_t*)data + record.indexOffset);
+      m.set_params(record.stride, record.numIndices, record.numVertices, record.mode, record.indexType);
+      for (unsigned slot = 0; slot != record.numSlots; ++slot) {
+        uint32_t s = record.slots[slot];
+        m.add_attribute(s & 0xff, (s >> 8) & 0xff, ((s >> 16) & 0xff) + GL_BYTE, s >> 24);
+      }
+      m.set_chunks(record.chunks, record.numChunks);
+    }
+
+    void getBuildings(dynarray<BuildingArea> &buildings) const {
+      unsigned numBuildings;
+      const BuildingRecord *records = getSection<BuildingRecord>(SECTION_BUILDINGS, numBuildings);
+
+      buildings.reset();
+      buildings.resize(numBuildings);
+      for (unsigned i = 0; i != numBuildings; ++i) {
+        BuildingArea &b = buildings[i];
+        for (int j = 0; j != 4; ++j) {
+          b.points[j] = records[i].points[j];
+        }
+        b.height = records[i].height;
+        b.area = records[i].area;
+      }
+    }
+
+    // Write a generated city, with the road meshes and building meshes made by CityMesh
+    static bool save(const char *path, City &city, unsigned int depth, HeightMap &heightMap, mesh &roadLeft, mesh &roadRight, mesh &pavement, dynarray<BuildingArea> &buildings, BuildingBatcher &batcher) {
+      FILE *file = fopen(path, "wb");
+      if (!file) {
+        printf("Can't write city snapshot %s.\n", path);
+        return false;
+      }
+
+      Header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "NNTCITY", 8);
+      header.version = VERSION;
+      header.depth = depth;
+      header.seed = city.random.getSeed();
+      header.heightmapHash = hashHeightMap(heightMap);
+      header.verticesHash = hashVertices(city.root.vertices);
+
+      // the header is written again at the end, with the sections filled in
+      Writer writer(file);
+      writer.write(&header, sizeof(header));
+
+      dynarray<MeshRecord> meshes;
+      writeMesh(writer, roadLeft, meshes);
+      writeMesh(writer, roadRight, meshes);
+      writeMesh(writer, pavement, meshes);
+      for (int part = 0; part != BuildingBatcher::NUM_PARTS; ++part) {
+        writeMesh(writer, batcher.getPart((BuildingBatcher::Part)part), meshes);
+      }
+
+      dynarray<BuildingRecord> buildingRecords;
+      buildingRecords.resize(buildings.size());
+      for (int i = 0; i != buildings.size(); ++i) {
+        BuildingRecord &r = buildingRecords[i];
+        memset(&r, 0, sizeof(r));
+        for (int j = 0; j != 4; ++j) {
+          r.points[j] = buildings[i].points[j];
+        }
+        r.height = buildings[i].height;
+        r.area = buildings[i].area;
+      }
+
+      dynarray<StreetRecord> streets;
+      streets.resize(city.streetsList.size());
+      for (int i = 0; i != streets.size(); ++i) {
+        streets[i].points[0] = city.streetsList[i].points[0];
+        streets[i].points[1] = city.streetsList[i].points[1];
+      }
+
+      dynarray<PropRecord> props;
+      for (int i = 0; i != city.models.size(); ++i) {
+        Model *model = city.models[i];
+        PropRecord r;
+        memset(&r, 0, sizeof(r));
+        r.modelToWorld = model->getModelToWorld();
+        r.prototype = City::NUM_PROP_PROTOTYPES;
+        for (int p = 0; p != City::NUM_PROP_PROTOTYPES; ++p) {
+          if (city.getPropPrototype(p) == model->getPrototype()) r.prototype = p;
+        }
+        strncpy(r.material, model->getMaterial().c_str(), sizeof(r.material) - 1);
+        props.push_back(r);
+      }
+
+      writer.writeSection(header, SECTION_STREETS, streets.data(), streets.size());
+      writer.writeSection(header, SECTION_GRAPH_NODES, city.streetGraph.getNodes(), city.streetGraph.getNumNodes());
+      writer.writeSection(header, SECTION_GRAPH_EDGES, city.streetGraph.getEdges(), city.streetGraph.getNumEdges());
+      writer.writeSection(header, SECTION_GRAPH_NODE_EDGES, city.streetGraph.getNodeEdges(), city.streetGraph.getNumNodeEdges());
+      writer.writeSection(header, SECTION_MESHES, meshes.data(), meshes.size());
+      writer.writeSection(header, SECTION_BUILDINGS, buildingRecords.data(), buildingRecords.size());
+      writer.writeSection(header, SECTION_PROPS, props.data(), props.size());
+
+      fseek(file, 0, SEEK_SET);
+      fwrite(&header, 1, sizeof(header), file);
+      fclose(file);
+
+      printf("City snapshot written to %s.\n", path);
+      return true;
+    }
+
+    // Saves a small city, loads it back and compares them, then damages the file in ways open() must reject.
+    // The file at path is overwritten and removed. Returns false if the city changes or a damaged file opens.
+    static bool checkRoundTrip(const char *path) {
+      enum { SEED = 5, DEPTH = 6, SIZE = 16 };
+      vec4 vertices[] = {
+        vec4(-10.0f, 0.0f, -16.0f, 1.0f),
+        vec4(-13.0f, 0.0f, 18.0f, 1.0f),
+        vec4(9.0f, 0.0f, 16.0f, 1.0f),
+        vec4(8.0f, 0.0f, -10.0f, 1.0f)
+      };
+      uint8_t samples[SIZE*SIZE];
+      for (int i = 0; i != SIZE*SIZE; ++i) {
+        samples[i] = (uint8_t)(i * 7);
+      }
+      heightfield_decoder::layout source;
+      source.samples = samples;
+      source.stride = SIZE;
+      source.format = heightfield_decoder::HEIGHTS_UINT8;
+      source.width = SIZE;
+      source.height = SIZE;
+      source.bias = 0.0f;
+      source.scale = 1.0f / 255.0f;
+      HeightMap heightMap;
+      heightMap.importHeights(source);
+
+      City city(SEED);
+      city.init(vertices);
+      city.stepPartition(DEPTH);
+      city.calculateIntersections();
+      city.calculateMeshesIntersections();
+      city.calculateBuildingsAreas();
+      dynarray<BuildingArea> &buildings = city.buildingAreaList;
+      for (int i = 0; i != (int)buildings.size(); ++i) {
+        buildings[i].height = 1.0f + i % 4;
+        buildings[i].area = (float)i;
+      }
+      BuildingBatcher batcher;
+      batcher.build(buildings);
+      mesh_builder builder;
+      mesh roads[3];
+      for (int i = 0; i != 3; ++i) {
+        builder.init();
+        builder.add_cube(1.0f + i);
+        builder.get_mesh(roads[i]);
+      }
+      save(path, city, DEPTH, heightMap, roads[0], roads[1], roads[2], buildings, batcher);
+
+      CitySnapshot snapshot;
+      bool ok = snapshot.open(path) && snapshot.matches(SEED, DEPTH, hashHeightMap(heightMap), hashVertices(vertices));
+      ok = ok && !snapshot.matches(SEED + 1, DEPTH, hashHeightMap(heightMap), hashVertices(vertices));
+      City loaded(SEED);
+      loaded.init(vertices);
+      dynarray<BuildingArea> loadedBuildings;
+      mesh pavement;
+      if (ok) {
+        snapshot.loadCity(loaded);
+        snapshot.getBuildings(loadedBuildings);
+        snapshot.getMesh(MESH_PAVEMENT, pavement);
+        ok = pavement.get_num_indices() == roads[2].get_num_indices() && pavement.get_num_vertices() == roads[2].get_num_vertices();
+      }
+      snapshot.close();
+
+      const StreetGraph &graph = city.streetGraph, &loadedGraph = loaded.streetGraph;
+      ok = ok && loaded.streetsList.size() == city.streetsList.size() && loadedBuildings.size() == buildings.size();
+      ok = ok && loadedGraph.getNumNodes() == graph.getNumNodes() && loadedGraph.getNumEdges() == graph.getNumEdges();
+      ok = ok && loadedGraph.getNumNodeEdges() == graph.getNumNodeEdges();
+      for (int i = 0; ok && i != (int)city.streetsList.size(); ++i) {
+        ok = all(loaded.streetsList[i].points[0] == city.streetsList[i].points[0]) && all(loaded.streetsList[i].points[1] == city.streetsList[i].points[1]);
+        ok = ok && !memcmp(&loadedGraph.getEdge(i), &graph.getEdge(i), sizeof(StreetGraph::Edge));
+      }
+      for (int i = 0; ok && i != graph.getNumNodes(); ++i) {
+        const StreetGraph::Node &a = graph.getNode(i), &b = loadedGraph.getNode(i);
+        ok = all(a.point == b.point) && a.firstEdge == b.firstEdge && a.numEdges == b.numEdges;
+      }
+      ok = ok && !memcmp(loadedGraph.getNodeEdges(), graph.getNodeEdges(), graph.getNumNodeEdges() * sizeof(int));
+      for (int i = 0; ok && i != (int)buildings.size(); ++i) {
+        for (int j = 0; j != 4; ++j) {
+          ok = ok && all(loadedBuildings[i].points[j] == buildings[i].points[j]);
+        }
+        ok = ok && loadedBuildings[i].height == buildings[i].height && loadedBuildings[i].area == buildings[i].area;
+      }
+
+      // the file as it was saved, then damaged a different way every time
+      dynarray<uint8_t> bytes;
+      FILE *file = fopen(path, "rb");
+      if (file) {
+        fseek(file, 0, SEEK_END);
+        bytes.resize((unsigned)ftell(file));
+        fseek(file, 0, SEEK_SET);
+        if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size()) bytes.reset();
+        fclose(file);
+      }
+      ok = ok && bytes.size() >= sizeof(Header);
+
+      enum { UNTOUCHED, BAD_MAGIC, BAD_VERSION, TRUNCATED, BAD_STREET_COUNT, BAD_EDGE_NODE, BAD_NODE_EDGE, BAD_NUM_INDICES, NUM_DAMAGES };
+      for (int damage = 0; ok && damage != NUM_DAMAGES; ++damage) {
+        dynarray<uint8_t> damaged;
+        damaged.resize(damage == TRUNCATED ? bytes.size() / 2 : bytes.size());
+        memcpy(damaged.data(), bytes.data(), damaged.size());
+        Header &header = *(Header*)damaged.data();
+        uint8_t *sections[NUM_SECTIONS];
+        for (int i = 0; i != NUM_SECTIONS; ++i) {
+          sections[i] = damaged.data() + header.sections[i].offset;
+        }
+
+        switch (damage) {
+          case BAD_MAGIC: header.magic[0] = 'X'; break;
+          case BAD_VERSION: header.version = VERSION + 1; break;
+          case BAD_STREET_COUNT: header.sections[SECTION_STREETS].count--; break;
+          case BAD_EDGE_NODE: ((StreetGraph::Edge*)sections[SECTION_GRAPH_EDGES])->nodes[1] = header.sections[SECTION_GRAPH_NODES].count; break;
+          case BAD_NODE_EDGE: *(int*)sections[SECTION_GRAPH_NODE_EDGES] = -1; break;
+          case BAD_NUM_INDICES: {
+            MeshRecord &record = ((MeshRecord*)sections[SECTION_MESHES])[MESH_PAVEMENT];
+            record.numIndices = record.indexBytes;
+            break;
+          }
+        }
+
+        file = fopen(path, "wb");
+        ok = file != NULL;
+        if (file) {
+          fwrite(damaged.data(), 1, damaged.size(), file);
+          fclose(file);
+          ok = snapshot.open(path) == (damage == UNTOUCHED);
+          snapshot.close();
+        }
+      }
+      remove(path);
+
+      printf("Snapshot check: %s\n", ok ? "ok." : "ERROR: the city does not survive a round trip, or a damaged file opens.");
+      return ok;
+    }
+  };
+}
@@ -0,0 +1,375 @@
+namespace octet {
+
+  // Ground of a height map as a quadtree of patches with the same number of cells.
+  // The root covers the whole map with big cells and every level below halves them,
+  // down to the leaves at the resolution of the map. Every frame the patches are chosen
+  // so that their error on screen stays under a few pixels, so the ground far away is drawn
+  // with a fraction of the triangles of a single full resolution mesh.
+  // Neighbouring patches of different levels do not share their borders, the cracks
+  // between them are hidden by skirts hanging from the border of every patch.
+  // Only the bounds and errors of the nodes are calculated up front. The vertices of a patch
+  // are built the first frame it is chosen and dropped once it has not been chosen for
+  // EVICT_FRAMES frames, so the GPU only keeps the patches around the camera.
+  class ChunkedTerrain {
+  public:
+    enum { PATCH_CELLS = 32, PATCH_VERTICES = PATCH_CELLS + 1, EVICT_FRAMES = 120 };
+
+  private:
+    // Vertices of a patch: the grid, then the skirts of the four borders
+    enum {
+      GRID_VERTICES = PATCH_VERTICES * PATCH_VERTICES,
+      NUM_VERTICES = GRID_VERTICES + 4 * PATCH_VERTICES,
+      VERTEX_FLOATS = 8,
+    };
+
+    struct Node {
+      aabb bounds;
+      // Largest height difference between the patch and the full resolution ground, with its children
+      float error;
+      // First vertex of the patch in the grid and the distance between its vertices, in grid vertices
+      int i0;
+      int j0;
+      int step;
+      // Children are consecutive in nodes, numChildren is 0 for the leaves
+      int firstChild;
+      int numChildren;
+      // Last frame the patch was chosen
+      unsigned lastUsed;
+    };
+
+    dynarray<Node> nodes;
+    // Patch of every node, NULL while it is not built
+    dynarray<ref<mesh> > patches;
+    // Nodes with a patch
+    dynarray<int> built;
+    ref<gl_resource> indices;
+    unsigned mode;
+    unsigned frame;
+
+    // Nodes drawn this frame
+    dynarray<int> selected;
+
+    // Grid of the height map, as in mesh_builder::add_plane_heightmap
+    const float *heights;
+    const vec4 *normals;
+    int nx;
+    int ny;
+    int hmx;
+    float originX;
+    float originZ;
+    float cellX;
+    float cellZ;
+    float baseY;
+    float uScale;
+    float vScale;
+
+    float height(int i, int j) const {
+      return heights[hmx * (j + 1) + (i + 1)];
+    }
+
+    // Bounds and error of the patch of a node against the full resolution grid.
+    // Cells are split along the same diagonal as the index buffer.
+    void measure(Node &node) const {
+      int s = node.step;
+      float minY = height(node.i0, node.j0);
+      float maxY = minY;
+      float error = 0.0f;
+
+      for (int b = 0; b != PATCH_CELLS; ++b) {
+        int qj = node.j0 + b * s;
+        if (qj >= ny - 1) break;
+        int qj1 = qj + s < ny - 1 ? qj + s : ny - 1;
+        for (int a = 0; a != PATCH_CELLS; ++a) {
+          int qi = node.i0 + a * s;
+          if (qi >= nx - 1) break;
+          int qi1 = qi + s < nx - 1 ? qi + s : nx - 1;
+
+          float h00 = height(qi, qj), h10 = height(qi1, qj);
+          float h01 = height(qi, qj1), h11 = height(qi1, qj1);
+          float du = 1.0f / (qi1 - qi), dv = 1.0f / (qj1 - qj);
+          for (int j = qj; j <= qj1; ++j) {
+            float v = (j - qj) * dv;
+            for (int i = qi; i <= qi1; ++i) {
+              float u = (i - qi) * du;
+              float h = height(i, j);
+              float flat = u >= v ? h00 + u * (h10 - h00) + v * (h11 - h10) : h00 + v * (h01 - h00) + u * (h11 - h01);
+              error = max(error, fabsf(h - flat));
+              minY = min(minY, h);
+              maxY = max(maxY, h);
+            }
+          }
+        }
+      }
+
+      int i1 = min(node.i0 + PATCH_CELLS * s, nx - 1);
+      int j1 = min(node.j0 + PATCH_CELLS * s, ny - 1);
+      vec3 corner0(originX + node.i0 * cellX, baseY + minY, originZ - node.j0 * cellZ);
+      vec3 corner1(originX + i1 * cellX, baseY + maxY, originZ - j1 * cellZ);
+      node.bounds = aabb((corner0 + corner1) * 0.5f, (corner1 - corner0).abs() * 0.5f);
+      node.error = error;
+    }
+
+    void writeVertex(float *dest, int i, int j, float drop) const {
+      i = min(i, nx - 1);
+      j = min(j, ny - 1);
+      const vec4 &normal = normals[nx * j + i];
+      dest[0] = originX + i * cellX;
+      dest[1] = baseY + height(i, j) - drop;
+      dest[2] = originZ - j * cellZ;
+      dest[3] = normal.x();
+      dest[4] = normal.y();
+      dest[5] = normal.z();
+      dest[6] = i * uScale;
+      dest[7] = j * vScale;
+    }
+
+    void buildPatch(const Node &node, mesh &result) const {
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, NUM_VERTICES * VERTEX_FLOATS * sizeof(float));
+      {
+        gl_resource::rwlock dst(vertices);
+        float *v = dst.f32();
+        for (int b = 0; b != PATCH_VERTICES; ++b) {
+          for (int a = 0; a != PATCH_VERTICES; ++a, v += VERTEX_FLOATS) {
+            writeVertex(v, node.i0 + a * node.step, node.j0 + b * node.step, 0.0f);
+          }
+        }
+
+        // a skirt deeper than the error covers the gap to any coarser neighbour
+        float drop = node.error + CityConstants::ROAD_HEIGHT;
+        int last = PATCH_CELLS * node.step;
+        for (int k = 0; k != PATCH_VERTICES; ++k, v += VERTEX_FLOATS) writeVertex(v, node.i0 + k * node.step, node.j0, drop);
+        for (int k = 0; k != PATCH_VERTICES; ++k, v += VERTEX_FLOATS) writeVertex(v, node.i0 + k * node.step, node.j0 + last, drop);
+        for (int k = 0; k != PATCH_VERTICES; ++k, v += VERTEX_FLOATS) writeVertex(v, node.i0, node.j0 + k * node.step, drop);
+        for (int k = 0; k != PATCH_VERTICES; ++k, v += VERTEX_FLOATS) writeVertex(v, node.i0 + last, node.j0 + k * node.step, drop);
+      }
+
+      result.init();
+      result.set_vertices(vertices);
+      result.set_indices(indices);
+      result.add_attribute(attribute_pos, 3, GL_FLOAT, 0);
+      result.add_attribute(attribute_normal, 3, GL_FLOAT, 12);
+      result.add_attribute(attribute_uv, 2, GL_FLOAT, 24);
+      result.set_params(VERTEX_FLOATS * sizeof(float), getIndicesPerPatch(), NUM_VERTICES, mode, GL_UNSIGNED_SHORT);
+    }
+
+    void buildPatch(int n) {
+      patches[n] = new mesh();
+      buildPatch(nodes[n], *patches[n]);
+      built.push_back(n);
+    }
+
+    // Drop the patches not chosen for EVICT_FRAMES frames, the root stays for getRootPatch
+    void evictPatches() {
+      for (int k = 0; k < built.size(); ) {
+        int n = built[k];
+        if (n != 0 && frame - nodes[n].lastUsed > EVICT_FRAMES) {
+          patches[n] = NULL;
+          built[k] = built.back();
+          built.pop_back();
+        } else {
+          ++k;
+        }
+      }
+    }
+
+    // The same triangles for every patch, with the diagonal of mesh_builder::add_plane_heightmap
+    void buildIndices() {
+      indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, getIndicesPerPatch() * sizeof(uint16_t));
+      gl_resource::rwlock dst(indices);
+      uint16_t *p = dst.u16();
+      for (int b = 0; b != PATCH_CELLS; ++b) {
+        for (int a = 0; a != PATCH_CELLS; ++a) {
+          uint16_t v = (uint16_t)(b * PATCH_VERTICES + a);
+          *p++ = v; *p++ = v + 1; *p++ = v + PATCH_VERTICES + 1;
+          *p++ = v; *p++ = v + PATCH_VERTICES + 1; *p++ = v + PATCH_VERTICES;
+        }
+      }
+
+      // border vertex k of each edge and the skirt vertex below it
+      for (int edge = 0; edge != 4; ++edge) {
+        for (int k = 0; k != PATCH_CELLS; ++k) {
+          uint16_t top0, top1;
+          switch (edge) {
+            case 0: top0 = (uint16_t)k; top1 = (uint16_t)(k + 1); break;
+            case 1: top0 = (uint16_t)(PATCH_CELLS * PATCH_VERTICES + k); top1 = top0 + 1; break;
+            case 2: top0 = (uint16_t)(k * PATCH_VERTICES); top1 = top0 + PATCH_VERTICES; break;
+            default: top0 = (uint16_t)(k * PATCH_VERTICES + PATCH_CELLS); top1 = top0 + PATCH_VERTICES; break;
+          }
+          uint16_t bottom0 = (uint16_t)(GRID_VERTICES + edge * PATCH_VERTICES + k);
+          *p++ = top0; *p++ = top1; *p++ = bottom0 + 1;
+          *p++ = top0; *p++ = bottom0 + 1; *p++ = bottom0;
+        }
+      }
+    }
+
+    static float distance(const vec4 &eye, const aabb &box) {
+      vec3 d = (vec3(eye.x(), eye.y(), eye.z()) - box.get_center()).abs() - box.get_half_extent();
+      d = d.max(vec3(0.0f, 0.0f, 0.0f));
+      return d.length();
+    }
+
+    void selectNode(int n, const Frustum &frustum, const vec4 &eye, float errorScale) {
+      const Node &node = nodes[n];
+      if (!frustum.intersects(node.bounds)) return;
+
+      if (node.numChildren && node.error * errorScale > distance(eye, node.bounds)) {
+        for (int c = 0; c != node.numChildren; ++c) {
+          selectNode(node.firstChild + c, frustum, eye, errorScale);
+        }
+      } else {
+        selected.push_back(n);
+      }
+    }
+
+  public:
+    ChunkedTerrain() {
+      heights = NULL;
+      normals = NULL;
+      nx = ny = hmx = 0;
+      mode = GL_TRIANGLES;
+      frame = 0;
+    }
+
+    static unsigned getIndicesPerPatch() {
+      return (PATCH_CELLS * PATCH_CELLS + 4 * PATCH_CELLS) * 6;
+    }
+
+    // Same place, normals and texture coordinates as the single mesh of add_plane_heightmap
+    // translated to center and rotated to the ground.
+    void build(HeightMap &heightMap, const vec4 &terrainDimensions, const vec4 &center) {
+      heights = heightMap.getHeightmap();
+      normals = heightMap.getNormalMapXZ();
+      hmx = heightMap.getWidth();
+      nx = heightMap.getWidth() - 2;
+      ny = heightMap.getHeight() - 2;
+      cellX = terrainDimensions.x() / nx;
+      cellZ = terrainDimensions.z() / ny;
+      originX = center.x() - terrainDimensions.x() * 0.5f;
+      originZ = center.z() + terrainDimensions.z() * 0.5f;
+      baseY = center.y();
+      uScale = 10.0f / nx;
+      vScale = 13.0f / ny;
+
+      nodes.reset();
+      patches.reset();
+      built.reset();
+      selected.reset();
+      frame = 0;
+
+      // levels from the root, every node is followed by the children of the nodes before it
+      int rootStep = 1;
+      while (PATCH_CELLS * rootStep < max(nx, ny) - 1) {
+        rootStep *= 2;
+      }
+      Node root = { aabb(), 0.0f, 0, 0, rootStep, 0, 0, 0 };
+      nodes.push_back(root);
+      for (int n = 0; n != nodes.size(); ++n) {
+        if (nodes[n].step == 1) continue;
+        int half = PATCH_CELLS * nodes[n].step / 2;
+        nodes[n].firstChild = nodes.size();
+        for (int b = 0; b != 2; ++b) {
+          for (int a = 0; a != 2; ++a) {
+            Node child = { aabb(), 0.0f, nodes[n].i0 + a * half, nodes[n].j0 + b * half, nodes[n].step / 2, 0, 0, 0 };
+            if (child.i0 >= nx - 1 || child.j0 >= ny - 1) continue;
+            nodes.push_back(child);
+            nodes[n].numChildren++;
+          }
+        }
+      }
+
+      // every level reads the whole grid once, the nodes are independent
+      #pragma omp parallel for schedule(dynamic)
+      for (int n = 0; n < (int)nodes.size(); ++n) {
+        measure(nodes[n]);
+      }
+
+      // children come after their parents
+      for (int n = nodes.size() - 1; n >= 0; --n) {
+        Node &node = nodes[n];
+        for (int c = 0; c != node.numChildren; ++c) {
+          node.error = max(node.error, nodes[node.firstChild + c].error);
+        }
+      }
+
+      buildIndices();
+      patches.resize(nodes.size());
+      buildPatch(0);
+
+      selected.push_back(0);
+      printf("Terrain: %d patches of %dx%d cells in %d levels.\n", nodes.size(), PATCH_CELLS, PATCH_CELLS, getNumLevels());
+    }
+
+    bool isBuilt() const {
+      return nodes.size() != 0;
+    }
+
+    int getNumLevels() const {
+      int levels = 0;
+      for (int step = nodes.size() ? nodes[0].step : 0; step; step /= 2) {
+        ++levels;
+      }
+      return levels;
+    }
+
+    // Choose the patches to draw: a patch is replaced by its children while its error,
+    // times errorScale, is bigger than its distance to the eye.
+    // errorScale is the number of pixels of a world unit at a distance of one divided by
+    // the error allowed in pixels, model to world is the identity.
+    // The chosen patches are built if they are not, the ones left unused for a while are dropped.
+    void select(const mat4t &worldToProjection, const vec4 &eye, float errorScale) {
+      if (!isBuilt()) return;
+      Frustum frustum;
+      frustum.init(worldToProjection);
+      selected.resize(0);
+      selectNode(0, frustum, eye, errorScale);
+
+      frame++;
+      for (int i = 0; i != selected.size(); ++i) {
+        int n = selected[i];
+        nodes[n].lastUsed = frame;
+        if (!patches[n]) {
+          buildPatch(n);
+        }
+      }
+      evictPatches();
+    }
+
+    void render() {
+      for (int i = 0; i != selected.size(); ++i) {
+        patches[selected[i]]->render();
+      }
+    }
+
+    void set_mode(unsigned int mode_) {
+      mode = mode_;
+      for (int k = 0; k != built.size(); ++k) {
+        patches[built[k]]->set_mode(mode);
+      }
+    }
+
+    // The root patch, the whole ground at the lowest detail
+    mesh *getRootPatch() {
+      return isBuilt() ? (mesh*)patches[0] : NULL;
+    }
+
+    int getPatchesDrawn() const {
+      return selected.size();
+    }
+
+    int getPatchesBuilt() const {
+      return built.size();
+    }
+
+    int getTrianglesDrawn() const {
+      return selected.size() * getIndicesPerPatch() / 3;
+    }
+
+    unsigned getGeometryBytes() const {
+      unsigned bytes = indices ? indices->get_size() : 0;
+      for (int k = 0; k != built.size(); ++k) {
+        bytes += patches[built[k]]->get_vertices()->get_size();
+      }
+      return bytes;
+    }
+  };
+}
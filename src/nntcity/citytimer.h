@@ -0,0 +1,32 @@
+#ifndef WIN32
+  #include <time.h>
+#endif
+
+namespace octet {
+
+  // Wall clock for the timings and time budgets of the city.
+  // clock() adds up the processor time of every thread, so it can't measure the parallel steps.
+  class CityTimer {
+  public:
+    // Seconds from an arbitrary origin
+    static double now() {
+    #if defined(_OPENMP)
+      return omp_get_wtime();
+    #elif defined(WIN32)
+      LARGE_INTEGER count, frequency;
+      QueryPerformanceCounter(&count);
+      QueryPerformanceFrequency(&frequency);
+      return (double)count.QuadPart / (double)frequency.QuadPart;
+    #else
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+    #endif
+    }
+
+    // Milliseconds since start, a value of now()
+    static float msSince(double start) {
+      return (float)((now() - start) * 1000.0);
+    }
+  };
+}
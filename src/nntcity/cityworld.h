@@ -0,0 +1,578 @@
+#if defined(WIN32)
+  #define OCTET_CITY_THREADS 1
+#elif defined(__APPLE__) || defined(__linux__)
+  #define OCTET_CITY_THREADS 1
+  #include <pthread.h>
+  #include <unistd.h>
+#else
+  #define OCTET_CITY_THREADS 0
+#endif
+
+namespace octet {
+
+  // The little threading CityWorld needs: a lock and threads that run a function until it returns.
+  // Without threads the tiles are generated on the main thread, one per frame.
+#if OCTET_CITY_THREADS && defined(WIN32)
+  class CityLock {
+    CRITICAL_SECTION section;
+
+  public:
+    CityLock() { InitializeCriticalSection(&section); }
+    ~CityLock() { DeleteCriticalSection(&section); }
+    void lock() { EnterCriticalSection(&section); }
+    void unlock() { LeaveCriticalSection(&section); }
+  };
+
+  class CityThread {
+    HANDLE handle;
+    void (*function)(void *);
+    void *arg;
+
+    static DWORD WINAPI run(LPVOID self) {
+      ((CityThread*)self)->function(((CityThread*)self)->arg);
+      return 0;
+    }
+
+  public:
+    CityThread() : handle(NULL), function(NULL), arg(NULL) {}
+
+    void start(void (*function_)(void *), void *arg_) {
+      function = function_;
+      arg = arg_;
+      handle = CreateThread(NULL, 0, run, this, 0, NULL);
+    }
+
+    void join() {
+      if (handle) {
+        WaitForSingleObject(handle, INFINITE);
+        CloseHandle(handle);
+        handle = NULL;
+      }
+    }
+
+    static void sleep(unsigned ms) { Sleep(ms); }
+  };
+#elif OCTET_CITY_THREADS
+  class CityLock {
+    pthread_mutex_t mutex;
+
+  public:
+    CityLock() { pthread_mutex_init(&mutex, NULL); }
+    ~CityLock() { pthread_mutex_destroy(&mutex); }
+    void lock() { pthread_mutex_lock(&mutex); }
+    void unlock() { pthread_mutex_unlock(&mutex); }
+  };
+
+  class CityThread {
+    pthread_t thread;
+    bool started;
+    void (*function)(void *);
+    void *arg;
+
+    static void *run(void *self) {
+      ((CityThread*)self)->function(((CityThread*)self)->arg);
+      return NULL;
+    }
+
+  public:
+    CityThread() : started(false), function(NULL), arg(NULL) {}
+
+    void start(void (*function_)(void *), void *arg_) {
+      function = function_;
+      arg = arg_;
+      started = pthread_create(&thread, NULL, run, this) == 0;
+    }
+
+    void join() {
+      if (started) {
+        pthread_join(thread, NULL);
+        started = false;
+      }
+    }
+
+    static void sleep(unsigned ms) { usleep(ms * 1000); }
+  };
+#else
+  class CityLock {
+  public:
+    void lock() {}
+    void unlock() {}
+  };
+#endif
+
+  // A square of a CityWorld with its own city, partition and meshes
+  class CityTile {
+  public:
+    enum State {
+      STATE_QUEUED,     // waiting for a worker
+      STATE_GENERATING, // a worker owns city, mesh and staging
+      STATE_STAGED,     // generated, the meshes are created on the main thread
+      STATE_RESIDENT,   // drawn
+    };
+
+    // grid coordinates and corners in the xz plane
+    int x;
+    int z;
+    vec4 tileMin;
+    vec4 tileMax;
+    aabb bounds;
+
+    State state;
+    City *city;
+    CityMesh *mesh;
+    CityMeshStaging *staging;
+
+    // buffers of a resident tile
+    unsigned bytes;
+    // last frame the camera was near, for the eviction
+    unsigned lastUsed;
+    // never evicted
+    bool pinned;
+
+    CityTile(int x_, int z_, const vec4 &tileMin_, const vec4 &tileMax_)
+      : x(x_)
+      , z(z_)
+      , tileMin(tileMin_)
+      , tileMax(tileMax_)
+      , state(STATE_QUEUED)
+      , city(NULL)
+      , mesh(NULL)
+      , staging(NULL)
+      , bytes(0)
+      , lastUsed(0)
+      , pinned(false)
+    {
+      // buildings stand on the ground, the ground is close to zero
+      vec3 center((tileMin.x() + tileMax.x()) * 0.5f, 5.0f, (tileMin.z() + tileMax.z()) * 0.5f);
+      vec3 half((tileMax.x() - tileMin.x()) * 0.5f, 6.0f, (tileMax.z() - tileMin.z()) * 0.5f);
+      bounds = aabb(center, half);
+    }
+
+    ~CityTile() {
+      delete staging;
+      delete mesh;
+      delete city;
+    }
+  };
+
+  // City without end made of tiles generated around the camera.
+  // Every tile is an independent City with the root at the tile square, seeded by the world seed
+  // and the tile coordinates, so a tile evicted and generated again is the same.
+  // Tiles share their border streets: both tiles generate the street on their common edge
+  // and each draws the half on its side. The ground of the tiles is aligned to the terrain
+  // grid of the heightmap, which only covers the original city, further away its border
+  // heights go on.
+  // Workers generate the city and the meshes without GL, the main thread creates the
+  // buffers of at most one tile per frame and evicts the tiles the camera left, oldest first,
+  // while the resident tiles go over the memory budget.
+  class CityWorld {
+    enum { MAX_WORKERS = 8 };
+
+    uint64_t seed;
+    unsigned depth;
+    HeightMap *heightMap;
+    // loaded the prop models, every tile uses them
+    City *prototypes;
+    // materials of the tiles and the props of every resident tile, one group of props per tile
+    CityMesh *sharedMesh;
+
+    // terrain mapping of the heightmap, as in CityMesh::init
+    vec4 worldDimensions;
+    vec4 worldCenter;
+
+    // tiles are a whole number of terrain cells, starting at the corner of the terrain grid
+    float originX;
+    float originZ;
+    int cellsX;
+    int cellsZ;
+    float tileSizeX;
+    float tileSizeZ;
+
+    // tiles in any state, the lock guards the list and their state
+    dynarray<CityTile *> tiles;
+    CityLock lock;
+    bool quit;
+    // workers start with the queued tile nearest to this point, ahead of the camera
+    vec4 focus;
+
+  #if OCTET_CITY_THREADS
+    CityThread workers[MAX_WORKERS];
+  #endif
+    int numWorkers;
+
+    // tiles up to radius tiles away from the camera tile are kept
+    int radius;
+    unsigned budgetBytes;
+    unsigned residentBytes;
+    unsigned frame;
+
+    int drawFlags;
+
+    // counters for printStats
+    int numGenerated;
+    int numEvicted;
+
+    static void workerMain(void *world) {
+      ((CityWorld*)world)->work();
+    }
+
+    void work() {
+    #if OCTET_CITY_THREADS
+      for (;;) {
+        lock.lock();
+        if (quit) {
+          lock.unlock();
+          return;
+        }
+        CityTile *tile = nextQueued();
+        if (tile) {
+          tile->state = CityTile::STATE_GENERATING;
+        }
+        lock.unlock();
+
+        if (tile) {
+          generate(tile);
+        } else {
+          CityThread::sleep(2);
+        }
+      }
+    #endif
+    }
+
+    // call with the lock
+    CityTile *nextQueued() {
+      CityTile *result = NULL;
+      float best = 0.0f;
+      for (int i = 0; i != tiles.size(); ++i) {
+        CityTile *tile = tiles[i];
+        if (tile->state != CityTile::STATE_QUEUED) continue;
+        vec4 offset = (tile->tileMin + tile->tileMax) * 0.5f - focus;
+        float distance = offset.x() * offset.x() + offset.z() * offset.z();
+        if (!result || distance < best) {
+          result = tile;
+          best = distance;
+        }
+      }
+      return result;
+    }
+
+    // call with the lock
+    CityTile *findTile(int x, int z) {
+      for (int i = 0; i != tiles.size(); ++i) {
+        if (tiles[i]->x == x && tiles[i]->z == z) return tiles[i];
+      }
+      return NULL;
+    }
+
+    // call with the lock
+    CityTile *addTile(int x, int z) {
+      vec4 tileMin(originX + x * tileSizeX, 0.0f, originZ + z * tileSizeZ, 1.0f);
+      vec4 tileMax(originX + (x+1) * tileSizeX, 0.0f, originZ + (z+1) * tileSizeZ, 1.0f);
+      CityTile *tile = new CityTile(x, z, tileMin, tileMax);
+      tiles.push_back(tile);
+      return tile;
+    }
+
+    // call with the lock
+    void removeTile(int index) {
+      tiles[index] = tiles.back();
+      tiles.pop_back();
+    }
+
+    // Generate the city and the meshes of a tile, in any thread
+    void generate(CityTile *tile) {
+      City *city = new City(CityRandom::combine(seed, CityRandom::combine((uint32_t)tile->x, (uint32_t)tile->z)));
+      city->sharePropPrototypes(prototypes);
+      city->setHeightmap(heightMap);
+
+      // same winding as the city of the engine
+      vec4 vertices[] = {
+        vec4(tile->tileMin.x(), 0.0f, tile->tileMin.z(), 1.0f),
+        vec4(tile->tileMin.x(), 0.0f, tile->tileMax.z(), 1.0f),
+        vec4(tile->tileMax.x(), 0.0f, tile->tileMax.z(), 1.0f),
+        vec4(tile->tileMax.x(), 0.0f, tile->tileMin.z(), 1.0f)
+      };
+      city->init(vertices);
+      city->stepPartition(depth);
+      city->calculateIntersections();
+      city->calculateMeshesIntersections();
+      city->calculateBuildingsAreas();
+      city->generate3DModels();
+      removeModelsOutside(*city, tile->tileMin, tile->tileMax);
+
+      CityMesh *mesh = new CityMesh();
+      mesh->setHeightmap(heightMap);
+      CityMeshStaging *staging = new CityMeshStaging();
+      mesh->stageTile(*city, worldDimensions, worldCenter, tile->tileMin, tile->tileMax, cellsX, cellsZ, *staging);
+
+      lock.lock();
+      tile->city = city;
+      tile->mesh = mesh;
+      tile->staging = staging;
+      tile->state = CityTile::STATE_STAGED;
+      lock.unlock();
+    }
+
+    // The outer pavement of the border streets belongs to the tile across, and so do its props
+    static void removeModelsOutside(City &city, const vec4 &tileMin, const vec4 &tileMax) {
+      std::vector <ref<Model>> inside;
+      dynarray<int> insideStreets;
+      for (int i = 0; i != city.models.size(); ++i) {
+        vec4 pos = city.models[i]->getModelToWorld().row(3);
+        if (pos.x() >= tileMin.x() && pos.x() < tileMax.x() && pos.z() >= tileMin.z() && pos.z() < tileMax.z()) {
+          inside.push_back(city.models[i]);
+          insideStreets.push_back(city.modelStreets[i]);
+        }
+      }
+      city.models.swap(inside);
+      city.modelStreets.swap(insideStreets);
+    }
+
+    // Create the buffers of a staged tile, on the main thread
+    void upload(CityTile *tile) {
+      tile->mesh->initFromStaging(*tile->staging, *sharedMesh);
+      tile->mesh->set_mode(drawFlags, &tile->city->buildingAreaList);
+      delete tile->staging;
+      tile->staging = NULL;
+
+      // the meshes have the geometry now, the city only keeps the streets for the camera
+      for (int i = 0; i != tile->city->streetsList.size(); ++i) {
+        tile->city->streetsList[i].resetMeshes();
+      }
+      tile->city->buildingAreaList.reset();
+
+      // buffers are in GPU memory and once more in the copy gl_resource keeps
+      tile->bytes = tile->mesh->getGeometryBytes() * 2 + tile->city->models.size() * sizeof(mat4t);
+      residentBytes += tile->bytes;
+      sharedMesh->updateProps(&tile->city->models, tile);
+      numGenerated++;
+
+      lock.lock();
+      tile->state = CityTile::STATE_RESIDENT;
+      lock.unlock();
+    }
+
+    // Drop the tiles the camera left, least recently used first, until the resident tiles fit the budget
+    void evict() {
+      while (residentBytes > budgetBytes) {
+        int oldest = -1;
+        for (int i = 0; i != tiles.size(); ++i) {
+          CityTile *tile = tiles[i];
+          if (tile->state != CityTile::STATE_RESIDENT || tile->pinned || tile->lastUsed == frame) continue;
+          if (oldest == -1 || tile->lastUsed < tiles[oldest]->lastUsed) oldest = i;
+        }
+        if (oldest == -1) return;
+
+        CityTile *tile = tiles[oldest];
+        residentBytes -= tile->bytes;
+        sharedMesh->removeProps(tile);
+        lock.lock();
+        removeTile(oldest);
+        lock.unlock();
+        delete tile;
+        numEvicted++;
+      }
+    }
+
+  public:
+    // seed, depth - of every tile, as for a City
+    // prototypes - City that loaded the prop models
+    // sharedMesh - initialized with initMaterials and initProps
+    // worldDimensions, worldCenter - where the heightmap is, as given to CityMesh::init
+    // tileSize - approximate side of the tiles, they are rounded to the terrain grid
+    // radius - tiles kept around the camera tile in every direction
+    // budgetBytes - tiles further than radius are evicted over this
+    // numWorkers - threads generating tiles, 0 to generate them on the main thread
+    CityWorld(uint64_t seed_, unsigned depth_, HeightMap *heightMap_, City *prototypes_, CityMesh *sharedMesh_,
+              const vec4 &worldDimensions_, const vec4 &worldCenter_, float tileSize, int radius_, unsigned budgetBytes_, int numWorkers_)
+      : seed(seed_)
+      , depth(depth_)
+      , heightMap(heightMap_)
+      , prototypes(prototypes_)
+      , sharedMesh(sharedMesh_)
+      , worldDimensions(worldDimensions_)
+      , worldCenter(worldCenter_)
+      , quit(false)
+      , focus(worldCenter_)
+      , numWorkers(OCTET_CITY_THREADS ? min(numWorkers_, (int)MAX_WORKERS) : 0)
+      , radius(radius_)
+      , budgetBytes(budgetBytes_)
+      , residentBytes(0)
+      , frame(0)
+      , drawFlags(0)
+      , numGenerated(0)
+      , numEvicted(0)
+    {
+      vec4 terrainDimensions = worldDimensions*2.0f;
+      int gridWidth = heightMap->getWidth()-2;
+      int gridHeight = heightMap->getHeight()-2;
+      float separationX = terrainDimensions.x() / gridWidth;
+      float separationZ = terrainDimensions.z() / gridHeight;
+
+      cellsX = max((int)(tileSize / separationX + 0.5f), 1);
+      cellsZ = max((int)(tileSize / separationZ + 0.5f), 1);
+      tileSizeX = cellsX * separationX;
+      tileSizeZ = cellsZ * separationZ;
+      originX = worldCenter.x() - separationX * (gridWidth / 2.0f);
+      originZ = worldCenter.z() - separationZ * (gridHeight / 2.0f);
+
+      // the workers only read the prototypes, their meshes are created here
+      for (int i = 0; i != City::NUM_PROP_PROTOTYPES; ++i) {
+        prototypes->getPropPrototype(i)->getMeshes();
+      }
+
+    #if OCTET_CITY_THREADS
+      for (int i = 0; i != numWorkers; ++i) {
+        workers[i].start(workerMain, this);
+      }
+    #endif
+      printf("City world: tiles of %.1f x %.1f, %d worker threads.\n", tileSizeX, tileSizeZ, numWorkers);
+    }
+
+    ~CityWorld() {
+      lock.lock();
+      quit = true;
+      lock.unlock();
+    #if OCTET_CITY_THREADS
+      for (int i = 0; i != numWorkers; ++i) {
+        workers[i].join();
+      }
+    #endif
+      for (int i = 0; i != tiles.size(); ++i) {
+        if (tiles[i]->state == CityTile::STATE_RESIDENT) {
+          sharedMesh->removeProps(tiles[i]);
+        }
+        delete tiles[i];
+      }
+    }
+
+    int getTileX(float x) const {
+      return (int)floorf((x - originX) / tileSizeX);
+    }
+
+    int getTileZ(float z) const {
+      return (int)floorf((z - originZ) / tileSizeZ);
+    }
+
+    // Generate the tile under a point now and keep it forever, for the camera to walk in.
+    // Call before the first update.
+    CityTile *pinTile(const vec4 &point) {
+      lock.lock();
+      int x = getTileX(point.x());
+      int z = getTileZ(point.z());
+      CityTile *tile = findTile(x, z);
+      if (!tile) {
+        tile = addTile(x, z);
+      }
+      tile->pinned = true;
+      tile->state = CityTile::STATE_GENERATING;
+      lock.unlock();
+
+      generate(tile);
+      upload(tile);
+      return tile;
+    }
+
+    // Queue the tiles around the camera, create the buffers of one generated tile and evict.
+    // Call every frame on the main thread.
+    void update(const mat4t &cameraToWorld) {
+      frame++;
+      vec4 eye = cameraToWorld.row(3);
+      vec4 forward = -cameraToWorld.row(2);
+      int cx = getTileX(eye.x());
+      int cz = getTileZ(eye.z());
+
+      lock.lock();
+      focus = eye + forward * (tileSizeX + tileSizeZ) * 0.5f;
+      for (int z = cz - radius; z <= cz + radius; ++z) {
+        for (int x = cx - radius; x <= cx + radius; ++x) {
+          CityTile *tile = findTile(x, z);
+          if (!tile) {
+            tile = addTile(x, z);
+          }
+          tile->lastUsed = frame;
+        }
+      }
+
+      // tiles the camera left before they were ready are not needed any more,
+      // the ones being generated are dropped when they are ready
+      dynarray<CityTile *> dropped;
+      CityTile *ready = NULL;
+      for (int i = 0; i < tiles.size(); ) {
+        CityTile *tile = tiles[i];
+        bool wanted = tile->lastUsed == frame;
+        if (!wanted && (tile->state == CityTile::STATE_QUEUED || tile->state == CityTile::STATE_STAGED)) {
+          dropped.push_back(tile);
+          removeTile(i);
+          continue;
+        }
+        if (tile->state == CityTile::STATE_STAGED && !ready) {
+          ready = tile;
+        }
+        ++i;
+      }
+      lock.unlock();
+
+      for (int i = 0; i != dropped.size(); ++i) {
+        delete dropped[i];
+      }
+
+      if (numWorkers == 0 && !ready) {
+        lock.lock();
+        CityTile *tile = nextQueued();
+        if (tile) {
+          tile->state = CityTile::STATE_GENERATING;
+        }
+        lock.unlock();
+        if (tile) {
+          generate(tile);
+          ready = tile;
+        }
+      }
+
+      if (ready) {
+        upload(ready);
+      }
+
+      evict();
+    }
+
+    // Ground, roads, buildings and water of the resident tiles in the view, in renderQueue.
+    // Props and sky are drawn by the shared mesh.
+    void render(CityRenderQueue &renderQueue, color_shader &cshader, const mat4t &modelToProjection, const mat4t &cameraToWorld, int drawFlags) {
+      Frustum frustum;
+      frustum.init(modelToProjection);
+
+      // the queue sorts the tiles by distance, water last from the furthest
+      vec3 eye = cameraToWorld.row(3).xyz();
+      for (int i = 0; i != tiles.size(); ++i) {
+        CityTile *tile = tiles[i];
+        if (tile->state != CityTile::STATE_RESIDENT || !frustum.intersects(tile->bounds)) continue;
+        float depth = (tile->bounds.get_center() - eye).length();
+        tile->mesh->renderGeometry(renderQueue, cshader, modelToProjection, drawFlags, depth);
+      }
+    }
+
+    void set_mode(int drawFlags_) {
+      drawFlags = drawFlags_;
+      for (int i = 0; i != tiles.size(); ++i) {
+        CityTile *tile = tiles[i];
+        if (tile->state == CityTile::STATE_RESIDENT) {
+          tile->mesh->set_mode(drawFlags, &tile->city->buildingAreaList);
+        }
+      }
+    }
+
+    void printStats() {
+      int counts[4] = { 0, 0, 0, 0 };
+      lock.lock();
+      for (int i = 0; i != tiles.size(); ++i) {
+        counts[tiles[i]->state]++;
+      }
+      lock.unlock();
+      printf("World: %d resident tiles (%.1f of %.1f MB), %d staged, %d generating, %d queued, %d generated, %d evicted.\n",
+        counts[CityTile::STATE_RESIDENT], residentBytes / 1048576.0f, budgetBytes / 1048576.0f,
+        counts[CityTile::STATE_STAGED], counts[CityTile::STATE_GENERATING], counts[CityTile::STATE_QUEUED], numGenerated, numEvicted);
+    }
+  };
+}
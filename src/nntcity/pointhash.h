@@ -0,0 +1,152 @@
+namespace octet {
+
+  // Spatial hash of points quantized on the XZ plane.
+  // Every cell keeps a linked list of (point, id) entries, so looking up
+  // the ids stored at a point is O(1) expected time instead of a full scan.
+  // Points are compared exactly, the quantization only picks the cell.
+  class PointHash {
+    struct Entry {
+      vec4 point;
+      int id;
+      int next;
+    };
+
+    // cell key -> first entry + 1, 0 means the cell is empty
+    hash_map<uint64_t, int> cells;
+    dynarray<Entry> entries;
+    int firstFree;
+
+    static uint64_t getKey(const vec4 &p) {
+      int qx = (int)floorf(p.x() * CityConstants::POINT_HASH_SCALE);
+      int qz = (int)floorf(p.z() * CityConstants::POINT_HASH_SCALE);
+      uint64_t key = ((uint64_t)(uint32_t)qx << 32) | (uint32_t)qz;
+      // 0 is the empty key of hash_map, sharing a cell with another key is harmless
+      return key ? key : 1;
+    }
+
+  public:
+    PointHash() {
+      firstFree = -1;
+    }
+
+    void reset() {
+      cells.clear();
+      entries.reset();
+      firstFree = -1;
+    }
+
+    void add(const vec4 &p, int id) {
+      int &head = cells[getKey(p)];
+
+      int index;
+      if (firstFree != -1) {
+        index = firstFree;
+        firstFree = entries[index].next;
+      } else {
+        index = entries.size();
+        entries.resize(index + 1);
+      }
+
+      Entry &e = entries[index];
+      e.point = p;
+      e.id = id;
+      e.next = head - 1;
+      head = index + 1;
+    }
+
+    void remove(const vec4 &p, int id) {
+      uint64_t key = getKey(p);
+      if (!cells.contains(key)) return;
+
+      int &head = cells[key];
+
+      int prev = -1;
+      for (int i = head - 1; i != -1; i = entries[i].next) {
+        if (entries[i].id == id && all(entries[i].point == p)) {
+          if (prev == -1) {
+            head = entries[i].next + 1;
+          } else {
+            entries[prev].next = entries[i].next;
+          }
+          entries[i].next = firstFree;
+          firstFree = i;
+          return;
+        }
+        prev = i;
+      }
+    }
+
+    // Add the ids stored at exactly p to a sorted list, without repetitions
+    void find(const vec4 &p, dynarray<int> &ids) {
+      uint64_t key = getKey(p);
+      if (!cells.contains(key)) return;
+
+      int head = cells[key];
+      for (int i = head - 1; i != -1; i = entries[i].next) {
+        if (!all(entries[i].point == p)) continue;
+
+        int id = entries[i].id;
+        int j = ids.size();
+        while (j != 0 && ids[j-1] > id) {
+          --j;
+        }
+        if (j != 0 && ids[j-1] == id) continue;
+
+        ids.resize(ids.size() + 1);
+        for (int k = ids.size() - 1; k != j; --k) {
+          ids[k] = ids[k-1];
+        }
+        ids[j] = id;
+      }
+    }
+
+    // Points are welded only when they are exactly the same, whatever cell they fall in.
+    // Returns false if a lookup finds the wrong ids.
+    static bool checkWelding() {
+      PointHash hash;
+      vec4 a(1.0f, 0.0f, 2.0f, 1.0f);
+      // same cell as a, a float apart
+      vec4 b(nextafterf(1.0f, 2.0f), 0.0f, 2.0f, 1.0f);
+      // on the corner of four cells, at negative coordinates
+      vec4 c(-0.5f, 0.0f, -0.25f, 1.0f);
+      // the cell of the empty key
+      vec4 zero(0.0f, 0.0f, 0.0f, 1.0f);
+
+      hash.add(a, 3);
+      hash.add(b, 1);
+      hash.add(a, 2);
+      hash.add(a, 3);
+      hash.add(c, 4);
+      hash.add(zero, 5);
+
+      dynarray<int> ids;
+      hash.find(a, ids);
+      bool ok = ids.size() == 2 && ids[0] == 2 && ids[1] == 3;
+
+      // ids already in the list are kept sorted and not repeated
+      hash.find(b, ids);
+      ok = ok && ids.size() == 3 && ids[0] == 1 && ids[1] == 2 && ids[2] == 3;
+
+      ids.resize(0);
+      hash.find(c, ids);
+      hash.find(zero, ids);
+      ok = ok && ids.size() == 2 && ids[0] == 4 && ids[1] == 5;
+
+      // a removed entry is gone and its room is used again
+      hash.remove(a, 3);
+      hash.remove(a, 3);
+      hash.add(vec4(7.0f, 0.0f, 7.0f, 1.0f), 6);
+      ids.resize(0);
+      hash.find(a, ids);
+      ok = ok && ids.size() == 1 && ids[0] == 2 && hash.entries.size() == 6;
+
+      ids.resize(0);
+      hash.find(vec4(7.0f, 0.0f, 7.0f, 1.0f), ids);
+      hash.find(vec4(8.0f, 0.0f, 7.0f, 1.0f), ids);
+      ok = ok && ids.size() == 1 && ids[0] == 6;
+
+      printf("Point hash check: %s\n", ok ? "ok." : "ERROR: points are welded wrong.");
+      return ok;
+    }
+  };
+}
@@ -8,14 +8,200 @@ namespace octet {
     int j;
     IntersectVertex(float _x = 0.0f, float _y = 0.0f, int _i = 0, int _j = 0)
     : x(_x), y(_y), i(_i), j(_j) { }
-    IntersectVertex(IntersectVertex &iv)
-    : x(iv.x), y(iv.y), i(iv.i), j(iv.j) { }
   };
 
   class PolygonIntersections {
     
     public:
 
+    // Room in the stack buffers of the clipper, every clipped side adds one vertex at most.
+    // Polygons with more than MAX_ROW_VERTICES are clipped the same way in buffers on the heap.
+    enum { MAX_CLIP_VERTICES = 16, MAX_ROW_VERTICES = MAX_CLIP_VERTICES - 4 };
+
+    // Convex polygon of x, z pairs being clipped, in buffers with room for the polygon and four clipped sides.
+    // edges[k] is the edge of the unclipped polygon the side from vertex k to the next lies on,
+    // or -1 for a side on a clip line. Crossings are calculated with the ends of the unclipped edge,
+    // so the cells at both sides of a grid line get bit for bit the same points and can share them.
+    struct ClipPolygon {
+      int numVertices;
+      float *points;
+      int *edges;
+    };
+
+    // Clip a convex polygon against an axis aligned line, with no allocations.
+    // source, numSource - The unclipped polygon, as x, z pairs
+    // axis - 0 for a line of constant x, 1 for constant z
+    // side - 1.0f keeps the points above bound, -1.0f the points below
+    static void clipPolygonAxis(const ClipPolygon &polygon, const float *source, int numSource,
+                                int axis, float bound, float side, ClipPolygon &result) {
+      result.numVertices = 0;
+      int numVertices = polygon.numVertices;
+      if (numVertices == 0) return;
+
+      int count = 0;
+      int prev = numVertices-1;
+      const float *a = polygon.points + prev*2;
+      float distA = side * (a[axis] - bound);
+      for (int i = 0; i != numVertices; i++) {
+        const float *b = polygon.points + i*2;
+        float distB = side * (b[axis] - bound);
+        if ((distA >= 0.0f) != (distB >= 0.0f)) {
+          const float *ea = a, *eb = b;
+          float distEA = distA, distEB = distB;
+          int edge = polygon.edges[prev];
+          if (edge >= 0) {
+            ea = source + edge*2;
+            eb = source + ((edge+1) % numSource)*2;
+            distEA = side * (ea[axis] - bound);
+            distEB = side * (eb[axis] - bound);
+          }
+          float t = distEA / (distEA - distEB);
+          result.points[count*2+0] = ea[0] + (eb[0] - ea[0])*t;
+          result.points[count*2+1] = ea[1] + (eb[1] - ea[1])*t;
+          result.points[count*2+axis] = bound;
+          // going in, the rest of the edge follows. Going out, the clip line follows.
+          result.edges[count] = distB >= 0.0f ? edge : -1;
+          count++;
+        }
+        if (distB >= 0.0f) {
+          result.points[count*2+0] = b[0];
+          result.points[count*2+1] = b[1];
+          result.edges[count] = polygon.edges[i];
+          count++;
+        }
+        prev = i;
+        a = b;
+        distA = distB;
+      }
+      result.numVertices = count;
+    }
+
+    // Index of the vertex at x, y, z, adding it if it is not in welded yet.
+    // The key is the bits of x and z, points are welded only when they are exactly the same.
+    static uint32_t addWeldedVertex(float x, float y, float z, hash_map<uint64_t, uint32_t> &welded,
+                                    dynarray<vec4> &resultVertices, dynarray<vec4> &resultNormals,
+                                    dynarray<vec2> &resultUVCoords) {
+      uint32_t bitsX, bitsZ;
+      memcpy(&bitsX, &x, sizeof(bitsX));
+      memcpy(&bitsZ, &z, sizeof(bitsZ));
+      uint64_t key = ((uint64_t)bitsX << 32) | bitsZ;
+      // 0 is the empty key of hash_map, welding 0,0 with the smallest denormal is harmless
+      // vertex index + 1, 0 means a new vertex
+      uint32_t &index = welded[key ? key : 1];
+      if (!index) {
+        resultVertices.push_back(vec4(x, y, z, 1.0f));
+        resultNormals.push_back(vec4(0, 0, 0, 0));
+        resultUVCoords.push_back(vec2(0, 0));
+        index = (uint32_t)resultVertices.size();
+      }
+      return index - 1;
+    }
+
+    // Clip a convex polygon of x, z pairs against the cells firstCell to lastCell of a row of the grid
+    // and add the pieces as triangle fans at height y. The polygon is clipped to the row once
+    // and the result to the sides of every cell, in buffers on the stack unless it has more
+    // than MAX_ROW_VERTICES.
+    // Only the cells the polygon overlaps are visited, and the cells completely inside it are
+    // added as they are without clipping.
+    // The pieces share their vertices, with the other rows of the polygon too, through welded.
+    // z0, z1 - Bounds of the row
+    // x0 - Left side of cell 0 of the row
+    static void clipPolygonRow(const float *polygon, int numVertices, float z0, float z1,
+                               float x0, float separationX, int firstCell, int lastCell, float y,
+                               hash_map<uint64_t, uint32_t> &welded,
+                               dynarray<vec4> &resultVertices, dynarray<uint32_t> &resultIndices,
+                               dynarray<vec4> &resultNormals, dynarray<vec2> &resultUVCoords) {
+      enum { NUM_BUFFERS = 5 };
+      float stackPoints[NUM_BUFFERS][MAX_CLIP_VERTICES*2];
+      int stackEdges[NUM_BUFFERS][MAX_CLIP_VERTICES];
+      dynarray<float> heapPoints;
+      dynarray<int> heapEdges;
+      int room = numVertices + 4;
+      bool onHeap = room > MAX_CLIP_VERTICES;
+      if (onHeap) {
+        heapPoints.resize(NUM_BUFFERS*room*2);
+        heapEdges.resize(NUM_BUFFERS*room);
+      }
+      ClipPolygon source, below, rowPolygon, right, cellPolygon;
+      ClipPolygon *buffers[NUM_BUFFERS] = { &source, &below, &rowPolygon, &right, &cellPolygon };
+      for (int b = 0; b != NUM_BUFFERS; b++) {
+        buffers[b]->points = onHeap ? heapPoints.data() + b*room*2 : stackPoints[b];
+        buffers[b]->edges = onHeap ? heapEdges.data() + b*room : stackEdges[b];
+      }
+
+      source.numVertices = numVertices;
+      for (int k = 0; k != numVertices; k++) {
+        source.points[k*2+0] = polygon[k*2+0];
+        source.points[k*2+1] = polygon[k*2+1];
+        source.edges[k] = k;
+      }
+      clipPolygonAxis(source, polygon, numVertices, 1, z0, 1.0f, below);
+      clipPolygonAxis(below, polygon, numVertices, 1, z1, -1.0f, rowPolygon);
+      int numRow = rowPolygon.numVertices;
+      const float *row = rowPolygon.points;
+      if (numRow < 3) return;
+      // The polygon in the row is convex, so it overlaps the cells between its lowest and highest x,
+      // and covers the whole height of the row between the x ranges it has on both bounds of the row.
+      // The clipper leaves the points on the bounds exactly at z0 and z1.
+      float minX = row[0], maxX = row[0];
+      float boundMin[2] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+      float boundMax[2] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+      float area = 0.0f;
+      for (int k = 0; k != numRow; k++) {
+        float x = row[k*2+0], z = row[k*2+1];
+        minX = min(minX, x);
+        maxX = max(maxX, x);
+        for (int b = 0; b != 2; b++) {
+          if (z == (b ? z1 : z0)) {
+            boundMin[b] = min(boundMin[b], x);
+            boundMax[b] = max(boundMax[b], x);
+          }
+        }
+        int next = (k+1) % numRow;
+        area += x * row[next*2+1] - row[next*2+0] * z;
+      }
+      float coveredMin = max(boundMin[0], boundMin[1]);
+      float coveredMax = min(boundMax[0], boundMax[1]);
+
+      firstCell = max(firstCell, (int)floorf((minX - x0) / separationX));
+      lastCell = min(lastCell, (int)floorf((maxX - x0) / separationX));
+
+      float *cell = cellPolygon.points;
+      for (int i = firstCell; i <= lastCell; i++) {
+        float cellX0 = x0 + i*separationX;
+        float cellX1 = x0 + (i+1)*separationX;
+        int numCell;
+        if (cellX0 >= coveredMin && cellX1 <= coveredMax) {
+          // the whole cell, turning the same way as the polygon
+          float corners[] = { cellX0, z0, cellX1, z0, cellX1, z1, cellX0, z1 };
+          for (int k = 0; k != 4; k++) {
+            int c = area >= 0.0f ? k : 3 - k;
+            cell[k*2+0] = corners[c*2+0];
+            cell[k*2+1] = corners[c*2+1];
+          }
+          numCell = 4;
+        } else {
+          clipPolygonAxis(rowPolygon, polygon, numVertices, 0, cellX0, 1.0f, right);
+          clipPolygonAxis(right, polygon, numVertices, 0, cellX1, -1.0f, cellPolygon);
+          numCell = cellPolygon.numVertices;
+          if (numCell < 3) continue;
+        }
+
+        uint32_t first = 0, prev = 0;
+        for (int k = 0; k != numCell; k++) {
+          uint32_t index = addWeldedVertex(cell[k*2+0], y, cell[k*2+1], welded, resultVertices, resultNormals, resultUVCoords);
+          if (k == 0) {
+            first = index;
+          } else if (k >= 2) {
+            resultIndices.push_back(first);
+            resultIndices.push_back(prev);
+            resultIndices.push_back(index);
+          }
+          prev = index;
+        }
+      }
+    }
+
     // Obtain a series of triangles that represent the intersection of
     // a polygon with a axis-aligned grid, in 2D.
     // Polygons are a series of vec4s, must be aligned to XZ axis.
@@ -24,24 +210,21 @@ namespace octet {
     // halfSizeY - Dimension in Y of the extruded polygon
     // width, height - Dimensions, in tile, of the grid
     // resultVertices, resultIndices - Resulting polygons of the intersection, in vertex/index mode.
+    //   They are appended to the results, indices count from the start of resultVertices.
     // borderVertices - Resulting vertices around the polygon border. For later extrusion purposes.
     static void intersectGrid(dynarray<vec4> &polygonPositions,
-                       dynarray<vec2> &polygonUVCoords,
                        float centerX, float centerZ, 
                        float separationX, float separationZ, float halfSizeY,
                        int width, int height, 
-                       dynarray<vec4> &resultVertices, dynarray<unsigned short> &resultIndices, 
+                       dynarray<vec4> &resultVertices, dynarray<uint32_t> &resultIndices, 
                        dynarray<vec4> &resultNormals, dynarray<vec2> &resultUVCoords) {
 
       IntersectVertex gridOrigin(centerX-separationX*(width/2.0f), centerZ-separationZ*(height/2.0f));
       IntersectVertex minGrid(centerX+separationX*(width/2.0f+1), centerZ+separationZ*(height/2.0f+1));
       IntersectVertex maxGrid(centerX-separationX*(width/2.0f+1), centerZ-separationZ*(height/2.0f+1));
 
-      resultVertices.reset();
-      resultIndices.reset();
-      resultNormals.reset();
-      resultUVCoords.reset();
-      
+      unsigned firstVertex = (unsigned)resultVertices.size();
+
       for (int i = 0; i != polygonPositions.size(); i ++) {
         IntersectVertex a(polygonPositions[i].x(), polygonPositions[i].z());
 
@@ -64,36 +247,27 @@ namespace octet {
       maxGrid.i = (int)floor((maxGrid.x - gridOrigin.x)/separationX);
       maxGrid.j = (int)floor((maxGrid.y - gridOrigin.y)/separationZ);
 
-      // Intersecting XZ-aligned polygons
+      // Intersecting XZ-aligned polygons, a row of the grid at a time
+      // on the stack unless it is too big for clipPolygonRow
+      int numVertices = polygonPositions.size();
+      float stackPolygon[MAX_ROW_VERTICES*2];
+      dynarray<float> heapPolygon;
+      float *polygon = stackPolygon;
+      if (numVertices > MAX_ROW_VERTICES) {
+        heapPolygon.resize(numVertices*2);
+        polygon = heapPolygon.data();
+      }
+      for (int i = 0; i != numVertices; i++) {
+        polygon[i*2+0] = polygonPositions[i].x();
+        polygon[i*2+1] = polygonPositions[i].z();
+      }
+
+      // vertices of the top on grid lines are shared by up to four cells
+      hash_map<uint64_t, uint32_t> welded;
       for (int j = minGrid.j; j <= maxGrid.j; j++) {
-        for (int i = minGrid.i; i <= maxGrid.i; i++) {
-          dynarray<vec4> polygonIntersect;
-          dynarray<vec4> borderIntersect;
-          float square[] = {
-            gridOrigin.x + i*separationX, gridOrigin.y + j*separationZ,
-            gridOrigin.x + (i+1)*separationX, gridOrigin.y + (j+1)*separationZ 
-          };
-          //printf("Comparing against square: (%.2f, %.2f), (%.2f, %.2f): ", square[0], square[1], square[2], square[3]);
-          PolygonIntersections::intersectPolygonAABB(polygonPositions, square, polygonIntersect);
-          if (polygonIntersect.size() > 0) {
-            unsigned short cur_vertex = (unsigned short)resultVertices.size();
-            int num_triangles = polygonIntersect.size()-2;
-            if (num_triangles > 0) {
-              
-              for (auto k = polygonIntersect.begin(); k != polygonIntersect.end(); k++) {
-                (*k)[1] = halfSizeY;
-                resultVertices.push_back(*k);
-                resultNormals.push_back(vec4(0, 0, 0, 0));
-                resultUVCoords.push_back(vec2(0, 0));
-              }
-              for (int k = 0; k != num_triangles; k++) {
-                resultIndices.push_back(cur_vertex+0);
-                resultIndices.push_back(cur_vertex+k+1);
-                resultIndices.push_back(cur_vertex+k+2);
-              }
-            }
-          }
-        }
+        clipPolygonRow(polygon, numVertices, gridOrigin.y + j*separationZ, gridOrigin.y + (j+1)*separationZ,
+                       gridOrigin.x, separationX, minGrid.i, maxGrid.i, halfSizeY, welded,
+                       resultVertices, resultIndices, resultNormals, resultUVCoords);
       }
 
       // Extruding polygons in the Y-axis
@@ -110,17 +284,10 @@ namespace octet {
         float angleRadians = atan2f(b.y - a.y, b.x - a.x);
         vec4 normal(cos(angleRadians-3.14159265359f/2.0f), 0.0f, sin(angleRadians-3.14159265359f/2.0f), 1.0f);
 
-        /*
-        printf("For polygon: [(%.2f, %.2f, %d, %d), (%.2f, %.2f, %d, %d)], resulting division: [\n", a.x, a.y, a.i, a.j, b.x, b.y, b.i, b.j);
-        for (auto k = borderVertices.begin(); k != borderVertices.end(); k++) {
-          printf("%.2f, %.2f),\n", k->x(), k->z());
-        }
-        printf("]\n");
-        */
         int num_triangles = borderVertices.size()*2-2;
 
         if (num_triangles > 0) {
-          unsigned short cur_vertex = (unsigned short)resultVertices.size();
+          unsigned cur_vertex = (unsigned)resultVertices.size();
 
           for (auto j = borderVertices.begin(); j != borderVertices.end(); j++) {
             (*j)[1] = halfSizeY;
@@ -165,22 +332,20 @@ namespace octet {
       float aLen = a.length();
       float bLen = b.length();
       
-      //printf("Init UV generation: \n");
-      for (int i = 0; i != resultVertices.size(); i++) {
+      for (int i = firstVertex; i != resultVertices.size(); i++) {
         vec4 pos = resultVertices[i];
         pos[1] = 0.0f;
         pos = pos - origin;
 
         resultUVCoords[i][0] = pos.dot(a)/(aLen*0.5f);
         resultUVCoords[i][1] = pos.dot(b)/(bLen*0.12f);
-        //printf("Vertex: (%g, %g), UV: (%g, %g)\n", pos[0], pos[2], uv[0], uv[1]);
       }
-      //printf("End UV generation.\n\n");
     }
 
     // Given a polygon, intersect it with an AABB defined by bounds, outputing the
     // vertices in result.
     // bounds is defined as {x0, y0, x1, y1}, given that x0 < x1 && y0 < y1.
+    // The cell at a time clipping intersectGrid used before clipPolygonRow, kept to compare with.
     static void intersectPolygonAABB(dynarray<vec4> &polygon, float bounds[], dynarray<vec4> &result) {
       IntersectVertex boundsMin(1000000.0f, 1000000.0f);
       IntersectVertex boundsMax(-1000000.0f, -1000000.0f);
@@ -205,7 +370,6 @@ namespace octet {
       // Four possibilities where aabb does not clip polygon at all
       if (boundsMax.x < bounds[0] || boundsMin.x > bounds[2] ||
         boundsMax.y < bounds[1] || boundsMin.y > bounds[3]) {
-        //printf("No polygon generated.\n");
         return;
       }
 
@@ -216,7 +380,6 @@ namespace octet {
         for (auto k = polygon.begin(); k != polygon.end(); k++) {
           result.push_back(*k);
         } 
-        //printf("Whole polygon contained.\n");
         return;
       }
       
@@ -368,19 +531,15 @@ namespace octet {
       
       //Copy intermediate results to final result
       result.reset();
-      //printf("Clipped result: [");
       for (auto k = intermediate->begin(); k != intermediate->end(); k++) {
           result.push_back(*k);
-          //printf("(%.2f, %.2f), ", k->x(), k->y());
       } 
-      //printf("]\n");
     }
     
     // Intersects
     static void intersectLineBorderGrid(const IntersectVertex &a, const IntersectVertex &b, const IntersectVertex &gridOrigin,
                                  float separationX, float separationZ, dynarray<vec4> &borderVertices) {
 
-      //printf("Intersection between (%.2f, %.2f) and (%.2f, %.2f)\n", a.x, a.y, b.x, b.y);
       
       borderVertices.push_back(vec4(a.x, 0, a.y, 1.0f));
       
@@ -437,7 +596,6 @@ namespace octet {
           sideDistX = (sideDistXp - start).length();
         }
       } else if (abs(b.x - a.x) < abs(b.y-a.y)) {
-        //printf("Y is longer than X\n");
         // Digital Differential Analysis --  http://lodev.org/cgtutor/raycasting.html
         float slope = (b.x-a.x)/(b.y-a.y);
         float origin = a.x - slope*a.y;
@@ -463,8 +621,6 @@ namespace octet {
         
         float lineLength = sqrtf((b.y-a.y)*(b.y-a.y)+(b.x-a.x)*(b.x-a.x));
         while (sideDistX < lineLength || sideDistY < lineLength) {
-          //printf("Step: [lineLength: (%.2f), sideDistXp: (%.2f, %.2f), sideDistYp: (%.2f, %.2f), sideDistX: %.2f, sideDistY: %.2f, deltaDistXp(%.2f, %.2f), deltaDistYp(%.2f, %.2f) ",
-          //  lineLength, sideDistXp.x(), sideDistXp.y(), sideDistYp.x(), sideDistYp.y(), sideDistX, sideDistY, deltaDistXp.x(), deltaDistXp.y(), deltaDistYp.x(), deltaDistYp.y());
           if (sideDistX < sideDistY) {
             borderVertices.push_back(vec4(sideDistXp.x(), 0, sideDistXp.y(), 1.0f));
             sideDistXp += deltaDistXp;
@@ -474,10 +630,8 @@ namespace octet {
             sideDistYp += deltaDistYp;
             sideDistY = (sideDistYp - start).length();
           }
-          //printf("Last point: (%.2f, %.2f)\n", borderVertices[borderVertices.size()-1].x(), borderVertices[borderVertices.size()-1].z());
         }
       } else {
-        //printf("X is longer than Y\n");
         // Digital Differential Analysis --  http://lodev.org/cgtutor/raycasting.html
         float slope = (b.y-a.y)/(b.x-a.x);
         float origin = a.y - slope*a.x;
@@ -503,8 +657,6 @@ namespace octet {
         
         float lineLength = sqrtf((b.y-a.y)*(b.y-a.y)+(b.x-a.x)*(b.x-a.x));
         while (sideDistX < lineLength || sideDistY < lineLength) {
-          //printf("Step: [lineLength: (%.2f), sideDistXp: (%.2f, %.2f), sideDistYp: (%.2f, %.2f), sideDistX: %.2f, sideDistY: %.2f, deltaDistXp(%.2f, %.2f), deltaDistYp(%.2f, %.2f) ",
-          //  lineLength, sideDistXp.x(), sideDistXp.y(), sideDistYp.x(), sideDistYp.y(), sideDistX, sideDistY, deltaDistXp.x(), deltaDistXp.y(), deltaDistYp.x(), deltaDistYp.y());
           if (sideDistX < sideDistY) {
             borderVertices.push_back(vec4(sideDistXp.x(), 0, sideDistXp.y(), 1.0f));
             sideDistXp += deltaDistXp;
@@ -514,10 +666,155 @@ namespace octet {
             sideDistYp += deltaDistYp;
             sideDistY = (sideDistYp - start).length();
           }
-          //printf("Last point: (%.2f, %.2f)\n", borderVertices[borderVertices.size()-1].x(), borderVertices[borderVertices.size()-1].z());
         }
       }
       borderVertices.push_back(vec4(b.x, 0, b.y, 1.0f));
     }
+
+    // Area in XZ of indexed triangles
+    static float getTrianglesArea(dynarray<vec4> &vertices, dynarray<uint32_t> &indices) {
+      float area = 0.0f;
+      for (int i = 0; i + 2 < indices.size(); i += 3) {
+        vec4 a = vertices[indices[i+1]] - vertices[indices[i]];
+        vec4 b = vertices[indices[i+2]] - vertices[indices[i]];
+        area += fabsf(a.x() * b.z() - a.z() * b.x()) * 0.5f;
+      }
+      return area;
+    }
+
+    // Time clipping street-like quads to a grid of unit cells a cell at a time with
+    // intersectPolygonAABB against a row at a time with clipPolygonRow.
+    // The areas covered by both should be the same, the row clipper shares the vertices of neighbouring cells.
+    // Quads are from a tenth of a cell to four cells wide, like streets on heightmaps of any size.
+    static void benchmarkClipping(unsigned int numPolygons) {
+      CityRandom::Generator rnd(numPolygons);
+      dynarray<vec4> polygons;
+      for (unsigned i = 0; i != numPolygons; ++i) {
+        vec4 center(rnd.getFloat() * 100.0f, 0.0f, rnd.getFloat() * 100.0f, 1.0f);
+        float angle = rnd.getFloat() * 6.2831853f;
+        float length = 1.0f + rnd.getFloat() * 4.0f;
+        vec4 along(cosf(angle) * length, 0.0f, sinf(angle) * length, 0.0f);
+        float width = 0.05f + rnd.getFloat() * rnd.getFloat() * 2.0f;
+        vec4 across(-sinf(angle) * width, 0.0f, cosf(angle) * width, 0.0f);
+        polygons.push_back(center - along - across);
+        polygons.push_back(center + along - across);
+        polygons.push_back(center + along + across);
+        polygons.push_back(center - along + across);
+      }
+
+      dynarray<vec4> vertices[2], normals[2];
+      dynarray<uint32_t> indices[2];
+      dynarray<vec2> uvCoords[2];
+      dynarray<vec4> polygon;
+      polygon.resize(4);
+
+      clock_t t0 = clock();
+      for (unsigned p = 0; p != numPolygons; ++p) {
+        vec4 minCoord = polygons[p*4].min(polygons[p*4+1]).min(polygons[p*4+2]).min(polygons[p*4+3]);
+        vec4 maxCoord = polygons[p*4].max(polygons[p*4+1]).max(polygons[p*4+2]).max(polygons[p*4+3]);
+        for (int k = 0; k != 4; ++k) {
+          polygon[k] = polygons[p*4+k];
+        }
+        for (int j = (int)floorf(minCoord.z()); j <= (int)floorf(maxCoord.z()); j++) {
+          for (int i = (int)floorf(minCoord.x()); i <= (int)floorf(maxCoord.x()); i++) {
+            dynarray<vec4> polygonIntersect;
+            float square[] = { (float)i, (float)j, (float)(i+1), (float)(j+1) };
+            intersectPolygonAABB(polygon, square, polygonIntersect);
+            unsigned cur_vertex = (unsigned)vertices[0].size();
+            for (int k = 0; k < (int)polygonIntersect.size(); k++) {
+              vertices[0].push_back(polygonIntersect[k]);
+              normals[0].push_back(vec4(0, 0, 0, 0));
+              uvCoords[0].push_back(vec2(0, 0));
+            }
+            for (int k = 0; k < (int)polygonIntersect.size()-2; k++) {
+              indices[0].push_back(cur_vertex+0);
+              indices[0].push_back(cur_vertex+k+1);
+              indices[0].push_back(cur_vertex+k+2);
+            }
+          }
+        }
+      }
+      clock_t t1 = clock();
+      for (unsigned p = 0; p != numPolygons; ++p) {
+        vec4 minCoord = polygons[p*4].min(polygons[p*4+1]).min(polygons[p*4+2]).min(polygons[p*4+3]);
+        vec4 maxCoord = polygons[p*4].max(polygons[p*4+1]).max(polygons[p*4+2]).max(polygons[p*4+3]);
+        float xz[8];
+        hash_map<uint64_t, uint32_t> welded;
+        for (int k = 0; k != 4; ++k) {
+          xz[k*2+0] = polygons[p*4+k].x();
+          xz[k*2+1] = polygons[p*4+k].z();
+        }
+        for (int j = (int)floorf(minCoord.z()); j <= (int)floorf(maxCoord.z()); j++) {
+          clipPolygonRow(xz, 4, (float)j, (float)(j+1), 0.0f, 1.0f, (int)floorf(minCoord.x()), (int)floorf(maxCoord.x()), 0.0f, welded,
+                         vertices[1], indices[1], normals[1], uvCoords[1]);
+        }
+      }
+      clock_t t2 = clock();
+
+      float toMs = 1000.0f / CLOCKS_PER_SEC;
+      printf("Grid clipping, %d quads (ms): cell %.1f | row %.1f (vertices %d %d, area %.3f %.3f)\n", numPolygons,
+        (t1 - t0) * toMs, (t2 - t1) * toMs, vertices[0].size(), vertices[1].size(),
+        getTrianglesArea(vertices[0], indices[0]), getTrianglesArea(vertices[1], indices[1]));
+    }
+
+    // Clips polygons of MAX_ROW_VERTICES, on the stack, and of one more vertex, on the heap,
+    // to a grid of unit cells. The pieces must cover the polygon, and the cells at both sides of
+    // a grid line must share the points where the polygon crosses it: the vertices are the corners
+    // of the polygon, its crossings with the grid lines and the grid points inside it, once each.
+    // Returns false if a polygon is clipped wrong.
+    static bool checkClipping() {
+      bool ok = true;
+      for (int numVertices = MAX_ROW_VERTICES; numVertices != MAX_ROW_VERTICES + 2; ++numVertices) {
+        // a regular polygon over a few cells, with no corner or side on a grid line
+        float polygon[(MAX_ROW_VERTICES + 1)*2];
+        for (int k = 0; k != numVertices; k++) {
+          float angle = 0.3f + k * 6.2831853f / numVertices;
+          polygon[k*2+0] = 0.37f + 2.3f * cosf(angle);
+          polygon[k*2+1] = 0.61f + 2.3f * sinf(angle);
+        }
+
+        float minX = polygon[0], maxX = polygon[0], minZ = polygon[1], maxZ = polygon[1];
+        float area = 0.0f;
+        int expectedVertices = numVertices;
+        for (int k = 0; k != numVertices; k++) {
+          const float *a = polygon + k*2, *b = polygon + ((k+1) % numVertices)*2;
+          minX = min(minX, a[0]);
+          maxX = max(maxX, a[0]);
+          minZ = min(minZ, a[1]);
+          maxZ = max(maxZ, a[1]);
+          area += (a[0] * b[1] - b[0] * a[1]) * 0.5f;
+          // crossings of the side with the grid lines of both axes
+          for (int axis = 0; axis != 2; axis++) {
+            expectedVertices += (int)floorf(max(a[axis], b[axis])) - (int)floorf(min(a[axis], b[axis]));
+          }
+        }
+        // grid points inside the polygon, at the left of every side going counterclockwise
+        for (int z = (int)ceilf(minZ); z <= (int)floorf(maxZ); z++) {
+          for (int x = (int)ceilf(minX); x <= (int)floorf(maxX); x++) {
+            bool inside = true;
+            for (int k = 0; k != numVertices; k++) {
+              const float *a = polygon + k*2, *b = polygon + ((k+1) % numVertices)*2;
+              inside = inside && (b[0] - a[0]) * (z - a[1]) - (b[1] - a[1]) * (x - a[0]) > 0.0f;
+            }
+            expectedVertices += inside;
+          }
+        }
+
+        dynarray<vec4> vertices, normals;
+        dynarray<uint32_t> indices;
+        dynarray<vec2> uvCoords;
+        hash_map<uint64_t, uint32_t> welded;
+        for (int j = (int)floorf(minZ); j <= (int)floorf(maxZ); j++) {
+          clipPolygonRow(polygon, numVertices, (float)j, (float)(j+1), 0.0f, 1.0f, (int)floorf(minX), (int)floorf(maxX), 0.0f, welded,
+                         vertices, indices, normals, uvCoords);
+        }
+
+        float clippedArea = getTrianglesArea(vertices, indices);
+        ok = ok && fabsf(clippedArea - area) < area * 1e-5f && (int)vertices.size() == expectedVertices;
+      }
+
+      printf("Grid clipping check: %s\n", ok ? "ok." : "ERROR: the pieces don't match the polygon.");
+      return ok;
+    }
   };  
 }
\ No newline at end of file
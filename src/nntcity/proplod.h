@@ -0,0 +1,468 @@
+namespace octet {
+
+  // Quadric error simplification of the meshes of the props.
+  // Vertices at the same position are one node, the cheapest edge between two nodes
+  // is collapsed into one of its ends, so the positions and texture coordinates
+  // of the result are a subset of the original ones. Open borders get extra planes
+  // so that they keep their outline.
+  class MeshSimplifier {
+    struct Quadric {
+      double q[10];
+
+      void clear() {
+        memset(q, 0, sizeof(q));
+      }
+
+      // plane a*x + b*y + c*z + d = 0 times weight
+      void addPlane(double a, double b, double c, double d, double weight) {
+        q[0] += weight * a * a; q[1] += weight * a * b; q[2] += weight * a * c; q[3] += weight * a * d;
+        q[4] += weight * b * b; q[5] += weight * b * c; q[6] += weight * b * d;
+        q[7] += weight * c * c; q[8] += weight * c * d;
+        q[9] += weight * d * d;
+      }
+
+      void add(const Quadric &rhs) {
+        for (int i = 0; i != 10; ++i) q[i] += rhs.q[i];
+      }
+
+      double error(const vec3 &p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+             + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+             + q[7] * z * z + 2 * q[8] * z + q[9];
+      }
+    };
+
+    struct Vertex {
+      vec3 pos;
+      vec3 normal;
+      float u;
+      float v;
+      int node;
+    };
+
+    // collapse of node from into node to, stamps tell if either changed since it was queued
+    struct Collapse {
+      double cost;
+      int from;
+      int to;
+      int fromStamp;
+      int toStamp;
+
+      bool operator<(const Collapse &rhs) const {
+        return cost > rhs.cost;
+      }
+    };
+
+    struct PositionLess {
+      const dynarray<Vertex> *vertices;
+
+      bool operator()(int a, int b) const {
+        const vec3 &p = (*vertices)[a].pos, &q = (*vertices)[b].pos;
+        if (p.x() != q.x()) return p.x() < q.x();
+        if (p.y() != q.y()) return p.y() < q.y();
+        return p.z() < q.z();
+      }
+    };
+
+    dynarray<Vertex> vertices;
+    dynarray<int> triangles;
+    dynarray<bool> triangleAlive;
+    int numAlive;
+
+    // per node: position, quadric, vertices, triangles, and a stamp bumped on every change
+    dynarray<vec3> nodePos;
+    dynarray<Quadric> quadrics;
+    std::vector<std::vector<int> > nodeVertices;
+    std::vector<std::vector<int> > nodeTriangles;
+    dynarray<int> stamps;
+    dynarray<bool> nodeAlive;
+
+    std::priority_queue<Collapse> queue;
+
+    void read(mesh &source) {
+      unsigned posSlot = source.get_slot(attribute_pos);
+      unsigned normalSlot = source.get_slot(attribute_normal);
+      unsigned uvSlot = source.get_slot(attribute_uv);
+
+      vertices.resize(source.get_num_vertices());
+      for (unsigned i = 0; i != source.get_num_vertices(); ++i) {
+        Vertex &v = vertices[i];
+        vec4 p = source.get_value(posSlot, i);
+        vec4 n = normalSlot != ~0u ? source.get_value(normalSlot, i) : vec4(0, 1, 0, 0);
+        vec4 t = uvSlot != ~0u ? source.get_value(uvSlot, i) : vec4(0, 0, 0, 0);
+        v.pos = vec3(p.x(), p.y(), p.z());
+        v.normal = vec3(n.x(), n.y(), n.z());
+        v.u = t.x();
+        v.v = t.y();
+      }
+
+      triangles.resize(0);
+      for (unsigned i = 0; i + 3 <= source.get_num_indices(); i += 3) {
+        unsigned a = source.get_index(i), b = source.get_index(i + 1), c = source.get_index(i + 2);
+        if (a == b || b == c || c == a) continue;
+        triangles.push_back(a);
+        triangles.push_back(b);
+        triangles.push_back(c);
+      }
+      numAlive = triangles.size() / 3;
+      triangleAlive.resize(numAlive);
+      for (int t = 0; t != numAlive; ++t) {
+        triangleAlive[t] = true;
+      }
+    }
+
+    // Vertices with the same position are one node
+    void weld() {
+      dynarray<int> sorted(vertices.size());
+      for (int i = 0; i != vertices.size(); ++i) {
+        sorted[i] = i;
+      }
+      PositionLess less = { &vertices };
+      if (sorted.size()) {
+        std::sort(&sorted[0], &sorted[0] + sorted.size(), less);
+      }
+
+      nodePos.resize(0);
+      nodeVertices.clear();
+      for (int i = 0; i != sorted.size(); ++i) {
+        Vertex &v = vertices[sorted[i]];
+        if (i == 0 || less(sorted[i - 1], sorted[i])) {
+          nodePos.push_back(v.pos);
+          nodeVertices.push_back(std::vector<int>());
+        }
+        v.node = nodePos.size() - 1;
+        nodeVertices.back().push_back(sorted[i]);
+      }
+
+      int numNodes = nodePos.size();
+      quadrics.resize(numNodes);
+      stamps.resize(numNodes);
+      nodeAlive.resize(numNodes);
+      nodeTriangles.assign(numNodes, std::vector<int>());
+      for (int n = 0; n != numNodes; ++n) {
+        quadrics[n].clear();
+        stamps[n] = 0;
+        nodeAlive[n] = true;
+      }
+    }
+
+    static uint64_t edgeKey(int a, int b) {
+      return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    }
+
+    int node(int t, int k) const {
+      return vertices[triangles[t * 3 + k]].node;
+    }
+
+    void buildQuadrics() {
+      // edges used by one triangle only are borders, found by sorting the node pairs
+      dynarray<uint64_t> edges;
+      for (int t = 0; t != triangles.size() / 3; ++t) {
+        vec3 p0 = nodePos[node(t, 0)], p1 = nodePos[node(t, 1)], p2 = nodePos[node(t, 2)];
+        vec3 n = (p1 - p0).cross(p2 - p0);
+        float area = n.length();
+        for (int k = 0; k != 3; ++k) {
+          nodeTriangles[node(t, k)].push_back(t);
+          int a = node(t, k), b = node(t, (k + 1) % 3);
+          edges.push_back(edgeKey(a, b));
+        }
+        if (area == 0.0f) continue;
+        n = n / area;
+        for (int k = 0; k != 3; ++k) {
+          quadrics[node(t, k)].addPlane(n.x(), n.y(), n.z(), -n.dot(p0), area);
+        }
+      }
+
+      if (edges.size()) {
+        std::sort(&edges[0], &edges[0] + edges.size());
+      }
+
+      for (int t = 0; t != triangles.size() / 3; ++t) {
+        vec3 p0 = nodePos[node(t, 0)], p1 = nodePos[node(t, 1)], p2 = nodePos[node(t, 2)];
+        vec3 n = (p1 - p0).cross(p2 - p0);
+        for (int k = 0; k != 3; ++k) {
+          int a = node(t, k), b = node(t, (k + 1) % 3);
+          uint64_t key = edgeKey(a, b);
+          uint64_t *end = &edges[0] + edges.size();
+          uint64_t *first = std::lower_bound(&edges[0], end, key);
+          if (first + 1 != end && first[1] == key) continue;
+          // plane through the border edge, perpendicular to the triangle
+          vec3 edge = nodePos[b] - nodePos[a];
+          vec3 side = edge.cross(n);
+          float length = side.length();
+          if (length == 0.0f) continue;
+          side = side / length;
+          double weight = edge.dot(edge) * BORDER_WEIGHT;
+          quadrics[a].addPlane(side.x(), side.y(), side.z(), -side.dot(nodePos[a]), weight);
+          quadrics[b].addPlane(side.x(), side.y(), side.z(), -side.dot(nodePos[a]), weight);
+        }
+      }
+    }
+
+    void queueEdges(int n) {
+      for (int i = 0; i != nodeTriangles[n].size(); ++i) {
+        int t = nodeTriangles[n][i];
+        if (!triangleAlive[t]) continue;
+        for (int k = 0; k != 3; ++k) {
+          int other = node(t, k);
+          if (other == n) continue;
+          Quadric q = quadrics[n];
+          q.add(quadrics[other]);
+          double toOther = q.error(nodePos[other]), toThis = q.error(nodePos[n]);
+          Collapse c;
+          if (toOther <= toThis) {
+            c.cost = toOther; c.from = n; c.to = other;
+          } else {
+            c.cost = toThis; c.from = other; c.to = n;
+          }
+          c.fromStamp = stamps[c.from];
+          c.toStamp = stamps[c.to];
+          queue.push(c);
+        }
+      }
+    }
+
+    // Moving from onto to must not turn any of the triangles that stay over
+    bool keepsOrientation(int from, int to) const {
+      for (int i = 0; i != nodeTriangles[from].size(); ++i) {
+        int t = nodeTriangles[from][i];
+        if (!triangleAlive[t]) continue;
+        vec3 p[3], q[3];
+        bool hasTo = false;
+        for (int k = 0; k != 3; ++k) {
+          int n = node(t, k);
+          hasTo |= n == to;
+          p[k] = nodePos[n];
+          q[k] = n == from ? nodePos[to] : p[k];
+        }
+        if (hasTo) continue;
+        vec3 before = (p[1] - p[0]).cross(p[2] - p[0]);
+        vec3 after = (q[1] - q[0]).cross(q[2] - q[0]);
+        if (before.dot(after) <= 0.0f) return false;
+      }
+      return true;
+    }
+
+    void collapse(int from, int to) {
+      // every vertex of from takes the vertex of to with the nearest texture coordinates
+      std::vector<int> &targets = nodeVertices[to];
+      for (int i = 0; i != nodeVertices[from].size(); ++i) {
+        int v = nodeVertices[from][i];
+        int best = targets[0];
+        float bestDistance = 1e30f;
+        for (int j = 0; j != targets.size(); ++j) {
+          const Vertex &w = vertices[targets[j]];
+          float du = w.u - vertices[v].u, dv = w.v - vertices[v].v;
+          if (du * du + dv * dv < bestDistance) {
+            bestDistance = du * du + dv * dv;
+            best = targets[j];
+          }
+        }
+        for (int k = 0; k != nodeTriangles[from].size(); ++k) {
+          int t = nodeTriangles[from][k];
+          for (int c = 0; c != 3; ++c) {
+            if (triangles[t * 3 + c] == v) triangles[t * 3 + c] = best;
+          }
+        }
+      }
+
+      for (int k = 0; k != nodeTriangles[from].size(); ++k) {
+        int t = nodeTriangles[from][k];
+        if (!triangleAlive[t]) continue;
+        if (node(t, 0) == node(t, 1) || node(t, 1) == node(t, 2) || node(t, 2) == node(t, 0)) {
+          triangleAlive[t] = false;
+          numAlive--;
+        } else {
+          nodeTriangles[to].push_back(t);
+        }
+      }
+
+      // drop the triangles of to that went away
+      std::vector<int> &kept = nodeTriangles[to];
+      int numKept = 0;
+      for (int k = 0; k != kept.size(); ++k) {
+        if (triangleAlive[kept[k]]) kept[numKept++] = kept[k];
+      }
+      kept.resize(numKept);
+
+      nodeAlive[from] = false;
+      nodeTriangles[from].clear();
+      quadrics[to].add(quadrics[from]);
+      stamps[from]++;
+      stamps[to]++;
+    }
+
+  public:
+    enum { BORDER_WEIGHT = 100 };
+
+    // Simplified copy of source with at most targetTriangles triangles when it can get there
+    void simplify(mesh &source, int targetTriangles, mesh &result) {
+      read(source);
+      weld();
+      buildQuadrics();
+
+      queue = std::priority_queue<Collapse>();
+      for (int n = 0; n != nodePos.size(); ++n) {
+        queueEdges(n);
+      }
+
+      while (numAlive > targetTriangles && !queue.empty()) {
+        Collapse c = queue.top();
+        queue.pop();
+        if (!nodeAlive[c.from] || !nodeAlive[c.to] || stamps[c.from] != c.fromStamp || stamps[c.to] != c.toStamp) continue;
+        if (!keepsOrientation(c.from, c.to)) continue;
+        collapse(c.from, c.to);
+        queueEdges(c.to);
+      }
+
+      // vertices still used, in their original order
+      mesh_builder mb;
+      mb.init(0, 0);
+      dynarray<int> remap(vertices.size());
+      for (int i = 0; i != vertices.size(); ++i) {
+        remap[i] = -1;
+      }
+      for (int t = 0; t != triangles.size() / 3; ++t) {
+        if (!triangleAlive[t]) continue;
+        for (int k = 0; k != 3; ++k) {
+          int v = triangles[t * 3 + k];
+          if (remap[v] < 0) {
+            const Vertex &src = vertices[v];
+            remap[v] = mb.add_vertex(vec4(src.pos.x(), src.pos.y(), src.pos.z(), 1.0f), vec4(src.normal.x(), src.normal.y(), src.normal.z(), 0.0f), src.u, src.v);
+          }
+          mb.add_index(remap[v]);
+        }
+      }
+      mb.get_mesh(result);
+    }
+
+    int getNumTriangles() const {
+      return numAlive;
+    }
+  };
+
+  // Far away tier of the trees: two crossed quads with the prototype drawn on them
+  // from the front and from the side. The pictures are drawn on the CPU from the
+  // triangles of the meshes and their diffuse texture, empty pixels are transparent.
+  class PropImpostor {
+    // one view: the prototype projected on the horizontal axis uAxis and upAxis, looking along viewAxis
+    static void drawView(std::vector<mesh*> &meshes, const image &texture, int uAxis, int upAxis, float upSign, int viewAxis,
+                         const vec3 &lo, const vec3 &hi, uint8_t *pixels, int x0, int width, int size, int stride) {
+      dynarray<float> depth(width * size);
+      for (int i = 0; i != depth.size(); ++i) {
+        depth[i] = -1e30f;
+      }
+      unsigned comps = texture.get_format() == GL_RGBA ? 4 : 3;
+      const uint8_t *texels = texture.get_bytes();
+      int tw = texture.get_width(), th = texture.get_height();
+
+      float su = width / (hi[uAxis] - lo[uAxis]), sv = size / (hi[upAxis] - lo[upAxis]);
+      for (int m = 0; m != meshes.size(); ++m) {
+        mesh &source = *meshes[m];
+        unsigned posSlot = source.get_slot(attribute_pos);
+        unsigned uvSlot = source.get_slot(attribute_uv);
+        for (unsigned i = 0; i + 3 <= source.get_num_indices(); i += 3) {
+          // screen x, y, depth towards the viewer and texture coordinates of the corners
+          float s[3][5];
+          for (int k = 0; k != 3; ++k) {
+            unsigned index = source.get_index(i + k);
+            vec4 p = source.get_value(posSlot, index);
+            vec4 t = uvSlot != ~0u ? source.get_value(uvSlot, index) : vec4(0, 0, 0, 0);
+            s[k][0] = (p[uAxis] - lo[uAxis]) * su;
+            s[k][1] = (upSign > 0 ? hi[upAxis] - p[upAxis] : p[upAxis] - lo[upAxis]) * sv;
+            s[k][2] = p[viewAxis];
+            s[k][3] = t.x();
+            s[k][4] = t.y();
+          }
+          float area = (s[1][0] - s[0][0]) * (s[2][1] - s[0][1]) - (s[2][0] - s[0][0]) * (s[1][1] - s[0][1]);
+          if (area == 0.0f) continue;
+
+          int minX = max(0, (int)floorf(min(s[0][0], min(s[1][0], s[2][0]))));
+          int maxX = min(width - 1, (int)floorf(max(s[0][0], max(s[1][0], s[2][0]))));
+          int minY = max(0, (int)floorf(min(s[0][1], min(s[1][1], s[2][1]))));
+          int maxY = min(size - 1, (int)floorf(max(s[0][1], max(s[1][1], s[2][1]))));
+          for (int y = minY; y <= maxY; ++y) {
+            for (int x = minX; x <= maxX; ++x) {
+              float px = x + 0.5f, py = y + 0.5f;
+              float l1 = ((px - s[0][0]) * (s[2][1] - s[0][1]) - (s[2][0] - s[0][0]) * (py - s[0][1])) / area;
+              float l2 = ((s[1][0] - s[0][0]) * (py - s[0][1]) - (px - s[0][0]) * (s[1][1] - s[0][1])) / area;
+              float l0 = 1.0f - l1 - l2;
+              if (l0 < 0.0f || l1 < 0.0f || l2 < 0.0f) continue;
+              float z = l0 * s[0][2] + l1 * s[1][2] + l2 * s[2][2];
+              float &d = depth[y * width + x];
+              if (z <= d) continue;
+
+              float u = l0 * s[0][3] + l1 * s[1][3] + l2 * s[2][3];
+              float v = l0 * s[0][4] + l1 * s[1][4] + l2 * s[2][4];
+              int tx = ((int)floorf(u * tw) % tw + tw) % tw;
+              int ty = ((int)floorf(v * th) % th + th) % th;
+              const uint8_t *texel = texels + (ty * tw + tx) * comps;
+              if (comps == 4 && texel[3] < 128) continue;
+
+              d = z;
+              uint8_t *dest = pixels + y * stride + (x0 + x) * 4;
+              dest[0] = texel[0];
+              dest[1] = texel[1];
+              dest[2] = texel[2];
+              dest[3] = 255;
+            }
+          }
+        }
+      }
+    }
+
+  public:
+    enum { SIZE = 64 };
+
+    // The quads in result, the pictures in a new image returned, NULL when there is nothing to draw.
+    // upAxis is the axis of the model that points up in the world, upSign its direction.
+    static image *build(std::vector<mesh*> &meshes, const image &texture, int upAxis, float upSign, mesh &result) {
+      if (!texture.get_bytes() || !texture.get_width() || !texture.get_height()) return NULL;
+      if (texture.get_format() != GL_RGB && texture.get_format() != GL_RGBA) return NULL;
+
+      vec3 lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f);
+      for (int m = 0; m != meshes.size(); ++m) {
+        unsigned posSlot = meshes[m]->get_slot(attribute_pos);
+        for (unsigned i = 0; i != meshes[m]->get_num_vertices(); ++i) {
+          vec4 p = meshes[m]->get_value(posSlot, i);
+          lo = lo.min(vec3(p.x(), p.y(), p.z()));
+          hi = hi.max(vec3(p.x(), p.y(), p.z()));
+        }
+      }
+      if (lo.x() >= hi.x() || lo.y() >= hi.y() || lo.z() >= hi.z()) return NULL;
+
+      // front view on the left half, side view on the right half
+      int a = (upAxis + 1) % 3, b = (upAxis + 2) % 3;
+      dynarray<uint8_t> pixels(SIZE * 2 * SIZE * 4);
+      memset(&pixels[0], 0, pixels.size());
+      drawView(meshes, texture, a, upAxis, upSign, b, lo, hi, &pixels[0], 0, SIZE, SIZE, SIZE * 2 * 4);
+      drawView(meshes, texture, b, upAxis, upSign, a, lo, hi, &pixels[0], SIZE, SIZE, SIZE, SIZE * 2 * 4);
+
+      // corners of the quads, top first, lit from above so that both get the light of the top of the tree
+      vec3 c = (lo + hi) * 0.5f;
+      float top = upSign > 0 ? hi[upAxis] : lo[upAxis], bottom = upSign > 0 ? lo[upAxis] : hi[upAxis];
+      vec4 up(0, 0, 0, 0);
+      up[upAxis] = upSign;
+      mesh_builder mb;
+      mb.init(0, 0);
+      for (unsigned q = 0; q != 2; ++q) {
+        int across = q ? b : a, along = q ? a : b;
+        float u0 = q * 0.5f;
+        for (unsigned k = 0; k != 4; ++k) {
+          vec4 pos(0, 0, 0, 1);
+          pos[across] = k == 0 || k == 3 ? lo[across] : hi[across];
+          pos[along] = c[along];
+          pos[upAxis] = k < 2 ? top : bottom;
+          mb.add_vertex(pos, up, k == 0 || k == 3 ? u0 : u0 + 0.5f, k < 2 ? 0.0f : 1.0f);
+        }
+        unsigned v = q * 4;
+        mb.add_index(v); mb.add_index(v + 1); mb.add_index(v + 2);
+        mb.add_index(v); mb.add_index(v + 2); mb.add_index(v + 3);
+      }
+      mb.get_mesh(result);
+
+      return new image(SIZE * 2, SIZE, GL_RGBA, &pixels[0]);
+    }
+  };
+}
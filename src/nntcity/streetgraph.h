@@ -0,0 +1,395 @@
+namespace octet {
+
+  // Road network of a city, built once the partition is finished.
+  // Nodes are the street extremes and edges are the streets. Edge ids are the
+  // indices of the streets in City::streetsList and node ids never change once
+  // created, so both can be stored instead of pointers.
+  // Streets removed by the incremental partition keep their edge id, with no nodes.
+  // Adjacency is kept in flat arrays (offset + count per node), every list is
+  // sorted by edge id. setEdge and removeEdge change the lists of a few nodes in place,
+  // a list that outgrows its room moves to the end of the array with twice the room.
+  class StreetGraph {
+  public:
+    struct Node {
+      vec4 point;
+      int firstEdge;
+      int numEdges;
+    };
+
+    struct Edge {
+      int nodes[2]; // nodes at points[0] and points[1] of the street
+    };
+
+  private:
+    dynarray<Node> nodes;
+    dynarray<Edge> edges;
+    dynarray<int> nodeEdges;
+    // room of the list of every node in nodeEdges
+    dynarray<int> nodeRoom;
+
+    // streets around every block (BSP leaf), same layout as the node adjacency
+    hash_map<void *, int> blockIds;
+    dynarray<int> blockFirstEdge;
+    dynarray<int> blockNumEdges;
+    dynarray<int> blockRoom;
+    dynarray<int> blockEdges;
+    // blocks at the left and right of every edge, -1 for none
+    dynarray<int> edgeBlocks;
+
+    PointHash nodeIndex;
+
+    int addNode(const vec4 &p) {
+      dynarray<int> found;
+      nodeIndex.find(p, found);
+      if (found.size()) {
+        return found[0];
+      }
+
+      int id = nodes.size();
+      nodes.resize(id + 1);
+      nodes[id].point = p;
+      nodes[id].firstEdge = nodeEdges.size();
+      nodes[id].numEdges = 0;
+      nodeRoom.push_back(0);
+      nodeIndex.add(p, id);
+      return id;
+    }
+
+    int addBlock(void *block) {
+      if (!block) return -1;
+      int &id = blockIds[block];
+      if (id == 0) {
+        blockFirstEdge.push_back(blockEdges.size());
+        blockNumEdges.push_back(0);
+        blockRoom.push_back(0);
+        id = blockFirstEdge.size();
+      }
+      // ids are stored +1 so that 0 means not found
+      return id - 1;
+    }
+
+    // Insert an edge in the sorted list at items[first, first + count), moving the list if it is full
+    static void insertSorted(dynarray<int> &items, int &first, int &count, int &room, int edge) {
+      if (count == room) {
+        int newRoom = room ? room * 2 : 4;
+        int newFirst = items.size();
+        items.resize(newFirst + newRoom);
+        for (int i = 0; i != count; ++i) {
+          items[newFirst + i] = items[first + i];
+        }
+        first = newFirst;
+        room = newRoom;
+      }
+      int i = count++;
+      for (; i != 0 && items[first + i - 1] > edge; --i) {
+        items[first + i] = items[first + i - 1];
+      }
+      items[first + i] = edge;
+    }
+
+    // Take an edge out of the sorted list at items[first, first + count)
+    static void eraseSorted(dynarray<int> &items, int first, int &count, int edge) {
+      int i = 0;
+      while (i != count && items[first + i] != edge) ++i;
+      if (i == count) return;
+      for (--count; i != count; ++i) {
+        items[first + i] = items[first + i + 1];
+      }
+    }
+
+    // True if the list is the expected one, which ends with -1
+    static bool isList(const int *items, int count, const int *expected) {
+      for (int i = 0; i != count; ++i) {
+        if (expected[i] != items[i]) return false;
+      }
+      return expected[count] == -1;
+    }
+
+    bool nodeEdgesAre(int node, const int *expected) const {
+      return isList(nodeEdges.data() + nodes[node].firstEdge, nodes[node].numEdges, expected);
+    }
+
+    bool blockEdgesAre(void *block, const int *expected) {
+      dynarray<int> result;
+      getBlockEdges(block, result);
+      return isList(result.data(), result.size(), expected);
+    }
+
+  public:
+    void reset() {
+      nodes.reset();
+      edges.reset();
+      nodeEdges.reset();
+      nodeRoom.reset();
+      blockIds.clear();
+      blockFirstEdge.reset();
+      blockNumEdges.reset();
+      blockRoom.reset();
+      blockEdges.reset();
+      edgeBlocks.reset();
+      nodeIndex.reset();
+    }
+
+    // Build the graph from the final list of streets, skipping the removed ones if given
+    template <class StreetList> void build(StreetList &streets, const dynarray<bool> *removed = NULL) {
+      reset();
+
+      edges.resize(streets.size());
+      edgeBlocks.resize(streets.size() * 2);
+
+      for (int i = 0; i != streets.size(); ++i) {
+        if (removed && (*removed)[i]) {
+          edges[i].nodes[0] = edges[i].nodes[1] = -1;
+          edgeBlocks[i*2+0] = edgeBlocks[i*2+1] = -1;
+          continue;
+        }
+
+        edges[i].nodes[0] = addNode(streets[i].points[0]);
+        edges[i].nodes[1] = addNode(streets[i].points[1]);
+        nodes[edges[i].nodes[0]].numEdges++;
+        if (edges[i].nodes[1] != edges[i].nodes[0]) nodes[edges[i].nodes[1]].numEdges++;
+
+        edgeBlocks[i*2+0] = addBlock(streets[i].leftNode);
+        edgeBlocks[i*2+1] = addBlock(streets[i].rightNode);
+        if (edgeBlocks[i*2+0] != -1) blockNumEdges[edgeBlocks[i*2+0]]++;
+        if (edgeBlocks[i*2+1] != -1 && edgeBlocks[i*2+1] != edgeBlocks[i*2+0]) blockNumEdges[edgeBlocks[i*2+1]]++;
+      }
+
+      // prefix sums give the start of every list, then fill them in edge order
+      int total = 0;
+      for (int n = 0; n != nodes.size(); ++n) {
+        nodes[n].firstEdge = total;
+        total += nodes[n].numEdges;
+        nodeRoom[n] = nodes[n].numEdges;
+        nodes[n].numEdges = 0;
+      }
+      nodeEdges.resize(total);
+
+      total = 0;
+      for (int b = 0; b != blockFirstEdge.size(); ++b) {
+        blockFirstEdge[b] = total;
+        total += blockNumEdges[b];
+        blockRoom[b] = blockNumEdges[b];
+        blockNumEdges[b] = 0;
+      }
+      blockEdges.resize(total);
+
+      for (int i = 0; i != edges.size(); ++i) {
+        if (edges[i].nodes[0] == -1) continue;
+
+        for (int j = 0; j != 2; ++j) {
+          Node &node = nodes[edges[i].nodes[j]];
+          if (j == 1 && edges[i].nodes[1] == edges[i].nodes[0]) break;
+          nodeEdges[node.firstEdge + node.numEdges++] = i;
+        }
+
+        for (int j = 0; j != 2; ++j) {
+          int b = edgeBlocks[i*2+j];
+          if (b == -1 || (j == 1 && b == edgeBlocks[i*2])) continue;
+          blockEdges[blockFirstEdge[b] + blockNumEdges[b]++] = i;
+        }
+      }
+    }
+
+    // Restore the road network from flat arrays, as saved by a city snapshot.
+    // Blocks are not restored, the partition does not exist anymore.
+    void load(const Node *nodes_, int numNodes, const Edge *edges_, int numEdges, const int *nodeEdges_, int numNodeEdges) {
+      reset();
+
+      nodes.resize(numNodes);
+      for (int i = 0; i != numNodes; ++i) nodes[i] = nodes_[i];
+      edges.resize(numEdges);
+      for (int i = 0; i != numEdges; ++i) edges[i] = edges_[i];
+      nodeEdges.resize(numNodeEdges);
+      for (int i = 0; i != numNodeEdges; ++i) nodeEdges[i] = nodeEdges_[i];
+      nodeRoom.resize(numNodes);
+      for (int i = 0; i != numNodes; ++i) {
+        nodeRoom[i] = nodes[i].numEdges;
+        nodeIndex.add(nodes[i].point, i);
+      }
+      edgeBlocks.resize(numEdges * 2);
+      for (int i = 0; i != numEdges * 2; ++i) edgeBlocks[i] = -1;
+    }
+
+    // Make the edge a street, or move it to where the street is now.
+    // Nodes are only added, a node left without edges stays with none.
+    template <class StreetType> void setEdge(int edge, const StreetType &street) {
+      while ((int)edges.size() <= edge) {
+        Edge none = { { -1, -1 } };
+        edges.push_back(none);
+        edgeBlocks.push_back(-1);
+        edgeBlocks.push_back(-1);
+      }
+      removeEdge(edge);
+
+      int n[2] = { addNode(street.points[0]), addNode(street.points[1]) };
+      for (int j = 0; j != 2; ++j) {
+        edges[edge].nodes[j] = n[j];
+        if (j == 1 && n[1] == n[0]) break;
+        insertSorted(nodeEdges, nodes[n[j]].firstEdge, nodes[n[j]].numEdges, nodeRoom[n[j]], edge);
+      }
+
+      void *sides[2] = { street.leftNode, street.rightNode };
+      for (int j = 0; j != 2; ++j) {
+        int b = addBlock(sides[j]);
+        edgeBlocks[edge*2+j] = b;
+        if (b == -1 || (j == 1 && b == edgeBlocks[edge*2])) continue;
+        insertSorted(blockEdges, blockFirstEdge[b], blockNumEdges[b], blockRoom[b], edge);
+      }
+    }
+
+    // Take a removed street out of the lists of its nodes and blocks, its id stays with no nodes
+    void removeEdge(int edge) {
+      if (edge >= (int)edges.size() || edges[edge].nodes[0] == -1) return;
+
+      for (int j = 0; j != 2; ++j) {
+        int n = edges[edge].nodes[j];
+        if (j == 1 && n == edges[edge].nodes[0]) break;
+        eraseSorted(nodeEdges, nodes[n].firstEdge, nodes[n].numEdges, edge);
+      }
+      for (int j = 0; j != 2; ++j) {
+        int b = edgeBlocks[edge*2+j];
+        if (b == -1 || (j == 1 && b == edgeBlocks[edge*2])) continue;
+        eraseSorted(blockEdges, blockFirstEdge[b], blockNumEdges[b], edge);
+      }
+      edges[edge].nodes[0] = edges[edge].nodes[1] = -1;
+      edgeBlocks[edge*2+0] = edgeBlocks[edge*2+1] = -1;
+    }
+
+    int getNumNodeEdges() const {
+      return nodeEdges.size();
+    }
+
+    // Flat arrays, for saving
+    const Node *getNodes() const {
+      return nodes.data();
+    }
+
+    const Edge *getEdges() const {
+      return edges.data();
+    }
+
+    const int *getNodeEdges() const {
+      return nodeEdges.data();
+    }
+
+    int getNumNodes() const {
+      return nodes.size();
+    }
+
+    int getNumEdges() const {
+      return edges.size();
+    }
+
+    const Node &getNode(int node) const {
+      return nodes[node];
+    }
+
+    const Edge &getEdge(int edge) const {
+      return edges[edge];
+    }
+
+    // i-th street meeting at a node, 0 <= i < getNode(node).numEdges
+    int getNodeEdge(int node, int i) const {
+      return nodeEdges[nodes[node].firstEdge + i];
+    }
+
+    // True if the street ends at the node
+    bool isNodeOfEdge(int node, int edge) const {
+      return edges[edge].nodes[0] == node || edges[edge].nodes[1] == node;
+    }
+
+    // Node at the other extreme of a street
+    int getOtherNode(int edge, int node) const {
+      return edges[edge].nodes[0] == node ? edges[edge].nodes[1] : edges[edge].nodes[0];
+    }
+
+    // Streets having the block at its left or right, in street order
+    void getBlockEdges(void *block, dynarray<int> &result) {
+      result.resize(0);
+      if (!block || !blockIds.contains(block)) return;
+
+      int b = blockIds[block] - 1;
+      for (int i = 0; i != blockNumEdges[b]; ++i) {
+        result.push_back(blockEdges[blockFirstEdge[b] + i]);
+      }
+    }
+
+    // Builds and edits the network of a square of streets with a street hanging from a corner
+    // and compares the adjacency lists with the ones worked out by hand.
+    // Returns false if a list is wrong.
+    static bool checkAdjacency() {
+      struct CheckStreet {
+        vec4 points[2];
+        void *leftNode;
+        void *rightNode;
+
+        CheckStreet() {
+        }
+
+        CheckStreet(float x0, float z0, float x1, float z1, void *left, void *right) {
+          points[0] = vec4(x0, 0.0f, z0, 1.0f);
+          points[1] = vec4(x1, 0.0f, z1, 1.0f);
+          leftNode = left;
+          rightNode = right;
+        }
+      };
+      int blockA, blockB;
+
+      //  3 --2-- 2
+      //  |   A   |  B
+      //  3       1
+      //  |       |  B
+      //  0 --0-- 1 --4-- 4
+      dynarray<CheckStreet> streets;
+      streets.push_back(CheckStreet(0, 0, 1, 0, &blockA, NULL));
+      streets.push_back(CheckStreet(1, 0, 1, 1, &blockA, &blockB));
+      streets.push_back(CheckStreet(1, 1, 0, 1, &blockA, NULL));
+      streets.push_back(CheckStreet(0, 1, 0, 0, &blockA, NULL));
+      streets.push_back(CheckStreet(1, 0, 2, 0, &blockB, NULL));
+      // the diagonal is removed
+      streets.push_back(CheckStreet(0, 0, 1, 1, &blockA, &blockA));
+      dynarray<bool> removed;
+      removed.resize(streets.size());
+      for (int i = 0; i != (int)removed.size(); ++i) {
+        removed[i] = i == 5;
+      }
+
+      StreetGraph graph;
+      graph.build(streets, &removed);
+      int n0 = graph.getEdge(0).nodes[0], n1 = graph.getEdge(0).nodes[1];
+      int n2 = graph.getEdge(1).nodes[1], n4 = graph.getEdge(4).nodes[1];
+
+      static const int n0Edges[] = { 0, 3, -1 }, n1Edges[] = { 0, 1, 4, -1 }, n2Edges[] = { 1, 2, -1 };
+      static const int aEdges[] = { 0, 1, 2, 3, -1 }, bEdges[] = { 1, 4, -1 };
+      bool ok = graph.getNumNodes() == 5 && graph.getEdge(5).nodes[0] == -1 && graph.getEdge(3).nodes[1] == n0;
+      ok = ok && graph.nodeEdgesAre(n0, n0Edges) && graph.nodeEdgesAre(n1, n1Edges) && graph.nodeEdgesAre(n2, n2Edges);
+      ok = ok && graph.blockEdgesAre(&blockA, aEdges) && graph.blockEdgesAre(&blockB, bEdges);
+      ok = ok && graph.isNodeOfEdge(n1, 4) && !graph.isNodeOfEdge(n0, 4) && graph.getOtherNode(4, n1) == n4;
+
+      // the diagonal comes back, with block A at both sides
+      graph.setEdge(5, streets[5]);
+      static const int n0Diagonal[] = { 0, 3, 5, -1 }, n2Diagonal[] = { 1, 2, 5, -1 }, aDiagonal[] = { 0, 1, 2, 3, 5, -1 };
+      ok = ok && graph.getNumNodes() == 5 && graph.nodeEdgesAre(n0, n0Diagonal) && graph.nodeEdgesAre(n2, n2Diagonal);
+      ok = ok && graph.blockEdgesAre(&blockA, aDiagonal) && graph.blockEdgesAre(&blockB, bEdges);
+
+      // street 4 moves to corner 2 and street 1 is removed
+      graph.setEdge(4, CheckStreet(1, 1, 2, 0, &blockB, NULL));
+      graph.removeEdge(1);
+      static const int n1Moved[] = { 0, -1 }, n2Moved[] = { 2, 4, 5, -1 }, aMoved[] = { 0, 2, 3, 5, -1 }, bMoved[] = { 4, -1 };
+      ok = ok && graph.nodeEdgesAre(n1, n1Moved) && graph.nodeEdgesAre(n2, n2Moved) && graph.getEdge(1).nodes[0] == -1;
+      ok = ok && graph.blockEdgesAre(&blockA, aMoved) && graph.blockEdgesAre(&blockB, bMoved) && graph.getOtherNode(4, n2) == n4;
+
+      // corner 0 outgrows its room, its list moves and the others stay where they are
+      for (int i = 6; i != 14; ++i) {
+        graph.setEdge(i, CheckStreet(0, 0, (float)i, 5, NULL, NULL));
+      }
+      static const int n0Grown[] = { 0, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, -1 };
+      ok = ok && graph.getNumNodes() == 13 && graph.nodeEdgesAre(n0, n0Grown) && graph.nodeEdgesAre(n2, n2Moved);
+      ok = ok && graph.blockEdgesAre(&blockA, aMoved);
+
+      printf("Street graph check: %s\n", ok ? "ok." : "ERROR: wrong adjacency lists.");
+      return ok;
+    }
+  };
+}
@@ -36,6 +36,13 @@
 #include <stdarg.h>
 #include <math.h>
 #include <assert.h>
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
 
 // xml library
 #include "../tinyxml/tinystr.cpp"
@@ -64,6 +71,7 @@ void operator delete(void *ptr, void *place, dynarray_dummy_t x) {}
   typedef name &name##_r;
 
 #include "../containers/allocator.h"
+#include "../containers/arena.h"
 #include "../containers/dictionary.h"
 #include "../containers/hash_map.h"
 #include "../containers/double_list.h"
@@ -136,6 +144,7 @@ static char *get_sprintf_buffer() {
 #include "../loaders/jpeg_encoder.h"
 #include "../loaders/tga_decoder.h"
 #include "../loaders/dds_decoder.h"
+#include "../loaders/heightfield_decoder.h"
 
 // resources
 #include "../resources/zip_file.h"
@@ -159,6 +168,7 @@ static char *get_sprintf_buffer() {
 #include "../shaders/bump_shader.h"
 #include "../shaders/city_bump_shader.h"
 #include "../shaders/city_buildings_bump_shader.h"
+#include "../shaders/city_props_bump_shader.h"
 #include "../shaders/skybox_shader.h"
 
 #include "../physics/physics.h"
@@ -176,6 +186,7 @@ static char *get_sprintf_buffer() {
 #include "../scene/camera_instance.h"
 #include "../scene/light_instance.h"
 #include "../scene/mesh_instance.h"
+#include "../scene/render_queue.h"
 #include "../scene/animation_instance.h"
 #include "../scene/scene.h"
 #include "../scene/displacement_map.h"
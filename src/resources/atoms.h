@@ -113,4 +113,6 @@ OCTET_ATOM(uscale)
 OCTET_ATOM(vscale)
 OCTET_ATOM(flags)
 OCTET_ATOM(size)
+OCTET_ATOM(index_chunks)
+OCTET_ATOM(num_chunks)
 
@@ -116,6 +116,14 @@ namespace octet {
       //glUnmapBuffer(target);
     }
 
+    // upload only the bytes from offset to offset + size after writing them
+    void unlock(unsigned offset, unsigned size) const {
+      assert(offset + size <= this->get_size());
+
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, offset, size, &bytes[offset]);
+    }
+
     void bind() const {
       glBindBuffer(target, buffer);
     }
@@ -13,7 +13,7 @@ namespace octet {
   class mesh_builder {
     struct vertex { float pos[3]; float normal[3]; float uv[2]; };
     dynarray<vertex, allocator> vertices;
-    dynarray<unsigned short, allocator> indices;
+    dynarray<uint32_t, allocator> indices;
     
     struct sphere {
       vec4 center;
@@ -31,7 +31,7 @@ namespace octet {
 
     // For a cube, add the front face. Matrix transforms are used to add the others.
     void add_front_face(float size) {
-      unsigned short cur_vertex = (unsigned short)vertices.size();
+      unsigned cur_vertex = (unsigned)vertices.size();
       add_vertex(vec4(-size, -size, size, 1), vec4(0, 0, 1, 0), 0, 0);
       add_vertex(vec4(-size,  size, size, 1), vec4(0, 0, 1, 0), 0, 1);
       add_vertex(vec4( size,  size, size, 1), vec4(0, 0, 1, 0), 1, 1);
@@ -46,7 +46,7 @@ namespace octet {
 
     // Add a front face aligned to plane XY, with distance z from origin
     void add_front_face(float x, float y, float z, float xOffset = 0.0f, float yOffset = 0.0f) {
-      unsigned short cur_vertex = (unsigned short)vertices.size();
+      unsigned cur_vertex = (unsigned)vertices.size();
       add_vertex(vec4(-x + xOffset, -y + yOffset, z, 1), vec4(0, 0, 1, 0), 0, 0);
       add_vertex(vec4(-x + xOffset,  y + yOffset, z, 1), vec4(0, 0, 1, 0), 0, 1);
       add_vertex(vec4( x + xOffset,  y + yOffset, z, 1), vec4(0, 0, 1, 0), 1, 1);
@@ -60,7 +60,7 @@ namespace octet {
     }
 
     void add_face(vec4 v1, vec4 v2, vec4 v3, vec4 v4, vec4 normal){
-      unsigned short cur_vertex = (unsigned short)vertices.size();
+      unsigned cur_vertex = (unsigned)vertices.size();
       add_vertex(v1, normal, 0, 0);
       add_vertex(v2, normal, 0, 1);
       add_vertex(v3, normal, 1, 1);
@@ -166,6 +166,14 @@ namespace octet {
       indices.push_back(index);
     }
 
+    unsigned get_num_vertices() const {
+      return vertices.size();
+    }
+
+    unsigned get_num_indices() const {
+      return indices.size();
+    }
+
     // add a cube to the model at the current matrix location
     // as in glutSolidCube
     void add_cube(float size) {
@@ -213,10 +221,10 @@ namespace octet {
       add_face((*vertices)[3], (*vertices)[7], (*vertices)[4], (*vertices)[0], vec4(-1, 0, 0, 0));
     }
 
-    void add_vertices(dynarray<vec4> &vertices_, dynarray<unsigned short> &indices_, dynarray<vec4> &normals_, dynarray<vec2> &uvcoords_,
+    void add_vertices(dynarray<vec4> &vertices_, dynarray<uint32_t> &indices_, dynarray<vec4> &normals_, dynarray<vec2> &uvcoords_,
                       vec4 &cityDimensions, vec4 &cityCenter, float multiplier, float offsetX, float offsetY,
                       unsigned nx, unsigned ny, vec4 *normalMap, unsigned hmx, unsigned hmy, float *heightmap) {
-      unsigned short cur_vertex = (unsigned short)vertices.size();
+      unsigned cur_vertex = (unsigned)vertices.size();
 
       for (int i = 0; i != vertices_.size(); i++) {
         vec4 &vertex = vertices_[i];
@@ -226,7 +234,10 @@ namespace octet {
           float v_ = (vertex.z()-cityCenter.z()+cityDimensions.z()*0.5f) / (cityDimensions.z());
           u_ = (u_*multiplier)+offsetX;
           v_ = ((1-v_)*multiplier)+offsetY;
-          add_vertex(vertex, normalMap[nx*(int)floor(v_*ny)+(int)floor(u_*nx)], uvcoords_[i].x(), uvcoords_[i].y());
+          // clamped to the border, vertices can be outside the terrain in a CityWorld
+          int ni = min(max((int)floor(u_*nx), 0), (int)nx-1);
+          int nj = min(max((int)floor(v_*ny), 0), (int)ny-1);
+          add_vertex(vertex, normalMap[nx*nj+ni], uvcoords_[i].x(), uvcoords_[i].y());
         } else {
           add_vertex(vertex, normals_[i], 0.0f, 0.0f);
         }
@@ -236,6 +247,20 @@ namespace octet {
       }
     }
 
+    // append the geometry of another builder, its vertices are already transformed
+    void add_mesh_builder(mesh_builder &other) {
+      unsigned cur_vertex = (unsigned)vertices.size();
+      vertices.reserve(vertices.size() + other.vertices.size());
+      indices.reserve(indices.size() + other.indices.size());
+
+      for (int i = 0; i != other.vertices.size(); i++) {
+        vertices.push_back(other.vertices[i]);
+      }
+      for (int i = 0; i != other.indices.size(); i++) {
+        indices.push_back(cur_vertex+other.indices[i]);
+      }
+    }
+
     void add_cuboid_heights(float x, float y, float z, unsigned nz, float *heights = NULL) {
       add_front_face(x, y, z, 0.0f, heights[0]);
       matrix.rotateY180();
@@ -245,7 +270,7 @@ namespace octet {
       float zsize = (z*2.0f)/nz;
 
       for (unsigned i = 0; i != nz; ++i) {
-        unsigned short cur_vertex = (unsigned short)vertices.size();
+        unsigned cur_vertex = (unsigned)vertices.size();
         float yOffset0 = heights[i];
         float yOffset1 = heights[i+1];
 
@@ -311,7 +336,7 @@ namespace octet {
       float ySizeBy2 = ySize * 0.5f;
       for (unsigned i = 0; i != nx; ++i) {
         for (unsigned j = 0; j != ny; ++j) {
-          unsigned short cur_vertex = (unsigned short)vertices.size();
+          unsigned cur_vertex = (unsigned)vertices.size();
           add_vertex(vec4( i*xsize-xSizeBy2, j*ysize-ySizeBy2, 0, 1), vec4(0, 0, 1, 0), 0, 0);
           add_vertex(vec4( i*xsize-xSizeBy2, (j+1)*ysize-ySizeBy2, 0, 1), vec4(0, 0, 1, 0), 0, 1);
           add_vertex(vec4( (i+1)*xsize-xSizeBy2, (j+1)*ysize-ySizeBy2, 0, 1), vec4(0, 0, 1, 0), 1, 1);
@@ -336,7 +361,7 @@ namespace octet {
       float xSizeBy2 = xSize * 0.5f;
       float ySizeBy2 = ySize * 0.5f;
 
-      unsigned short cur_vertex = (unsigned short)vertices.size();
+      unsigned cur_vertex = (unsigned)vertices.size();
 
       for (unsigned j = 0; j != ny; ++j) {
         for (unsigned i = 0; i != nx; ++i) {
@@ -11,12 +11,52 @@
 // get a mesh mesh from the builder either as VBOs or allocated memory.
 namespace octet {
   inline void mesh_builder::get_mesh(mesh &s) {
-    unsigned isize = indices.size() * sizeof(indices[0]);
     unsigned vsize = vertices.size() * sizeof(vertices[0]);
     s.init();
-    s.allocate(vsize, isize);
-    s.assign(vsize, isize, (unsigned char*)&vertices[0], (unsigned char*)&indices[0]);
-    s.set_params(sizeof(vertex), indices.size(), vertices.size(), GL_TRIANGLES, GL_UNSIGNED_SHORT);
+
+    // 16 bit indices when they fit, GLES2 only has 32 bit indices with OES_element_index_uint.
+    // Bigger meshes are split into chunks of whole triangles that each use a window of 65536 vertices.
+    dynarray<unsigned short> short_indices(indices.size());
+    mesh::index_chunk chunks[mesh::max_chunks];
+    unsigned num_chunks = 0;
+    bool is_short = vertices.size() <= 0x10000;
+    if (is_short) {
+      for (unsigned i = 0; i != indices.size(); ++i) {
+        short_indices[i] = (unsigned short)indices[i];
+      }
+    } else if (indices.size() % 3 == 0) {
+      is_short = true;
+      unsigned base = 0;
+      for (unsigned i = 0; i != indices.size(); i += 3) {
+        unsigned lo = min(indices[i], min(indices[i+1], indices[i+2]));
+        unsigned hi = max(indices[i], max(indices[i+1], indices[i+2]));
+        if (!num_chunks || lo < base || hi - base > 0xffff) {
+          if (num_chunks == mesh::max_chunks || hi - lo > 0xffff) {
+            is_short = false;
+            break;
+          }
+          chunks[num_chunks].first_index = i;
+          chunks[num_chunks].first_vertex = base = lo;
+          num_chunks++;
+        }
+        for (unsigned j = 0; j != 3; ++j) {
+          short_indices[i+j] = (unsigned short)(indices[i+j] - base);
+        }
+      }
+    }
+
+    if (is_short) {
+      unsigned isize = short_indices.size() * sizeof(short_indices[0]);
+      s.allocate(vsize, isize);
+      s.assign(vsize, isize, (unsigned char*)&vertices[0], (unsigned char*)&short_indices[0]);
+      s.set_params(sizeof(vertex), indices.size(), vertices.size(), GL_TRIANGLES, GL_UNSIGNED_SHORT);
+      s.set_chunks(chunks, num_chunks);
+    } else {
+      unsigned isize = indices.size() * sizeof(indices[0]);
+      s.allocate(vsize, isize);
+      s.assign(vsize, isize, (unsigned char*)&vertices[0], (unsigned char*)&indices[0]);
+      s.set_params(sizeof(vertex), indices.size(), vertices.size(), GL_TRIANGLES, GL_UNSIGNED_INT);
+    }
 
     s.add_attribute(attribute_pos, 3, GL_FLOAT, 0);
     s.add_attribute(attribute_normal, 3, GL_FLOAT, 12);
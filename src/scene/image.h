@@ -230,6 +230,16 @@ namespace octet {
     image(const image &other) {
       init(other);
     }
+
+    // image made on the fly from RGB or RGBA pixels, mipmaps are made by GL
+    image(unsigned width_, unsigned height_, unsigned format_, const uint8_t *pixels) {
+      init("");
+      width = (uint16_t)width_;
+      height = (uint16_t)height_;
+      format = (uint16_t)format_;
+      bytes.resize(width_ * height_ * (format_ == RGBA ? 4 : 3));
+      memcpy(&bytes[0], pixels, bytes.size());
+    }
     
     ~image() {
     }
@@ -242,6 +252,16 @@ namespace octet {
       return height;
     }
 
+    // GL format of the bytes, RGB or RGBA for decoded images
+    unsigned get_format() const {
+      return format;
+    }
+
+    // pixels of the top mip level, rows of get_width() pixels
+    const uint8_t *get_bytes() const {
+      return bytes.data();
+    }
+
     // access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -158,8 +158,8 @@ namespace octet {
       bind_textures();
     }
 
-	void render_building(city_buildings_bump_shader &shader, const mat4t &modelToProjection, const mat4t &modelToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights, float building_height, float building_area, int texture_switcher, int part_to_render) const {
-      shader.render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, building_height, building_area, texture_switcher, part_to_render);
+	void render_building(city_buildings_bump_shader &shader, const mat4t &modelToProjection, const mat4t &modelToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights, int texture_switcher) const {
+      shader.render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights, texture_switcher);
       bind_textures_buildings();
     }
 
@@ -174,6 +174,20 @@ namespace octet {
       bind_textures();
     }
 
+    void render_props(city_props_bump_shader &shader, const mat4t &worldToProjection, const mat4t &worldToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights) const {
+      shader.render(worldToProjection, worldToCamera, light_uniforms, num_light_uniforms, num_lights);
+      bind_textures();
+    }
+
+    // textures only, for a shader that is already in use (render queue)
+    void render_textures() const {
+      bind_textures();
+    }
+
+    void render_textures_building() const {
+      bind_textures_buildings();
+    }
+
   };
 }
 
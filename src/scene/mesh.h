@@ -17,6 +17,15 @@ namespace octet {
       vec3p normal;
       vec2p uv;
     };
+
+    // a run of 16 bit indices from first_index counted from first_vertex,
+    // meshes with more than 65536 vertices are drawn as chunks
+    struct index_chunk {
+      uint32_t first_index;
+      uint32_t first_vertex;
+    };
+
+    enum { max_chunks = 64 };
   private:
     ref<gl_resource> vertices;
     ref<gl_resource> indices;
@@ -34,6 +43,13 @@ namespace octet {
 
     uint8_t num_slots;
 
+    // chunks of the indices, none when the indices count from vertex 0
+    index_chunk chunks[max_chunks];
+    uint8_t num_chunks;
+
+    // first vertex of the attribute pointers since enable_attributes
+    mutable unsigned bound_vertex;
+
     // optional skin
     ref<skin> mesh_skin;
     
@@ -95,6 +111,8 @@ namespace octet {
       v.visit(index_type, atom_index_type);
       v.visit(normalized, atom_normalized);
       v.visit(num_slots, atom_num_slots);
+      v.visit(chunks, atom_index_chunks);
+      v.visit(num_chunks, atom_num_chunks);
       v.visit(mesh_skin, atom_mesh_skin);
       v.visit(mesh_aabb, atom_aabb);
     }
@@ -116,6 +134,8 @@ namespace octet {
       normalized = 0;
 
       num_slots = 0;
+      num_chunks = 0;
+      bound_vertex = 0;
       index_type = GL_UNSIGNED_SHORT;
       mode = GL_TRIANGLES;
 
@@ -186,6 +206,31 @@ namespace octet {
       return num_slots;
     }
 
+    unsigned get_num_chunks() const {
+      return num_chunks;
+    }
+
+    const index_chunk *get_chunks() const {
+      return chunks;
+    }
+
+    // set the chunks of the indices, the first one starts at index 0
+    void set_chunks(const index_chunk *src, unsigned count) {
+      assert(count <= max_chunks);
+      memcpy(chunks, src, count * sizeof(index_chunk));
+      num_chunks = (uint8_t)count;
+    }
+
+    // the chunk that holds an index
+    unsigned get_chunk_of(unsigned index) const {
+      unsigned lo = 0, hi = num_chunks;
+      while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if (chunks[mid].first_index <= index) lo = mid; else hi = mid;
+      }
+      return lo;
+    }
+
     // get the optional skin data
     skin *get_skin() const {
       return (skin*)mesh_skin;
@@ -308,6 +353,9 @@ namespace octet {
         result = *src;
         indices->unlock_read_only();
       }
+      if (num_chunks) {
+        result += chunks[get_chunk_of(index)].first_vertex;
+      }
       return result;
     }
 
@@ -352,6 +400,14 @@ namespace octet {
     // render a mesh with OpenGL
     // assume the shader, uniforms and render params are already set up.
     void enable_attributes() const {
+      set_attribute_pointers(0);
+      for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
+        glEnableVertexAttribArray(get_attr(slot));
+      }
+    }
+
+    // point the attributes at the vertices from first_vertex
+    void set_attribute_pointers(unsigned first_vertex) const {
       vertices->bind();
 
       unsigned n = normalized;
@@ -359,16 +415,38 @@ namespace octet {
         unsigned size = get_size(slot);
         unsigned kind = get_kind(slot);
         unsigned attr = get_attr(slot);
-        unsigned offset = get_offset(slot);
+        size_t offset = get_offset(slot) + (size_t)first_vertex * get_stride();
         glVertexAttribPointer(attr, size, kind, n & 1, get_stride(), (void*)(offset));
-        glEnableVertexAttribArray(attr);
         n >>= 1;
       }
+      bound_vertex = first_vertex;
     }
 
     void draw() {
+      draw(0, get_num_indices());
+    }
+
+    // draw count indices from first, the attributes must be enabled
+    void draw(unsigned first, unsigned count) {
       indices->bind();
-      glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)0);
+      unsigned index_size = get_index_type() == GL_UNSIGNED_SHORT ? 2 : 4;
+      if (!num_chunks) {
+        glDrawElements(get_mode(), count, get_index_type(), (GLvoid*)(size_t)(first * index_size));
+        return;
+      }
+
+      // one draw for each chunk in the range, with the attributes moved to its first vertex
+      unsigned end = first + count;
+      for (unsigned chunk = get_chunk_of(first); chunk != num_chunks && chunks[chunk].first_index < end; ++chunk) {
+        unsigned chunk_end = chunk + 1 != num_chunks ? chunks[chunk + 1].first_index : num_indices;
+        unsigned from = max(first, (unsigned)chunks[chunk].first_index);
+        unsigned to = min(end, chunk_end);
+        if (from >= to) continue;
+        if (bound_vertex != chunks[chunk].first_vertex) {
+          set_attribute_pointers(chunks[chunk].first_vertex);
+        }
+        glDrawElements(get_mode(), to - from, get_index_type(), (GLvoid*)(size_t)(from * index_size));
+      }
     }
 
     void disable_attributes() {
@@ -480,6 +558,7 @@ namespace octet {
       allocate(vsize, isize);
       set_params(stride + 24, source.get_num_indices(), source.get_num_vertices(), source.get_mode(), source.get_index_type());
       indices = source.get_indices();
+      set_chunks(source.chunks, source.num_chunks);
 
       unsigned pos_slot = source.get_slot(attribute_pos);
       unsigned uv_slot = source.get_slot(attribute_uv);
@@ -0,0 +1,336 @@
+namespace octet {
+  class render_pass;
+
+  // one object to draw
+  struct render_packet {
+    render_pass *pass;
+    material *mat;
+
+    // the mesh for the passes that draw meshes, whatever the pass draws for the others
+    void *object;
+
+    // free for the pass, a part or a level of detail
+    int tag;
+
+    mat4t modelToWorld;
+  };
+
+  // how packets are drawn, usually one per shader
+  class render_pass {
+  public:
+    virtual ~render_pass() {
+    }
+
+    // program and uniforms shared by every packet of the pass
+    virtual void bind_shader() = 0;
+
+    // textures of a material, after bind_shader
+    virtual void bind_material(material *mat) = 0;
+
+    virtual void draw(const render_packet &packet) = 0;
+  };
+
+  // Objects are submitted as packets in any order and drawn sorted so that the packets
+  // with the same pass (shader) and then the same material are drawn together, nearest first.
+  // The pass sets up its shader once per run of packets and the material once per change.
+  // Transparent packets go after the others, furthest first.
+  class render_queue {
+    dynarray<render_packet> packets;
+
+    // sort keys and packet indices, the temp arrays are for the radix sort
+    dynarray<uint64_t> keys;
+    dynarray<unsigned> order;
+    dynarray<uint64_t> temp_keys;
+    dynarray<unsigned> temp_order;
+
+    // passes and materials numbered in order of first submission, 0 is no material
+    hash_map<void *, unsigned> pass_ids;
+    hash_map<void *, unsigned> material_ids;
+    unsigned num_passes;
+    unsigned num_materials;
+
+    // counters for the last frame
+    int shader_changes;
+    int material_changes;
+    int unsorted_changes;
+
+    static uint32_t depth_bits(float depth) {
+      // the bits of a positive float sort like the float
+      if (!(depth > 0.0f)) return 0;
+      uint32_t bits;
+      memcpy(&bits, &depth, sizeof(bits));
+      return bits;
+    }
+
+    // least significant byte first, skipping the bytes that are the same in every key
+    void sort() {
+      unsigned n = keys.size();
+      order.resize(n);
+      temp_keys.resize(n);
+      temp_order.resize(n);
+      for (unsigned i = 0; i != n; ++i) {
+        order[i] = i;
+      }
+      if (!n) return;
+
+      for (unsigned shift = 0; shift != 64; shift += 8) {
+        unsigned counts[256];
+        memset(counts, 0, sizeof(counts));
+        for (unsigned i = 0; i != n; ++i) {
+          counts[(keys[i] >> shift) & 0xff]++;
+        }
+        if (counts[(keys[0] >> shift) & 0xff] == n) continue;
+
+        unsigned total = 0;
+        for (unsigned b = 0; b != 256; ++b) {
+          unsigned count = counts[b];
+          counts[b] = total;
+          total += count;
+        }
+        for (unsigned i = 0; i != n; ++i) {
+          unsigned dest = counts[(keys[i] >> shift) & 0xff]++;
+          temp_keys[dest] = keys[i];
+          temp_order[dest] = order[i];
+        }
+        keys.swap(temp_keys);
+        order.swap(temp_order);
+      }
+    }
+
+    // changes of pass or material drawing the packets in this order
+    int count_changes(const unsigned *indices) const {
+      int changes = 0;
+      render_pass *pass = 0;
+      material *mat = 0;
+      for (unsigned i = 0; i != packets.size(); ++i) {
+        const render_packet &packet = packets[indices ? indices[i] : i];
+        if (packet.pass != pass) {
+          changes += packet.mat ? 2 : 1;
+        } else if (packet.mat != mat && packet.mat) {
+          changes++;
+        }
+        pass = packet.pass;
+        mat = packet.mat;
+      }
+      return changes;
+    }
+
+  public:
+    render_queue() {
+      num_passes = 0;
+      num_materials = 0;
+      shader_changes = 0;
+      material_changes = 0;
+      unsorted_changes = 0;
+    }
+
+    // empty the queue for a new frame
+    void begin() {
+      packets.resize(0);
+      keys.resize(0);
+      pass_ids.clear();
+      material_ids.clear();
+      num_passes = 0;
+      num_materials = 0;
+    }
+
+    // depth is the distance from the camera, mat may be NULL for passes without materials
+    void submit(render_pass *pass, material *mat, void *object, const mat4t &modelToWorld, float depth, int tag = 0, bool transparent = false) {
+      unsigned &pass_id = pass_ids[(void*)pass];
+      if (!pass_id) pass_id = ++num_passes;
+      unsigned mat_id = 0;
+      if (mat) {
+        unsigned &id = material_ids[(void*)mat];
+        if (!id) id = ++num_materials;
+        mat_id = id;
+      }
+
+      // opaque: pass 8 bits, material 23 bits, depth 32 bits nearest first
+      // transparent: depth 32 bits furthest first, pass 8 bits, material 23 bits
+      uint64_t state = (uint64_t)(pass_id & 0xff) << 23 | (mat_id & 0x7fffff);
+      uint64_t key;
+      if (transparent) {
+        key = (uint64_t)1 << 63 | (uint64_t)~depth_bits(depth) << 31 | state;
+      } else {
+        key = state << 32 | depth_bits(depth);
+      }
+      keys.push_back(key);
+
+      render_packet packet;
+      packet.pass = pass;
+      packet.mat = mat;
+      packet.object = object;
+      packet.tag = tag;
+      packet.modelToWorld = modelToWorld;
+      packets.push_back(packet);
+    }
+
+    // draw every packet submitted since begin()
+    void execute() {
+      unsorted_changes = count_changes(NULL);
+      sort();
+
+      shader_changes = 0;
+      material_changes = 0;
+      render_pass *pass = 0;
+      material *mat = 0;
+      for (unsigned i = 0; i != order.size(); ++i) {
+        const render_packet &packet = packets[order[i]];
+        // a new pass may bind other texture units, its first material is always bound
+        bool new_pass = packet.pass != pass;
+        if (new_pass) {
+          packet.pass->bind_shader();
+          shader_changes++;
+          pass = packet.pass;
+        }
+        if (packet.mat && (new_pass || packet.mat != mat)) {
+          packet.pass->bind_material(packet.mat);
+          material_changes++;
+        }
+        mat = packet.mat;
+        packet.pass->draw(packet);
+      }
+    }
+
+    int get_num_packets() const {
+      return packets.size();
+    }
+
+    int get_shader_changes() const {
+      return shader_changes;
+    }
+
+    int get_material_changes() const {
+      return material_changes;
+    }
+
+    // shader and material changes the last frame would have had in the order it was submitted
+    int get_unsorted_changes() const {
+      return unsorted_changes;
+    }
+
+    // Submits packets of a few passes and materials in any order and checks the order execute() draws them in:
+    // opaque packets by pass, then material, then nearest first, transparent packets after them furthest first,
+    // and packets with the same key in the order they were submitted. Returns false if the order is wrong.
+    static bool check_sort_order() {
+      // counts the packets drawn, draws nothing
+      class count_pass : public render_pass {
+      public:
+        int num_drawn;
+        count_pass() : num_drawn(0) {}
+        void bind_shader() {}
+        void bind_material(material *) {}
+        void draw(const render_packet &) { num_drawn++; }
+      };
+
+      enum { packet_count = 1000, pass_count = 3, material_count = 4 };
+      count_pass passes[pass_count];
+      // materials are only compared, never used
+      char materials[material_count];
+
+      // the same packets every time, from a linear congruential generator
+      unsigned state = 1;
+      float depths[packet_count];
+      bool transparent[packet_count];
+      render_queue queue;
+      queue.begin();
+      for (int i = 0; i != packet_count; ++i) {
+        unsigned r[4];
+        for (int j = 0; j != 4; ++j) {
+          state = state * 1664525 + 1013904223;
+          r[j] = state >> 16;
+        }
+        // material material_count is none, depths repeat and share their low bytes
+        unsigned m = r[1] % (material_count + 1);
+        material *mat = m == material_count ? NULL : (material*)&materials[m];
+        depths[i] = 1.0f + (r[2] % 64) * 0.5f;
+        transparent[i] = r[3] % 4 == 0;
+        queue.submit(&passes[r[0] % pass_count], mat, NULL, mat4t(), depths[i], i, transparent[i]);
+      }
+      queue.execute();
+
+      int num_drawn = 0;
+      for (int i = 0; i != pass_count; ++i) {
+        num_drawn += passes[i].num_drawn;
+      }
+      bool ok = queue.get_num_packets() == packet_count && num_drawn == packet_count && queue.order.size() == packet_count;
+
+      // ids in order of first submission, as submit() gives them
+      hash_map<void *, unsigned> ids;
+      unsigned num_ids = 0;
+      for (int i = 0; i != packet_count; ++i) {
+        void *objects[2] = { queue.packets[i].pass, queue.packets[i].mat };
+        for (int j = 0; j != 2; ++j) {
+          if (objects[j] && !ids[objects[j]]) ids[objects[j]] = ++num_ids;
+        }
+      }
+
+      for (unsigned i = 1; i < queue.order.size() && ok; ++i) {
+        const render_packet &a = queue.packets[queue.order[i-1]];
+        const render_packet &b = queue.packets[queue.order[i]];
+        bool back[2] = { transparent[a.tag], transparent[b.tag] };
+        unsigned pass[2] = { ids[a.pass], ids[b.pass] };
+        unsigned mat[2] = { a.mat ? ids[a.mat] : 0, b.mat ? ids[b.mat] : 0 };
+        float depth[2] = { depths[a.tag], depths[b.tag] };
+        // -1 if a goes before b, 1 if after, 0 if they have the same key
+        int order = back[0] != back[1] ? (back[0] ? 1 : -1) : 0;
+        if (back[0] && !order) {
+          order = depth[0] != depth[1] ? (depth[0] > depth[1] ? -1 : 1) : 0;
+        }
+        if (!order) order = pass[0] != pass[1] ? (pass[0] < pass[1] ? -1 : 1) : 0;
+        if (!order) order = mat[0] != mat[1] ? (mat[0] < mat[1] ? -1 : 1) : 0;
+        if (!order && !back[0]) {
+          order = depth[0] != depth[1] ? (depth[0] < depth[1] ? -1 : 1) : 0;
+        }
+        ok = order == -1 || (order == 0 && a.tag < b.tag);
+      }
+
+      printf("Render queue check: %s\n", ok ? "ok." : "ERROR: packets drawn out of order.");
+      return ok;
+    }
+  };
+
+  // Packets drawn with the bump shader, the object of every packet is a mesh
+  class bump_pass : public render_pass {
+    bump_shader *shader;
+    mat4t worldToProjection;
+    mat4t worldToCamera;
+    const vec4 *light_uniforms;
+    int num_light_uniforms;
+    int num_lights;
+
+  public:
+    bump_pass() {
+      shader = 0;
+      light_uniforms = 0;
+      num_light_uniforms = 0;
+      num_lights = 0;
+    }
+
+    // camera and lights of the frame, light_uniforms must last until the queue is executed
+    void init(bump_shader *shader_, const mat4t &worldToProjection_, const mat4t &worldToCamera_, const vec4 *light_uniforms_, int num_light_uniforms_, int num_lights_) {
+      shader = shader_;
+      worldToProjection = worldToProjection_;
+      worldToCamera = worldToCamera_;
+      light_uniforms = light_uniforms_;
+      num_light_uniforms = num_light_uniforms_;
+      num_lights = num_lights_;
+    }
+
+    void bind_shader() {
+      shader->render_lights(light_uniforms, num_light_uniforms, num_lights);
+    }
+
+    void bind_material(material *mat) {
+      mat->render_textures();
+    }
+
+    void draw(const render_packet &packet) {
+      shader->set_matrices(packet.modelToWorld * worldToProjection, packet.modelToWorld * worldToCamera);
+      mesh *msh = (mesh*)packet.object;
+      msh->enable_attributes();
+      msh->draw();
+      msh->disable_attributes();
+    }
+  };
+}
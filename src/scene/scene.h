@@ -42,6 +42,10 @@ namespace octet {
 
     int frame_number;
 
+    // meshes drawn sorted by material, nearest first
+    render_queue queue;
+    bump_pass object_pass;
+
     void draw_aabb(const aabb &bb) {
       vec3 pos[8];
       for (int i = 0; i != 8; ++i) {
@@ -118,14 +122,12 @@ namespace octet {
         mat4t modelToCamera;
         mat4t modelToProjection;
         cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
-        const char *ip = (const char*)msh->get_indices()->lock_read_only();
         const char *vp = (const char*)msh->get_vertices()->lock_read_only();
         unsigned pos_offset = msh->get_offset(msh->get_slot(attribute_pos));
         unsigned stride = msh->get_stride();
-        bool is_short_index = msh->get_index_type() != GL_UNSIGNED_INT;
 
         for (unsigned i = 0; i != msh->get_num_indices(); ++i) {
-          unsigned index = is_short_index ? ((uint16_t*)ip)[i] : ((uint32_t*)ip)[i];
+          unsigned index = msh->get_index(i);
           const vec3p &pos = (const vec3p&)*(vp + stride * index + pos_offset);
           vec4 pos1 = vec3(pos).xyz1();
           vec4 world_pos = pos1 * modelToWorld;
@@ -138,7 +140,6 @@ namespace octet {
           );
         }
 
-        msh->get_indices()->unlock_read_only();
         msh->get_vertices()->unlock_read_only();
       }
     }
@@ -182,6 +183,10 @@ namespace octet {
 
       draw_debug_data(object_shader, cam);
 
+      // single matrix objects go in the queue, skinned ones are drawn straight away
+      queue.begin();
+      object_pass.init(&object_shader, worldToCamera * cameraToProjection, worldToCamera, light_uniforms, num_light_uniforms, num_lights);
+
       for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
         mesh_instance *mi = mesh_instances[mesh_index];
         mesh *msh = mi->get_mesh();
@@ -196,9 +201,9 @@ namespace octet {
 
         if (!skel || !skn) {
           // normal rendering for single matrix objects
-          // build a projection matrix: model -> world -> camera_instance -> projection
+          // the queue builds the projection matrix: model -> world -> camera_instance -> projection
           // the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-          mat->render(object_shader, modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+          queue.submit(&object_pass, mat, msh, modelToWorld, -modelToCamera.row(3).z());
         } else {
           // multi-matrix rendering
           mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
@@ -210,12 +215,16 @@ namespace octet {
           } else {
             mat->render_skinned(skin_shader, cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
           }
+          msh->enable_attributes();
+          msh->draw();
+          msh->disable_attributes();
         }
+      }
+      queue.execute();
 
-        msh->enable_attributes();
-        msh->draw();
-        msh->disable_attributes();
-
+      // the boxes of the selected meshes go over the meshes the queue has drawn
+      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
+        mesh_instance *mi = mesh_instances[mesh_index];
         if (mi->get_flags() & mesh_instance::flag_selected) {
           aabb bb = mi->get_mesh()->get_aabb();
           bb = bb.get_transform(mi->get_node()->calcModelToWorld());
@@ -372,6 +381,11 @@ namespace octet {
       return light_instances[index];
     }
 
+    // packets and state changes of the last frame
+    const render_queue &get_render_queue() const {
+      return queue;
+    }
+
     // advance all the animation instances
     // note that we want to update before rendering or doing physics and AI actions.
     void update(float delta_time) {
@@ -59,6 +59,14 @@ namespace octet {
       src->get_indices()->unlock();
       set_num_indices(num_indices*2);
       set_indices( indices );
+
+      // every triangle became three lines, so the chunks start twice as far in
+      index_chunk line_chunks[max_chunks];
+      for (unsigned i = 0; i != get_num_chunks(); ++i) {
+        line_chunks[i].first_index = get_chunks()[i].first_index * 2;
+        line_chunks[i].first_vertex = get_chunks()[i].first_vertex;
+      }
+      set_chunks(line_chunks, get_num_chunks());
     }
 
     void visit(visitor &v) {
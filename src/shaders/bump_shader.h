@@ -165,13 +165,15 @@ namespace octet {
     }
 
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      render_lights(light_uniforms, num_light_uniforms, num_lights);
+      set_matrices(modelToProjection, modelToCamera);
+    }
+
+    // use the program with the uniforms shared by every object, set_matrices does the rest
+    void render_lights(const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
       // tell openGL to use the program
       shader::render();
 
-      // customize the program with uniforms
-      glUniformMatrix4fv(modelToProjection_index, 1, GL_FALSE, modelToProjection.get());
-      glUniformMatrix4fv(modelToCamera_index, 1, GL_FALSE, modelToCamera.get());
-
       glUniform4fv(light_uniforms_index, num_light_uniforms, (float*)light_uniforms);
       glUniform1i(num_lights_index, num_lights);
 
@@ -180,6 +182,12 @@ namespace octet {
       glUniform1iv(samplers_index, 6, samplers);
     }
 
+    // matrices of one object, after render_lights
+    void set_matrices(const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      glUniformMatrix4fv(modelToProjection_index, 1, GL_FALSE, modelToProjection.get());
+      glUniformMatrix4fv(modelToCamera_index, 1, GL_FALSE, modelToCamera.get());
+    }
+
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_matrices, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
       // tell openGL to use the program
       shader::render();
@@ -10,16 +10,17 @@ namespace octet {
     GLuint light_uniforms_index;    // lighting parameters for fragment shader
     GLuint num_lights_index;        // how many lights?
     GLuint samplers_index;          // index for texture samplers
-	GLuint bulding_height_index;		// index for building height 
-	GLuint building_area_index;			// index for building area
 	GLuint texture_switcher_index; 
-	GLuint part_to_render_index;
 
     void init_uniforms(const char *vertex_shader, const char *fragment_shader) {
       // use the common shader code to compile and link the shaders
       // the result is a shader program
       shader::init(vertex_shader, fragment_shader);
 
+      // the building attribute is not in the standard set, bind it and link again
+      glBindAttribLocation(program(), attribute_building, "building");
+      glLinkProgram(program());
+
       // extract the indices of the uniforms to use later
       modelToProjection_index	= glGetUniformLocation(program(), "modelToProjection");
       cameraToProjection_index	= glGetUniformLocation(program(), "cameraToProjection");
@@ -27,13 +28,15 @@ namespace octet {
       light_uniforms_index		= glGetUniformLocation(program(), "light_uniforms");
       num_lights_index			= glGetUniformLocation(program(), "num_lights");
       samplers_index			= glGetUniformLocation(program(), "samplers");
-	  bulding_height_index		= glGetUniformLocation(program(), "b_height"); 
-	  building_area_index		= glGetUniformLocation(program(), "b_area"); 
 	  texture_switcher_index	= glGetUniformLocation(program(), "switcher"); 
-	  part_to_render_index		= glGetUniformLocation(program(), "part_to_render"); 
     }
 
   public:
+    enum {
+      // height, area and part of the building, slot not used by the standard vertex formats
+      attribute_building = 13,
+    };
+
     void init(bool is_skinned=false) {
       // this is the vertex shader for regular geometry
       // it is called for each corner of each triangle
@@ -46,18 +49,21 @@ namespace octet {
         varying vec3 tangent_;
         varying vec3 bitangent_;
 		varying vec3 normal_t_;
+        varying vec3 building_;
       
         attribute vec4 pos;
         attribute vec3 normal;
         attribute vec3 tangent;
         attribute vec3 bitangent;
         attribute vec2 uv;
+        attribute vec3 building;
       
         uniform mat4 modelToProjection;
         uniform mat4 modelToCamera;
       
         void main() {
           uv_ = uv;
+          building_ = building;
           normal_ = (modelToCamera * vec4(normal,0)).xyz;
 		  normal_t_ = normal;
           tangent_ = (modelToCamera * vec4(tangent,0)).xyz;
@@ -76,6 +82,7 @@ namespace octet {
         varying vec3 normal_;
         varying vec3 tangent_;
         varying vec3 bitangent_;
+        varying vec3 building_;
       
         attribute vec4 pos;
         attribute vec3 normal;
@@ -84,12 +91,14 @@ namespace octet {
         attribute vec2 uv;
         attribute vec3 blendweight;
         attribute vec4 blendindices;
+        attribute vec3 building;
       
         uniform mat4 cameraToProjection;
         uniform mat4 modelToCamera[192];
       
         void main() {
           uv_ = uv;
+          building_ = building;
           ivec4 index = ivec4(blendindices);
           mat4 m2c0 = modelToCamera[index.x];
           mat4 m2c1 = modelToCamera[index.y];
@@ -116,20 +125,21 @@ namespace octet {
 		varying vec3 normal_t_;
         varying vec3 tangent_;
         varying vec3 bitangent_;
+        varying vec3 building_;
 
         uniform vec4 light_uniforms[1+max_lights*4];
 		uniform int num_lights;
 
 		uniform sampler2D samplers[9];
         
-		uniform float b_height; 
-		uniform float b_area;
 		uniform int switcher;
-		uniform int part_to_render;
 
 		
 		vec4 texture_selector() {
 			vec4 color; 
+			float b_height = building_.x;
+			float b_area = building_.y;
+			int part_to_render = int(building_.z + 0.5);
 		  if (switcher == 0) {
 			  if ( part_to_render == 1 ) {
 				  //color = texture2D(samplers[0], uv_);
@@ -244,7 +254,7 @@ namespace octet {
       init_uniforms(is_skinned ? skinned_vertex_shader : vertex_shader, fragment_shader);
     }
 
-    void render(const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights, float bulding_height, float building_area, int texture_switcher, int part_to_render) {
+    void render(const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights, int texture_switcher) {
       // tell openGL to use the program
       shader::render();
 
@@ -255,10 +265,7 @@ namespace octet {
       glUniform4fv(light_uniforms_index, num_light_uniforms, (float*)light_uniforms);
       glUniform1i(num_lights_index, num_lights);
 	  
-	  glUniform1f(bulding_height_index, bulding_height); 
-	  glUniform1f(building_area_index, building_area); 
 	  glUniform1i(texture_switcher_index, texture_switcher); 
-	  glUniform1i(part_to_render_index, part_to_render); 
 
       // we use textures 0-3 for material properties.
       static const GLint samplers[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
@@ -0,0 +1,185 @@
+namespace octet {
+  // Bump shader for many copies of the same mesh (street furniture).
+  // The model to world matrix comes either from a per-instance attribute
+  // (hardware instancing) or from a uniform array indexed by a vertex attribute (GLES2).
+  class city_props_bump_shader : public shader {
+    // indices to use with glUniform*()
+
+    GLuint worldToProjection_index; // index for world space to projection space matrix
+    GLuint worldToCamera_index;     // second matrix used for lighting maps world to camera space
+    GLuint instanceToWorld_index;   // uniform array of matrices when batching without instancing
+    GLuint light_uniforms_index;    // lighting parameters for fragment shader
+    GLuint num_lights_index;        // how many lights?
+    GLuint samplers_index;          // index for texture samplers
+
+    bool hardware_instancing;
+
+    void init_uniforms(const char *vertex_shader, const char *fragment_shader) {
+      // use the common shader code to compile and link the shaders
+      // the result is a shader program
+      shader::init(vertex_shader, fragment_shader);
+
+      // the instance attributes are not in the standard set, bind them and link again
+      glBindAttribLocation(program(), attribute_instance0 + 0, "instance0");
+      glBindAttribLocation(program(), attribute_instance0 + 1, "instance1");
+      glBindAttribLocation(program(), attribute_instance0 + 2, "instance2");
+      glBindAttribLocation(program(), attribute_instance0 + 3, "instance3");
+      glBindAttribLocation(program(), attribute_instance_index, "instance");
+      glLinkProgram(program());
+
+      // extract the indices of the uniforms to use later
+      worldToProjection_index = glGetUniformLocation(program(), "worldToProjection");
+      worldToCamera_index = glGetUniformLocation(program(), "worldToCamera");
+      instanceToWorld_index = glGetUniformLocation(program(), "instanceToWorld");
+      light_uniforms_index = glGetUniformLocation(program(), "light_uniforms");
+      num_lights_index = glGetUniformLocation(program(), "num_lights");
+      samplers_index = glGetUniformLocation(program(), "samplers");
+    }
+
+  public:
+    enum {
+      // attribute slots not used by the standard vertex formats
+      attribute_instance0 = 9,       // four slots with the rows of the model to world matrix
+      attribute_instance_index = 9,  // index into instanceToWorld when batching
+
+      // matrices per batch, keeps us inside the 128 vertex uniform vectors of GLES2
+      max_batch = 24,
+    };
+
+    // returns true if the driver can do glDrawElementsInstanced and glVertexAttribDivisor.
+    // On Windows the platform loads the GL entry points with init_wgl and leaves the missing ones NULL,
+    // the other platforms only get the GLES2 calls.
+    static bool has_hardware_instancing() {
+      #ifdef WIN32
+        return glDrawElementsInstanced != NULL && glVertexAttribDivisor != NULL;
+      #else
+        return false;
+      #endif
+    }
+
+    bool is_instanced() const {
+      return hardware_instancing;
+    }
+
+    void init(bool hardware_instancing) {
+      this->hardware_instancing = hardware_instancing;
+
+      // vertex shader for hardware instancing
+      // the model to world matrix is fed as four vec4 attributes with a divisor of one
+      const char instanced_vertex_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec3 normal_;
+
+        attribute vec4 pos;
+        attribute vec3 normal;
+        attribute vec2 uv;
+        attribute vec4 instance0;
+        attribute vec4 instance1;
+        attribute vec4 instance2;
+        attribute vec4 instance3;
+
+        uniform mat4 worldToProjection;
+        uniform mat4 worldToCamera;
+
+        void main() {
+          mat4 instanceToWorld = mat4(instance0, instance1, instance2, instance3);
+          uv_ = uv;
+          normal_ = (worldToCamera * (instanceToWorld * vec4(normal,0))).xyz;
+          gl_Position = worldToProjection * (instanceToWorld * pos);
+        }
+      );
+
+      // vertex shader for GLES2 batching
+      // the mesh is replicated max_batch times and each copy carries its index
+      const char batched_vertex_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec3 normal_;
+
+        attribute vec4 pos;
+        attribute vec3 normal;
+        attribute vec2 uv;
+        attribute float instance;
+
+        uniform mat4 worldToProjection;
+        uniform mat4 worldToCamera;
+        uniform mat4 instanceToWorld[24];
+
+        void main() {
+          mat4 modelToWorld = instanceToWorld[int(instance)];
+          uv_ = uv;
+          normal_ = (worldToCamera * (modelToWorld * vec4(normal,0))).xyz;
+          gl_Position = worldToProjection * (modelToWorld * pos);
+        }
+      );
+
+      // this is the same fragment shader as bump_shader
+      const char fragment_shader[] = SHADER_STR(
+        const int max_lights = 4;
+        varying vec2 uv_;
+        varying vec3 normal_;
+
+        uniform vec4 light_uniforms[1+max_lights*4];
+        uniform int num_lights;
+        uniform sampler2D samplers[6];
+
+        void main() {
+          float shininess = texture2D(samplers[5], uv_).x * 255.0;
+          vec3 nnormal = normal_;
+          vec3 diffuse_light = vec3(0.3, 0.3, 0.3);
+          vec3 specular_light = vec3(0, 0, 0);
+
+          for (int i = 0; i != num_lights; ++i) {
+            vec3 light_direction = light_uniforms[i * 4 + 2].xyz;
+            vec3 light_color = light_uniforms[i * 4 + 3].xyz;
+            vec3 half_direction = normalize(light_direction + vec3(0, 0, 1));
+
+            float diffuse_factor = max(dot(light_direction, nnormal), 0.0);
+            float specular_factor = pow(max(dot(half_direction, nnormal), 0.0), shininess) * diffuse_factor;
+
+            diffuse_light += diffuse_factor * light_color;
+            specular_light += specular_factor * light_color;
+          }
+
+          vec4 diffuse = texture2D(samplers[0], uv_);
+          if(diffuse.a < 0.5) discard;
+          vec4 ambient = texture2D(samplers[1], uv_);
+          vec4 emission = texture2D(samplers[2], uv_);
+          vec4 specular = texture2D(samplers[3], uv_);
+
+          vec3 ambient_light = light_uniforms[0].xyz;
+
+          gl_FragColor.xyz =
+            ambient_light * ambient.xyz +
+            diffuse_light * diffuse.xyz +
+            emission.xyz +
+            specular_light * specular.xyz
+          ;
+          gl_FragColor.w = diffuse.w;
+        }
+      );
+
+      init_uniforms(hardware_instancing ? instanced_vertex_shader : batched_vertex_shader, fragment_shader);
+    }
+
+    void render(const mat4t &worldToProjection, const mat4t &worldToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      // tell openGL to use the program
+      shader::render();
+
+      // customize the program with uniforms
+      glUniformMatrix4fv(worldToProjection_index, 1, GL_FALSE, worldToProjection.get());
+      glUniformMatrix4fv(worldToCamera_index, 1, GL_FALSE, worldToCamera.get());
+
+      glUniform4fv(light_uniforms_index, num_light_uniforms, (float*)light_uniforms);
+      glUniform1i(num_lights_index, num_lights);
+
+      // we use textures 0-5 for material properties.
+      static const GLint samplers[] = { 0, 1, 2, 3, 4, 5 };
+      glUniform1iv(samplers_index, 6, samplers);
+    }
+
+    // upload the matrices of one batch (GLES2 path only)
+    void set_instances(const mat4t *instanceToWorld, int num_instances) {
+      glUniformMatrix4fv(instanceToWorld_index, num_instances, GL_FALSE, (float*)instanceToWorld);
+    }
+  };
+}